@@ -24,6 +24,21 @@
 using namespace Mlt;
 
 #include <time.h>
+#include <stdlib.h>
+#include <string.h>
+#include <melted/melted_local.h>
+#include <melted/melted_scheduler.h>
+
+/** A command executed asynchronously.
+*/
+
+struct melted_async
+{
+	Melted *melted;
+	char *command;
+	Melted::response_callback callback;
+	void *data;
+};
 
 static mvcp_response mlt_melted_execute( void *arg, char *command )
 {
@@ -138,6 +153,39 @@ Response *Melted::push( char *command, Service *service )
 	return new Response( _push( _real, command, service->get_service( ) ) );
 }
 
+static void mlt_melted_async( void *arg )
+{
+	melted_async *job = ( melted_async * )arg;
+	Response *response = job->melted->execute( job->command );
+	job->callback( job->data, *response );
+	delete response;
+	free( job->command );
+	delete job;
+}
+
+/** Execute a command without waiting for it. A unit command is queued behind
+	the other commands of its unit and the callback is called from the unit's
+	worker with the response returned by execute, which it may copy or move
+	from. Other commands, and all commands while the server isn't running,
+	complete before this returns.
+*/
+
+bool Melted::execute_async( char *command, response_callback callback, void *data )
+{
+	melted_async *job = new melted_async;
+	job->melted = this;
+	job->command = strdup( command );
+	job->callback = callback;
+	job->data = data;
+	if ( job->command == NULL )
+	{
+		delete job;
+		return false;
+	}
+	melted_scheduler_submit( melted_local_unit( command ), mlt_melted_async, job );
+	return true;
+}
+
 void Melted::wait_for_shutdown( )
 {
 	struct timespec tm = { 1, 0 };
@@ -155,3 +203,26 @@ Properties *Melted::unit( int index )
 	mlt_properties properties = melted_server_fetch_unit( server, index );
 	return properties != NULL ? new Properties( properties ) : NULL;
 }
+
+/** Get the status of every unit with a single ASTA - at most count statuses
+	are stored. Returns the number stored or -1 on error.
+*/
+
+int Melted::units_status( mvcp_status statuses, int count )
+{
+	Response *response = execute( ( char * )"ASTA" );
+	int stored = -1;
+	if ( response != NULL && response->error_code( ) < 300 )
+	{
+		stored = 0;
+		for ( int index = 1; index < response->count( ) && stored < count; index ++ )
+		{
+			if ( *response->get( index ) == '\0' )
+				continue;
+			memset( &statuses[ stored ], 0, sizeof( mvcp_status_t ) );
+			response->status( statuses[ stored ++ ], index );
+		}
+	}
+	delete response;
+	return stored;
+}
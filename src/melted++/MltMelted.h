@@ -24,6 +24,10 @@
 #include <melted/melted_server.h>
 #include <melted/melted_log.h>
 #include <MltService.h>
+#include "MltResponse.h"
+#if __cplusplus >= 201103L
+#include <future>
+#endif
 
 namespace Mlt
 {
@@ -33,12 +37,22 @@ namespace Mlt
 
 	class Melted : public Properties
 	{
+		public:
+			typedef void ( *response_callback )( void *data, Response &response );
 		private:
 			melted_server server;
 			void *_real;
 			parser_execute _execute;
 			parser_received _received;
 			parser_push _push;
+#if __cplusplus >= 201103L
+			static void promise_response( void *data, Response &response )
+			{
+				std::promise< Response > *promise = ( std::promise< Response > * )data;
+				promise->set_value( std::move( response ) );
+				delete promise;
+			}
+#endif
 		public:
 			Melted( char *name, int port = 5250, char *config = NULL );
 			virtual ~Melted( );
@@ -48,9 +62,27 @@ namespace Mlt
 			virtual Response *execute( char *command );
 			virtual Response *received( char *command, char *doc );
 			virtual Response *push( char *command, Service *service );
+			bool execute_async( char *command, response_callback callback, void *data );
+#if __cplusplus >= 201103L
+			/** Defined here so the library doesn't depend on the standard its
+				applications use.
+			*/
+			std::future< Response > execute_async( char *command )
+			{
+				std::promise< Response > *promise = new std::promise< Response >( );
+				std::future< Response > future = promise->get_future( );
+				if ( !execute_async( command, promise_response, promise ) )
+				{
+					promise->set_value( Response( 500, "Unable to queue command" ) );
+					delete promise;
+				}
+				return future;
+			}
+#endif
 			void wait_for_shutdown( );
 			static void log_level( int );
 			Properties *unit( int );
+			int units_status( mvcp_status statuses, int count );
 	};
 }
 
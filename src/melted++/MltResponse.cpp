@@ -19,9 +19,15 @@
  */
 
 #include <string.h>
+#include <stdlib.h>
 #include "MltResponse.h"
 using namespace Mlt;
 
+Response::Response( ) :
+	_response( NULL )
+{
+}
+
 Response::Response( mvcp_response response ) :
 	_response( response )
 {
@@ -35,16 +41,62 @@ Response::Response( int error, const char *message ) :
 		mvcp_response_set_error( _response, error, message );
 }
 
+Response::Response( const Response &response ) :
+	_response( response._response != NULL ? mvcp_response_clone( response._response ) : NULL )
+{
+}
+
+#if __cplusplus >= 201103L
+Response::Response( Response &&response ) noexcept :
+	_response( response._response )
+{
+	response._response = NULL;
+}
+
+Response &Response::operator=( Response &&response ) noexcept
+{
+	if ( this != &response )
+	{
+		mvcp_response_close( _response );
+		_response = response._response;
+		response._response = NULL;
+	}
+	return *this;
+}
+#endif
+
+Response &Response::operator=( const Response &response )
+{
+	if ( this != &response )
+	{
+		mvcp_response_close( _response );
+		_response = response._response != NULL ? mvcp_response_clone( response._response ) : NULL;
+	}
+	return *this;
+}
+
 Response::~Response( )
 {
 	mvcp_response_close( _response );
 }
 
+bool Response::is_valid( )
+{
+	return _response != NULL;
+}
+
 mvcp_response Response::get_response( )
 {
 	return _response;
 }
 
+mvcp_response Response::release( )
+{
+	mvcp_response response = _response;
+	_response = NULL;
+	return response;
+}
+
 int Response::error_code( )
 {
 	return mvcp_response_get_error_code( get_response( ) );
@@ -60,6 +112,11 @@ char *Response::get( int index )
 	return mvcp_response_get_line( get_response( ), index );
 }
 
+int Response::length( int index )
+{
+	return _response != NULL ? mvcp_response_get_length( _response, index ) : 0;
+}
+
 int Response::count( )
 {
 	return mvcp_response_count( get_response( ) );
@@ -70,3 +127,197 @@ int Response::write( const char *data )
 	return mvcp_response_write( get_response( ), data, strlen( data ) );
 }
 
+int Response::write( const char *data, int length )
+{
+	return mvcp_response_write( get_response( ), data, length );
+}
+
+/** Append a number of pre-formatted buffers, reserving the space for all of
+	them first.
+*/
+
+int Response::write( const char **buffers, const int *lengths, int count )
+{
+	int total = 0;
+	int written = 0;
+	for ( int index = 0; index < count; index ++ )
+		total += lengths[ index ];
+	if ( mvcp_response_reserve( get_response( ), count, total + count ) != 0 )
+		return 0;
+	for ( int index = 0; index < count; index ++ )
+		written += mvcp_response_write( get_response( ), buffers[ index ], lengths[ index ] );
+	return written;
+}
+
+/** Parse a USTA row, by default the one following the response code.
+*/
+
+bool Response::status( mvcp_status_t &status, int index )
+{
+	if ( index < 1 || index >= count( ) )
+		return false;
+	mvcp_status_parse( &status, get( index ) );
+	return true;
+}
+
+#if __cplusplus >= 201703L
+/** Split the next space separated field from a row - a quoted field may hold
+	spaces and is returned without its quotes.
+*/
+
+static bool response_field( std::string_view &row, std::string_view &field )
+{
+	size_t start = row.find_first_not_of( ' ' );
+	size_t end = 0;
+
+	if ( start == std::string_view::npos )
+		return false;
+
+	if ( row[ start ] == '"' )
+	{
+		end = row.find( '"', start + 1 );
+		if ( end == std::string_view::npos )
+			end = row.size( );
+		field = row.substr( start + 1, end - start - 1 );
+		row.remove_prefix( end < row.size( ) ? end + 1 : end );
+	}
+	else
+	{
+		end = row.find( ' ', start );
+		if ( end == std::string_view::npos )
+			end = row.size( );
+		field = row.substr( start, end - start );
+		row.remove_prefix( end );
+	}
+
+	return true;
+}
+
+/** Copy a numeric field to a terminated buffer for conversion.
+*/
+
+static const char *response_terminate( std::string_view field, char *buffer, size_t size )
+{
+	size_t length = field.size( ) < size - 1 ? field.size( ) : size - 1;
+	memcpy( buffer, field.data( ), length );
+	buffer[ length ] = '\0';
+	return buffer;
+}
+
+static long response_number( std::string_view field )
+{
+	char buffer[ 32 ];
+	return strtol( response_terminate( field, buffer, sizeof( buffer ) ), NULL, 10 );
+}
+
+static double response_double( std::string_view field )
+{
+	char buffer[ 32 ];
+	return strtod( response_terminate( field, buffer, sizeof( buffer ) ), NULL );
+}
+
+Response::const_iterator Response::Lines::begin( ) const
+{
+	return const_iterator( _response, _first < mvcp_response_count( _response ) ? _first : mvcp_response_count( _response ) );
+}
+
+Response::const_iterator Response::Lines::end( ) const
+{
+	return const_iterator( _response, mvcp_response_count( _response ) );
+}
+
+/** Get a line without copying it - the view is valid until the response is
+	changed or closed.
+*/
+
+std::string_view Response::line( int index )
+{
+	if ( index < 0 || index >= count( ) )
+		return std::string_view( );
+	return std::string_view( get( index ), length( index ) );
+}
+
+/** Iterate over the lines from the given one without copying them.
+*/
+
+Response::Lines Response::lines( int first )
+{
+	return Lines( _response, first );
+}
+
+int Response::write( std::string_view data )
+{
+	return mvcp_response_write( get_response( ), data.data( ), data.size( ) );
+}
+
+/** The play list generation of a LIST response.
+*/
+
+int Response::list_generation( )
+{
+	return count( ) > 1 ? atoi( get( 1 ) ) : -1;
+}
+
+/** The number of clips in a LIST response.
+*/
+
+int Response::list_count( )
+{
+	return count( ) > 2 ? count( ) - 3 : 0;
+}
+
+/** Parse a clip of a LIST response in place.
+*/
+
+bool Response::list_entry( int index, ListEntry &entry )
+{
+	std::string_view row = line( index + 2 );
+	std::string_view fields[ 8 ];
+	int found = 0;
+
+	if ( index < 0 || index >= list_count( ) )
+		return false;
+	while ( found < 8 && response_field( row, fields[ found ] ) )
+		found ++;
+	if ( found < 7 )
+		return false;
+
+	entry.clip = response_number( fields[ 0 ] );
+	entry.resource = fields[ 1 ];
+	entry.in = response_number( fields[ 2 ] );
+	entry.out = response_number( fields[ 3 ] );
+	entry.max = response_number( fields[ 4 ] );
+	entry.size = response_number( fields[ 5 ] );
+	entry.fps = response_double( fields[ 6 ] );
+	entry.id = found > 7 ? response_number( fields[ 7 ] ) : 0;
+
+	return true;
+}
+
+/** The number of entries in a CLS response.
+*/
+
+int Response::dir_count( )
+{
+	return count( ) > 1 ? count( ) - 2 : 0;
+}
+
+/** Parse an entry of a CLS response in place.
+*/
+
+bool Response::dir_entry( int index, DirEntry &entry )
+{
+	std::string_view row = line( index + 1 );
+	std::string_view size;
+	char buffer[ 32 ];
+
+	if ( index < 0 || index >= dir_count( ) || !response_field( row, entry.name ) )
+		return false;
+
+	entry.dir = !response_field( row, size );
+	entry.size = entry.dir ? 0 : strtoull( response_terminate( size, buffer, sizeof( buffer ) ), NULL, 10 );
+
+	return true;
+}
+#endif
+
@@ -21,24 +21,101 @@
 #ifndef _MLTPP_RESPONSE_H_
 #define _MLTPP_RESPONSE_H_
 
+#include <stdint.h>
 #include <mvcp/mvcp_response.h>
+#include <mvcp/mvcp_status.h>
+#if __cplusplus >= 201703L
+#include <string_view>
+#endif
 
 namespace Mlt
 {
+#if __cplusplus >= 201703L
+	/** A row of a LIST response - the resource refers to the response text.
+	*/
+
+	struct ListEntry
+	{
+		int clip;
+		std::string_view resource;
+		int32_t in;
+		int32_t out;
+		int32_t max;
+		int32_t size;
+		double fps;
+		int id;
+	};
+
+	/** A row of a CLS response - the name refers to the response text.
+	*/
+
+	struct DirEntry
+	{
+		std::string_view name;
+		bool dir;
+		unsigned long long size;
+	};
+#endif
+
 	class Response
 	{
 		private:
 			mvcp_response _response;
 		public:
+			Response( );
 			Response( mvcp_response response );
 			Response( int error, const char *message );
+			Response( const Response &response );
+#if __cplusplus >= 201103L
+			Response( Response &&response ) noexcept;
+			Response &operator=( Response &&response ) noexcept;
+#endif
+			Response &operator=( const Response &response );
 			~Response( );
+			bool is_valid( );
 			mvcp_response get_response( );
+			mvcp_response release( );
 			int error_code( );
 			const char *error_string( );
 			char *get( int );
+			int length( int );
 			int count( );
 			int write( const char *data );
+			int write( const char *data, int length );
+			int write( const char **buffers, const int *lengths, int count );
+			bool status( mvcp_status_t &status, int index = 1 );
+#if __cplusplus >= 201703L
+			class const_iterator
+			{
+				private:
+					mvcp_response _response;
+					int _index;
+				public:
+					const_iterator( mvcp_response response, int index ) : _response( response ), _index( index ) { }
+					std::string_view operator*( ) const { return std::string_view( mvcp_response_get_line( _response, _index ), mvcp_response_get_length( _response, _index ) ); }
+					const_iterator &operator++( ) { _index ++; return *this; }
+					bool operator==( const const_iterator &that ) const { return _index == that._index; }
+					bool operator!=( const const_iterator &that ) const { return _index != that._index; }
+			};
+			class Lines
+			{
+				private:
+					mvcp_response _response;
+					int _first;
+				public:
+					Lines( mvcp_response response, int first ) : _response( response ), _first( first ) { }
+					const_iterator begin( ) const;
+					const_iterator end( ) const;
+			};
+			std::string_view line( int index );
+			Lines lines( int first = 0 );
+			int write( std::string_view data );
+			int list_generation( );
+			int list_count( );
+			bool list_entry( int index, ListEntry &entry );
+			int dir_count( );
+			bool dir_entry( int index, DirEntry &entry );
+#endif
 	};
 }
 
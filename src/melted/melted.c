@@ -51,6 +51,7 @@ static melted_server server = NULL;
 static void main_cleanup( )
 {
 	melted_server_close( server );
+	melted_log_async( 0 );
 }
 
 /** Report usage and exit.
@@ -58,7 +59,7 @@ static void main_cleanup( )
 
 void usage( char *app )
 {
-	fprintf( stderr, "Usage: %s [-prio NNNN|max] [-test] [-port NNNN] [-c config-file]\n", app );
+	fprintf( stderr, "Usage: %s [-prio NNNN|max] [-test] [-port NNNN] [-io-threads N] [-parallel-startup] [-asrun file] [-index] [-probe-cache file] [-replicate host[:port][,...]] [-snapshot file] [-restore] [-c config-file]\n", app );
 	exit( 0 );
 }
 
@@ -72,11 +73,6 @@ int main( int argc, char **argv )
 	int background = 1;
 	int test = 0;
 	struct timespec tm = { 1, 0 };
-	mvcp_status_t status;
-	struct {
-		int clip_index;
-		int is_logged;
-	} asrun[ MAX_UNITS ];
 	const char *config_file = "/etc/melted.conf";
 
 #ifndef __DARWIN__
@@ -109,6 +105,22 @@ int main( int argc, char **argv )
 			melted_server_set_port( server, atoi( argv[ ++ index ] ) );
 		else if ( !strcmp( argv[ index ], "-proxy" ) )
 			melted_server_set_proxy( server, argv[ ++ index ] );
+		else if ( !strcmp( argv[ index ], "-io-threads" ) )
+			mlt_properties_set_int( &server->parent, "io-threads", atoi( argv[ ++ index ] ) );
+		else if ( !strcmp( argv[ index ], "-parallel-startup" ) )
+			mlt_properties_set_int( &server->parent, "parallel-startup", 1 );
+		else if ( !strcmp( argv[ index ], "-asrun" ) )
+			mlt_properties_set( &server->parent, "asrun-file", argv[ ++ index ] );
+		else if ( !strcmp( argv[ index ], "-index" ) )
+			mlt_properties_set_int( &server->parent, "index", 1 );
+		else if ( !strcmp( argv[ index ], "-probe-cache" ) )
+			mlt_properties_set( &server->parent, "probe-cache", argv[ ++ index ] );
+		else if ( !strcmp( argv[ index ], "-replicate" ) )
+			mlt_properties_set( &server->parent, "replicate", argv[ ++ index ] );
+		else if ( !strcmp( argv[ index ], "-snapshot" ) )
+			mlt_properties_set( &server->parent, "snapshot", argv[ ++ index ] );
+		else if ( !strcmp( argv[ index ], "-restore" ) )
+			mlt_properties_set_int( &server->parent, "restore", 1 );
 		else if ( !strcmp( argv[ index ], "-test" ) )
 		{
 			test = 1;
@@ -143,6 +155,9 @@ int main( int argc, char **argv )
 		melted_log_init( log_syslog, LOG_NOTICE );
 	}
 
+	/* Keep the writing of log messages off the command threads */
+	melted_log_async( 1 );
+
 	atexit( main_cleanup );
 
 	/* Set the config script */
@@ -151,39 +166,10 @@ int main( int argc, char **argv )
 	/* Execute the server */
 	error = melted_server_execute( server );
 
-	/* Initialize the as-run log tracking */
-	for ( index = 0; index < MAX_UNITS; index ++ )
-		asrun[ index ].clip_index = -1;
-
-	/* We need to wait until we're exited.. */
+	/* Status and as-run logging are driven by the units' consumers, so we
+	   only need to wait until we're exited.. */
 	while ( !server->shutdown )
-	{
 		nanosleep( &tm, NULL );
 
-		/* As-run logging */
-		for ( index = 0; !error && index < MAX_UNITS; index ++ )
-		{
-			melted_unit unit = melted_get_unit( index );
-
-			if ( unit && melted_unit_get_status( unit, &status ) == 0 )
-			{
-				int length = status.length - 60;
-
-				/* Reset the logging if needed */
-				if ( status.clip_index != asrun[ index ].clip_index || status.position < length || status.status == unit_not_loaded )
-				{
-					asrun[ index ].clip_index = status.clip_index;
-					asrun[ index ].is_logged = 0;
-				}
-				/* Log as-run only once when near the end */
-				if ( ! asrun[ index ].is_logged && status.length > 0 && status.position > length )
-				{
-					melted_log( LOG_NOTICE, "AS-RUN U%d \"%s\" len %d pos %d", index, status.clip, status.length, status.position );
-					asrun[ index ].is_logged = 1;
-				}
-			}
-		}
-	}
-
 	return error;
 }
@@ -0,0 +1,455 @@
+/*
+ * melted_asrun.c -- As-Run Log Writer
+ * Copyright (C) 2002-2015 Meltytech, LLC
+ * Author: Charles Yates <charles.yates@pandora.be>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+/* System header files */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/time.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <strings.h>
+
+/* Application header files */
+#include "melted_asrun.h"
+#include "melted_log.h"
+
+/** Number of records which may wait for the writer before more are dropped.
+*/
+
+#define MELTED_ASRUN_QUEUE 4096
+
+/** An aired clip waiting to be written.
+*/
+
+typedef struct asrun_record_s
+{
+	int unit;
+	int clip_index;
+	char resource[ 2048 ];
+	int32_t in;
+	int32_t out;
+	int32_t first;
+	int32_t last;
+	int frames;
+	int64_t start;
+	int64_t end;
+	const char *reason;
+	struct asrun_record_s *next;
+}
+*asrun_record, asrun_record_t;
+
+/** Output formats.
+*/
+
+typedef enum
+{
+	asrun_log,
+	asrun_json,
+	asrun_csv
+}
+asrun_format;
+
+static pthread_mutex_t asrun_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t asrun_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t asrun_writer;
+static int asrun_running = 0;
+static asrun_record asrun_head = NULL;
+static asrun_record asrun_tail = NULL;
+static int asrun_queued = 0;
+static unsigned int asrun_dropped = 0;
+static char *asrun_path = NULL;
+static asrun_format asrun_output = asrun_log;
+static int64_t asrun_size = 0;
+static int asrun_keep = 0;
+static FILE *asrun_file = NULL;
+static int64_t asrun_length = 0;
+
+/** The wall clock time in microseconds.
+*/
+
+static int64_t asrun_now( )
+{
+	struct timeval now;
+	gettimeofday( &now, NULL );
+	return ( int64_t )now.tv_sec * 1000000 + now.tv_usec;
+}
+
+/** Format a wall clock time as ISO 8601 local time with milliseconds.
+*/
+
+static void asrun_time( char *text, size_t size, int64_t when )
+{
+	time_t seconds = when / 1000000;
+	struct tm local;
+	char zone[ 8 ];
+	int length = 0;
+
+	localtime_r( &seconds, &local );
+	length = strftime( text, size, "%Y-%m-%dT%H:%M:%S", &local );
+	strftime( zone, sizeof( zone ), "%z", &local );
+	snprintf( text + length, size - length, ".%03d%s", ( int )( when % 1000000 / 1000 ), zone );
+}
+
+/** Copy a string, escaping it for a JSON string or a CSV field.
+*/
+
+static void asrun_escape( char *output, size_t size, const char *input, int json )
+{
+	size_t used = 0;
+
+	while ( *input != '\0' && used + 7 < size )
+	{
+		unsigned char c = *input ++;
+		if ( json && ( c == '"' || c == '\\' ) )
+		{
+			output[ used ++ ] = '\\';
+			output[ used ++ ] = c;
+		}
+		else if ( json && c < 0x20 )
+		{
+			used += sprintf( output + used, "\\u%04x", c );
+		}
+		else if ( !json && c == '"' )
+		{
+			output[ used ++ ] = '"';
+			output[ used ++ ] = '"';
+		}
+		else
+		{
+			output[ used ++ ] = c;
+		}
+	}
+
+	output[ used ] = '\0';
+}
+
+/** Open the log file, starting a CSV file with its header.
+*/
+
+static void asrun_open( )
+{
+	struct stat info;
+
+	asrun_file = fopen( asrun_path, "a" );
+	asrun_length = asrun_file != NULL && stat( asrun_path, &info ) == 0 ? info.st_size : 0;
+
+	if ( asrun_file == NULL )
+		melted_log( LOG_ERR, "unable to open as-run log %s: %s", asrun_path, strerror( errno ) );
+	else if ( asrun_output == asrun_csv && asrun_length == 0 )
+		asrun_length += fprintf( asrun_file, "unit,clip,start,end,first,last,frames,in,out,reason,resource\n" );
+}
+
+/** Move the full log aside as path.1, shifting older logs up to path.keep.
+*/
+
+static void asrun_rotate( )
+{
+	char from[ 1024 ];
+	char to[ 1024 ];
+	int index = 0;
+
+	fclose( asrun_file );
+	asrun_file = NULL;
+
+	if ( asrun_keep <= 0 )
+	{
+		unlink( asrun_path );
+	}
+	else
+	{
+		for ( index = asrun_keep - 1; index > 0; index -- )
+		{
+			snprintf( from, sizeof( from ), "%s.%d", asrun_path, index );
+			snprintf( to, sizeof( to ), "%s.%d", asrun_path, index + 1 );
+			rename( from, to );
+		}
+		snprintf( to, sizeof( to ), "%s.1", asrun_path );
+		rename( asrun_path, to );
+	}
+
+	asrun_open( );
+}
+
+/** Write a record in the configured format.
+*/
+
+static void asrun_write( asrun_record record )
+{
+	char start[ 64 ];
+	char end[ 64 ];
+	char resource[ 4096 ];
+	char line[ 8192 ];
+	int length = 0;
+
+	asrun_time( start, sizeof( start ), record->start );
+	asrun_time( end, sizeof( end ), record->end );
+
+	if ( asrun_output == asrun_log )
+	{
+		melted_log( LOG_NOTICE, "AS-RUN U%d \"%s\" start %s end %s frames %d first %d last %d %s", record->unit, record->resource,
+					start, end, record->frames, record->first, record->last, record->reason );
+		return;
+	}
+
+	asrun_escape( resource, sizeof( resource ), record->resource, asrun_output == asrun_json );
+
+	if ( asrun_output == asrun_json )
+		length = snprintf( line, sizeof( line ), "{\"unit\":%d,\"clip\":%d,\"resource\":\"%s\",\"start\":\"%s\",\"end\":\"%s\","
+						   "\"duration\":%.3f,\"first\":%d,\"last\":%d,\"frames\":%d,\"in\":%d,\"out\":%d,\"reason\":\"%s\"}\n",
+						   record->unit, record->clip_index, resource, start, end, ( record->end - record->start ) / 1000000.0,
+						   record->first, record->last, record->frames, record->in, record->out, record->reason );
+	else
+		length = snprintf( line, sizeof( line ), "%d,%d,%s,%s,%d,%d,%d,%d,%d,%s,\"%s\"\n", record->unit, record->clip_index,
+						   start, end, record->first, record->last, record->frames, record->in, record->out, record->reason, resource );
+
+	if ( length >= sizeof( line ) )
+		length = sizeof( line ) - 1;
+
+	if ( asrun_file != NULL && asrun_size > 0 && asrun_length > 0 && asrun_length + length > asrun_size )
+		asrun_rotate( );
+	if ( asrun_file == NULL )
+		asrun_open( );
+
+	if ( asrun_file != NULL && fwrite( line, 1, length, asrun_file ) == length )
+		asrun_length += length;
+}
+
+/** The writer thread - writes each record as it arrives so the file is
+	complete up to the last clip which left air.
+*/
+
+static void *asrun_thread( void *arg )
+{
+	unsigned int reported = 0;
+
+	pthread_mutex_lock( &asrun_mutex );
+
+	while ( asrun_running || asrun_head != NULL )
+	{
+		asrun_record record = asrun_head;
+
+		if ( record == NULL )
+		{
+			pthread_cond_wait( &asrun_cond, &asrun_mutex );
+			continue;
+		}
+
+		asrun_head = record->next;
+		if ( asrun_head == NULL )
+			asrun_tail = NULL;
+		asrun_queued --;
+		pthread_mutex_unlock( &asrun_mutex );
+
+		if ( asrun_dropped != reported )
+		{
+			melted_log( LOG_WARNING, "as-run log fell behind - %u records dropped", asrun_dropped - reported );
+			reported = asrun_dropped;
+		}
+		asrun_write( record );
+		if ( asrun_file != NULL )
+			fflush( asrun_file );
+		free( record );
+
+		pthread_mutex_lock( &asrun_mutex );
+	}
+
+	pthread_mutex_unlock( &asrun_mutex );
+
+	return NULL;
+}
+
+/** Start the writer. Records go to the file at path in the json (JSON lines,
+	the default) or csv format, which is moved aside when it would grow past
+	size bytes keeping keep older files. Without a path they are logged as
+	before. Returns non-zero if the writer could not be started.
+*/
+
+int melted_asrun_init( const char *path, const char *format, int64_t size, int keep )
+{
+	int error = 0;
+
+	pthread_mutex_lock( &asrun_mutex );
+
+	if ( !asrun_running )
+	{
+		free( asrun_path );
+		asrun_path = path != NULL && *path != '\0' ? strdup( path ) : NULL;
+		asrun_output = asrun_path == NULL ? asrun_log : format != NULL && !strcasecmp( format, "csv" ) ? asrun_csv : asrun_json;
+		asrun_size = size;
+		asrun_keep = keep;
+		asrun_running = 1;
+		if ( pthread_create( &asrun_writer, NULL, asrun_thread, NULL ) != 0 )
+		{
+			asrun_running = 0;
+			error = 1;
+		}
+	}
+
+	pthread_mutex_unlock( &asrun_mutex );
+
+	return error;
+}
+
+/** Write the records still queued and stop the writer.
+*/
+
+void melted_asrun_close( )
+{
+	int running = 0;
+
+	pthread_mutex_lock( &asrun_mutex );
+	running = asrun_running;
+	asrun_running = 0;
+	pthread_cond_signal( &asrun_cond );
+	pthread_mutex_unlock( &asrun_mutex );
+
+	if ( running )
+	{
+		pthread_join( asrun_writer, NULL );
+		if ( asrun_file != NULL )
+			fclose( asrun_file );
+		asrun_file = NULL;
+	}
+}
+
+/** Queue a record of the clip on air, which left air at end, for the writer.
+*/
+
+static void asrun_queue( melted_asrun_clip clip, int64_t end, const char *reason )
+{
+	asrun_record record = NULL;
+
+	pthread_mutex_lock( &asrun_mutex );
+	if ( !asrun_running || asrun_queued >= MELTED_ASRUN_QUEUE )
+	{
+		asrun_dropped += asrun_running;
+	}
+	else if ( ( record = malloc( sizeof( asrun_record_t ) ) ) != NULL )
+	{
+		record->unit = clip->unit;
+		record->clip_index = clip->clip_index;
+		strcpy( record->resource, clip->resource );
+		record->in = clip->in;
+		record->out = clip->out;
+		record->first = clip->first;
+		record->last = clip->last;
+		record->frames = clip->frames;
+		record->start = clip->start;
+		record->end = end;
+		record->reason = reason;
+		record->next = NULL;
+		if ( asrun_tail != NULL )
+			asrun_tail->next = record;
+		else
+			asrun_head = record;
+		asrun_tail = record;
+		asrun_queued ++;
+		pthread_cond_signal( &asrun_cond );
+	}
+	pthread_mutex_unlock( &asrun_mutex );
+}
+
+void melted_asrun_clip_init( melted_asrun_clip clip )
+{
+	memset( clip, 0, sizeof( melted_asrun_clip_t ) );
+	pthread_mutex_init( &clip->mutex, NULL );
+}
+
+void melted_asrun_clip_close( melted_asrun_clip clip )
+{
+	pthread_mutex_destroy( &clip->mutex );
+}
+
+/** Record the clip on air leaving it for the given reason.
+*/
+
+void melted_asrun_end( melted_asrun_clip clip, const char *reason )
+{
+	pthread_mutex_lock( &clip->mutex );
+	// The last frame shown was on air for one frame period
+	if ( clip->active )
+		asrun_queue( clip, clip->shown + ( clip->fps > 0 ? ( int64_t )( 1000000 / clip->fps ) : 0 ), reason );
+	clip->active = 0;
+	pthread_mutex_unlock( &clip->mutex );
+}
+
+/** Follow the clips on air from the status of each frame shown. A clip airs
+	from the first frame shown while playing until a different clip is
+	shown, playback pauses or stops, or it plays again from an earlier
+	position.
+*/
+
+void melted_asrun_frame( melted_asrun_clip clip, mvcp_status status )
+{
+	int playing = status->status == unit_playing && status->speed != 0;
+	int64_t now = asrun_now( );
+
+	pthread_mutex_lock( &clip->mutex );
+
+	if ( clip->active )
+	{
+		const char *reason = NULL;
+
+		if ( status->status == unit_not_loaded )
+			reason = "unloaded";
+		else if ( status->status == unit_stopped )
+			reason = "stopped";
+		else if ( !playing )
+			reason = "paused";
+		else if ( status->clip_index != clip->clip_index || strcmp( status->clip, clip->resource ) )
+			reason = "next";
+		else if ( status->speed > 0 && status->position < clip->last )
+			reason = "repeat";
+
+		if ( reason != NULL )
+		{
+			// Whatever is shown now replaced the last frame on air
+			asrun_queue( clip, now, reason );
+			clip->active = 0;
+		}
+		else
+		{
+			clip->frames ++;
+			clip->last = status->position;
+			clip->shown = now;
+		}
+	}
+
+	if ( !clip->active && playing )
+	{
+		clip->active = 1;
+		clip->unit = status->unit;
+		clip->clip_index = status->clip_index;
+		snprintf( clip->resource, sizeof( clip->resource ), "%s", status->clip );
+		clip->in = status->in;
+		clip->out = status->out;
+		clip->first = status->position;
+		clip->last = status->position;
+		clip->frames = 1;
+		clip->fps = status->fps;
+		clip->start = now;
+		clip->shown = now;
+	}
+
+	pthread_mutex_unlock( &clip->mutex );
+}
@@ -0,0 +1,65 @@
+/*
+ * melted_asrun.h -- As-Run Log Writer
+ * Copyright (C) 2002-2015 Meltytech, LLC
+ * Author: Charles Yates <charles.yates@pandora.be>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#ifndef _MELTED_ASRUN_H_
+#define _MELTED_ASRUN_H_
+
+#include <stdint.h>
+#include <pthread.h>
+#include <mvcp/mvcp_status.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+/** The clip a unit has on air, from its first frame shown.
+*/
+
+typedef struct
+{
+	pthread_mutex_t mutex;
+	int active;
+	int unit;
+	int clip_index;
+	char resource[ 2048 ];
+	int32_t in;
+	int32_t out;
+	int32_t first;
+	int32_t last;
+	int frames;
+	double fps;
+	int64_t start;
+	int64_t shown;
+}
+melted_asrun_clip_t, *melted_asrun_clip;
+
+extern int melted_asrun_init( const char *path, const char *format, int64_t size, int keep );
+extern void melted_asrun_close( void );
+extern void melted_asrun_clip_init( melted_asrun_clip clip );
+extern void melted_asrun_clip_close( melted_asrun_clip clip );
+extern void melted_asrun_frame( melted_asrun_clip clip, mvcp_status status );
+extern void melted_asrun_end( melted_asrun_clip clip, const char *reason );
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,219 @@
+/*
+ * melted_batch.c -- Startup Batch Execution
+ * Copyright (C) 2002-2015 Meltytech, LLC
+ * Author: Charles Yates <charles.yates@pandora.be>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+/* System header files */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <time.h>
+
+/* Application header files */
+#include <mvcp/mvcp_util.h>
+#include "melted_batch.h"
+#include "melted_loader.h"
+#include "melted_log.h"
+
+/** Seconds on the monotonic clock.
+*/
+
+static double batch_time( )
+{
+	struct timespec now;
+	clock_gettime( CLOCK_MONOTONIC, &now );
+	return now.tv_sec + now.tv_nsec / 1000000000.0;
+}
+
+/** Check if the command is the named one.
+*/
+
+static int batch_is( const char *command, const char *name )
+{
+	int length = strlen( name );
+	return !strncasecmp( command, name, length ) && ( command[ length ] == ' ' || command[ length ] == '\0' );
+}
+
+/** The unit a command is addressed to, or -1 for a global command.
+*/
+
+static int batch_unit( const char *command )
+{
+	const char *argument = strchr( command, ' ' );
+
+	while ( argument != NULL && *argument == ' ' )
+		argument ++;
+
+	if ( argument != NULL && toupper( argument[ 0 ] ) == 'U' && isdigit( argument[ 1 ] ) )
+		return atoi( argument + 1 );
+
+	return -1;
+}
+
+/** Check if the command opens a clip and can be queued on the loader.
+*/
+
+static int batch_is_load( const char *command )
+{
+	int length = strlen( command );
+
+	if ( length >= 6 && !strcasecmp( command + length - 6, " ASYNC" ) )
+		return 0;
+
+	return batch_is( command, "LOAD" ) || batch_is( command, "APND" ) || batch_is( command, "INSERT" );
+}
+
+/** Read the commands in the file, skipping blank lines and comments. Returns
+	the number of commands read.
+*/
+
+static int batch_scan( FILE *file, char ***commands )
+{
+	char command[ 1024 ];
+	int count = 0;
+	int size = 0;
+
+	*commands = NULL;
+
+	while ( fgets( command, sizeof( command ), file ) )
+	{
+		mvcp_util_trim( mvcp_util_chomp( command ) );
+		if ( strcmp( command, "" ) && command[ 0 ] != '#' )
+		{
+			if ( count == size )
+			{
+				char **grown = realloc( *commands, ( size = size ? size * 2 : 64 ) * sizeof( char * ) );
+				if ( grown == NULL )
+					break;
+				*commands = grown;
+			}
+			( *commands )[ count ++ ] = strdup( command );
+		}
+	}
+
+	return count;
+}
+
+/** Execute a command, queueing clips which are opened on the loader. When
+	too many requests are outstanding, the loader is drained and the request
+	retried before falling back to opening the clip here. Any other command
+	on a unit waits for that unit's clips first, and global commands other
+	than UADD wait for all of them.
+*/
+
+mvcp_response melted_batch_execute( mvcp_parser parser, char *command )
+{
+	mvcp_response response = NULL;
+	int unit = batch_unit( command );
+
+	if ( unit >= 0 && batch_is_load( command ) )
+	{
+		char async[ 1100 ];
+		snprintf( async, sizeof( async ), "%s ASYNC", command );
+		response = mvcp_parser_execute( parser, async );
+		if ( mvcp_response_get_error_code( response ) == 406 )
+		{
+			mvcp_response_close( response );
+			melted_loader_wait( -1 );
+			response = mvcp_parser_execute( parser, async );
+		}
+		if ( mvcp_response_get_error_code( response ) == 406 )
+		{
+			mvcp_response_close( response );
+			response = mvcp_parser_execute( parser, command );
+		}
+	}
+	else
+	{
+		// Other commands see the play lists as the serial batch would have left them
+		if ( unit >= 0 && !batch_is( command, "XFER" ) && !batch_is( command, "SWAP" ) )
+			melted_loader_wait( unit );
+		else if ( !batch_is( command, "UADD" ) )
+			melted_loader_wait( -1 );
+		response = mvcp_parser_execute( parser, command );
+	}
+
+	return response;
+}
+
+/** Run a batch file at startup. All of the commands are read first, then
+	executed in order with each LOAD, APND and INSERT queued on the loader,
+	so clips are opened in parallel while each unit's play list is built in
+	the order given. Any other command on a unit waits for that unit's clips
+	first, and global commands other than UADD wait for all of them. The
+	response is as for mvcp_parser_run, except that queued clips report
+	their job id and a clip which fails to open is only logged.
+*/
+
+mvcp_response melted_batch_run( mvcp_parser parser, const char *filename )
+{
+	mvcp_response response = mvcp_response_init( );
+	FILE *file = fopen( filename, "r" );
+	char **commands = NULL;
+	int count = 0;
+	int clips = 0;
+	int index = 0;
+	double start = batch_time( );
+	double scanned = 0;
+	double executed = 0;
+
+	if ( file == NULL )
+	{
+		mvcp_response_set_error( response, 404, "File not found." );
+		return response;
+	}
+
+	count = batch_scan( file, &commands );
+	fclose( file );
+	scanned = batch_time( );
+	melted_log( LOG_NOTICE, "startup: read %d commands from %s in %.3fs", count, filename, scanned - start );
+
+	mvcp_response_set_error( response, 201, "OK" );
+
+	for ( index = 0; index < count && mvcp_response_get_error_code( response ) == 201; index ++ )
+	{
+		mvcp_response temp = NULL;
+		mvcp_response_printf( response, 1024, "%s\n", commands[ index ] );
+		clips += batch_unit( commands[ index ] ) >= 0 && batch_is_load( commands[ index ] );
+		temp = melted_batch_execute( parser, commands[ index ] );
+		if ( temp != NULL )
+		{
+			int line = 0;
+			for ( line = 0; line < mvcp_response_count( temp ); line ++ )
+				mvcp_response_printf( response, 10240, "%s\n", mvcp_response_get_line( temp, line ) );
+			mvcp_response_close( temp );
+		}
+		else
+		{
+			mvcp_response_set_error( response, 500, "Batch execution failed" );
+		}
+	}
+
+	executed = batch_time( );
+	melted_log( LOG_NOTICE, "startup: executed %d commands with %d clips in %.3fs", index, clips, executed - scanned );
+
+	melted_loader_wait( -1 );
+	melted_log( LOG_NOTICE, "startup: clips opened %.3fs later, %.3fs in total", batch_time( ) - executed, batch_time( ) - start );
+
+	for ( index = 0; index < count; index ++ )
+		free( commands[ index ] );
+	free( commands );
+
+	return response;
+}
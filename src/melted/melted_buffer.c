@@ -0,0 +1,188 @@
+/*
+ * melted_buffer.c -- Connection Receive Buffer
+ * Copyright (C) 2002-2015 Meltytech, LLC
+ * Author: Charles Yates <charles.yates@pandora.be>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+/* System header files */
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/uio.h>
+
+/* Application header files */
+#include "melted_buffer.h"
+
+/** Initialise an empty receive buffer.
+*/
+
+void melted_buffer_init( melted_buffer this )
+{
+	this->head = 0;
+	this->count = 0;
+	this->line = NULL;
+	this->line_size = 0;
+	this->line_used = 0;
+}
+
+/** Read whatever the socket has available into the free space of the ring.
+	Returns the number of bytes read, 0 on end of file or -1 on error.
+*/
+
+int melted_buffer_fill( melted_buffer this, int fd )
+{
+	struct iovec iov[ 2 ];
+	int tail = ( this->head + this->count ) % MELTED_BUFFER_SIZE;
+	int space = MELTED_BUFFER_SIZE - this->count;
+	int vectors = 1;
+	ssize_t count = 0;
+
+	if ( space == 0 )
+		return -1;
+
+	iov[ 0 ].iov_base = this->data + tail;
+	if ( tail + space > MELTED_BUFFER_SIZE )
+	{
+		iov[ 0 ].iov_len = MELTED_BUFFER_SIZE - tail;
+		iov[ 1 ].iov_base = this->data;
+		iov[ 1 ].iov_len = space - iov[ 0 ].iov_len;
+		vectors = 2;
+	}
+	else
+	{
+		iov[ 0 ].iov_len = space;
+	}
+
+	do
+		count = readv( fd, iov, vectors );
+	while ( count == -1 && errno == EINTR );
+
+	if ( count > 0 )
+		this->count += count;
+
+	return count;
+}
+
+/** Number of bytes held in the ring.
+*/
+
+int melted_buffer_available( melted_buffer this )
+{
+	return this->count;
+}
+
+/** Append to the line being assembled.
+*/
+
+static int melted_buffer_append( melted_buffer this, const char *data, int length )
+{
+	if ( this->line_used + length + 1 > this->line_size )
+	{
+		int size = this->line_size == 0 ? 1024 : this->line_size;
+		char *line = NULL;
+		while ( size < this->line_used + length + 1 )
+			size *= 2;
+		line = realloc( this->line, size );
+		if ( line == NULL )
+			return -1;
+		this->line = line;
+		this->line_size = size;
+	}
+	memcpy( this->line + this->line_used, data, length );
+	this->line_used += length;
+	return 0;
+}
+
+/** Fetch the next complete line. Returns 1 and sets line to a nul terminated
+	string with the CR/LF terminator removed when a line is available, 0 when
+	more input is required and -1 if the line exceeds the maximum length. The
+	line remains owned by the buffer and is valid until the next call.
+*/
+
+int melted_buffer_get_line( melted_buffer this, char **line )
+{
+	while ( this->count > 0 )
+	{
+		int length = this->count;
+		char *start = this->data + this->head;
+		char *lf = NULL;
+
+		if ( this->head + length > MELTED_BUFFER_SIZE )
+			length = MELTED_BUFFER_SIZE - this->head;
+
+		lf = memchr( start, '\n', length );
+		if ( lf != NULL )
+			length = lf - start + 1;
+
+		if ( this->line_used + length > MELTED_BUFFER_MAX_LINE || melted_buffer_append( this, start, length ) )
+			return -1;
+
+		this->head = ( this->head + length ) % MELTED_BUFFER_SIZE;
+		this->count -= length;
+
+		if ( lf != NULL )
+		{
+			this->line_used --;
+			if ( this->line_used > 0 && this->line[ this->line_used - 1 ] == '\r' )
+				this->line_used --;
+			this->line[ this->line_used ] = '\0';
+			this->line_used = 0;
+			*line = this->line;
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+/** Copy up to length bytes of buffered data. Returns the number copied.
+*/
+
+int melted_buffer_get_data( melted_buffer this, char *data, int length )
+{
+	int total = 0;
+
+	while ( total < length && this->count > 0 )
+	{
+		int count = length - total;
+		if ( count > this->count )
+			count = this->count;
+		if ( this->head + count > MELTED_BUFFER_SIZE )
+			count = MELTED_BUFFER_SIZE - this->head;
+		memcpy( data + total, this->data + this->head, count );
+		this->head = ( this->head + count ) % MELTED_BUFFER_SIZE;
+		this->count -= count;
+		total += count;
+	}
+
+	if ( this->count == 0 )
+		this->head = 0;
+
+	return total;
+}
+
+/** Release the resources held by the buffer.
+*/
+
+void melted_buffer_close( melted_buffer this )
+{
+	free( this->line );
+	this->line = NULL;
+	this->line_size = 0;
+	this->line_used = 0;
+}
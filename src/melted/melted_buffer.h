@@ -0,0 +1,63 @@
+/*
+ * melted_buffer.h -- Connection Receive Buffer
+ * Copyright (C) 2002-2015 Meltytech, LLC
+ * Author: Charles Yates <charles.yates@pandora.be>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#ifndef _MELTED_BUFFER_H_
+#define _MELTED_BUFFER_H_
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+/** Size of the receive ring and the longest command line accepted.
+*/
+
+#define MELTED_BUFFER_SIZE 16384
+#define MELTED_BUFFER_MAX_LINE 1048576
+
+/** Receive buffer structure.
+*/
+
+typedef struct
+{
+	char data[ MELTED_BUFFER_SIZE ];
+	int head;
+	int count;
+	char *line;
+	int line_size;
+	int line_used;
+}
+*melted_buffer, melted_buffer_t;
+
+/** API for the receive buffer.
+*/
+
+extern void melted_buffer_init( melted_buffer );
+extern int melted_buffer_fill( melted_buffer, int );
+extern int melted_buffer_available( melted_buffer );
+extern int melted_buffer_get_line( melted_buffer, char ** );
+extern int melted_buffer_get_data( melted_buffer, char *, int );
+extern void melted_buffer_close( melted_buffer );
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,175 @@
+/*
+ * melted_cache.c -- Producer Cache
+ * Copyright (C) 2002-2015 Meltytech, LLC
+ * Author: Charles Yates <charles.yates@pandora.be>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+/* System header files */
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/stat.h>
+
+/* Application header files */
+#include "melted_cache.h"
+
+/** Cache entry.
+*/
+
+typedef struct
+{
+	char *resource;
+	time_t modified;
+	mlt_producer producer;
+	unsigned long used;
+}
+cache_entry;
+
+/** Cache structure.
+*/
+
+struct melted_cache_s
+{
+	pthread_mutex_t mutex;
+	cache_entry *entries;
+	int size;
+	unsigned long clock;
+};
+
+/** Modification time of the resource, or 0 if it isn't a file.
+*/
+
+static time_t cache_modified( const char *resource )
+{
+	struct stat buf;
+	return stat( resource, &buf ) == 0 ? buf.st_mtime : 0;
+}
+
+/** Release an entry - must be called with the mutex held.
+*/
+
+static void cache_release( cache_entry *entry )
+{
+	free( entry->resource );
+	mlt_producer_close( entry->producer );
+	memset( entry, 0, sizeof( cache_entry ) );
+}
+
+/** Create a cache holding up to size producers.
+*/
+
+melted_cache melted_cache_init( int size )
+{
+	melted_cache this = calloc( 1, sizeof( struct melted_cache_s ) );
+	if ( this != NULL )
+	{
+		this->entries = calloc( size, sizeof( cache_entry ) );
+		this->size = size;
+		pthread_mutex_init( &this->mutex, NULL );
+		if ( this->entries == NULL )
+		{
+			melted_cache_close( this );
+			this = NULL;
+		}
+	}
+	return this;
+}
+
+/** Fetch a reference to the producer previously opened for resource. The
+	caller must close the producer returned. Entries whose file has changed
+	since it was opened are discarded.
+*/
+
+mlt_producer melted_cache_get( melted_cache this, const char *resource )
+{
+	mlt_producer producer = NULL;
+	time_t modified = cache_modified( resource );
+	int index = 0;
+
+	pthread_mutex_lock( &this->mutex );
+	for ( index = 0; index < this->size; index ++ )
+	{
+		cache_entry *entry = &this->entries[ index ];
+		if ( entry->resource != NULL && !strcmp( entry->resource, resource ) )
+		{
+			if ( entry->modified == modified )
+			{
+				entry->used = ++ this->clock;
+				producer = entry->producer;
+				mlt_properties_inc_ref( MLT_PRODUCER_PROPERTIES( producer ) );
+			}
+			else
+			{
+				cache_release( entry );
+			}
+			break;
+		}
+	}
+	pthread_mutex_unlock( &this->mutex );
+
+	return producer;
+}
+
+/** Remember a producer, replacing the least recently used entry.
+*/
+
+void melted_cache_put( melted_cache this, const char *resource, mlt_producer producer )
+{
+	cache_entry *entry = NULL;
+	int index = 0;
+
+	pthread_mutex_lock( &this->mutex );
+	for ( index = 0; index < this->size; index ++ )
+	{
+		if ( this->entries[ index ].resource == NULL || !strcmp( this->entries[ index ].resource, resource ) )
+		{
+			entry = &this->entries[ index ];
+			break;
+		}
+		if ( entry == NULL || this->entries[ index ].used < entry->used )
+			entry = &this->entries[ index ];
+	}
+	if ( entry != NULL )
+	{
+		if ( entry->resource != NULL )
+			cache_release( entry );
+		entry->resource = strdup( resource );
+		entry->modified = cache_modified( resource );
+		entry->producer = producer;
+		entry->used = ++ this->clock;
+		mlt_properties_inc_ref( MLT_PRODUCER_PROPERTIES( producer ) );
+	}
+	pthread_mutex_unlock( &this->mutex );
+}
+
+/** Close the cache, releasing all producers.
+*/
+
+void melted_cache_close( melted_cache this )
+{
+	if ( this != NULL )
+	{
+		int index = 0;
+		for ( index = 0; this->entries != NULL && index < this->size; index ++ )
+			if ( this->entries[ index ].resource != NULL )
+				cache_release( &this->entries[ index ] );
+		free( this->entries );
+		pthread_mutex_destroy( &this->mutex );
+		free( this );
+	}
+}
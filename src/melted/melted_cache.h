@@ -0,0 +1,48 @@
+/*
+ * melted_cache.h -- Producer Cache
+ * Copyright (C) 2002-2015 Meltytech, LLC
+ * Author: Charles Yates <charles.yates@pandora.be>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#ifndef _MELTED_CACHE_H_
+#define _MELTED_CACHE_H_
+
+#include <framework/mlt.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+/** Opaque cache handle.
+*/
+
+typedef struct melted_cache_s *melted_cache;
+
+/** API for the producer cache.
+*/
+
+extern melted_cache melted_cache_init( int );
+extern mlt_producer melted_cache_get( melted_cache, const char * );
+extern void melted_cache_put( melted_cache, const char *, mlt_producer );
+extern void melted_cache_close( melted_cache );
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
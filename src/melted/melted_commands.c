@@ -27,23 +27,91 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <dirent.h>
+#include <fnmatch.h>
 #include <pthread.h>
 
 #include "melted_unit.h"
 #include "melted_commands.h"
+#include "melted_loader.h"
 #include "melted_log.h"
+#include "melted_metrics.h"
+#include "melted_trace.h"
+#include "melted_index.h"
+#include "melted_probe.h"
+#include "melted_snapshot.h"
+#include "melted_unit_commands.h"
+
+/** The unit registry - a table which grows on demand. The table holds one
+	reference to each unit, the rest are held by callers between
+	melted_acquire_unit and melted_release_unit.
+*/
 
-static melted_unit g_units[MAX_UNITS] = {NULL};
+static pthread_mutex_t g_units_mutex = PTHREAD_MUTEX_INITIALIZER;
+static melted_unit *g_units = NULL;
+static int g_units_size = 0;
 
-/** Return the melted_unit given a numeric index.
+/** Marks a slot taken by a unit which is still being built - readers see no
+	unit there.
+*/
+
+static int g_units_reserved;
+#define UNIT_RESERVED ( ( melted_unit )&g_units_reserved )
+
+/** Return the melted_unit given a numeric index. The pointer is borrowed:
+	unit commands are safe since the dispatcher holds a reference while they
+	run, anything else should use melted_acquire_unit.
 */
 
 melted_unit melted_get_unit( int n )
 {
-	if (n < MAX_UNITS)
-		return g_units[n];
-	else
-		return NULL;
+	melted_unit unit = NULL;
+	pthread_mutex_lock( &g_units_mutex );
+	if ( n >= 0 && n < g_units_size && g_units[ n ] != UNIT_RESERVED )
+		unit = g_units[ n ];
+	pthread_mutex_unlock( &g_units_mutex );
+	return unit;
+}
+
+/** Return the melted_unit given a numeric index with a reference held, or
+	NULL if there is no such unit.
+*/
+
+melted_unit melted_acquire_unit( int n )
+{
+	melted_unit unit = NULL;
+	pthread_mutex_lock( &g_units_mutex );
+	if ( n >= 0 && n < g_units_size && g_units[ n ] != UNIT_RESERVED && ( unit = g_units[ n ] ) != NULL )
+		unit->refs ++;
+	pthread_mutex_unlock( &g_units_mutex );
+	return unit;
+}
+
+/** Drop a reference to a unit - the last one closes it.
+*/
+
+void melted_release_unit( melted_unit unit )
+{
+	int refs = 1;
+	if ( unit != NULL )
+	{
+		pthread_mutex_lock( &g_units_mutex );
+		refs = -- unit->refs;
+		pthread_mutex_unlock( &g_units_mutex );
+		if ( refs == 0 )
+			melted_unit_close( unit );
+	}
+}
+
+/** Return the number of unit slots - every unit index is below this.
+*/
+
+int melted_count_units( void )
+{
+	int size = 0;
+	pthread_mutex_lock( &g_units_mutex );
+	size = g_units_size;
+	pthread_mutex_unlock( &g_units_mutex );
+	return size;
 }
 
 /** Destroy the melted_unit given its numeric index.
@@ -51,15 +119,20 @@ melted_unit melted_get_unit( int n )
 
 void melted_delete_unit( int n )
 {
-	if (n < MAX_UNITS)
+	melted_unit unit = NULL;
+
+	pthread_mutex_lock( &g_units_mutex );
+	if ( n >= 0 && n < g_units_size && g_units[ n ] != UNIT_RESERVED )
 	{
-		melted_unit unit = melted_get_unit(n);
-		if (unit != NULL)
-		{
-			melted_unit_close( unit );
-			g_units[ n ] = NULL;
-			melted_log( LOG_NOTICE, "Deleted unit U%d.", n ); 
-		}
+		unit = g_units[ n ];
+		g_units[ n ] = NULL;
+	}
+	pthread_mutex_unlock( &g_units_mutex );
+
+	if ( unit != NULL )
+	{
+		melted_release_unit( unit );
+		melted_log( LOG_NOTICE, "Deleted unit U%d.", n ); 
 	}
 }
 
@@ -69,39 +142,83 @@ void melted_delete_unit( int n )
 void melted_delete_all_units( void )
 {
 	int i;
-	for (i = 0; i < MAX_UNITS; i++)
+	for ( i = 0; i < melted_count_units( ); i++ )
 		melted_delete_unit( i );
+	pthread_mutex_lock( &g_units_mutex );
+	free( g_units );
+	g_units = NULL;
+	g_units_size = 0;
+	pthread_mutex_unlock( &g_units_mutex );
 }
 
-/** Add a virtual vtr to the server.
+/** Add a virtual vtr to the server. The slot is reserved under the mutex and
+	the unit is built outside it, since that starts its consumer and threads,
+	then published.
 */
 response_codes melted_add_unit( command_argument cmd_arg )
 {
 	int i = 0;
+	int size = 0;
+	int published = 0;
+	melted_unit unit = NULL;
 
-	// Initialize g_units array on first call.
-	if ( g_units[0] == NULL )
-	{
-		for ( i = 1; i < MAX_UNITS; i ++ )
-			g_units[ i ] = NULL;
-	}
+	pthread_mutex_lock( &g_units_mutex );
 
-	// Locate first empty item in g_units array.
-	for ( i = 0; i < MAX_UNITS; i ++ )
+	// Locate first empty item in the registry, growing it if full.
+	for ( i = 0; i < g_units_size; i ++ )
 		if ( g_units[ i ] == NULL )
 			break;
 
-	if ( i < MAX_UNITS )
+	if ( i == g_units_size && g_units_size < MELTED_MAX_UNITS )
+	{
+		int size = g_units_size > 0 ? g_units_size * 2 : MAX_UNITS;
+		melted_unit *units = realloc( g_units, size * sizeof( melted_unit ) );
+		if ( units != NULL )
+		{
+			memset( units + g_units_size, 0, ( size - g_units_size ) * sizeof( melted_unit ) );
+			g_units = units;
+			g_units_size = size;
+		}
+	}
+
+	size = g_units_size;
+	if ( i < size )
+		g_units[ i ] = UNIT_RESERVED;
+
+	pthread_mutex_unlock( &g_units_mutex );
+
+	if ( i < size )
 	{
-		// Add unit.
-		char *arg = cmd_arg->argument;
-		g_units[ i ] = melted_unit_init( i, arg );
-		if ( g_units[ i ] != NULL )
+		unit = melted_unit_init( i, cmd_arg->argument );
+		if ( unit != NULL )
+			unit->refs = 1;
+
+		// Publish the unit, or give the slot back - unless the registry was
+		// emptied meanwhile
+		pthread_mutex_lock( &g_units_mutex );
+		if ( i < g_units_size && g_units[ i ] == UNIT_RESERVED )
 		{
-			melted_unit_set_notifier( g_units[ i ], mvcp_parser_get_notifier( cmd_arg->parser ), cmd_arg->root_dir );
-			mvcp_response_printf( cmd_arg->response, 10, "U%1d\n\n", i );
+			g_units[ i ] = unit;
+			published = 1;
+		}
+		pthread_mutex_unlock( &g_units_mutex );
+
+		if ( unit != NULL && !published )
+		{
+			melted_unit_close( unit );
+			unit = NULL;
 		}
-		return g_units[ i ] != NULL ? RESPONSE_SUCCESS_N : RESPONSE_ERROR;
+	}
+
+	if ( unit != NULL )
+	{
+		melted_unit_set_notifier( unit, mvcp_parser_get_notifier( cmd_arg->parser ), cmd_arg->root_dir );
+		mvcp_response_printf( cmd_arg->response, 1024, "U%1d\n\n", i );
+		return RESPONSE_SUCCESS_N;
+	}
+	else if ( i < size )
+	{
+		return RESPONSE_ERROR;
 	}
 	mvcp_response_printf( cmd_arg->response, 1024, "no more units can be created\n\n" );
 
@@ -125,9 +242,9 @@ response_codes melted_list_units( command_argument cmd_arg )
 	response_codes error = RESPONSE_SUCCESS_N;
 	int i = 0;
 
-	for ( i = 0; i < MAX_UNITS; i ++ )
+	for ( i = 0; i < melted_count_units( ); i ++ )
 	{
-		melted_unit unit = melted_get_unit( i );
+		melted_unit unit = melted_acquire_unit( i );
 		if ( unit != NULL )
 		{
 			mlt_properties properties = unit->properties;
@@ -135,6 +252,7 @@ response_codes melted_list_units( command_argument cmd_arg )
 			int node = mlt_properties_get_int( properties, "node" );
 			int online = !mlt_properties_get_int( properties, "offline" );
 			mvcp_response_printf( cmd_arg->response, 1024, "U%d %02d %s %d\n", i, node, constructor, online );
+			melted_release_unit( unit );
 		}
 	}
 	mvcp_response_printf( cmd_arg->response, 1024, "\n" );
@@ -142,23 +260,107 @@ response_codes melted_list_units( command_argument cmd_arg )
 	return error;
 }
 
+/** Report the status of every unit, one USTA row each.
+*/
+
+response_codes melted_get_all_status( command_argument cmd_arg )
+{
+	char text[ 10240 ];
+	int i = 0;
+
+	for ( i = 0; i < melted_count_units( ); i ++ )
+	{
+		melted_unit unit = melted_acquire_unit( i );
+		if ( unit != NULL )
+		{
+			mvcp_status_t status;
+			if ( melted_unit_get_status( unit, &status ) == 0 )
+				mvcp_response_printf( cmd_arg->response, sizeof( text ), "%s", mvcp_status_serialise( &status, text, sizeof( text ) ) );
+			melted_release_unit( unit );
+		}
+	}
+	mvcp_response_printf( cmd_arg->response, 1024, "\n" );
+
+	return RESPONSE_SUCCESS_N;
+}
+
 static int filter_files( const struct dirent *de )
 {
 	return de->d_name[ 0 ] != '.';
 }
 
-/** List clips in a directory.
+/** Paging and filtering of a CLS listing.
+*/
+
+typedef struct
+{
+	mvcp_response response;
+	int first;
+	int count;
+	const char *pattern;
+	int seen;
+}
+clip_listing_t, *clip_listing;
+
+/** Add an entry to a CLS listing - the pattern only applies to files, so
+	directories can always be browsed.
+*/
+
+static void list_clip( void *arg, const char *name, int directory, uint64_t size )
+{
+	clip_listing listing = arg;
+
+	if ( !directory && listing->pattern != NULL && fnmatch( listing->pattern, name, 0 ) != 0 )
+		return;
+	if ( listing->seen ++ < listing->first )
+		return;
+	if ( listing->count >= 0 && listing->seen > listing->first + listing->count )
+		return;
+
+	if ( directory )
+		mvcp_response_printf( listing->response, 1024, "\"%s/\"\n", name );
+	else
+		mvcp_response_printf( listing->response, 1024, "\"%s\" %llu\n", name, (unsigned long long) size );
+}
+
+/** List clips in a directory, optionally skipping the first entries,
+	limiting the count and matching the files against a shell pattern:
+
+	CLS "dir" [first [count]] [pattern]
+
+	Directories held by the index are listed from memory.
 */
 response_codes melted_list_clips( command_argument cmd_arg )
 {
 	response_codes error = RESPONSE_BAD_FILE;
 	const char *dir_name = (const char*) cmd_arg->argument;
+	clip_listing_t listing = { cmd_arg->response, 0, -1, NULL, 0 };
+	command_value_t *value = NULL;
+	int argument = 2;
 	DIR *dir;
 	char fullname[1024];
 	struct dirent **de = NULL;
 	int i, n;
-	
+
+	if ( ( value = melted_command_arg( cmd_arg, argument ) ) != NULL && value->is_number )
+	{
+		listing.first = value->number < 0 ? 0 : value->number;
+		if ( ( value = melted_command_arg( cmd_arg, ++ argument ) ) != NULL && value->is_number )
+		{
+			listing.count = value->number;
+			value = melted_command_arg( cmd_arg, ++ argument );
+		}
+	}
+	if ( value != NULL )
+		listing.pattern = value->string;
+
 	snprintf( fullname, 1023, "%s%s", cmd_arg->root_dir, dir_name );
+	if ( melted_index_list( fullname, list_clip, &listing ) == 0 )
+	{
+		mvcp_response_write( cmd_arg->response, "\n", 1 );
+		return RESPONSE_SUCCESS_N;
+	}
+
 	dir = opendir( fullname );
 	if (dir != NULL)
 	{
@@ -169,14 +371,14 @@ response_codes melted_list_clips( command_argument cmd_arg )
 		{
 			snprintf( fullname, 1023, "%s%s/%s", cmd_arg->root_dir, dir_name, de[i]->d_name );
 			if ( stat( fullname, &info ) == 0 && S_ISDIR( info.st_mode ) )
-				mvcp_response_printf( cmd_arg->response, 1024, "\"%s/\"\n", de[i]->d_name );
+				list_clip( &listing, de[i]->d_name, 1, 0 );
 		}
 		for (i = 0; i < n; i++ )
 		{
 			snprintf( fullname, 1023, "%s%s/%s", cmd_arg->root_dir, dir_name, de[i]->d_name );
 			if ( lstat( fullname, &info ) == 0 && 
 				 ( S_ISREG( info.st_mode ) || S_ISLNK( info.st_mode ) || ( strstr( fullname, ".clip" ) && info.st_mode | S_IXUSR ) ) )
-				mvcp_response_printf( cmd_arg->response, 1024, "\"%s\" %llu\n", de[i]->d_name, (unsigned long long) info.st_size );
+				list_clip( &listing, de[i]->d_name, 0, info.st_size );
 			free( de[ i ] );
 		}
 		free( de );
@@ -187,6 +389,64 @@ response_codes melted_list_clips( command_argument cmd_arg )
 	return error;
 }
 
+/** Describe clips without loading them, from the probe cache where the
+	file is unchanged since it was last opened:
+
+	PROBE "file" ["file" ...]
+
+	Each file gives one line of "file" length fps service width height
+	channels frequency "streams" - one which can't be opened has a length
+	of -1.
+*/
+
+response_codes melted_probe_clips( command_argument cmd_arg )
+{
+	mlt_profile profile = mlt_profile_init( NULL );
+	int index = 0;
+
+	if ( profile == NULL )
+		return RESPONSE_ERROR;
+
+	for ( index = 1; index < cmd_arg->argc; index ++ )
+	{
+		char *name = mvcp_tokeniser_get_string( cmd_arg->tokeniser, index );
+		char filename[ 1024 ];
+		char fullname[ 1024 ];
+		melted_probe_t probe;
+
+		snprintf( filename, sizeof( filename ), "%s", name );
+		get_fullname( cmd_arg, fullname, sizeof( fullname ), filename );
+
+		if ( melted_probe_resource( fullname, profile, &probe ) == 0 )
+			mvcp_response_printf( cmd_arg->response, 2048, "\"%s\" %d %.2f %s %d %d %d %d \"%s\"\n", name,
+								  probe.length, probe.fps, probe.service[ 0 ] ? probe.service : "-",
+								  probe.width, probe.height, probe.channels, probe.frequency, probe.streams );
+		else
+			mvcp_response_printf( cmd_arg->response, 2048, "\"%s\" -1 0.00 - 0 0 0 0 \"\"\n", name );
+	}
+
+	mlt_profile_close( profile );
+	mvcp_response_write( cmd_arg->response, "\n", 1 );
+
+	return RESPONSE_SUCCESS_N;
+}
+
+/** Write the state of every unit to the file given, or to the snapshot file
+	the server was started with.
+*/
+
+response_codes melted_write_snapshot( command_argument cmd_arg )
+{
+	command_value_t *file = melted_command_arg( cmd_arg, 1 );
+
+	if ( file == NULL && melted_snapshot_path( ) == NULL )
+		return RESPONSE_MISSING_ARG;
+	if ( melted_snapshot_write( file != NULL ? file->string : NULL ) != 0 )
+		return RESPONSE_ERROR;
+
+	return RESPONSE_SUCCESS;
+}
+
 /** Set a server configuration property.
 */
 
@@ -208,10 +468,12 @@ response_codes melted_set_global_property( command_argument cmd_arg )
 		int i;
 		
 		/* stop all units and unload clips */
-		for (i = 0; i < MAX_UNITS; i++)
+		for (i = 0; i < melted_count_units( ); i++)
 		{
-			if (g_units[i] != NULL)
-				melted_unit_terminate( g_units[i] );
+			melted_unit unit = melted_acquire_unit( i );
+			if (unit != NULL)
+				melted_unit_terminate( unit );
+			melted_release_unit( unit );
 		}
 
 		/* set the property */
@@ -223,6 +485,9 @@ response_codes melted_set_global_property( command_argument cmd_arg )
 			cmd_arg->root_dir[ len ] = '/';
 			cmd_arg->root_dir[ len + 1 ] = '\0';
 		}
+
+		/* index the new media root if the index is enabled */
+		melted_index_root( cmd_arg->root_dir );
 	}
 	else
 		return RESPONSE_OUT_OF_RANGE;
@@ -248,4 +513,62 @@ response_codes melted_get_global_property( command_argument cmd_arg )
 	return RESPONSE_SUCCESS;
 }
 
+/** Report the state of an asynchronous load request.
+*/
+
+response_codes melted_get_job_status( command_argument cmd_arg )
+{
+	int id = *( int * )cmd_arg->argument;
+
+	if ( melted_loader_report( id, cmd_arg->response ) != 0 )
+		return RESPONSE_OUT_OF_RANGE;
+
+	return RESPONSE_SUCCESS;
+}
+
+/** Report whether PUSH bodies may be sent with the named encoding - a client
+	only compresses a PUSH after the server accepts the encoding here.
+*/
+
+response_codes melted_encoding( command_argument cmd_arg )
+{
+#ifdef HAVE_ZLIB
+	if ( !strcasecmp( (char*) cmd_arg->argument, "DEFLATE" ) )
+		return RESPONSE_SUCCESS;
+#endif
+
+	return RESPONSE_OUT_OF_RANGE;
+}
 
+/** Report the server metrics - a summary by default, the Prometheus text
+	exposition format with STATS PROMETHEUS, a single unit with its recent
+	dropped frames with STATS U{n} or the recent traced commands with STATS
+	TRACE.
+*/
+
+response_codes melted_report_stats( command_argument cmd_arg )
+{
+	command_value_t *format = melted_command_arg( cmd_arg, 1 );
+	int prometheus = format != NULL && !strcasecmp( format->string, "PROMETHEUS" );
+
+	if ( format != NULL && !prometheus && ( format->string[ 0 ] == 'U' || format->string[ 0 ] == 'u' ) && format->string[ 1 ] != '\0' )
+	{
+		if ( melted_metrics_report_unit( cmd_arg->response, atoi( format->string + 1 ) ) != 0 )
+			return RESPONSE_INVALID_UNIT;
+	}
+	else if ( format != NULL && !strcasecmp( format->string, "TRACE" ) )
+	{
+		melted_trace_report( cmd_arg->response );
+	}
+	else if ( format != NULL && !prometheus )
+	{
+		return RESPONSE_OUT_OF_RANGE;
+	}
+	else
+	{
+		melted_metrics_report( cmd_arg->response, prometheus );
+	}
+	mvcp_response_printf( cmd_arg->response, 1024, "\n" );
+
+	return RESPONSE_SUCCESS_N;
+}
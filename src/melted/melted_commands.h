@@ -31,7 +31,15 @@ extern "C"
 {
 #endif
 
+/** Upper limit on the number of units the registry grows to.
+*/
+
+#define MELTED_MAX_UNITS 1024
+
 extern melted_unit melted_get_unit( int );
+extern melted_unit melted_acquire_unit( int );
+extern void melted_release_unit( melted_unit );
+extern int melted_count_units( void );
 extern void melted_delete_unit( int );
 extern void melted_delete_all_units( void );
 //extern void raw1394_start_service_threads( void );
@@ -40,9 +48,15 @@ extern void melted_delete_all_units( void );
 extern response_codes melted_add_unit( command_argument );
 extern response_codes melted_list_nodes( command_argument );
 extern response_codes melted_list_units( command_argument );
+extern response_codes melted_get_all_status( command_argument );
 extern response_codes melted_list_clips( command_argument );
+extern response_codes melted_probe_clips( command_argument );
+extern response_codes melted_write_snapshot( command_argument );
 extern response_codes melted_set_global_property( command_argument );
 extern response_codes melted_get_global_property( command_argument );
+extern response_codes melted_get_job_status( command_argument );
+extern response_codes melted_encoding( command_argument );
+extern response_codes melted_report_stats( command_argument );
 
 #ifdef __cplusplus
 }
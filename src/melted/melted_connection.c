@@ -28,11 +28,17 @@
 #include <string.h>
 #include <signal.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <unistd.h>
 #include <time.h>
 #include <netdb.h>
 #include <sys/socket.h> 
 #include <arpa/inet.h>
+#include <netinet/tcp.h>
+#include <errno.h>
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
 
 #include <mvcp/mvcp_socket.h>
 
@@ -41,69 +47,125 @@
 #include "melted_connection.h"
 #include "melted_server.h"
 #include "melted_log.h"
+#include "melted_resolver.h"
+#include "melted_metrics.h"
+#include "melted_trace.h"
+#include "melted_unit.h"
+#include "melted_local.h"
+#include "melted_proxy.h"
+
+static int connection_initiate( connection_t * );
+static int connection_send( connection_t *, mvcp_response );
+static int connection_read( connection_t *, char ** );
+static void connection_close( int );
 
-/** This is a generic replacement for fgets which operates on a file
-   descriptor. Unlike fgets, we can also specify a line terminator. Maximum
-   of (max - 1) chars can be read into buf from fd. If we reach the
-   end-of-file, *eof_chk is set to 1. 
+/** Apply the socket options requested by the server properties.
 */
 
-int fdgetline( int fd, char *buf, int max, char line_terminator, int *eof_chk )
+static void connection_options( connection_t *connection )
 {
-	int count = 0;
-	char tmp [1];
-	*eof_chk = 0;
-	
-	if (fd)
-		while (count < max - 1) {
-			if (read (fd, tmp, 1) > 0) {
-				if (tmp [0] != line_terminator)
-					buf [count++] = tmp [0];
-				else
-					break;
-
-/* Is it an EOF character (ctrl-D, i.e. ascii 4)? If so we definitely want
-   to break. */
-
-				if (tmp [0] == 4) {
-					*eof_chk = 1;
-					break;
-				}
-			} else {
-				*eof_chk = 1;
-				break;
-			}
-		}
-		
-	buf [count] = '\0';
-	
-	return count;
+	int flag = 1;
+	if ( mlt_properties_get_int( connection->owner, "tcp-nodelay" ) )
+		setsockopt( connection->fd, IPPROTO_TCP, TCP_NODELAY, (char *)&flag, sizeof( int ) );
 }
 
-static int connection_initiate( int );
-static int connection_send( int, mvcp_response );
-static int connection_read( int, char *, int );
-static void connection_close( int );
-
-static int connection_initiate( int fd )
+static int connection_initiate( connection_t *connection )
 {
 	int error = 0;
 	mvcp_response response = mvcp_response_init( );
+	connection_options( connection );
 	mvcp_response_set_error( response, 100, "VTR Ready" );
-	error = connection_send( fd, response );
+	error = connection_send( connection, response );
 	mvcp_response_close( response );
 	return error;
 }
 
-static int connection_send( int fd, mvcp_response response )
+/** Write the whole of a buffer to the socket.
+*/
+
+static int connection_write( int fd, const char *data, int length )
+{
+	while ( length > 0 )
+	{
+		int count = write( fd, data, length );
+		if ( count > 0 )
+		{
+			data += count;
+			length -= count;
+		}
+		else if ( count == 0 || errno != EINTR )
+		{
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/** Write a vector of buffers to the socket, resuming after partial writes.
+*/
+
+static int connection_writev( int fd, struct iovec *vector, int count )
+{
+	while ( count > 0 )
+	{
+		ssize_t written = writev( fd, vector, count );
+		if ( written > 0 )
+		{
+			while ( count > 0 && written >= ( ssize_t )vector->iov_len )
+			{
+				written -= vector->iov_len;
+				vector ++;
+				count --;
+			}
+			if ( count > 0 )
+			{
+				vector->iov_base = ( char * )vector->iov_base + written;
+				vector->iov_len -= written;
+			}
+		}
+		else if ( written == 0 || errno != EINTR )
+		{
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/** The number of buffers handed to writev at once.
+*/
+
+#define CONNECTION_IOV 1024
+
+/** Default bounds on a decompressed PUSH document - the size when
+	push-max-size isn't set, and the ratio to the compressed size when
+	push-inflate-ratio isn't set.
+*/
+
+#define CONNECTION_INFLATE_MAX ( 64 * 1024 * 1024 )
+#define CONNECTION_INFLATE_RATIO 100
+
+/** Send the lines of the response straight from its arena, gathered into as
+	few writes as possible.
+*/
+
+static int connection_send( connection_t *connection, mvcp_response response )
 {
+	static char blank[] = " ";
+	static char crlf[] = "\r\n";
 	int error = 0;
 	int index = 0;
 	int code = mvcp_response_get_error_code( response );
+	int fd = connection->fd;
 
 	if ( code != -1 )
 	{
 		int items = mvcp_response_count( response );
+		struct iovec vector[ CONNECTION_IOV ];
+		int used = 0;
+#ifdef TCP_CORK
+		int cork = mlt_properties_get_int( connection->owner, "tcp-cork" );
+		int flag = 1;
+#endif
 
 		if ( items == 0 )
 			mvcp_response_set_error( response, 500, "Unknown error" );
@@ -116,80 +178,175 @@ static int connection_send( int fd, mvcp_response response )
 		code = mvcp_response_get_error_code( response );
 		items = mvcp_response_count( response );
 
+#ifdef TCP_CORK
+		if ( cork )
+			setsockopt( fd, IPPROTO_TCP, TCP_CORK, (char *)&flag, sizeof( int ) );
+#endif
+
 		for ( index = 0; !error && index < items; index ++ )
 		{
-			char *line = mvcp_response_get_line( response, index );
-			int length = strlen( line );
-			if ( length == 0 && index != mvcp_response_count( response ) - 1 && write( fd, " ", 1 ) != 1 )
-				error = -1;
-			else if ( length > 0 && write( fd, line, length ) != length )
-				error = -1;
-			if ( write( fd, "\r\n", 2 ) != 2 )
-				error = -1;			
+			int length = mvcp_response_get_length( response, index );
+			if ( used > CONNECTION_IOV - 4 )
+			{
+				error = connection_writev( fd, vector, used );
+				used = 0;
+			}
+			if ( length == 0 && index != items - 1 )
+			{
+				vector[ used ].iov_base = blank;
+				vector[ used ++ ].iov_len = 1;
+			}
+			if ( length > 0 )
+			{
+				vector[ used ].iov_base = mvcp_response_get_line( response, index );
+				vector[ used ++ ].iov_len = length;
+			}
+			vector[ used ].iov_base = crlf;
+			vector[ used ++ ].iov_len = 2;
 		}
 
 		if ( ( code == 201 || code == 500 ) && strcmp( mvcp_response_get_line( response, items - 1 ), "" ) )
-			if ( write( fd, "\r\n", 2 ) != 2 )
-				melted_log( LOG_ERR, "write(\"\\r\\n\") failed!" );
+		{
+			vector[ used ].iov_base = crlf;
+			vector[ used ++ ].iov_len = 2;
+		}
+
+		if ( !error )
+			error = connection_writev( fd, vector, used );
+
+#ifdef TCP_CORK
+		if ( cork )
+		{
+			flag = 0;
+			setsockopt( fd, IPPROTO_TCP, TCP_CORK, (char *)&flag, sizeof( int ) );
+		}
+#endif
 	}
 	else
 	{
 		const char *message = "500 Empty Response\r\n\r\n";
-		if ( write( fd, message, strlen( message ) ) != strlen( message ))
+		if ( connection_write( fd, message, strlen( message ) ) != 0 )
 			melted_log( LOG_ERR, "write(%s) failed!", message );
 	}
 
 	return error;
 }
 
-static int connection_read( int fd, char *command, int length )
+/** Fetch the next command line from the connection's receive buffer, reading
+	from the socket only when no complete line is buffered. Returns 0 on end of
+	file, ctrl-D or BYE.
+*/
+
+static int connection_read( connection_t *connection, char **command )
 {
-	int eof_chk;
-	int nchars = fdgetline( fd, command, length, '\n', &eof_chk );
-	char *cr = strchr( command, '\r');
-	if ( cr != NULL ) 
-		cr[0] = '\0';
-	if ( eof_chk || strncasecmp( command, "BYE", 3 ) == 0 ) 
-		nchars = 0;
-	return nchars;
+	int result = 0;
+
+	while ( ( result = melted_buffer_get_line( &connection->buffer, command ) ) == 0 )
+		if ( melted_buffer_fill( &connection->buffer, connection->fd ) <= 0 )
+			break;
+
+	if ( result == -1 )
+		melted_log( LOG_WARNING, "%s command exceeds %d bytes", connection->address, MELTED_BUFFER_MAX_LINE );
+
+	if ( result != 1 || strchr( *command, 4 ) != NULL || strncasecmp( *command, "BYE", 3 ) == 0 )
+		return 0;
+
+	return 1;
 }
 
-int connection_status( int fd, mvcp_notifier notifier )
+/** Read part of a PUSH body, taking whatever is already buffered before
+	reading from the socket. Returns the number of bytes read or <= 0 on end
+	of file or error.
+*/
+
+static int connection_read_data( connection_t *connection, char *buffer, int bytes )
+{
+	int count = melted_buffer_get_data( &connection->buffer, buffer, bytes );
+
+	while ( count == 0 )
+	{
+		count = read( connection->fd, buffer, bytes );
+		if ( count < 0 && errno == EINTR )
+			count = 0;
+		else if ( count <= 0 )
+			break;
+	}
+
+	return count;
+}
+
+/** Determine if a STATUS command requests delta mode.
+*/
+
+int connection_status_delta( char *command )
+{
+	return !strncasecmp( command, "STATUS DELTA", 12 );
+}
+
+/** Send the stored status of every unit.
+*/
+
+static int connection_status_all( mvcp_socket socket, mvcp_notifier notifier )
 {
 	int error = 0;
 	int index = 0;
-	mvcp_status_t status;
-	char text[ 10240 ];
-	mvcp_socket socket = mvcp_socket_init_fd( fd );
-	
-	for ( index = 0; !error && index < MAX_UNITS; index ++ )
+
+	for ( index = 0; !error && index < mvcp_notifier_units( notifier ); index ++ )
 	{
-		mvcp_notifier_get( notifier, &status, index );
-		mvcp_status_serialise( &status, text, sizeof( text ) );
-		error = mvcp_socket_write_data( socket, text, strlen( text )  ) != strlen( text );
+		mvcp_notifier_line line = mvcp_notifier_get_line( notifier, index );
+		if ( line != NULL )
+			error = mvcp_socket_write_data( socket, line->text, line->length ) != line->length;
+		mvcp_notifier_release( notifier, line );
 	}
 
+	return error;
+}
+
+/** Send every status change until the client sends anything or goes away.
+	In delta mode only the fields which changed are sent after the initial
+	status of each unit.
+*/
+
+int connection_status( int fd, mvcp_notifier notifier, int delta )
+{
+	int error = 0;
+	mvcp_socket socket = mvcp_socket_init_fd( fd );
+	unsigned int cursor = mvcp_notifier_cursor( notifier );
+	int depth = 0;
+
+	melted_metrics_subscriber( 1 );
+	error = connection_status_all( socket, notifier );
+
 	while ( !error )
 	{
-		if ( mvcp_notifier_wait( notifier, &status ) == 0 )
+		struct timeval tv = { 0, 0 };
+		fd_set rfds;
+		mvcp_notifier_line line = NULL;
+		int result = mvcp_notifier_next_lines( notifier, &cursor, delta ? NULL : &line, delta ? &line : NULL, 1000 );
+
+		if ( result == 0 && line != NULL )
 		{
-			mvcp_status_serialise( &status, text, sizeof( text ) );
-			error = mvcp_socket_write_data( socket, text, strlen( text ) ) != strlen( text );
+			error = mvcp_socket_write_data( socket, line->text, line->length ) != line->length;
+			mvcp_notifier_release( notifier, line );
+			melted_metrics_queue( &depth, ( int )( mvcp_notifier_cursor( notifier ) - cursor ) );
 		}
-		else
+		else if ( result == EOVERFLOW )
 		{
-			struct timeval tv = { 0, 0 };
-			fd_set rfds;
+			melted_log( LOG_NOTICE, "Status subscriber (%d) fell behind - resending all units", fd );
+			melted_metrics_overflow( );
+			error = connection_status_all( socket, notifier );
+		}
 
-		    FD_ZERO( &rfds );
-		    FD_SET( fd, &rfds );
+	    FD_ZERO( &rfds );
+	    FD_SET( fd, &rfds );
 
-			if ( select( socket->fd + 1, &rfds, NULL, NULL, &tv ) )
-				error = 1;
-		}
+		if ( !error && select( socket->fd + 1, &rfds, NULL, NULL, &tv ) )
+			error = 1;
 	}
 
 	mvcp_socket_close( socket );
+	melted_metrics_queue( &depth, 0 );
+	melted_metrics_subscriber( 0 );
 	
 	return error;
 }
@@ -199,35 +356,402 @@ static void connection_close( int fd )
 	close( fd );
 }
 
+/** Determine the printable address of the connected peer. The numeric
+	address is used unless the name is already known - lookups happen in the
+	background so they never delay the banner.
+*/
+
+void connection_address( connection_t *connection )
+{
+	if ( mlt_properties_get_int( connection->owner, "dns-lookup-off" ) )
+		inet_ntop( AF_INET, &( connection->sin.sin_addr.s_addr ), connection->address, sizeof( connection->address ) );
+	else
+		melted_resolver_lookup( connection->sin.sin_addr, connection->address, sizeof( connection->address ), connection->fd );
+}
+
+/** Send the initial banner to the connected peer.
+*/
+
+int connection_banner( connection_t *connection )
+{
+	return connection_initiate( connection );
+}
+
+/** Execute a single command received on the connection and send the response.
+	A command prefixed by @id is traced until its response has been sent.
+*/
+
+int connection_execute( connection_t *connection, char *command )
+{
+	int error = 0;
+	int64_t start = 0;
+	mvcp_response response = NULL;
+	melted_trace trace = melted_trace_begin( &command );
+
+	melted_trace_set_current( trace );
+	melted_unit_set_session( connection );
+	mlt_events_fire( connection->owner, "command-received", &response, command, NULL );
+	if ( response == NULL )
+		response = mvcp_parser_execute( connection->parser, command );
+	melted_unit_set_session( NULL );
+	melted_trace_set_current( 0 );
+	melted_log( LOG_INFO, "%s \"%s\" %d", connection->address, command, mvcp_response_get_error_code( response ) );
+	start = melted_metrics_now( );
+	error = connection_send( connection, response );
+	melted_metrics_send( command, melted_metrics_now( ) - start );
+	melted_trace_end( trace );
+	mvcp_response_close( response );
+
+	return error;
+}
+
+/** Open a temporary file to hold a PUSH document. Returns non-zero on failure.
+*/
+
+static int connection_push_spool( connection_t *connection, connection_push_t *push )
+{
+	const char *dir = getenv( "TMPDIR" ) ? getenv( "TMPDIR" ) : "/tmp";
+	snprintf( push->path, sizeof( push->path ), "%s/melted-push-XXXXXX", dir );
+	push->spool = mkstemp( push->path );
+	if ( push->spool == -1 )
+		melted_log( LOG_WARNING, "%s unable to spool push to %s", connection->address, dir );
+	return push->spool == -1;
+}
+
+/** Write all of a block to the spool file. Returns non-zero on failure.
+*/
+
+static int connection_push_write( connection_push_t *push, char *data, int count )
+{
+	int written = 0;
+	while ( written < count )
+	{
+		int result = write( push->spool, data + written, count - written );
+		if ( result > 0 )
+			written += result;
+		else if ( result == 0 || errno != EINTR )
+			break;
+	}
+	return written != count;
+}
+
+/** Store the next part of the document. Only a compressed document, whose
+	size isn't known up front, grows the buffer - it moves to a spool file
+	once it passes push-spool-size and is rejected once it passes
+	push-max-size.
+*/
+
+static void connection_push_store( connection_t *connection, connection_push_t *push, char *data, int count )
+{
+	mlt_properties owner = connection->owner;
+	int limit = mlt_properties_get_int( owner, "push-max-size" );
+
+	if ( limit > 0 && push->length + count > limit )
+	{
+		melted_log( LOG_WARNING, "%s push of more than %d bytes exceeds the limit of %d", connection->address, push->length + count, limit );
+		push->error = RESPONSE_OUT_OF_RANGE;
+	}
+	else if ( push->spool == -1 && push->length + count >= push->size )
+	{
+		int spool = mlt_properties_get_int( owner, "push-spool-size" );
+
+		if ( spool > 0 && push->length + count > spool && mlt_properties_get( owner, "push-parser-off" ) == 0 &&
+			 connection_push_spool( connection, push ) == 0 )
+		{
+			if ( connection_push_write( push, push->buffer, push->length ) )
+				push->error = RESPONSE_ERROR;
+			free( push->buffer );
+			push->buffer = NULL;
+			push->size = 0;
+		}
+		else
+		{
+			int size = push->size == 0 ? 65536 : push->size;
+			char *buffer = NULL;
+			while ( size <= push->length + count )
+				size *= 2;
+			buffer = realloc( push->buffer, size );
+			if ( buffer != NULL )
+			{
+				push->buffer = buffer;
+				push->size = size;
+			}
+			else
+			{
+				push->error = RESPONSE_ERROR;
+			}
+		}
+	}
+
+	if ( push->error )
+		return;
+
+	if ( push->spool != -1 )
+	{
+		if ( connection_push_write( push, data, count ) )
+			push->error = RESPONSE_ERROR;
+	}
+	else
+	{
+		memcpy( push->buffer + push->length, data, count );
+	}
+
+	push->length += count;
+}
+
+/** The largest document a compressed PUSH of the given size may inflate to.
+*/
+
+static int connection_inflate_limit( connection_t *connection, int bytes )
+{
+	mlt_properties owner = connection->owner;
+	int64_t limit = mlt_properties_get_int( owner, "push-max-size" );
+	int64_t ratio = CONNECTION_INFLATE_RATIO;
+
+	if ( limit <= 0 )
+		limit = CONNECTION_INFLATE_MAX;
+	if ( mlt_properties_get( owner, "push-inflate-ratio" ) != NULL )
+		ratio = mlt_properties_get_int( owner, "push-inflate-ratio" );
+	if ( ratio > 0 && ( int64_t )bytes * ratio < limit )
+		limit = ( int64_t )bytes * ratio;
+
+	return ( int )limit;
+}
+
+/** Prepare to receive a PUSH document of the size declared on the length
+	line. Pushes larger than the push-max-size property are rejected before
+	any allocation and their body discarded, and documents larger than
+	push-spool-size are written to a temporary file rather than held in
+	memory. A length line of "DEFLATE {bytes}" declares a zlib stream which
+	is decompressed as it arrives, so only the document itself is stored, and
+	is rejected once it inflates past push-max-size (64MB when unset) or
+	push-inflate-ratio (default 100) times its compressed size.
+*/
+
+void connection_push_begin( connection_t *connection, connection_push_t *push, char *command, char *length )
+{
+	mlt_properties owner = connection->owner;
+	int limit = mlt_properties_get_int( owner, "push-max-size" );
+	int spool = mlt_properties_get_int( owner, "push-spool-size" );
+	int deflate = length != NULL && !strncasecmp( length, "DEFLATE ", 8 );
+	int bytes = length == NULL ? 0 : atoi( deflate ? length + 8 : length );
+
+	memset( push, 0, sizeof( connection_push_t ) );
+	push->command = strdup( command );
+	push->bytes = bytes;
+	push->spool = -1;
+	push->inflate_limit = connection_inflate_limit( connection, bytes );
+
+	if ( limit > 0 && bytes > limit )
+	{
+		melted_log( LOG_WARNING, "%s push of %d bytes exceeds the limit of %d", connection->address, bytes, limit );
+		push->error = RESPONSE_OUT_OF_RANGE;
+	}
+	else if ( bytes > 0 && deflate )
+	{
+#ifdef HAVE_ZLIB
+		z_stream *stream = calloc( 1, sizeof( z_stream ) );
+		if ( stream != NULL && inflateInit( stream ) == Z_OK )
+			push->stream = stream;
+		else
+			free( stream );
+		if ( push->stream == NULL )
+			push->error = RESPONSE_ERROR;
+#else
+		melted_log( LOG_WARNING, "%s compressed push is not supported", connection->address );
+		push->error = RESPONSE_BAD_FILE;
+#endif
+	}
+	else if ( bytes > 0 )
+	{
+		if ( spool > 0 && bytes > spool && mlt_properties_get( owner, "push-parser-off" ) == 0 )
+			connection_push_spool( connection, push );
+		if ( push->spool == -1 && ( push->buffer = malloc( bytes + 1 ) ) == NULL )
+			push->error = RESPONSE_ERROR;
+		else if ( push->spool == -1 )
+			push->size = bytes + 1;
+	}
+}
+
+/** Accept the next part of the PUSH body. Returns the number of bytes used.
+*/
+
+int connection_push_data( connection_t *connection, connection_push_t *push, char *data, int count )
+{
+	if ( count > push->bytes - push->total )
+		count = push->bytes - push->total;
+
+	if ( push->error )
+	{
+		// Discard the body of a rejected push
+	}
+#ifdef HAVE_ZLIB
+	else if ( push->stream != NULL && !push->inflated )
+	{
+		z_stream *stream = push->stream;
+		char output[ 16384 ];
+		int result = Z_OK;
+
+		stream->next_in = ( Bytef * )data;
+		stream->avail_in = count;
+
+		do
+		{
+			stream->next_out = ( Bytef * )output;
+			stream->avail_out = sizeof( output );
+			result = inflate( stream, Z_NO_FLUSH );
+			if ( ( result == Z_OK || result == Z_STREAM_END ) && push->length + ( int )( sizeof( output ) - stream->avail_out ) > push->inflate_limit )
+			{
+				melted_log( LOG_WARNING, "%s compressed push of %d bytes inflates past the limit of %d", connection->address, push->bytes, push->inflate_limit );
+				push->error = RESPONSE_OUT_OF_RANGE;
+			}
+			else if ( result == Z_OK || result == Z_STREAM_END )
+				connection_push_store( connection, push, output, sizeof( output ) - stream->avail_out );
+			else if ( result != Z_BUF_ERROR )
+				push->error = RESPONSE_BAD_FILE;
+			push->inflated = result == Z_STREAM_END;
+		}
+		while ( !push->error && result == Z_OK && ( stream->avail_in > 0 || stream->avail_out == 0 ) );
+	}
+#endif
+	else if ( push->stream == NULL )
+	{
+		connection_push_store( connection, push, data, count );
+	}
+
+	push->total += count;
+
+	return count;
+}
+
+/** Process the document received with a PUSH command and send the response.
+*/
+
+int connection_push_end( connection_t *connection, connection_push_t *push )
+{
+	int error = 0;
+	mlt_properties owner = connection->owner;
+	mvcp_response response = NULL;
+	mlt_service service = NULL;
+	int64_t start = melted_metrics_now( );
+	int64_t parsed = 0;
+
+	melted_unit_set_session( connection );
+	if ( push->error )
+	{
+		response = mvcp_response_init();
+		if ( push->error == RESPONSE_OUT_OF_RANGE )
+			mvcp_response_set_error( response, push->error, "Document too large" );
+		else if ( push->error == RESPONSE_BAD_FILE )
+			mvcp_response_set_error( response, push->error, "Failed to decompress document" );
+		else
+			mvcp_response_set_error( response, push->error, "Failed to store document" );
+	}
+	else if ( push->stream != NULL && push->total == push->bytes && ( !push->inflated || push->length == 0 ) )
+	{
+		response = mvcp_response_init();
+		mvcp_response_set_error( response, RESPONSE_BAD_FILE, "Failed to decompress document" );
+	}
+	else if ( push->bytes > 0 && push->total == push->bytes )
+	{
+		if ( push->spool == -1 && mlt_properties_get( owner, "push-parser-off" ) != 0 )
+		{
+			push->buffer[ push->length ] = '\0';
+			response = mvcp_parser_received( connection->parser, push->command, push->buffer );
+		}
+		else
+		{
+			mlt_profile profile = mlt_profile_init( NULL );
+			profile->is_explicit = 1;
+			// A spooled document is read back, so that relative resources resolve
+			// as they do for one held in memory rather than against the spool
+			if ( push->spool != -1 && ( push->buffer = malloc( push->length + 1 ) ) != NULL &&
+				 pread( push->spool, push->buffer, push->length, 0 ) != push->length )
+			{
+				free( push->buffer );
+				push->buffer = NULL;
+			}
+			if ( push->buffer != NULL )
+			{
+				push->buffer[ push->length ] = '\0';
+				service = ( mlt_service )mlt_factory_producer( profile, "xml-string", push->buffer );
+			}
+			if ( service )
+			{
+				mlt_properties_set_data( MLT_SERVICE_PROPERTIES( service ), "melted_profile", profile,
+					0, (mlt_destructor) mlt_profile_close, NULL );
+				parsed = melted_metrics_now( );
+				mlt_events_fire( owner, "push-received", &response, push->command, service, NULL );
+				if ( response == NULL )
+					response = mvcp_parser_push( connection->parser, push->command, service );
+				// The XML load is the parse phase of a PUSH
+				melted_metrics_command( push->command, parsed - start, melted_metrics_now( ) - parsed );
+			}
+			else
+			{
+				mlt_profile_close( profile );
+				response = mvcp_response_init();
+				mvcp_response_set_error( response, RESPONSE_BAD_FILE, "Failed to load XML" );
+			}
+		}
+	}
+	melted_unit_set_session( NULL );
+
+	melted_log( LOG_INFO, "%s \"%s\" %d", connection->address, push->command, mvcp_response_get_error_code( response ) );
+	start = melted_metrics_now( );
+	error = connection_send( connection, response );
+	melted_metrics_send( push->command, melted_metrics_now( ) - start );
+	mvcp_response_close( response );
+	mlt_service_close( service );
+	connection_push_cancel( push );
+
+	return error;
+}
+
+/** Release the resources held by a PUSH.
+*/
+
+void connection_push_cancel( connection_push_t *push )
+{
+#ifdef HAVE_ZLIB
+	if ( push->stream != NULL )
+	{
+		inflateEnd( push->stream );
+		free( push->stream );
+	}
+#endif
+	if ( push->spool != -1 )
+	{
+		close( push->spool );
+		unlink( push->path );
+	}
+	free( push->buffer );
+	free( push->command );
+	memset( push, 0, sizeof( connection_push_t ) );
+	push->spool = -1;
+}
+
 void *parser_thread( void *arg )
 {
-	struct hostent *he;
 	connection_t *connection = arg;
-	mlt_properties owner = connection->owner;
-	char address[ 512 ];
-	char command[ 1024 ];
+	char *command = NULL;
 	int fd = connection->fd;
-	mvcp_parser parser = connection->parser;
-	mvcp_response response = NULL;
+
+	melted_buffer_init( &connection->buffer );
 
 	/* Get the connecting clients ip information */
-	he = gethostbyaddr( (char *) &( connection->sin.sin_addr.s_addr ), sizeof(u_int32_t), AF_INET); 
-	if ( he != NULL )
-		strcpy( address, he->h_name );
-	else
-		inet_ntop( AF_INET, &( connection->sin.sin_addr.s_addr), address, 32 );
+	connection_address( connection );
 
-	melted_log( LOG_NOTICE, "Connection established with %s (%d)", address, fd );
+	melted_log( LOG_NOTICE, "Connection established with %s (%d)", connection->address, fd );
+	melted_metrics_connection( 1 );
 
 	/* Execute the commands received. */
-	if ( connection_initiate( fd ) == 0 )
+	if ( connection_initiate( connection ) == 0 )
 	{
 		int error = 0;
 
-		while( !error && connection_read( fd, command, 1024 ) )
+		while( !error && connection_read( connection, &command ) )
 		{
-			response = NULL;
-
 			if ( !strcmp( command, "" ) )
 			{
 				// Ignore blank lines
@@ -236,79 +760,47 @@ void *parser_thread( void *arg )
 			if ( !strncmp( command, "PUSH ", 5 ) )
 			{
 				// Append XML as clip
-				char temp[ 20 ];
-				int bytes;
-				char *buffer = NULL;
-				int total = 0;
-				mlt_service service = NULL;
-
-				connection_read( fd, temp, 20 );
-				bytes = atoi( temp );
-				buffer = malloc( bytes + 1 );
-				while ( total < bytes )
+				connection_push_t push;
+				char chunk[ 65536 ];
+				char *line = strdup( command );
+				char *temp = NULL;
+
+				if ( !connection_read( connection, &temp ) )
+					temp = NULL;
+				connection_push_begin( connection, &push, line, temp );
+				free( line );
+				while ( push.total < push.bytes )
 				{
-					int count = read( fd, buffer + total, bytes - total );
-					if ( count >= 0 )
-						total += count;
-					else
+					int count = push.bytes - push.total;
+					count = connection_read_data( connection, chunk, count < sizeof( chunk ) ? count : sizeof( chunk ) );
+					if ( count <= 0 )
 						break;
+					connection_push_data( connection, &push, chunk, count );
 				}
-				buffer[ bytes ] = '\0';
-				if ( bytes > 0 && total == bytes )
-				{
-					if ( mlt_properties_get( owner, "push-parser-off" ) == 0 )
-					{
-						mlt_profile profile = mlt_profile_init( NULL );
-						profile->is_explicit = 1;
-						service = ( mlt_service )mlt_factory_producer( profile, "xml-string", buffer );
-						if ( service )
-						{
-							mlt_properties_set_data( MLT_SERVICE_PROPERTIES( service ), "melted_profile", profile,
-								0, (mlt_destructor) mlt_profile_close, NULL );
-							mlt_events_fire( owner, "push-received", &response, command, service, NULL );
-							if ( response == NULL )
-								response = mvcp_parser_push( parser, command, service );
-						}
-						else
-						{
-							response = mvcp_response_init();
-							mvcp_response_set_error( response, RESPONSE_BAD_FILE, "Failed to load XML" );
-						}
-					}
-					else
-					{
-						response = mvcp_parser_received( parser, command, buffer );
-					}
-				}
-				melted_log( LOG_INFO, "%s \"%s\" %d", address, command, mvcp_response_get_error_code( response ) );
-				error = connection_send( fd, response );
-				mvcp_response_close( response );
-				mlt_service_close( service );
-				free( buffer );
+				error = connection_push_end( connection, &push );
 			}
 			else if ( strncmp( command, "STATUS", 6 ) )
 			{
 				// All other commands
-				mlt_events_fire( owner, "command-received", &response, command, NULL );
-				if ( response == NULL )
-					response = mvcp_parser_execute( parser, command );
-				melted_log( LOG_INFO, "%s \"%s\" %d", address, command, mvcp_response_get_error_code( response ) );
-				error = connection_send( fd, response );
-				mvcp_response_close( response );
+				error = connection_execute( connection, command );
 			}
 			else
 			{
 				// Start sending status repeatedly
-				error = connection_status( fd, mvcp_parser_get_notifier( parser ) );
+				error = connection_status( fd, mvcp_parser_get_notifier( connection->parser ), connection_status_delta( command ) );
 			}
 		}
 	}
 
 	/* Free the resources associated with this connection. */
+	melted_local_end_session( connection );
+	melted_proxy_end_session( connection->parser, connection );
 	connection_close( fd );
 
-	melted_log( LOG_NOTICE, "Connection with %s (%d) closed", address, fd );
+	melted_log( LOG_NOTICE, "Connection with %s (%d) closed", connection->address, fd );
+	melted_metrics_connection( 0 );
 
+	melted_buffer_close( &connection->buffer );
 	free( connection );
 
 	return NULL;
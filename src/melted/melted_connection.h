@@ -28,6 +28,8 @@
 #include <mvcp/mvcp_parser.h>
 #include <mvcp/mvcp_tokeniser.h>
 
+#include "melted_buffer.h"
+
 #ifdef __cplusplus
 extern "C"
 {
@@ -42,9 +44,31 @@ typedef struct
 	int fd;
 	struct sockaddr_in sin;
 	mvcp_parser parser;
+	char address[ 512 ];
+	melted_buffer_t buffer;
 } 
 connection_t;
 
+/** State of a PUSH being received.
+*/
+
+typedef struct
+{
+	char *command;
+	int bytes;
+	int total;
+	char *buffer;
+	int size;
+	int length;
+	int spool;
+	char path[ 512 ];
+	int error;
+	void *stream;
+	int inflated;
+	int inflate_limit;
+}
+connection_push_t;
+
 /** Enumeration for responses.
 */
 
@@ -64,6 +88,33 @@ typedef enum
 } 
 response_codes;
 
+/** Argument types.
+*/
+
+typedef enum 
+{
+	ATYPE_NONE,
+	ATYPE_FLOAT,
+	ATYPE_STRING,
+	ATYPE_INT,
+	ATYPE_PAIR
+} 
+arguments_types;
+
+/* the number of tokens of a command that are parsed up front */
+
+#define MELTED_MAX_ARGS 16
+
+/* a token of a command, unquoted and converted to a number once */
+
+typedef struct
+{
+	char *string;
+	int   number;
+	int   is_number;
+}
+command_value_t;
+
 /* the following struct is passed as the single argument 
    to all command callback functions */
 
@@ -76,14 +127,27 @@ typedef struct
 	int           unit;
 	void         *argument;
 	char         *root_dir;
+	int           argc;
+	command_value_t argv[ MELTED_MAX_ARGS ];
 } 
 command_argument_t, *command_argument;
 
+/* Token i of the command, or NULL beyond the tokens parsed up front. */
+#define melted_command_arg( cmd, i ) ( ( i ) < ( cmd )->argc && ( i ) < MELTED_MAX_ARGS ? &( cmd )->argv[ i ] : NULL )
+
 /* A handler is defined as follows. */
 typedef int (*command_handler_t) ( command_argument );
 
 
 extern void *parser_thread( void *arg );
+extern int connection_status_delta( char * );
+extern void connection_address( connection_t * );
+extern int connection_banner( connection_t * );
+extern int connection_execute( connection_t *, char * );
+extern void connection_push_begin( connection_t *, connection_push_t *, char *, char * );
+extern int connection_push_data( connection_t *, connection_push_t *, char *, int );
+extern int connection_push_end( connection_t *, connection_push_t * );
+extern void connection_push_cancel( connection_push_t * );
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,384 @@
+/*
+ * melted_cue.c -- Scheduled Commands
+ * Copyright (C) 2002-2015 Meltytech, LLC
+ * Author: Charles Yates <charles.yates@pandora.be>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+/* System header files */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/time.h>
+
+/* Application header files */
+#include "melted_cue.h"
+#include "melted_log.h"
+#include "melted_replica.h"
+#include "melted_local.h"
+#include "melted_scheduler.h"
+
+/** A command waiting for its time - a wall-clock time (T), a frame of
+	whichever clip is shown (F) or a frame within a clip given by index or
+	id (C).
+*/
+
+typedef struct cue_s
+{
+	int id;
+	int unit;
+	char type;
+	char when[ 64 ];
+	double time;
+	int position;
+	int clip;
+	int by_id;
+	int due;
+	char *command;
+	struct cue_s *next;
+}
+cue;
+
+static pthread_mutex_t cue_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cue_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t cue_thread;
+static mvcp_parser cue_parser = NULL;
+static cue *cue_head = NULL;
+static int cue_running = 0;
+static int cue_id = 0;
+static volatile int cue_frames = 0;
+
+/** Current wall-clock time in seconds.
+*/
+
+static double cue_now( )
+{
+	struct timeval now;
+	gettimeofday( &now, NULL );
+	return now.tv_sec + now.tv_usec / 1000000.0;
+}
+
+/** Parse the time specification of a cue. Returns non-zero if invalid.
+*/
+
+static int cue_parse( cue *this, const char *when )
+{
+	char *end = NULL;
+
+	this->type = when[ 0 ];
+	switch( this->type )
+	{
+		case 'T':
+		case 't':
+			this->type = 'T';
+			if ( when[ 1 ] == '+' )
+			{
+				this->time = cue_now( ) + strtod( when + 2, &end );
+				return end == when + 2 || *end != '\0';
+			}
+			this->time = strtod( when + 1, &end );
+			return end == when + 1 || *end != '\0';
+
+		case 'F':
+		case 'f':
+			this->type = 'F';
+			this->position = strtol( when + 1, &end, 10 );
+			return end == when + 1 || *end != '\0';
+
+		case 'C':
+		case 'c':
+			this->type = 'C';
+			this->by_id = when[ 1 ] == '#';
+			this->clip = strtol( when + 1 + this->by_id, &end, 10 );
+			if ( end == when + 1 + this->by_id || *end != ':' )
+				return 1;
+			when = end + 1;
+			this->position = strtol( when, &end, 10 );
+			return end == when || *end != '\0';
+	}
+
+	return 1;
+}
+
+/** Log the result of a cued command and release the cue.
+*/
+
+static void cue_done( void *arg, mvcp_response response )
+{
+	cue *this = arg;
+	melted_log( LOG_NOTICE, "cue %d U%d %s: %s -> %d", this->id, this->unit, this->when, this->command, mvcp_response_get_error_code( response ) );
+	mvcp_response_close( response );
+	free( this->command );
+	free( this );
+}
+
+/** Runner thread - executes due cues in the order they were added and
+	fires wall-clock cues itself.
+*/
+
+static void *cue_run( void *arg )
+{
+	// The standbys fire their own cues
+	melted_replica_suppress( 1 );
+
+	pthread_mutex_lock( &cue_mutex );
+
+	while ( cue_running )
+	{
+		double now = cue_now( );
+		double next = 0;
+		cue **ptr = &cue_head;
+		cue *due = NULL;
+
+		while ( *ptr != NULL )
+		{
+			if ( ( *ptr )->type == 'T' && !( *ptr )->due )
+			{
+				if ( ( *ptr )->time <= now )
+					( *ptr )->due = 1;
+				else if ( next == 0 || ( *ptr )->time < next )
+					next = ( *ptr )->time;
+			}
+			if ( ( *ptr )->due )
+			{
+				due = *ptr;
+				*ptr = due->next;
+				break;
+			}
+			ptr = &( *ptr )->next;
+		}
+
+		if ( due != NULL )
+		{
+			pthread_mutex_unlock( &cue_mutex );
+			cue_done( due, mvcp_parser_execute( cue_parser, due->command ) );
+			pthread_mutex_lock( &cue_mutex );
+		}
+		else if ( next > 0 )
+		{
+			struct timespec until;
+			until.tv_sec = ( time_t )next;
+			until.tv_nsec = ( long )( ( next - until.tv_sec ) * 1000000000.0 );
+			pthread_cond_timedwait( &cue_cond, &cue_mutex, &until );
+		}
+		else
+		{
+			pthread_cond_wait( &cue_cond, &cue_mutex );
+		}
+	}
+
+	pthread_mutex_unlock( &cue_mutex );
+
+	return NULL;
+}
+
+/** Start the runner which executes cued commands through the parser.
+*/
+
+int melted_cue_init( mvcp_parser parser )
+{
+	int error = 0;
+
+	pthread_mutex_lock( &cue_mutex );
+	if ( !cue_running )
+	{
+		cue_parser = parser;
+		cue_running = 1;
+		if ( ( error = pthread_create( &cue_thread, NULL, cue_run, NULL ) ) != 0 )
+			cue_running = 0;
+	}
+	pthread_mutex_unlock( &cue_mutex );
+
+	return error;
+}
+
+/** Cue a command on a unit. Returns the cue id or -1 if the time is invalid
+	or the runner is not available.
+*/
+
+int melted_cue_add( int unit, const char *when, const char *command )
+{
+	cue *this = calloc( 1, sizeof( cue ) );
+	int id = -1;
+
+	if ( this == NULL )
+		return -1;
+
+	if ( cue_parse( this, when ) != 0 || ( this->command = strdup( command ) ) == NULL )
+	{
+		free( this );
+		return -1;
+	}
+
+	this->unit = unit;
+	strncpy( this->when, when, sizeof( this->when ) - 1 );
+
+	pthread_mutex_lock( &cue_mutex );
+	if ( cue_running )
+	{
+		cue **ptr = &cue_head;
+		while ( *ptr != NULL )
+			ptr = &( *ptr )->next;
+		this->id = id = ++ cue_id;
+		cue_frames += this->type != 'T';
+		*ptr = this;
+		pthread_cond_signal( &cue_cond );
+	}
+	pthread_mutex_unlock( &cue_mutex );
+
+	if ( id < 0 )
+	{
+		free( this->command );
+		free( this );
+	}
+
+	return id;
+}
+
+/** Remove a pending cue. Returns non-zero if the unit has no such cue.
+*/
+
+int melted_cue_remove( int unit, int id )
+{
+	cue **ptr = NULL;
+	cue *found = NULL;
+
+	pthread_mutex_lock( &cue_mutex );
+	for ( ptr = &cue_head; *ptr != NULL; ptr = &( *ptr )->next )
+	{
+		if ( ( *ptr )->id == id && ( *ptr )->unit == unit && !( *ptr )->due )
+		{
+			found = *ptr;
+			*ptr = found->next;
+			cue_frames -= found->type != 'T';
+			break;
+		}
+	}
+	pthread_mutex_unlock( &cue_mutex );
+
+	if ( found != NULL )
+	{
+		free( found->command );
+		free( found );
+	}
+
+	return found == NULL;
+}
+
+/** List the pending cues of a unit.
+*/
+
+void melted_cue_report( int unit, mvcp_response response )
+{
+	cue *this = NULL;
+
+	pthread_mutex_lock( &cue_mutex );
+	for ( this = cue_head; this != NULL; this = this->next )
+		if ( this->unit == unit )
+			mvcp_response_printf( response, 10240, "%d %s %s\n", this->id, this->when, this->command );
+	pthread_mutex_unlock( &cue_mutex );
+	mvcp_response_printf( response, 1024, "\n" );
+}
+
+/** Returns non-zero while any unit has frame or clip cues pending - lets the
+	consumer skip the lookups melted_cue_frame needs when nothing is cued.
+*/
+
+int melted_cue_waiting( )
+{
+	return cue_frames > 0;
+}
+
+/** Called by a unit for every frame shown with the clip the frame belongs to
+	and the frame's position within it. A reached cue whose command is a unit
+	command is queued on that unit straight away, so that it is the next
+	thing the unit does, and other reached cues wake the runner.
+*/
+
+void melted_cue_frame( int unit, int clip, int clip_id, int clip_position )
+{
+	int direct = melted_scheduler_available( );
+	cue **ptr = &cue_head;
+	cue *queued = NULL;
+	cue **tail = &queued;
+	int due = 0;
+
+	pthread_mutex_lock( &cue_mutex );
+	while ( *ptr != NULL )
+	{
+		cue *this = *ptr;
+		if ( this->unit == unit && !this->due && this->type != 'T' )
+		{
+			if ( this->type == 'F' )
+				this->due = clip_position >= this->position;
+			else
+				this->due = ( this->by_id ? clip_id : clip ) == this->clip && clip_position >= this->position;
+			cue_frames -= this->due;
+			if ( this->due && direct && melted_local_unit( this->command ) >= 0 )
+			{
+				*ptr = this->next;
+				this->next = NULL;
+				*tail = this;
+				tail = &this->next;
+				continue;
+			}
+			due |= this->due;
+		}
+		ptr = &this->next;
+	}
+	if ( due )
+		pthread_cond_signal( &cue_cond );
+	pthread_mutex_unlock( &cue_mutex );
+
+	// Like the runner's, these commands are not replicated
+	melted_replica_suppress( 1 );
+	while ( queued != NULL )
+	{
+		cue *next = queued->next;
+		if ( mvcp_parser_submit( cue_parser, queued->command, cue_done, queued ) != 0 )
+			cue_done( queued, NULL );
+		queued = next;
+	}
+	melted_replica_suppress( 0 );
+}
+
+/** Stop the runner and discard the pending cues.
+*/
+
+void melted_cue_close( )
+{
+	int running = 0;
+
+	pthread_mutex_lock( &cue_mutex );
+	running = cue_running;
+	cue_running = 0;
+	pthread_cond_signal( &cue_cond );
+	pthread_mutex_unlock( &cue_mutex );
+
+	if ( running )
+		pthread_join( cue_thread, NULL );
+
+	while ( cue_head != NULL )
+	{
+		cue *next = cue_head->next;
+		free( cue_head->command );
+		free( cue_head );
+		cue_head = next;
+	}
+	cue_frames = 0;
+}
@@ -0,0 +1,480 @@
+/*
+ * melted_event_loop.c -- Event Driven Connection Handler
+ * Copyright (C) 2002-2015 Meltytech, LLC
+ * Author: Charles Yates <charles.yates@pandora.be>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+/* System header files */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#ifdef __linux__
+#include <sys/epoll.h>
+#endif
+
+/* Application header files */
+#include "melted_event_loop.h"
+#include "melted_connection.h"
+#include "melted_local.h"
+#include "melted_proxy.h"
+#include "melted_log.h"
+#include "melted_metrics.h"
+
+#ifdef __linux__
+
+/** Maximum number of ready connections taken by an I/O thread per wakeup.
+*/
+
+#define EVENT_BATCH 8
+
+/** Input states of an event driven connection.
+*/
+
+typedef enum
+{
+	state_command,
+	state_push_length,
+	state_push_body
+}
+event_state;
+
+/** Event driven connection.
+*/
+
+typedef struct event_connection_s
+{
+	connection_t connection;
+	event_state state;
+	char *command;
+	connection_push_t push;
+	int subscribed;
+	int delta;
+	unsigned int cursor;
+	int dead;
+	struct event_connection_s *next;
+}
+*event_connection, event_connection_t;
+
+/** Event loop structure.
+*/
+
+typedef struct
+{
+	melted_server server;
+	int epoll;
+	pthread_mutex_t mutex;
+	event_connection subscribers;
+}
+*event_loop, event_loop_t;
+
+/** Write a status line to a subscriber without blocking the caller.
+*/
+
+static int event_connection_notify( event_connection this, const char *text, int length )
+{
+	int error = 0;
+	if ( !this->dead && send( this->connection.fd, text, length, MSG_DONTWAIT | MSG_NOSIGNAL ) != length )
+	{
+		/* A subscriber which can't keep up is disconnected - the owning I/O
+		   thread sees the shutdown and releases the connection. */
+		melted_log( LOG_NOTICE, "Status subscriber %s (%d) is not reading - disconnecting", this->connection.address, this->connection.fd );
+		shutdown( this->connection.fd, SHUT_RDWR );
+		this->dead = 1;
+		error = -1;
+	}
+	return error;
+}
+
+/** Convert the connection into a status subscriber.
+*/
+
+static void event_loop_subscribe( event_loop this, event_connection connection, int delta )
+{
+	mvcp_notifier notifier = mvcp_parser_get_notifier( connection->connection.parser );
+	int index = 0;
+
+	pthread_mutex_lock( &this->mutex );
+
+	/* Changes older than the snapshot are not sent to this subscriber. */
+	connection->cursor = mvcp_notifier_cursor( notifier );
+
+	for ( index = 0; index < mvcp_notifier_units( notifier ); index ++ )
+	{
+		mvcp_notifier_line line = mvcp_notifier_get_line( notifier, index );
+		if ( line != NULL )
+			event_connection_notify( connection, line->text, line->length );
+		mvcp_notifier_release( notifier, line );
+	}
+
+	connection->subscribed = 1;
+	connection->delta = delta;
+	melted_metrics_subscriber( 1 );
+	connection->next = this->subscribers;
+	this->subscribers = connection;
+
+	pthread_mutex_unlock( &this->mutex );
+}
+
+/** Send the stored status of every unit to all subscribers.
+*/
+
+static void event_loop_resend( event_loop this, mvcp_notifier notifier )
+{
+	int index = 0;
+
+	pthread_mutex_lock( &this->mutex );
+	for ( index = 0; index < mvcp_notifier_units( notifier ); index ++ )
+	{
+		event_connection subscriber = NULL;
+		mvcp_notifier_line line = mvcp_notifier_get_line( notifier, index );
+		for ( subscriber = this->subscribers; line != NULL && subscriber != NULL; subscriber = subscriber->next )
+			event_connection_notify( subscriber, line->text, line->length );
+		mvcp_notifier_release( notifier, line );
+	}
+	pthread_mutex_unlock( &this->mutex );
+}
+
+/** Thread which distributes unit status changes to all subscribers.
+*/
+
+static void *event_loop_status_thread( void *arg )
+{
+	event_loop this = arg;
+	mvcp_notifier notifier = mvcp_parser_get_notifier( this->server->parser );
+	unsigned int cursor = mvcp_notifier_cursor( notifier );
+	int depth = 0;
+
+	while ( !this->server->shutdown )
+	{
+		unsigned int sequence = cursor;
+		mvcp_notifier_line line = NULL;
+		mvcp_notifier_line delta = NULL;
+		int result = mvcp_notifier_next_lines( notifier, &cursor, &line, &delta, 1000 );
+
+		if ( result == 0 && line != NULL && delta != NULL )
+		{
+			event_connection subscriber = NULL;
+
+			pthread_mutex_lock( &this->mutex );
+			for ( subscriber = this->subscribers; subscriber != NULL; subscriber = subscriber->next )
+			{
+				mvcp_notifier_line text = subscriber->delta ? delta : line;
+				if ( ( int )( sequence - subscriber->cursor ) >= 0 )
+					event_connection_notify( subscriber, text->text, text->length );
+			}
+			pthread_mutex_unlock( &this->mutex );
+
+			// Every subscriber is fed from this one queue
+			melted_metrics_queue( &depth, ( int )( mvcp_notifier_cursor( notifier ) - cursor ) );
+		}
+		else if ( result == EOVERFLOW )
+		{
+			melted_log( LOG_NOTICE, "%s status distribution fell behind - resending all units", this->server->id );
+			melted_metrics_overflow( );
+			event_loop_resend( this, notifier );
+		}
+
+		mvcp_notifier_release( notifier, line );
+		mvcp_notifier_release( notifier, delta );
+	}
+
+	melted_metrics_queue( &depth, 0 );
+
+	return NULL;
+}
+
+/** Release a connection.
+*/
+
+static void event_loop_drop( event_loop this, event_connection connection )
+{
+	epoll_ctl( this->epoll, EPOLL_CTL_DEL, connection->connection.fd, NULL );
+
+	if ( connection->subscribed )
+	{
+		event_connection *ptr = NULL;
+		pthread_mutex_lock( &this->mutex );
+		for ( ptr = &this->subscribers; *ptr != NULL; ptr = &( *ptr )->next )
+		{
+			if ( *ptr == connection )
+			{
+				*ptr = connection->next;
+				break;
+			}
+		}
+		pthread_mutex_unlock( &this->mutex );
+		melted_metrics_subscriber( 0 );
+	}
+
+	melted_local_end_session( &connection->connection );
+	melted_proxy_end_session( connection->connection.parser, &connection->connection );
+	close( connection->connection.fd );
+	melted_log( LOG_NOTICE, "Connection with %s (%d) closed", connection->connection.address, connection->connection.fd );
+	melted_metrics_connection( 0 );
+
+	melted_buffer_close( &connection->connection.buffer );
+	if ( connection->state == state_push_body )
+		connection_push_cancel( &connection->push );
+	free( connection->command );
+	free( connection );
+}
+
+/** Handle all complete requests held in the receive buffer.
+*/
+
+static int event_loop_process( event_loop this, event_connection connection )
+{
+	int error = 0;
+
+	while ( !error && !connection->subscribed )
+	{
+		if ( connection->state == state_push_body )
+		{
+			connection_push_t *push = &connection->push;
+			char chunk[ 4096 ];
+
+			while ( push->total < push->bytes )
+			{
+				int count = push->bytes - push->total;
+				count = melted_buffer_get_data( &connection->connection.buffer, chunk, count < sizeof( chunk ) ? count : sizeof( chunk ) );
+				if ( count == 0 )
+					break;
+				connection_push_data( &connection->connection, push, chunk, count );
+			}
+
+			if ( push->total < push->bytes )
+				break;
+
+			error = connection_push_end( &connection->connection, push );
+			connection->state = state_command;
+		}
+		else
+		{
+			char *line = NULL;
+			int result = melted_buffer_get_line( &connection->connection.buffer, &line );
+
+			if ( result <= 0 )
+			{
+				error = result;
+				break;
+			}
+
+			if ( strchr( line, 4 ) != NULL || ( connection->state == state_command && strncasecmp( line, "BYE", 3 ) == 0 ) )
+			{
+				error = -1;
+			}
+			else if ( connection->state == state_push_length )
+			{
+				connection_push_begin( &connection->connection, &connection->push, connection->command, line );
+				free( connection->command );
+				connection->command = NULL;
+				connection->state = state_push_body;
+			}
+			else if ( !strcmp( line, "" ) )
+			{
+				// Ignore blank lines
+			}
+			else if ( !strncmp( line, "PUSH ", 5 ) )
+			{
+				connection->command = strdup( line );
+				connection->state = state_push_length;
+			}
+			else if ( strncmp( line, "STATUS", 6 ) )
+			{
+				error = connection_execute( &connection->connection, line );
+			}
+			else
+			{
+				event_loop_subscribe( this, connection, connection_status_delta( line ) );
+			}
+		}
+	}
+
+	return error;
+}
+
+/** Accept all pending connections.
+*/
+
+static void event_loop_accept( event_loop this )
+{
+	melted_server server = this->server;
+
+	while ( !server->shutdown )
+	{
+		event_connection connection = calloc( 1, sizeof( event_connection_t ) );
+		socklen_t socksize = sizeof( struct sockaddr_in );
+		struct epoll_event event;
+
+		if ( connection == NULL )
+			break;
+
+		connection->connection.owner = &server->parent;
+		connection->connection.parser = server->parser;
+		melted_buffer_init( &connection->connection.buffer );
+		connection->connection.fd = accept( server->socket, (struct sockaddr*) &( connection->connection.sin ), &socksize );
+
+		if ( connection->connection.fd == -1 )
+		{
+			free( connection );
+			break;
+		}
+
+		connection_address( &connection->connection );
+		melted_log( LOG_NOTICE, "Connection established with %s (%d)", connection->connection.address, connection->connection.fd );
+
+		if ( connection_banner( &connection->connection ) != 0 )
+		{
+			close( connection->connection.fd );
+			free( connection );
+			continue;
+		}
+
+		melted_metrics_connection( 1 );
+
+		memset( &event, 0, sizeof( event ) );
+		event.events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT;
+		event.data.ptr = connection;
+		if ( epoll_ctl( this->epoll, EPOLL_CTL_ADD, connection->connection.fd, &event ) != 0 )
+		{
+			close( connection->connection.fd );
+			free( connection );
+			melted_metrics_connection( 0 );
+		}
+	}
+}
+
+/** Handle activity reported on a connection.
+*/
+
+static void event_loop_service( event_loop this, event_connection connection, uint32_t events )
+{
+	int error = ( events & EPOLLERR ) != 0;
+
+	if ( !error )
+		error = melted_buffer_fill( &connection->connection.buffer, connection->connection.fd ) > 0 ? 0 : -1;
+
+	/* Subscribers accept no further input. */
+	if ( !error && connection->subscribed )
+		error = -1;
+
+	if ( !error )
+		error = event_loop_process( this, connection );
+
+	if ( !error )
+	{
+		struct epoll_event event;
+		memset( &event, 0, sizeof( event ) );
+		event.events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT;
+		event.data.ptr = connection;
+		error = epoll_ctl( this->epoll, EPOLL_CTL_MOD, connection->connection.fd, &event );
+	}
+
+	if ( error )
+		event_loop_drop( this, connection );
+}
+
+/** I/O thread.
+*/
+
+static void *event_loop_thread( void *arg )
+{
+	event_loop this = arg;
+	struct epoll_event events[ EVENT_BATCH ];
+
+	while ( !this->server->shutdown )
+	{
+		int count = epoll_wait( this->epoll, events, EVENT_BATCH, 1000 );
+		int index = 0;
+
+		for ( index = 0; index < count; index ++ )
+		{
+			if ( events[ index ].data.ptr == NULL )
+				event_loop_accept( this );
+			else
+				event_loop_service( this, events[ index ].data.ptr, events[ index ].events );
+		}
+	}
+
+	return NULL;
+}
+
+int melted_event_loop_run( melted_server server, int threads )
+{
+	event_loop_t loop;
+	pthread_t *workers = calloc( threads, sizeof( pthread_t ) );
+	pthread_t status;
+	struct epoll_event event;
+	int index = 0;
+
+	memset( &loop, 0, sizeof( loop ) );
+	loop.server = server;
+	loop.epoll = epoll_create( 1 );
+
+	memset( &event, 0, sizeof( event ) );
+	event.events = EPOLLIN;
+	event.data.ptr = NULL;
+
+	if ( workers == NULL || loop.epoll == -1 || epoll_ctl( loop.epoll, EPOLL_CTL_ADD, server->socket, &event ) != 0 )
+	{
+		melted_log( LOG_ERR, "%s unable to initialise the event loop", server->id );
+		if ( loop.epoll != -1 )
+			close( loop.epoll );
+		free( workers );
+		return -1;
+	}
+
+	pthread_mutex_init( &loop.mutex, NULL );
+	pthread_create( &status, NULL, event_loop_status_thread, &loop );
+
+	melted_log( LOG_NOTICE, "%s handling connections on %d I/O threads", server->id, threads );
+
+	for ( index = 1; index < threads; index ++ )
+		pthread_create( &workers[ index ], NULL, event_loop_thread, &loop );
+
+	event_loop_thread( &loop );
+
+	for ( index = 1; index < threads; index ++ )
+		pthread_join( workers[ index ], NULL );
+	pthread_join( status, NULL );
+
+	pthread_mutex_destroy( &loop.mutex );
+	close( loop.epoll );
+	free( workers );
+
+	return 0;
+}
+
+#else
+
+int melted_event_loop_run( melted_server server, int threads )
+{
+	melted_log( LOG_WARNING, "%s event loop is not available on this platform", server->id );
+	return -1;
+}
+
+#endif
@@ -0,0 +1,784 @@
+/*
+ * melted_index.c -- Indexed Media Directory Cache
+ * Copyright (C) 2002-2015 Meltytech, LLC
+ * Author: Charles Yates <charles.yates@pandora.be>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+/* System header files */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <dirent.h>
+#include <poll.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <sys/inotify.h>
+#include <sys/vfs.h>
+#endif
+
+/* Application header files */
+#include "melted_index.h"
+#include "melted_log.h"
+#include "melted_metrics.h"
+
+/** Number of hash buckets for the directories and their watches.
+*/
+
+#define INDEX_BUCKETS 16384
+
+/** Events watched on each directory - files being written are picked up
+	when they are closed rather than on every write.
+*/
+
+#ifdef __linux__
+#define INDEX_EVENTS ( IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_CLOSE_WRITE | IN_ATTRIB | IN_DELETE_SELF | IN_ONLYDIR )
+#endif
+
+/** An entry of a directory as CLS reports it.
+*/
+
+typedef struct
+{
+	char *name;
+	uint64_t size;
+	unsigned int directory : 1;
+	unsigned int file : 1;
+	unsigned int subtree : 1;
+}
+index_entry_t, *index_entry;
+
+/** An indexed directory, sorted as scandir with alphasort.
+*/
+
+typedef struct index_dir_s
+{
+	char *path;
+	int wd;
+	int remote;
+	int stale;
+	int queued;
+	time_t scanned;
+	index_entry entries;
+	int count;
+	struct index_dir_s *next;
+	struct index_dir_s *next_watch;
+}
+index_dir_t, *index_dir;
+
+/** Paths waiting to be scanned by the index thread.
+*/
+
+typedef struct
+{
+	char **paths;
+	int head;
+	int count;
+	int size;
+}
+index_queue_t, *index_queue;
+
+static pthread_mutex_t index_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_t index_thread;
+static int index_running = 0;
+static int index_restart = 0;
+static int index_rescan = 60;
+static char *index_root = NULL;
+static int index_fd = -1;
+static int index_limited = 0;
+static index_dir index_dirs[ INDEX_BUCKETS ];
+static index_dir index_watches[ INDEX_BUCKETS ];
+
+/** Hash a path.
+*/
+
+static unsigned int index_hash( const char *path )
+{
+	unsigned int hash = 2166136261u;
+	while ( *path )
+		hash = ( hash ^ ( unsigned char )*path ++ ) * 16777619u;
+	return hash % INDEX_BUCKETS;
+}
+
+/** Normalise a path by removing repeated and trailing slashes. Returns
+	non-zero if the path is relative, too long or has . or .. components,
+	which are never served from the index.
+*/
+
+static int index_normalise( char *output, size_t size, const char *path )
+{
+	size_t length = 0;
+
+	if ( path == NULL || *path != '/' )
+		return -1;
+
+	while ( *path != '\0' )
+	{
+		if ( *path == '/' )
+		{
+			while ( *path == '/' )
+				path ++;
+			if ( ( path[ 0 ] == '.' && ( path[ 1 ] == '/' || path[ 1 ] == '\0' ) ) ||
+				 ( path[ 0 ] == '.' && path[ 1 ] == '.' && ( path[ 2 ] == '/' || path[ 2 ] == '\0' ) ) )
+				return -1;
+			if ( *path == '\0' )
+				break;
+			if ( length + 1 >= size )
+				return -1;
+			output[ length ++ ] = '/';
+		}
+		else
+		{
+			if ( length + 1 >= size )
+				return -1;
+			output[ length ++ ] = *path ++;
+		}
+	}
+
+	if ( length == 0 )
+		output[ length ++ ] = '/';
+	output[ length ] = '\0';
+
+	return 0;
+}
+
+/** Join a directory and a name.
+*/
+
+static void index_join( char *output, size_t size, const char *path, const char *name )
+{
+	snprintf( output, size, "%s/%s", strcmp( path, "/" ) ? path : "", name );
+}
+
+/** Find an indexed directory - must be called with the mutex held.
+*/
+
+static index_dir index_find( const char *path )
+{
+	index_dir dir = index_dirs[ index_hash( path ) ];
+	while ( dir != NULL && strcmp( dir->path, path ) )
+		dir = dir->next;
+	return dir;
+}
+
+/** Find the directory of a watch - must be called with the mutex held.
+*/
+
+static index_dir index_find_watch( int wd )
+{
+	index_dir dir = index_watches[ ( unsigned int )wd % INDEX_BUCKETS ];
+	while ( dir != NULL && dir->wd != wd )
+		dir = dir->next_watch;
+	return dir;
+}
+
+/** Release the entries of a directory.
+*/
+
+static void index_entries_close( index_entry entries, int count )
+{
+	int index = 0;
+	for ( index = 0; index < count; index ++ )
+		free( entries[ index ].name );
+	free( entries );
+}
+
+/** Forget the watch of a directory - must be called with the mutex held.
+*/
+
+static void index_unwatch( index_dir dir, int remove )
+{
+	if ( dir->wd >= 0 )
+	{
+		index_dir *previous = &index_watches[ ( unsigned int )dir->wd % INDEX_BUCKETS ];
+		while ( *previous != NULL && *previous != dir )
+			previous = &( *previous )->next_watch;
+		if ( *previous != NULL )
+			*previous = dir->next_watch;
+#ifdef __linux__
+		if ( remove && index_fd >= 0 )
+			inotify_rm_watch( index_fd, dir->wd );
+#endif
+		dir->wd = -1;
+	}
+}
+
+/** Determine if a directory is on a network file system, where inotify
+	only sees changes made by this host.
+*/
+
+static int index_remote( const char *path )
+{
+#ifdef __linux__
+	struct statfs fs;
+	if ( statfs( path, &fs ) == 0 )
+	{
+		switch ( ( unsigned long )fs.f_type & 0xffffffffUL )
+		{
+			case 0x6969UL:		/* NFS */
+			case 0x517BUL:		/* SMB */
+			case 0xFF534D42UL:	/* CIFS */
+			case 0xFE534D42UL:	/* SMB2 */
+			case 0x73757245UL:	/* CODA */
+			case 0x5346414FUL:	/* AFS */
+			case 0x6B414653UL:	/* kAFS */
+			case 0x00C36400UL:	/* CEPH */
+			case 0x01021997UL:	/* 9P */
+			case 0x47504653UL:	/* GPFS */
+			case 0x0BD00BD0UL:	/* Lustre */
+				return 1;
+		}
+	}
+#endif
+	return 0;
+}
+
+/** Watch a directory for changes - must be called with the mutex held.
+	Directories which can't be watched, or which are on a network file
+	system, are rescanned periodically as well.
+*/
+
+static void index_watch( index_dir dir )
+{
+	dir->remote = index_remote( dir->path );
+	if ( dir->remote )
+		melted_log( LOG_DEBUG, "INDEX %s is on a network file system - rescanning every %d seconds", dir->path, index_rescan );
+#ifdef __linux__
+	if ( index_fd >= 0 )
+	{
+		dir->wd = inotify_add_watch( index_fd, dir->path, INDEX_EVENTS );
+		if ( dir->wd >= 0 )
+		{
+			/* A path may be given the watch of one removed but not yet ignored. */
+			index_dir other = index_find_watch( dir->wd );
+			if ( other != NULL )
+				index_unwatch( other, 0 );
+			dir->next_watch = index_watches[ ( unsigned int )dir->wd % INDEX_BUCKETS ];
+			index_watches[ ( unsigned int )dir->wd % INDEX_BUCKETS ] = dir;
+		}
+		else if ( errno == ENOSPC && !index_limited )
+		{
+			index_limited = 1;
+			melted_log( LOG_WARNING, "INDEX out of inotify watches - rescanning the rest every %d seconds", index_rescan );
+		}
+	}
+#endif
+}
+
+/** Remove a directory and everything below it - must be called with the
+	mutex held.
+*/
+
+static void index_remove_tree( const char *path )
+{
+	size_t length = strlen( path );
+	int bucket = 0;
+
+	for ( bucket = 0; bucket < INDEX_BUCKETS; bucket ++ )
+	{
+		index_dir *previous = &index_dirs[ bucket ];
+		while ( *previous != NULL )
+		{
+			index_dir dir = *previous;
+			if ( !strncmp( dir->path, path, length ) && ( dir->path[ length ] == '\0' || dir->path[ length ] == '/' || length == 1 ) )
+			{
+				*previous = dir->next;
+				index_unwatch( dir, 1 );
+				index_entries_close( dir->entries, dir->count );
+				free( dir->path );
+				free( dir );
+			}
+			else
+			{
+				previous = &dir->next;
+			}
+		}
+	}
+}
+
+/** Queue a path for the index thread.
+*/
+
+static void index_queue_push( index_queue queue, const char *path )
+{
+	if ( queue->count == queue->size )
+	{
+		int size = queue->size > 0 ? queue->size * 2 : 256;
+		char **paths = malloc( size * sizeof( char * ) );
+		int index = 0;
+		if ( paths == NULL )
+			return;
+		for ( index = 0; index < queue->count; index ++ )
+			paths[ index ] = queue->paths[ ( queue->head + index ) % queue->size ];
+		free( queue->paths );
+		queue->paths = paths;
+		queue->head = 0;
+		queue->size = size;
+	}
+	queue->paths[ ( queue->head + queue->count ++ ) % queue->size ] = strdup( path );
+}
+
+/** Take the next queued path - the caller frees it.
+*/
+
+static char *index_queue_pop( index_queue queue )
+{
+	char *path = NULL;
+	if ( queue->count > 0 )
+	{
+		path = queue->paths[ queue->head ];
+		queue->head = ( queue->head + 1 ) % queue->size;
+		queue->count --;
+	}
+	return path;
+}
+
+/** Empty the queue.
+*/
+
+static void index_queue_clear( index_queue queue )
+{
+	char *path = NULL;
+	while ( queue->count > 0 )
+		if ( ( path = index_queue_pop( queue ) ) != NULL )
+			free( path );
+}
+
+/** Hide dot files as CLS does.
+*/
+
+static int index_filter( const struct dirent *de )
+{
+	return de->d_name[ 0 ] != '.';
+}
+
+/** Compare entries by name in the order alphasort gives.
+*/
+
+static int index_compare( const void *a, const void *b )
+{
+	return strcoll( ( ( const index_entry_t * )a )->name, ( ( const index_entry_t * )b )->name );
+}
+
+/** Read a directory from disk, classifying each entry as CLS does. This
+	does all the metadata I/O and is never called with the mutex held.
+*/
+
+static int index_scan( const char *path, index_entry *entries, int *count )
+{
+	struct dirent **de = NULL;
+	int n = scandir( path, &de, index_filter, alphasort );
+	int i = 0;
+
+	*entries = NULL;
+	*count = 0;
+
+	if ( n < 0 )
+		return -1;
+
+	*entries = calloc( n > 0 ? n : 1, sizeof( index_entry_t ) );
+
+	for ( i = 0; i < n; i ++ )
+	{
+		char fullname[ 1024 ];
+		struct stat info;
+		index_entry_t entry;
+
+		memset( &entry, 0, sizeof( entry ) );
+		index_join( fullname, sizeof( fullname ), path, de[ i ]->d_name );
+		if ( stat( fullname, &info ) == 0 && S_ISDIR( info.st_mode ) )
+			entry.directory = 1;
+		if ( lstat( fullname, &info ) == 0 )
+		{
+			entry.subtree = S_ISDIR( info.st_mode );
+			entry.file = S_ISREG( info.st_mode ) || S_ISLNK( info.st_mode ) || strstr( fullname, ".clip" ) != NULL;
+			entry.size = info.st_size;
+		}
+		if ( *entries != NULL && ( entry.directory || entry.file ) && ( entry.name = strdup( de[ i ]->d_name ) ) != NULL )
+			( *entries )[ ( *count ) ++ ] = entry;
+		free( de[ i ] );
+	}
+	free( de );
+
+	return *entries != NULL ? 0 : -1;
+}
+
+/** Scan a directory and replace its entries in the index, queueing new
+	subdirectories and dropping those which have gone.
+*/
+
+static void index_visit( const char *path, index_queue queue )
+{
+	index_entry entries = NULL;
+	index_dir dir = NULL;
+	int count = 0;
+	int i = 0;
+
+	/* Changes from here on queue the directory again. */
+	pthread_mutex_lock( &index_mutex );
+	if ( ( dir = index_find( path ) ) != NULL )
+		dir->queued = 0;
+	pthread_mutex_unlock( &index_mutex );
+
+	if ( index_scan( path, &entries, &count ) != 0 )
+	{
+		pthread_mutex_lock( &index_mutex );
+		index_remove_tree( path );
+		pthread_mutex_unlock( &index_mutex );
+		return;
+	}
+
+	pthread_mutex_lock( &index_mutex );
+
+	dir = index_find( path );
+	if ( dir == NULL && ( dir = calloc( 1, sizeof( index_dir_t ) ) ) != NULL )
+	{
+		unsigned int hash = index_hash( path );
+		dir->path = strdup( path );
+		dir->wd = -1;
+		dir->next = index_dirs[ hash ];
+		index_dirs[ hash ] = dir;
+		index_watch( dir );
+	}
+
+	if ( dir == NULL )
+	{
+		pthread_mutex_unlock( &index_mutex );
+		index_entries_close( entries, count );
+		return;
+	}
+
+	for ( i = 0; i < count; i ++ )
+	{
+		char child[ 1024 ];
+		index_join( child, sizeof( child ), path, entries[ i ].name );
+		if ( entries[ i ].subtree && index_find( child ) == NULL )
+			index_queue_push( queue, child );
+	}
+
+	for ( i = 0; i < dir->count; i ++ )
+	{
+		index_entry found = NULL;
+		if ( !dir->entries[ i ].subtree )
+			continue;
+		found = bsearch( &dir->entries[ i ], entries, count, sizeof( index_entry_t ), index_compare );
+		if ( found == NULL || !found->subtree )
+		{
+			char child[ 1024 ];
+			index_join( child, sizeof( child ), path, dir->entries[ i ].name );
+			index_remove_tree( child );
+		}
+	}
+
+	index_entries_close( dir->entries, dir->count );
+	dir->entries = entries;
+	dir->count = count;
+	dir->stale = dir->queued;
+	dir->scanned = time( NULL );
+
+	pthread_mutex_unlock( &index_mutex );
+}
+
+/** Mark a directory as out of date and queue it - must be called with the
+	mutex held. CLS reads a stale directory from disk until it is rescanned.
+*/
+
+static void index_invalidate( index_dir dir, index_queue queue )
+{
+	dir->stale = 1;
+	if ( !dir->queued )
+	{
+		dir->queued = 1;
+		index_queue_push( queue, dir->path );
+	}
+}
+
+/** Read the pending inotify events, invalidating the directories they name.
+	Returns non-zero if events were lost and the tree must be crawled again.
+*/
+
+static int index_events( index_queue queue )
+{
+	int lost = 0;
+#ifdef __linux__
+	char buffer[ 65536 ] __attribute__ ( ( aligned( __alignof__( struct inotify_event ) ) ) );
+	ssize_t length = 0;
+
+	while ( index_fd >= 0 && ( length = read( index_fd, buffer, sizeof( buffer ) ) ) > 0 )
+	{
+		char *position = buffer;
+
+		pthread_mutex_lock( &index_mutex );
+		while ( position < buffer + length )
+		{
+			struct inotify_event *event = ( struct inotify_event * )position;
+			index_dir dir = event->wd >= 0 ? index_find_watch( event->wd ) : NULL;
+
+			if ( event->mask & IN_Q_OVERFLOW )
+				lost = 1;
+			else if ( dir != NULL && ( event->mask & IN_IGNORED ) )
+				index_unwatch( dir, 0 );
+			else if ( dir != NULL )
+				index_invalidate( dir, queue );
+
+			position += sizeof( struct inotify_event ) + event->len;
+		}
+		pthread_mutex_unlock( &index_mutex );
+	}
+#endif
+	return lost;
+}
+
+/** Queue every directory without a watch, or on a network file system, for
+	a rescan.
+*/
+
+static void index_sweep( index_queue queue )
+{
+	int bucket = 0;
+	pthread_mutex_lock( &index_mutex );
+	for ( bucket = 0; bucket < INDEX_BUCKETS; bucket ++ )
+	{
+		index_dir dir = NULL;
+		for ( dir = index_dirs[ bucket ]; dir != NULL; dir = dir->next )
+			if ( dir->wd < 0 || dir->remote )
+				index_invalidate( dir, queue );
+	}
+	pthread_mutex_unlock( &index_mutex );
+}
+
+/** Count the indexed directories and entries - must be called with the
+	mutex held.
+*/
+
+static void index_count( int *dirs, int *entries )
+{
+	int bucket = 0;
+	*dirs = *entries = 0;
+	for ( bucket = 0; bucket < INDEX_BUCKETS; bucket ++ )
+	{
+		index_dir dir = NULL;
+		for ( dir = index_dirs[ bucket ]; dir != NULL; dir = dir->next )
+		{
+			( *dirs ) ++;
+			*entries += dir->count;
+		}
+	}
+}
+
+/** The index thread crawls the root, then rescans what changes. Work is
+	done in small batches so that events and a change of root are noticed
+	promptly even during the first crawl of a large tree.
+*/
+
+static void *index_thread_main( void *arg )
+{
+	index_queue_t queue;
+	time_t sweep = time( NULL ) + index_rescan;
+	int64_t started = 0;
+	int crawling = 0;
+	int running = 1;
+
+	memset( &queue, 0, sizeof( queue ) );
+
+	while ( running )
+	{
+		char *root = NULL;
+		int batch = 0;
+
+		pthread_mutex_lock( &index_mutex );
+		running = index_running;
+		if ( index_restart )
+		{
+			index_restart = 0;
+			index_remove_tree( "/" );
+			root = index_root != NULL ? strdup( index_root ) : NULL;
+		}
+		pthread_mutex_unlock( &index_mutex );
+
+		if ( root != NULL )
+		{
+			index_queue_clear( &queue );
+			index_queue_push( &queue, root );
+			melted_log( LOG_NOTICE, "INDEX crawling %s", root );
+			started = melted_metrics_now( );
+			crawling = 1;
+			free( root );
+		}
+
+		while ( running && batch ++ < 256 && queue.count > 0 )
+		{
+			char *path = index_queue_pop( &queue );
+			if ( path != NULL )
+				index_visit( path, &queue );
+			free( path );
+		}
+
+		if ( crawling && queue.count == 0 )
+		{
+			int dirs = 0;
+			int entries = 0;
+			pthread_mutex_lock( &index_mutex );
+			index_count( &dirs, &entries );
+			pthread_mutex_unlock( &index_mutex );
+			melted_log( LOG_NOTICE, "INDEX %d directories and %d entries in %lld ms", dirs, entries,
+						( long long )( melted_metrics_now( ) - started ) / 1000 );
+			crawling = 0;
+		}
+
+		if ( index_fd >= 0 )
+		{
+			struct pollfd fd = { index_fd, POLLIN, 0 };
+			if ( poll( &fd, 1, queue.count > 0 ? 0 : 1000 ) > 0 && index_events( &queue ) )
+			{
+				melted_log( LOG_WARNING, "INDEX lost inotify events - crawling again" );
+				pthread_mutex_lock( &index_mutex );
+				index_restart = index_root != NULL;
+				pthread_mutex_unlock( &index_mutex );
+			}
+		}
+		else if ( queue.count == 0 )
+		{
+			sleep( 1 );
+		}
+
+		if ( time( NULL ) >= sweep )
+		{
+			index_sweep( &queue );
+			sweep = time( NULL ) + index_rescan;
+		}
+	}
+
+	index_queue_clear( &queue );
+	free( queue.paths );
+
+	return NULL;
+}
+
+/** Start the index thread. Directories which inotify can't watch are
+	rescanned every rescan seconds. Nothing is indexed until a root is given.
+	Returns non-zero if the thread could not be started.
+*/
+
+int melted_index_init( int rescan )
+{
+	int error = 0;
+
+	pthread_mutex_lock( &index_mutex );
+
+	if ( !index_running )
+	{
+		index_rescan = rescan > 0 ? rescan : 60;
+		index_limited = 0;
+#ifdef __linux__
+		index_fd = inotify_init1( IN_NONBLOCK | IN_CLOEXEC );
+		if ( index_fd < 0 )
+			melted_log( LOG_WARNING, "INDEX inotify unavailable - rescanning every %d seconds", index_rescan );
+#endif
+		index_restart = index_root != NULL;
+		index_running = 1;
+		if ( pthread_create( &index_thread, NULL, index_thread_main, NULL ) != 0 )
+		{
+			index_running = 0;
+			error = 1;
+		}
+	}
+
+	pthread_mutex_unlock( &index_mutex );
+
+	return error;
+}
+
+/** Index the tree below root, replacing any previous root. This may be
+	called before the thread is started.
+*/
+
+void melted_index_root( const char *root )
+{
+	char path[ 1024 ];
+
+	if ( index_normalise( path, sizeof( path ), root ) != 0 )
+		return;
+
+	pthread_mutex_lock( &index_mutex );
+	if ( index_root == NULL || strcmp( index_root, path ) )
+	{
+		free( index_root );
+		index_root = strdup( path );
+		index_restart = index_running;
+	}
+	pthread_mutex_unlock( &index_mutex );
+}
+
+/** List an indexed directory, giving the directories and then the files to
+	entry as CLS orders them. Returns non-zero if the directory isn't indexed
+	or has changed since it was last scanned, so the caller should read it
+	from disk.
+*/
+
+int melted_index_list( const char *path, melted_index_entry entry, void *data )
+{
+	char normal[ 1024 ];
+	index_dir dir = NULL;
+	int error = -1;
+
+	if ( index_normalise( normal, sizeof( normal ), path ) != 0 )
+		return error;
+
+	pthread_mutex_lock( &index_mutex );
+	if ( index_running && ( dir = index_find( normal ) ) != NULL && !dir->stale )
+	{
+		int i = 0;
+		for ( i = 0; i < dir->count; i ++ )
+			if ( dir->entries[ i ].directory )
+				entry( data, dir->entries[ i ].name, 1, 0 );
+		for ( i = 0; i < dir->count; i ++ )
+			if ( dir->entries[ i ].file )
+				entry( data, dir->entries[ i ].name, 0, dir->entries[ i ].size );
+		error = 0;
+	}
+	pthread_mutex_unlock( &index_mutex );
+
+	return error;
+}
+
+/** Stop the index thread and release the index.
+*/
+
+void melted_index_close( )
+{
+	int running = 0;
+
+	pthread_mutex_lock( &index_mutex );
+	running = index_running;
+	index_running = 0;
+	pthread_mutex_unlock( &index_mutex );
+
+	if ( running )
+	{
+		pthread_join( index_thread, NULL );
+		pthread_mutex_lock( &index_mutex );
+		index_remove_tree( "/" );
+		if ( index_fd >= 0 )
+			close( index_fd );
+		index_fd = -1;
+		pthread_mutex_unlock( &index_mutex );
+	}
+}
@@ -0,0 +1,46 @@
+/*
+ * melted_index.h -- Indexed Media Directory Cache
+ * Copyright (C) 2002-2015 Meltytech, LLC
+ * Author: Charles Yates <charles.yates@pandora.be>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#ifndef _MELTED_INDEX_H_
+#define _MELTED_INDEX_H_
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+/** Callback receiving the name of each entry of a listed directory, whether
+	it is a directory and the size of a file.
+*/
+
+typedef void ( *melted_index_entry )( void *, const char *, int, uint64_t );
+
+extern int melted_index_init( int rescan );
+extern void melted_index_root( const char *root );
+extern int melted_index_list( const char *path, melted_index_entry entry, void *data );
+extern void melted_index_close( void );
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
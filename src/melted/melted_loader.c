@@ -0,0 +1,366 @@
+/*
+ * melted_loader.c -- Asynchronous Clip Loader
+ * Copyright (C) 2002-2015 Meltytech, LLC
+ * Author: Charles Yates <charles.yates@pandora.be>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+/* System header files */
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+/* Application header files */
+#include <mvcp/mvcp_notifier.h>
+#include "melted_loader.h"
+#include "melted_scheduler.h"
+#include "melted_commands.h"
+#include "melted_unit.h"
+#include "melted_log.h"
+
+/** Job states as reported by JSTA.
+*/
+
+typedef enum
+{
+	loader_queued,
+	loader_opening,
+	loader_done,
+	loader_failed
+}
+loader_state;
+
+static const char *loader_states[] = { "queued", "opening", "done", "failed" };
+
+/** A load request - producers are opened in parallel, but a unit's play list
+	is changed in the order the requests were submitted.
+*/
+
+typedef struct loader_job_s
+{
+	int id;
+	int unit;
+	melted_loader_operation operation;
+	char clip[ 1024 ];
+	int index;
+	int32_t in;
+	int32_t out;
+	int flush;
+	unsigned int ticket;
+	loader_state state;
+	int error;
+	mlt_producer producer;
+	void *session;
+	struct loader_job_s *next;
+}
+loader_job;
+
+static pthread_mutex_t loader_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t loader_ready = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t loader_turn = PTHREAD_COND_INITIALIZER;
+static loader_job *loader_jobs[ MELTED_LOADER_JOBS ];
+static loader_job *loader_head = NULL;
+static loader_job *loader_tail = NULL;
+static unsigned int *loader_tickets = NULL;
+static unsigned int *loader_splices = NULL;
+static int loader_units = 0;
+static pthread_t *loader_threads = NULL;
+static int loader_count = 0;
+static int loader_running = 0;
+static int loader_id = 0;
+
+/** Make room for the ticket counters of a unit - must be called with the
+	mutex held.
+*/
+
+static int loader_grow( int unit )
+{
+	if ( unit >= loader_units )
+	{
+		int units = loader_units > 0 ? loader_units : MAX_UNITS;
+		unsigned int *tickets = NULL;
+		unsigned int *splices = NULL;
+
+		while ( units <= unit )
+			units *= 2;
+
+		tickets = realloc( loader_tickets, units * sizeof( unsigned int ) );
+		if ( tickets == NULL )
+			return -1;
+		loader_tickets = tickets;
+		splices = realloc( loader_splices, units * sizeof( unsigned int ) );
+		if ( splices == NULL )
+			return -1;
+		loader_splices = splices;
+
+		memset( loader_tickets + loader_units, 0, ( units - loader_units ) * sizeof( unsigned int ) );
+		memset( loader_splices + loader_units, 0, ( units - loader_units ) * sizeof( unsigned int ) );
+		loader_units = units;
+	}
+	return 0;
+}
+
+/** Change the play list - runs on the unit's scheduler queue.
+*/
+
+static void loader_splice( void *arg )
+{
+	loader_job *job = arg;
+	melted_unit unit = melted_acquire_unit( job->unit );
+
+	if ( unit == NULL )
+	{
+		job->error = 1;
+		return;
+	}
+
+	melted_unit_set_session( job->session );
+	switch( job->operation )
+	{
+		case melted_loader_load:
+			melted_unit_load_producer( unit, job->producer, job->in, job->out, job->flush );
+			break;
+		case melted_loader_insert:
+			job->error = melted_unit_insert_producer( unit, job->producer, job->index, job->in, job->out ) != mvcp_ok;
+			break;
+		case melted_loader_append:
+			job->error = melted_unit_append_producer( unit, job->producer, job->in, job->out ) != mvcp_ok;
+			break;
+	}
+	melted_unit_set_session( NULL );
+
+	melted_release_unit( unit );
+}
+
+/** Loader thread.
+*/
+
+static void *loader_thread( void *arg )
+{
+	pthread_mutex_lock( &loader_mutex );
+
+	while ( loader_running || loader_head != NULL )
+	{
+		loader_job *job = loader_head;
+		melted_unit unit = NULL;
+
+		if ( job == NULL )
+		{
+			pthread_cond_wait( &loader_ready, &loader_mutex );
+			continue;
+		}
+
+		loader_head = job->next;
+		if ( loader_head == NULL )
+			loader_tail = NULL;
+		job->state = loader_opening;
+
+		pthread_mutex_unlock( &loader_mutex );
+		unit = melted_acquire_unit( job->unit );
+		job->producer = unit != NULL ? melted_unit_open( unit, job->clip ) : NULL;
+		melted_release_unit( unit );
+		pthread_mutex_lock( &loader_mutex );
+
+		// Wait for earlier requests on the same unit to be spliced
+		while ( loader_splices[ job->unit ] != job->ticket )
+			pthread_cond_wait( &loader_turn, &loader_mutex );
+
+		pthread_mutex_unlock( &loader_mutex );
+		if ( job->producer != NULL )
+		{
+			melted_scheduler_execute( job->unit, loader_splice, job );
+			mlt_producer_close( job->producer );
+			job->producer = NULL;
+		}
+		else
+		{
+			job->error = 1;
+		}
+		if ( job->error )
+			melted_log( LOG_WARNING, "job %d: failed to load clip %s", job->id, job->clip );
+		else
+			melted_log( LOG_DEBUG, "job %d: loaded clip %s", job->id, job->clip );
+		pthread_mutex_lock( &loader_mutex );
+
+		loader_splices[ job->unit ] ++;
+		job->state = job->error ? loader_failed : loader_done;
+		pthread_cond_broadcast( &loader_turn );
+	}
+
+	pthread_mutex_unlock( &loader_mutex );
+
+	return NULL;
+}
+
+/** Start the loader threads.
+*/
+
+int melted_loader_init( int threads )
+{
+	int index = 0;
+
+	if ( threads <= 0 )
+		threads = MELTED_LOADER_THREADS;
+
+	pthread_mutex_lock( &loader_mutex );
+
+	if ( !loader_running )
+	{
+		loader_threads = calloc( threads, sizeof( pthread_t ) );
+		if ( loader_threads != NULL )
+		{
+			loader_running = 1;
+			for ( index = 0; index < threads; index ++ )
+				if ( pthread_create( &loader_threads[ index ], NULL, loader_thread, NULL ) != 0 )
+					break;
+			loader_count = index;
+		}
+	}
+
+	pthread_mutex_unlock( &loader_mutex );
+
+	return loader_count > 0 ? 0 : -1;
+}
+
+/** Queue a load request for a unit. Returns the job id or -1 if the loader
+	is not running or too many requests are outstanding.
+*/
+
+int melted_loader_submit( int unit, melted_loader_operation operation, char *clip, int index, int32_t in, int32_t out, int flush )
+{
+	int id = -1;
+
+	if ( unit < 0 )
+		return -1;
+
+	pthread_mutex_lock( &loader_mutex );
+
+	if ( loader_running && loader_count > 0 && loader_grow( unit ) == 0 )
+	{
+		loader_job **slot = &loader_jobs[ ( loader_id + 1 ) % MELTED_LOADER_JOBS ];
+
+		if ( *slot == NULL || ( *slot )->state == loader_done || ( *slot )->state == loader_failed )
+		{
+			loader_job *job = *slot != NULL ? *slot : malloc( sizeof( loader_job ) );
+			if ( job != NULL )
+			{
+				memset( job, 0, sizeof( loader_job ) );
+				job->id = id = ++ loader_id;
+				job->unit = unit;
+				job->operation = operation;
+				strncpy( job->clip, clip, sizeof( job->clip ) - 1 );
+				job->index = index;
+				job->in = in;
+				job->out = out;
+				job->flush = flush;
+				job->session = melted_unit_session( );
+				job->ticket = loader_tickets[ unit ] ++;
+				job->state = loader_queued;
+				*slot = job;
+
+				if ( loader_tail != NULL )
+					loader_tail->next = job;
+				else
+					loader_head = job;
+				loader_tail = job;
+				pthread_cond_signal( &loader_ready );
+			}
+		}
+	}
+
+	pthread_mutex_unlock( &loader_mutex );
+
+	return id;
+}
+
+/** Report the state of a job. Returns -1 if the job is unknown or forgotten.
+*/
+
+int melted_loader_report( int id, mvcp_response response )
+{
+	int error = -1;
+
+	pthread_mutex_lock( &loader_mutex );
+
+	if ( id > 0 )
+	{
+		loader_job *job = loader_jobs[ id % MELTED_LOADER_JOBS ];
+		if ( job != NULL && job->id == id )
+		{
+			mvcp_response_printf( response, 2048, "%d U%d %s \"%s\"\n", job->id, job->unit, loader_states[ job->state ], job->clip );
+			error = 0;
+		}
+	}
+
+	pthread_mutex_unlock( &loader_mutex );
+
+	return error;
+}
+
+/** Wait until every request submitted for a unit has been spliced into its
+	play list, or for all units when unit is negative.
+*/
+
+void melted_loader_wait( int unit )
+{
+	int index = 0;
+
+	pthread_mutex_lock( &loader_mutex );
+	for ( index = unit < 0 ? 0 : unit; index < loader_units && ( unit < 0 || index == unit ); index ++ )
+		while ( loader_count > 0 && loader_splices[ index ] != loader_tickets[ index ] )
+			pthread_cond_wait( &loader_turn, &loader_mutex );
+	pthread_mutex_unlock( &loader_mutex );
+}
+
+/** Stop the loader threads once the queued requests have been completed.
+*/
+
+void melted_loader_close( )
+{
+	int index = 0;
+	int count = 0;
+
+	pthread_mutex_lock( &loader_mutex );
+	if ( loader_running )
+	{
+		loader_running = 0;
+		count = loader_count;
+		pthread_cond_broadcast( &loader_ready );
+	}
+	pthread_mutex_unlock( &loader_mutex );
+
+	for ( index = 0; index < count; index ++ )
+		pthread_join( loader_threads[ index ], NULL );
+
+	if ( count > 0 )
+	{
+		pthread_mutex_lock( &loader_mutex );
+		for ( index = 0; index < MELTED_LOADER_JOBS; index ++ )
+		{
+			free( loader_jobs[ index ] );
+			loader_jobs[ index ] = NULL;
+		}
+		free( loader_tickets );
+		free( loader_splices );
+		loader_tickets = NULL;
+		loader_splices = NULL;
+		loader_units = 0;
+		loader_count = 0;
+		pthread_mutex_unlock( &loader_mutex );
+		free( loader_threads );
+		loader_threads = NULL;
+	}
+}
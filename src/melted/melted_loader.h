@@ -0,0 +1,66 @@
+/*
+ * melted_loader.h -- Asynchronous Clip Loader
+ * Copyright (C) 2002-2015 Meltytech, LLC
+ * Author: Charles Yates <charles.yates@pandora.be>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#ifndef _MELTED_LOADER_H_
+#define _MELTED_LOADER_H_
+
+#include <stdint.h>
+#include <mvcp/mvcp_response.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+/** Default number of loader threads.
+*/
+
+#define MELTED_LOADER_THREADS 2
+
+/** Number of jobs remembered for status queries.
+*/
+
+#define MELTED_LOADER_JOBS 256
+
+/** Play list operation performed once the producer is open.
+*/
+
+typedef enum
+{
+	melted_loader_load,
+	melted_loader_insert,
+	melted_loader_append
+}
+melted_loader_operation;
+
+/** API for the loader.
+*/
+
+extern int melted_loader_init( int );
+extern int melted_loader_submit( int, melted_loader_operation, char *, int, int32_t, int32_t, int );
+extern int melted_loader_report( int, mvcp_response );
+extern void melted_loader_wait( int );
+extern void melted_loader_close( );
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -25,7 +25,9 @@
 /* System header files */
 #include <stdlib.h>
 #include <string.h>
+#include <ctype.h>
 #include <signal.h>
+#include <pthread.h>
 
 /* Needed for backtrace on linux */
 #ifdef linux
@@ -44,6 +46,12 @@
 #include "melted_commands.h"
 #include "melted_unit_commands.h"
 #include "melted_log.h"
+#include "melted_scheduler.h"
+#include "melted_loader.h"
+#include "melted_cue.h"
+#include "melted_metrics.h"
+#include "melted_trace.h"
+#include "melted_replica.h"
 
 /** Private melted_local structure.
 */
@@ -62,7 +70,9 @@ static mvcp_response melted_local_connect( melted_local );
 static mvcp_response melted_local_execute( melted_local, char * );
 static mvcp_response melted_local_push( melted_local, char *, mlt_service );
 static mvcp_response melted_local_receive( melted_local, char *, char * );
+static int melted_local_submit( melted_local, char *, mvcp_response_callback, void * );
 static void melted_local_close( melted_local );
+static void dispatch_init( );
 response_codes melted_help( command_argument arg );
 response_codes melted_run( command_argument arg );
 response_codes melted_shutdown( command_argument arg );
@@ -84,6 +94,7 @@ mvcp_parser melted_parser_init_local( )
 		parser->push = (parser_push)melted_local_push;
 		parser->received = (parser_received)melted_local_receive;
 		parser->close = (parser_close)melted_local_close;
+		parser->submit = (parser_submit)melted_local_submit;
 		parser->real = local;
 
 		if ( local != NULL )
@@ -93,6 +104,18 @@ mvcp_parser melted_parser_init_local( )
 			local->root_dir[0] = '/';
 		}
 
+		// Start the unit command workers
+		melted_scheduler_init( getenv( "MELTED_WORKERS" ) ? atoi( getenv( "MELTED_WORKERS" ) ) : 0 );
+
+		// Start the asynchronous clip loaders
+		melted_loader_init( getenv( "MELTED_LOADERS" ) ? atoi( getenv( "MELTED_LOADERS" ) ) : 0 );
+
+		// Start the runner for cued commands
+		melted_cue_init( parser );
+
+		// Enter the vocabulary into the dispatch table
+		dispatch_init( );
+
 		// Construct the factory
 		mlt_factory_init( getenv( "MLT_REPOSITORY" ) );
 	}
@@ -127,19 +150,6 @@ static responses_t responses [] =
 	{RESPONSE_ERROR, "Server Error"}
 };
 
-/** Argument types.
-*/
-
-typedef enum 
-{
-	ATYPE_NONE,
-	ATYPE_FLOAT,
-	ATYPE_STRING,
-	ATYPE_INT,
-	ATYPE_PAIR
-} 
-arguments_types;
-
 /** A command definition.
 */
 
@@ -173,10 +183,16 @@ static command_t vocabulary[] =
 	{"NLS", melted_list_nodes, 0, ATYPE_NONE, "List the AV/C nodes on the 1394 bus."},
 	{"UADD", melted_add_unit, 0, ATYPE_STRING, "Create a new playout unit (virtual VTR) to transmit to receiver specified in GUID argument."},
 	{"ULS", melted_list_units, 0, ATYPE_NONE, "Lists the units that have already been added to the server."},
+	{"ASTA", melted_get_all_status, 0, ATYPE_NONE, "Report information about every unit."},
 	{"CLS", melted_list_clips, 0, ATYPE_STRING, "Lists the clips at directory name argument."},
+	{"PROBE", melted_probe_clips, 0, ATYPE_STRING, "Report the length, frame rate and streams of clips without loading them."},
 	{"SET", melted_set_global_property, 0, ATYPE_PAIR, "Set a server configuration property."},
 	{"GET", melted_get_global_property, 0, ATYPE_STRING, "Get a server configuration property."},
 	{"RUN", melted_run, 0, ATYPE_STRING, "Run a batch file." },
+	{"JSTA", melted_get_job_status, 0, ATYPE_INT, "Report the state of an asynchronous LOAD, INSERT or APND."},
+	{"ENCODING", melted_encoding, 0, ATYPE_STRING, "Report whether PUSH documents may be sent with the given encoding."},
+	{"STATS", melted_report_stats, 0, ATYPE_NONE, "Report command latencies, connection and subscriber counts, clip open and frame timings."},
+	{"SNAPSHOT", melted_write_snapshot, 0, ATYPE_NONE, "Write the state of every unit to the snapshot file or the file given."},
 	{"LIST", melted_list, 1, ATYPE_NONE, "List the playlist associated to a unit."},
 	{"LOAD", melted_load, 1, ATYPE_STRING, "Load clip specified in absolute filename argument."},
 	{"INSERT", melted_insert, 1, ATYPE_STRING, "Insert a clip at the given clip index."},
@@ -186,6 +202,12 @@ static command_t vocabulary[] =
 	{"CLEAR", melted_clear, 1, ATYPE_NONE, "Clear a unit by removing all clips."},
 	{"MOVE", melted_move, 1, ATYPE_INT, "Move a clip to another clip index."},
 	{"APND", melted_append, 1, ATYPE_STRING, "Append a clip specified in absolute filename argument."},
+	{"BEGIN", melted_begin, 1, ATYPE_NONE, "Start recording INSERT, APND, REMOVE and MOVE for a unit."},
+	{"COMMIT", melted_commit, 1, ATYPE_NONE, "Apply the recorded playlist edits at once."},
+	{"ROLLBACK", melted_rollback, 1, ATYPE_NONE, "Discard the recorded playlist edits."},
+	{"CUE", melted_cue, 1, ATYPE_STRING, "Run a command at a wall-clock time, playlist frame or clip frame."},
+	{"CUES", melted_list_cues, 1, ATYPE_NONE, "List the pending cues of a unit."},
+	{"UNCUE", melted_uncue, 1, ATYPE_INT, "Remove a pending cue."},
 	{"PLAY", melted_play, 1, ATYPE_NONE, "Play a loaded clip at speed -2000 to 2000 where 1000 = normal forward speed."},
 	{"STOP", melted_stop, 1, ATYPE_NONE, "Stop a loaded and playing clip."},
 	{"PAUSE", melted_pause, 1, ATYPE_NONE, "Pause a playing clip."},
@@ -199,6 +221,9 @@ static command_t vocabulary[] =
 	{"USET", melted_set_unit_property, 1, ATYPE_PAIR, "Set a unit configuration property."},
 	{"UGET", melted_get_unit_property, 1, ATYPE_STRING, "Get a unit configuration property."},
 	{"XFER", melted_transfer, 1, ATYPE_STRING, "Transfer the unit's clip to another unit specified as argument."},
+	{"SWAP", melted_swap, 1, ATYPE_STRING, "Exchange the play lists of the unit and another unit specified as argument."},
+	{"SYNC", melted_sync, 1, ATYPE_INT, "Seek and set the speed of a standby unit if it has drifted from its primary's clip, frame and speed."},
+	{"NEXTID", melted_next_id, 1, ATYPE_INT, "Set the id given to the next clip added to the unit."},
 	{"SHUTDOWN", melted_shutdown, 0, ATYPE_NONE, "Shutdown the server."},
 	{NULL, NULL, 0, ATYPE_NONE, NULL}
 };
@@ -214,6 +239,125 @@ static char helpstr [] =
 	"		Charles Yates <charles.yates@pandora.be>\n"
 	"Available commands:\n";
 
+/** Hashed, case insensitive dispatch table. The vocabulary is entered when
+	the first parser is created, embedders may add or override commands at
+	any time with melted_local_register. Registered commands live for the
+	rest of the process.
+*/
+
+#define MELTED_DISPATCH_BUCKETS 128
+
+typedef struct dispatch_entry_s
+{
+	command_t *command;
+	int registered;
+	struct dispatch_entry_s *next;
+}
+dispatch_entry;
+
+static pthread_rwlock_t dispatch_lock = PTHREAD_RWLOCK_INITIALIZER;
+static dispatch_entry *dispatch_table[ MELTED_DISPATCH_BUCKETS ];
+static int dispatch_ready = 0;
+
+static unsigned int dispatch_hash( const char *name )
+{
+	unsigned int hash = 2166136261u;
+	while ( *name )
+		hash = ( hash ^ ( unsigned char )toupper( ( unsigned char )*name ++ ) ) * 16777619u;
+	return hash % MELTED_DISPATCH_BUCKETS;
+}
+
+/** Add an entry - the newest entry for a name shadows the older ones.
+	Must be called with the dispatch lock held for writing.
+*/
+
+static int dispatch_add( command_t *command, int registered )
+{
+	unsigned int hash = dispatch_hash( command->command );
+	dispatch_entry *entry = calloc( 1, sizeof( dispatch_entry ) );
+
+	if ( entry == NULL )
+		return -1;
+
+	entry->command = command;
+	entry->registered = registered;
+	entry->next = dispatch_table[ hash ];
+	dispatch_table[ hash ] = entry;
+
+	return 0;
+}
+
+static void dispatch_init( )
+{
+	int index = 0;
+
+	pthread_rwlock_wrlock( &dispatch_lock );
+	// BYE is handled by the connection, never dispatched
+	for ( index = 1; !dispatch_ready && vocabulary[ index ].command != NULL; index ++ )
+		dispatch_add( &vocabulary[ index ], 0 );
+	dispatch_ready = 1;
+	pthread_rwlock_unlock( &dispatch_lock );
+}
+
+/** Find a command and copy its definition. Must be called with the dispatch
+	lock held for reading.
+*/
+
+static dispatch_entry *dispatch_find( const char *name )
+{
+	dispatch_entry *entry = NULL;
+
+	if ( name != NULL )
+		for ( entry = dispatch_table[ dispatch_hash( name ) ]; entry != NULL; entry = entry->next )
+			if ( !strcasecmp( entry->command->command, name ) )
+				break;
+
+	return entry;
+}
+
+static int dispatch_lookup( const char *name, command_t *command )
+{
+	dispatch_entry *entry = NULL;
+
+	pthread_rwlock_rdlock( &dispatch_lock );
+	if ( ( entry = dispatch_find( name ) ) != NULL )
+		*command = *entry->command;
+	pthread_rwlock_unlock( &dispatch_lock );
+
+	return entry != NULL;
+}
+
+/** Register a command with every local parser. An existing command of the
+	same name, built in or registered, is replaced. Returns non-zero on error.
+*/
+
+int melted_local_register( const char *name, response_codes ( *operation )( command_argument ), int is_unit, arguments_types type, const char *help )
+{
+	command_t *command = NULL;
+	int error = name == NULL || *name == '\0' || strchr( name, ' ' ) != NULL || operation == NULL;
+
+	if ( !error )
+	{
+		dispatch_init( );
+		command = calloc( 1, sizeof( command_t ) );
+		error = command == NULL;
+	}
+
+	if ( !error )
+	{
+		command->command = strdup( name );
+		command->operation = operation;
+		command->is_unit = is_unit;
+		command->type = type;
+		command->help = strdup( help != NULL ? help : "" );
+		pthread_rwlock_wrlock( &dispatch_lock );
+		error = dispatch_add( command, 1 );
+		pthread_rwlock_unlock( &dispatch_lock );
+	}
+
+	return error;
+}
+
 /** Lookup the response message for a status code.
 */
 
@@ -233,11 +377,31 @@ response_codes melted_help( command_argument cmd_arg )
 	
 	mvcp_response_printf( cmd_arg->response, 10240, "%s", helpstr );
 	
+	pthread_rwlock_rdlock( &dispatch_lock );
 	for ( i = 0; vocabulary[ i ].command != NULL; i ++ )
+	{
+		dispatch_entry *entry = dispatch_find( vocabulary[ i ].command );
+		command_t *command = entry != NULL ? entry->command : &vocabulary[ i ];
 		mvcp_response_printf( cmd_arg->response, 1024,
 							"%-10.10s%s\n", 
-							vocabulary[ i ].command, 
-							vocabulary[ i ].help );
+							command->command, 
+							command->help );
+	}
+
+	// Registered commands which are not overrides
+	for ( i = 0; i < MELTED_DISPATCH_BUCKETS; i ++ )
+	{
+		dispatch_entry *entry = NULL;
+		for ( entry = dispatch_table[ i ]; entry != NULL; entry = entry->next )
+		{
+			int index = 0;
+			while ( vocabulary[ index ].command != NULL && strcasecmp( vocabulary[ index ].command, entry->command->command ) )
+				index ++;
+			if ( entry->registered && vocabulary[ index ].command == NULL && dispatch_find( entry->command->command ) == entry )
+				mvcp_response_printf( cmd_arg->response, 1024, "%-10.10s%s\n", entry->command->command, entry->command->help );
+		}
+	}
+	pthread_rwlock_unlock( &dispatch_lock );
 
 	mvcp_response_printf( cmd_arg->response, 2, "\n" );
 
@@ -351,6 +515,32 @@ static mvcp_response melted_local_connect( melted_local local )
 	return response;
 }
 
+/** Tokenise a command, strip the quotes and convert the leading tokens once.
+*/
+
+static int melted_command_tokenise( command_argument cmd, char *command )
+{
+	int count = mvcp_tokeniser_parse_new( cmd->tokeniser, command, " " );
+	int index = 0;
+
+	cmd->argc = count > 0 ? count : 0;
+
+	for ( index = 0; index < cmd->argc; index ++ )
+	{
+		char *string = mvcp_tokeniser_get_string( cmd->tokeniser, index );
+		mvcp_util_strip( string, '\"' );
+		if ( index < MELTED_MAX_ARGS )
+		{
+			char *end = NULL;
+			cmd->argv[ index ].string = string;
+			cmd->argv[ index ].number = strtol( string, &end, 10 );
+			cmd->argv[ index ].is_number = end != string && *end == '\0';
+		}
+	}
+
+	return count;
+}
+
 /** Set the error and determine the message associated to this command.
 */
 
@@ -368,6 +558,9 @@ int melted_command_parse_unit( command_argument cmd, int argument )
 	char *string = mvcp_tokeniser_get_string( cmd->tokeniser, argument );
 	if ( string != NULL && ( string[ 0 ] == 'U' || string[ 0 ] == 'u' ) && strlen( string ) > 1 )
 		unit = atoi( string + 1 );
+	/* Units beyond the registry limit can never exist. */
+	if ( unit < 0 || unit >= MELTED_MAX_UNITS )
+		unit = -1;
 	return unit;
 }
 
@@ -412,7 +605,7 @@ void *melted_command_parse_argument( command_argument cmd, int argument, argumen
 			case ATYPE_INT:
 				ret = malloc( sizeof( int ) );
 				if ( ret != NULL )
-					*( int * )ret = atoi( value );
+					*( int * )ret = argument < MELTED_MAX_ARGS ? cmd->argv[ argument ].number : atoi( value );
 				break;
 		}
 	}
@@ -431,47 +624,123 @@ response_codes melted_command_get_error( command_argument cmd )
 	return ret;
 }
 
-/** Execute the command.
+/** Scheduled unit operation.
+*/
+
+typedef struct
+{
+	command_t *entry;
+	command_argument cmd;
+	mlt_service service;
+	char *doc;
+	response_codes error;
+	melted_trace trace;
+	int replicate;
+	void *session;
+}
+local_job;
+
+static void melted_local_operation( void *arg )
+{
+	local_job *job = arg;
+	/* Keep the unit alive while the command runs. */
+	melted_unit unit = melted_acquire_unit( job->cmd->unit );
+	void *session = melted_unit_session( );
+	melted_unit_set_session( job->session );
+	melted_trace_stamp( job->trace, trace_locked );
+	job->error = job->entry->operation( job->cmd );
+	melted_trace_stamp( job->trace, trace_executed );
+	if ( job->replicate && job->error / 100 == 2 )
+		melted_replica_command( job->entry->command, job->cmd->unit, job->cmd->command );
+	if ( job->entry->is_unit )
+		melted_trace_watch( job->trace, job->cmd->unit );
+	melted_unit_set_session( session );
+	melted_release_unit( unit );
+}
+
+static void melted_local_push_operation( void *arg )
+{
+	local_job *job = arg;
+	melted_unit unit = melted_acquire_unit( job->cmd->unit );
+	void *session = melted_unit_session( );
+	char *doc = NULL;
+
+	melted_unit_set_session( job->session );
+	// The document is taken before the service starts playing
+	if ( job->replicate )
+		doc = melted_replica_serialise( job->service );
+	if ( melted_push( job->cmd, job->service ) == RESPONSE_SUCCESS && doc != NULL )
+		melted_replica_document( job->cmd->unit, job->cmd->command, doc );
+	free( doc );
+	melted_unit_set_session( session );
+	melted_release_unit( unit );
+}
+
+static void melted_local_receive_operation( void *arg )
+{
+	local_job *job = arg;
+	melted_unit unit = melted_acquire_unit( job->cmd->unit );
+	void *session = melted_unit_session( );
+	melted_unit_set_session( job->session );
+	if ( melted_receive( job->cmd, job->doc ) == RESPONSE_SUCCESS && job->replicate )
+		melted_replica_document( job->cmd->unit, job->cmd->command, job->doc );
+	melted_unit_set_session( session );
+	melted_release_unit( unit );
+}
+
+/** The other unit changed by a command which moves play lists between two
+	units - XFER and SWAP - or -1. Such a command holds the queues of both.
+*/
+
+static int melted_local_other_unit( command_t *entry, command_argument cmd )
+{
+	if ( entry->operation == melted_transfer || entry->operation == melted_swap )
+		return melted_command_parse_unit( cmd, 2 );
+	return -1;
+}
+
+/** Execute the command. Unit commands are serialised per unit on the
+	scheduler, global commands run on the calling thread. A command prefixed
+	by @id is traced, unless the connection which received it traces it.
 */
 
 static mvcp_response melted_local_execute( melted_local local, char *command )
 {
 	command_argument_t cmd;
+	mvcp_tokeniser_t tokeniser;
+	int64_t start = 0;
+	melted_trace trace = melted_trace_current( );
+	melted_trace owned = trace == 0 ? melted_trace_begin( &command ) : 0;
 	cmd.parser = local->parser;
 	cmd.response = mvcp_response_init( );
-	cmd.tokeniser = mvcp_tokeniser_init( );
+	cmd.tokeniser = mvcp_tokeniser_init_inline( &tokeniser );
 	cmd.command = command;
 	cmd.unit = -1;
 	cmd.argument = NULL;
 	cmd.root_dir = local->root_dir;
+	cmd.argc = 0;
+	start = melted_metrics_now( );
+
+	/* Commands run by this one aren't part of its trace */
+	if ( trace != 0 )
+		melted_trace_set_current( 0 );
 
 	/* Set the default error */
 	melted_command_set_error( &cmd, RESPONSE_UNKNOWN_COMMAND );
 
 	/* Parse the command */
-	if ( mvcp_tokeniser_parse_new( cmd.tokeniser, command, " " ) > 0 )
+	if ( melted_command_tokenise( &cmd, command ) > 0 )
 	{
-		int index = 0;
-		char *value = mvcp_tokeniser_get_string( cmd.tokeniser, 0 );
-		int found = 0;
-
-		/* Strip quotes from all tokens */
-		for ( index = 0; index < mvcp_tokeniser_count( cmd.tokeniser ); index ++ )
-			mvcp_util_strip( mvcp_tokeniser_get_string( cmd.tokeniser, index ), '\"' );
-
-		/* Search the vocabulary array for value */
-		for ( index = 1; !found && vocabulary[ index ].command != NULL; index ++ )
-			if ( ( found = !strcasecmp( vocabulary[ index ].command, value ) ) )
-				break;
+		command_t entry;
 
 		/* If we found something, the handle the args and call the handler. */
-		if ( found )
+		if ( dispatch_lookup( cmd.argv[ 0 ].string, &entry ) )
 		{
 			int position = 1;
 
 			melted_command_set_error( &cmd, RESPONSE_SUCCESS );
 
-			if ( vocabulary[ index ].is_unit )
+			if ( entry.is_unit )
 			{
 				cmd.unit = melted_command_parse_unit( &cmd, position );
 				if ( cmd.unit == -1 )
@@ -481,16 +750,23 @@ static mvcp_response melted_local_execute( melted_local local, char *command )
 
 			if ( melted_command_get_error( &cmd ) == RESPONSE_SUCCESS )
 			{
-				cmd.argument = melted_command_parse_argument( &cmd, position, vocabulary[ index ].type, command );
-				if ( cmd.argument == NULL && vocabulary[ index ].type != ATYPE_NONE )
+				cmd.argument = melted_command_parse_argument( &cmd, position, entry.type, command );
+				if ( cmd.argument == NULL && entry.type != ATYPE_NONE )
 					melted_command_set_error( &cmd, RESPONSE_MISSING_ARG );
 				position ++;
 			}
 
 			if ( melted_command_get_error( &cmd ) == RESPONSE_SUCCESS )
 			{
-				response_codes error = vocabulary[ index ].operation( &cmd );
-				melted_command_set_error( &cmd, error );
+				local_job job = { &entry, &cmd, NULL, NULL, RESPONSE_SUCCESS, trace != 0 ? trace : owned, melted_replica_wanted( ), melted_unit_session( ) };
+				int64_t parsed = melted_metrics_now( );
+				melted_trace_stamp( job.trace, trace_dispatched );
+				if ( entry.is_unit )
+					melted_scheduler_execute_pair( cmd.unit, melted_local_other_unit( &entry, &cmd ), melted_local_operation, &job );
+				else
+					melted_local_operation( &job );
+				melted_command_set_error( &cmd, job.error );
+				melted_metrics_command( entry.command, parsed - start, melted_metrics_now( ) - parsed );
 			}
 
 			free( cmd.argument );
@@ -498,40 +774,178 @@ static mvcp_response melted_local_execute( melted_local local, char *command )
 	}
 
 	mvcp_tokeniser_close( cmd.tokeniser );
+	melted_trace_end( owned );
 
 	return cmd.response;
 }
 
+/** Find the units a command operates on - -1 for global commands and for
+	commands which aren't known, and other is set for XFER and SWAP.
+*/
+
+static int melted_local_units( char *command, int *other )
+{
+	command_argument_t cmd;
+	mvcp_tokeniser_t tokeniser;
+	command_t entry;
+	int unit = -1;
+
+	*other = -1;
+
+	/* Skip the trace id */
+	if ( command != NULL && *command == '@' )
+		command += strcspn( command, " \t" );
+	if ( command == NULL )
+		return -1;
+
+	cmd.tokeniser = mvcp_tokeniser_init_inline( &tokeniser );
+	if ( melted_command_tokenise( &cmd, command ) > 1 && dispatch_lookup( cmd.argv[ 0 ].string, &entry ) && entry.is_unit )
+	{
+		unit = melted_command_parse_unit( &cmd, 1 );
+		*other = melted_local_other_unit( &entry, &cmd );
+	}
+	mvcp_tokeniser_close( cmd.tokeniser );
+
+	return unit;
+}
+
+/** Find the unit a command operates on - -1 for global commands and for
+	commands which aren't known.
+*/
+
+int melted_local_unit( char *command )
+{
+	int other = -1;
+	return melted_local_units( command, &other );
+}
+
+/** A session ending on a unit.
+*/
+
+typedef struct
+{
+	int unit;
+	void *session;
+}
+local_session;
+
+static void melted_local_end_session_operation( void *arg )
+{
+	local_session *ending = arg;
+	melted_unit unit = melted_acquire_unit( ending->unit );
+	if ( unit != NULL )
+		melted_unit_end_session( unit, ending->session );
+	melted_release_unit( unit );
+}
+
+/** Discard the batches a closed connection left open.
+*/
+
+void melted_local_end_session( void *session )
+{
+	int count = melted_count_units( );
+	int index = 0;
+
+	for ( index = 0; index < count; index ++ )
+	{
+		melted_unit unit = melted_acquire_unit( index );
+		if ( unit != NULL && unit->batching && unit->batch_session == session )
+		{
+			local_session ending = { index, session };
+			melted_scheduler_execute( index, melted_local_end_session_operation, &ending );
+		}
+		melted_release_unit( unit );
+	}
+}
+
+/** A command submitted without waiting for its response.
+*/
+
+typedef struct
+{
+	melted_local local;
+	char *command;
+	mvcp_response_callback callback;
+	void *data;
+	void *session;
+	int replicate;
+}
+local_submission;
+
+static void melted_local_submit_operation( void *arg )
+{
+	local_submission *submission = arg;
+	void *session = melted_unit_session( );
+	mvcp_response response = NULL;
+
+	melted_unit_set_session( submission->session );
+	melted_replica_suppress( !submission->replicate );
+	response = melted_local_execute( submission->local, submission->command );
+	melted_replica_suppress( 0 );
+	melted_unit_set_session( session );
+	submission->callback( submission->data, response );
+	free( submission->command );
+	free( submission );
+}
+
+/** Submit a command. A unit command is queued behind the unit's other
+	commands and the callback is called from its worker, other commands run
+	before this returns.
+*/
+
+static int melted_local_submit( melted_local local, char *command, mvcp_response_callback callback, void *data )
+{
+	local_submission *submission = malloc( sizeof( local_submission ) );
+	int other = -1;
+	int unit = -1;
+
+	if ( submission == NULL || ( submission->command = strdup( command ) ) == NULL )
+	{
+		free( submission );
+		return -1;
+	}
+
+	submission->local = local;
+	submission->callback = callback;
+	submission->data = data;
+	submission->session = melted_unit_session( );
+	submission->replicate = melted_replica_wanted( );
+	unit = melted_local_units( command, &other );
+	melted_scheduler_submit_pair( unit, other, melted_local_submit_operation, submission );
+
+	return 0;
+}
+
 static mvcp_response melted_local_receive( melted_local local, char *command, char *doc )
 {
 	command_argument_t cmd;
+	mvcp_tokeniser_t tokeniser;
 	cmd.parser = local->parser;
 	cmd.response = mvcp_response_init( );
-	cmd.tokeniser = mvcp_tokeniser_init( );
+	cmd.tokeniser = mvcp_tokeniser_init_inline( &tokeniser );
 	cmd.command = command;
 	cmd.unit = -1;
 	cmd.argument = NULL;
 	cmd.root_dir = local->root_dir;
+	cmd.argc = 0;
 
 	/* Set the default error */
 	melted_command_set_error( &cmd, RESPONSE_SUCCESS );
 
 	/* Parse the command */
-	if ( mvcp_tokeniser_parse_new( cmd.tokeniser, command, " " ) > 0 )
+	if ( melted_command_tokenise( &cmd, command ) > 0 )
 	{
-		int index = 0;
 		int position = 1;
 
-		/* Strip quotes from all tokens */
-		for ( index = 0; index < mvcp_tokeniser_count( cmd.tokeniser ); index ++ )
-			mvcp_util_strip( mvcp_tokeniser_get_string( cmd.tokeniser, index ), '\"' );
-
 		cmd.unit = melted_command_parse_unit( &cmd, position );
 		if ( cmd.unit == -1 )
 			melted_command_set_error( &cmd, RESPONSE_MISSING_ARG );
 		position ++;
 
-		melted_receive( &cmd, doc );
+		{
+			local_job job = { NULL, &cmd, NULL, doc, RESPONSE_SUCCESS, 0, melted_replica_wanted( ), melted_unit_session( ) };
+			melted_scheduler_execute( cmd.unit, melted_local_receive_operation, &job );
+		}
 		melted_command_set_error( &cmd, RESPONSE_SUCCESS );
 
 		free( cmd.argument );
@@ -545,33 +959,33 @@ static mvcp_response melted_local_receive( melted_local local, char *command, ch
 static mvcp_response melted_local_push( melted_local local, char *command, mlt_service service )
 {
 	command_argument_t cmd;
+	mvcp_tokeniser_t tokeniser;
 	cmd.parser = local->parser;
 	cmd.response = mvcp_response_init( );
-	cmd.tokeniser = mvcp_tokeniser_init( );
+	cmd.tokeniser = mvcp_tokeniser_init_inline( &tokeniser );
 	cmd.command = command;
 	cmd.unit = -1;
 	cmd.argument = NULL;
 	cmd.root_dir = local->root_dir;
+	cmd.argc = 0;
 
 	/* Set the default error */
 	melted_command_set_error( &cmd, RESPONSE_SUCCESS );
 
 	/* Parse the command */
-	if ( mvcp_tokeniser_parse_new( cmd.tokeniser, command, " " ) > 0 )
+	if ( melted_command_tokenise( &cmd, command ) > 0 )
 	{
-		int index = 0;
 		int position = 1;
 
-		/* Strip quotes from all tokens */
-		for ( index = 0; index < mvcp_tokeniser_count( cmd.tokeniser ); index ++ )
-			mvcp_util_strip( mvcp_tokeniser_get_string( cmd.tokeniser, index ), '\"' );
-
 		cmd.unit = melted_command_parse_unit( &cmd, position );
 		if ( cmd.unit == -1 )
 			melted_command_set_error( &cmd, RESPONSE_MISSING_ARG );
 		position ++;
 
-		melted_push( &cmd, service );
+		{
+			local_job job = { NULL, &cmd, service, NULL, RESPONSE_SUCCESS, 0, melted_replica_wanted( ), melted_unit_session( ) };
+			melted_scheduler_execute( cmd.unit, melted_local_push_operation, &job );
+		}
 		melted_command_set_error( &cmd, RESPONSE_SUCCESS );
 
 		free( cmd.argument );
@@ -587,6 +1001,9 @@ static mvcp_response melted_local_push( melted_local local, char *command, mlt_s
 
 static void melted_local_close( melted_local local )
 {
+	melted_cue_close( );
+	melted_loader_close( );
+	melted_scheduler_close( );
 	melted_delete_all_units();
 #ifdef linux
 	//pthread_kill_other_threads_np();
@@ -23,6 +23,7 @@
 
 /* Application header files */
 #include <mvcp/mvcp_parser.h>
+#include "melted_connection.h"
 
 #ifdef __cplusplus
 extern "C"
@@ -33,6 +34,9 @@ extern "C"
 */
 
 extern mvcp_parser melted_parser_init_local( );
+extern int melted_local_unit( char * );
+extern void melted_local_end_session( void * );
+extern int melted_local_register( const char *, response_codes ( * )( command_argument ), int, arguments_types, const char * );
 
 #ifdef __cplusplus
 }
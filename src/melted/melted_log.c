@@ -21,12 +21,52 @@
 #include <stdarg.h>
 #include <syslog.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/time.h>
+#include <pthread.h>
 
 #include "melted_log.h"
 
+/** Number of messages the asynchronous ring holds - a power of 2.
+*/
+
+#define MELTED_LOG_RING 1024
+
+/** Longest message kept by the asynchronous ring.
+*/
+
+#define MELTED_LOG_LINE 512
+
+/** A slot of the ring. The sequence is the position a producer may claim
+	the slot at, or that position plus one once the message is complete.
+*/
+
+typedef struct
+{
+	volatile unsigned int sequence;
+	int priority;
+	char text[ MELTED_LOG_LINE ];
+}
+log_slot;
+
 static int log_output = log_stderr;
 static int threshold = LOG_DEBUG;
 
+static log_slot *ring = NULL;
+static volatile unsigned int ring_head = 0;
+static unsigned int ring_tail = 0;
+static volatile unsigned int written = 0;
+static volatile unsigned int dropped = 0;
+static unsigned int reported = 0;
+static volatile int writer_running = 0;
+static volatile int writer_waiting = 0;
+static pthread_t writer;
+static pthread_mutex_t writer_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t writer_cond = PTHREAD_COND_INITIALIZER;
+
 void melted_log_init( enum log_output method, int new_threshold )
 {
 	log_output = method;
@@ -36,13 +76,190 @@ void melted_log_init( enum log_output method, int new_threshold )
 
 }
 
+/** Write a formatted message to the configured output.
+*/
+
+static void log_write( int priority, const char *text )
+{
+	if ( log_output == log_syslog )
+		syslog( priority, "%s", text );
+	else
+		fprintf( stderr, "(%d) %s\n", priority, text );
+}
+
+/** Claim a slot, fill it and publish it. Any number of threads may do this at
+	once without taking a lock - a full ring drops the message rather than
+	waiting for the writer.
+*/
+
+static void log_enqueue( int priority, const char *format, va_list list )
+{
+	unsigned int position = ring_head;
+
+	while ( 1 )
+	{
+		log_slot *slot = &ring[ position & ( MELTED_LOG_RING - 1 ) ];
+		int difference = ( int )( slot->sequence - position );
+
+		if ( difference == 0 )
+		{
+			unsigned int claimed = __sync_val_compare_and_swap( &ring_head, position, position + 1 );
+			if ( claimed == position )
+			{
+				slot->priority = priority;
+				vsnprintf( slot->text, sizeof( slot->text ), format, list );
+				__sync_synchronize( );
+				slot->sequence = position + 1;
+				__sync_synchronize( );
+				break;
+			}
+			position = claimed;
+		}
+		else if ( difference < 0 )
+		{
+			__sync_fetch_and_add( &dropped, 1 );
+			return;
+		}
+		else
+		{
+			position = ring_head;
+		}
+	}
+
+	if ( writer_waiting )
+	{
+		pthread_mutex_lock( &writer_mutex );
+		pthread_cond_signal( &writer_cond );
+		pthread_mutex_unlock( &writer_mutex );
+	}
+}
+
+/** Write every complete message in the ring. Returns the number written.
+*/
+
+static int log_drain( )
+{
+	int count = 0;
+
+	while ( 1 )
+	{
+		log_slot *slot = &ring[ ring_tail & ( MELTED_LOG_RING - 1 ) ];
+		if ( slot->sequence != ring_tail + 1 )
+			break;
+		__sync_synchronize( );
+		log_write( slot->priority, slot->text );
+		__sync_synchronize( );
+		slot->sequence = ring_tail + MELTED_LOG_RING;
+		ring_tail ++;
+		count ++;
+	}
+
+	if ( count > 0 )
+		__sync_fetch_and_add( &written, count );
+
+	return count;
+}
+
+/** The writer thread - sleeps until messages arrive, reporting how many were
+	dropped since it last looked.
+*/
+
+static void *log_writer( void *arg )
+{
+	while ( 1 )
+	{
+		int running = writer_running;
+		unsigned int lost = dropped;
+
+		log_drain( );
+
+		if ( lost != reported )
+		{
+			char text[ 128 ];
+			snprintf( text, sizeof( text ), "log overflow - %u messages dropped", lost - reported );
+			log_write( LOG_WARNING, text );
+			reported = lost;
+		}
+
+		if ( !running )
+			break;
+
+		pthread_mutex_lock( &writer_mutex );
+		writer_waiting = 1;
+		__sync_synchronize( );
+		if ( writer_running && ring[ ring_tail & ( MELTED_LOG_RING - 1 ) ].sequence != ring_tail + 1 )
+		{
+			// Timed so that a missed wake up can only delay the messages
+			struct timeval now;
+			struct timespec until;
+			gettimeofday( &now, NULL );
+			until.tv_sec = now.tv_sec + ( now.tv_usec >= 900000 );
+			until.tv_nsec = ( ( now.tv_usec + 100000 ) % 1000000 ) * 1000;
+			pthread_cond_timedwait( &writer_cond, &writer_mutex, &until );
+		}
+		writer_waiting = 0;
+		pthread_mutex_unlock( &writer_mutex );
+	}
+
+	return NULL;
+}
+
+/** Move the writing of messages to a dedicated thread, or with 0 write any
+	messages still queued and return to writing on the caller's thread.
+*/
+
+void melted_log_async( int enabled )
+{
+	if ( enabled && !writer_running )
+	{
+		if ( ring == NULL )
+		{
+			unsigned int index = 0;
+			log_slot *slots = calloc( MELTED_LOG_RING, sizeof( log_slot ) );
+			if ( slots == NULL )
+				return;
+			for ( index = 0; index < MELTED_LOG_RING; index ++ )
+				slots[ index ].sequence = index;
+			ring = slots;
+		}
+		writer_running = 1;
+		if ( pthread_create( &writer, NULL, log_writer, NULL ) != 0 )
+			writer_running = 0;
+	}
+	else if ( !enabled && writer_running )
+	{
+		pthread_mutex_lock( &writer_mutex );
+		writer_running = 0;
+		pthread_cond_signal( &writer_cond );
+		pthread_mutex_unlock( &writer_mutex );
+		pthread_join( writer, NULL );
+		// Messages logged from here on are written directly, but the ring
+		// is kept for any thread still in the middle of queuing one and for
+		// the writer if it is started again
+	}
+}
+
+/** Report the number of messages written and dropped by the asynchronous
+	writer.
+*/
+
+void melted_log_counts( unsigned int *count, unsigned int *lost )
+{
+	*count = written;
+	*lost = dropped;
+}
+
 void melted_log( int priority, const char *format, ... )
 {
 	va_list list;
 	va_start( list, format );
 	if ( LOG_PRI(priority) <= threshold )
 	{
-		if ( log_output == log_syslog )
+		if ( writer_running )
+		{
+			log_enqueue( priority, format, list );
+		}
+		else if ( log_output == log_syslog )
 		{
 				vsyslog( priority, format, list );
 		}
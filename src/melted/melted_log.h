@@ -34,6 +34,8 @@ enum log_output {
 };
 
 void melted_log_init( enum log_output method, int threshold );
+void melted_log_async( int enabled );
+void melted_log_counts( unsigned int *written, unsigned int *dropped );
 void melted_log( int priority, const char *format, ... );
 
 #ifdef __cplusplus
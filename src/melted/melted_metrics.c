@@ -0,0 +1,510 @@
+/*
+ * melted_metrics.c -- Server Metrics Registry
+ * Copyright (C) 2002-2015 Meltytech, LLC
+ * Author: Charles Yates <charles.yates@pandora.be>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+/* System header files */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <time.h>
+#include <pthread.h>
+
+/* Application header files */
+#include "melted_metrics.h"
+#include "melted_commands.h"
+#include "melted_log.h"
+
+/** A latency histogram.
+*/
+
+typedef struct
+{
+	int64_t buckets[ MELTED_METRICS_BUCKETS ];
+	int64_t count;
+	int64_t total;
+	int64_t max;
+}
+metrics_histogram;
+
+/** The timings of one command name.
+*/
+
+typedef struct
+{
+	char name[ 16 ];
+	metrics_histogram phases[ metrics_phases ];
+}
+metrics_command;
+
+/** A gap in the frames shown by a unit.
+*/
+
+typedef struct
+{
+	time_t when;
+	int frames;
+	int position;
+	char clip[ 256 ];
+}
+metrics_drop;
+
+/** The producer open and frame timings of one unit.
+*/
+
+typedef struct
+{
+	metrics_histogram open;
+	int64_t cached;
+	int64_t last;
+	metrics_histogram latency;
+	metrics_histogram jitter;
+	int64_t frames;
+	int64_t late;
+	int64_t dropped;
+	metrics_drop drops[ MELTED_METRICS_DROPS ];
+	int drops_count;
+}
+metrics_unit;
+
+static const char *phase_names[] = { "parse", "execute", "send" };
+
+static pthread_mutex_t metrics_mutex = PTHREAD_MUTEX_INITIALIZER;
+static metrics_command commands[ MELTED_METRICS_COMMANDS + 1 ];
+static int commands_count = 0;
+static metrics_unit *units[ MELTED_MAX_UNITS ];
+static int connections = 0;
+static int64_t connections_total = 0;
+static int subscribers = 0;
+static int queued = 0;
+static int queued_peak = 0;
+static int64_t overflows = 0;
+
+/** The current time in microseconds from an arbitrary start.
+*/
+
+int64_t melted_metrics_now( )
+{
+	struct timespec now;
+	clock_gettime( CLOCK_MONOTONIC, &now );
+	return ( int64_t )now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+/** Add a time to a histogram.
+*/
+
+static void metrics_histogram_add( metrics_histogram *histogram, int64_t elapsed )
+{
+	int bucket = 0;
+
+	if ( elapsed < 0 )
+		elapsed = 0;
+	while ( bucket < MELTED_METRICS_BUCKETS - 1 && elapsed >= ( ( int64_t )1 << bucket ) )
+		bucket ++;
+
+	histogram->buckets[ bucket ] ++;
+	histogram->count ++;
+	histogram->total += elapsed;
+	if ( elapsed > histogram->max )
+		histogram->max = elapsed;
+}
+
+/** Estimate a percentile of a histogram as the upper bound of the bucket it
+	falls in.
+*/
+
+static int64_t metrics_histogram_percentile( metrics_histogram *histogram, int percent )
+{
+	int64_t target = ( histogram->count * percent + 99 ) / 100;
+	int64_t seen = 0;
+	int bucket = 0;
+
+	for ( bucket = 0; bucket < MELTED_METRICS_BUCKETS - 1; bucket ++ )
+	{
+		seen += histogram->buckets[ bucket ];
+		if ( seen >= target )
+			break;
+	}
+
+	if ( bucket == MELTED_METRICS_BUCKETS - 1 || ( ( int64_t )1 << bucket ) > histogram->max )
+		return histogram->max;
+	return ( int64_t )1 << bucket;
+}
+
+/** Locate the entry for the first word of a command, creating it if asked
+	and there is room. Must be called with the mutex held.
+*/
+
+static metrics_command *metrics_command_find( const char *command, int create )
+{
+	char name[ 16 ];
+	int length = 0;
+	int index = 0;
+
+	while ( length < sizeof( name ) - 1 && command[ length ] != '\0' && !isspace( ( unsigned char )command[ length ] ) )
+	{
+		name[ length ] = toupper( ( unsigned char )command[ length ] );
+		length ++;
+	}
+	name[ length ] = '\0';
+
+	for ( index = 0; index < commands_count; index ++ )
+		if ( !strcmp( commands[ index ].name, name ) )
+			return &commands[ index ];
+
+	if ( create && commands_count < MELTED_METRICS_COMMANDS )
+	{
+		strcpy( commands[ commands_count ].name, name );
+		return &commands[ commands_count ++ ];
+	}
+
+	strcpy( commands[ MELTED_METRICS_COMMANDS ].name, "OTHER" );
+	return &commands[ MELTED_METRICS_COMMANDS ];
+}
+
+/** Record the time taken to parse and execute a command.
+*/
+
+void melted_metrics_command( const char *command, int64_t parse, int64_t execute )
+{
+	metrics_command *entry = NULL;
+	pthread_mutex_lock( &metrics_mutex );
+	entry = metrics_command_find( command, 1 );
+	metrics_histogram_add( &entry->phases[ metrics_parse ], parse );
+	metrics_histogram_add( &entry->phases[ metrics_execute ], execute );
+	pthread_mutex_unlock( &metrics_mutex );
+}
+
+/** Record the time taken to send the response to a command.
+*/
+
+void melted_metrics_send( const char *command, int64_t elapsed )
+{
+	pthread_mutex_lock( &metrics_mutex );
+	metrics_histogram_add( &metrics_command_find( command, 0 )->phases[ metrics_send ], elapsed );
+	pthread_mutex_unlock( &metrics_mutex );
+}
+
+/** Record a client connection being opened or closed.
+*/
+
+void melted_metrics_connection( int opened )
+{
+	pthread_mutex_lock( &metrics_mutex );
+	connections += opened ? 1 : -1;
+	if ( opened )
+		connections_total ++;
+	pthread_mutex_unlock( &metrics_mutex );
+}
+
+/** Record a STATUS subscriber starting or stopping.
+*/
+
+void melted_metrics_subscriber( int subscribed )
+{
+	pthread_mutex_lock( &metrics_mutex );
+	subscribers += subscribed ? 1 : -1;
+	pthread_mutex_unlock( &metrics_mutex );
+}
+
+/** Record the number of status changes waiting to be sent to a subscriber.
+	The caller holds the depth it last reported, which 0 withdraws.
+*/
+
+void melted_metrics_queue( int *depth, int value )
+{
+	pthread_mutex_lock( &metrics_mutex );
+	queued += value - *depth;
+	if ( value > queued_peak )
+		queued_peak = value;
+	*depth = value;
+	pthread_mutex_unlock( &metrics_mutex );
+}
+
+/** Record a subscriber falling so far behind that every unit is resent.
+*/
+
+void melted_metrics_overflow( )
+{
+	pthread_mutex_lock( &metrics_mutex );
+	overflows ++;
+	pthread_mutex_unlock( &metrics_mutex );
+}
+
+/** Locate the entry of a unit, creating it on first use. Must be called
+	with the mutex held.
+*/
+
+static metrics_unit *metrics_unit_find( int unit )
+{
+	if ( unit < 0 || unit >= MELTED_MAX_UNITS )
+		return NULL;
+	if ( units[ unit ] == NULL )
+		units[ unit ] = calloc( 1, sizeof( metrics_unit ) );
+	return units[ unit ];
+}
+
+/** Record the time taken to open a producer for a unit.
+*/
+
+void melted_metrics_open( int unit, int64_t elapsed, int cached )
+{
+	metrics_unit *entry = NULL;
+
+	pthread_mutex_lock( &metrics_mutex );
+	if ( ( entry = metrics_unit_find( unit ) ) != NULL )
+	{
+		metrics_histogram_add( &entry->open, elapsed );
+		entry->cached += cached != 0;
+		entry->last = elapsed;
+	}
+	pthread_mutex_unlock( &metrics_mutex );
+}
+
+/** Record a frame shown by a unit with the time since it was rendered and
+	since the previous frame, given the frame period of the unit. The
+	interval is 0 for the first frame after playback starts. A frame shown
+	more than half a period late is counted as late.
+*/
+
+void melted_metrics_frame( int unit, int64_t latency, int64_t interval, int64_t period )
+{
+	metrics_unit *entry = NULL;
+
+	pthread_mutex_lock( &metrics_mutex );
+	if ( ( entry = metrics_unit_find( unit ) ) != NULL )
+	{
+		entry->frames ++;
+		if ( latency >= 0 )
+			metrics_histogram_add( &entry->latency, latency );
+		if ( interval > 0 )
+		{
+			metrics_histogram_add( &entry->jitter, interval > period ? interval - period : period - interval );
+			if ( interval * 2 > period * 3 )
+				entry->late ++;
+		}
+	}
+	pthread_mutex_unlock( &metrics_mutex );
+}
+
+/** Record frames which were never shown, with the clip and position shown
+	after the gap.
+*/
+
+void melted_metrics_drop( int unit, const char *clip, int position, int frames )
+{
+	metrics_unit *entry = NULL;
+
+	pthread_mutex_lock( &metrics_mutex );
+	if ( ( entry = metrics_unit_find( unit ) ) != NULL )
+	{
+		metrics_drop *drop = &entry->drops[ entry->drops_count ++ % MELTED_METRICS_DROPS ];
+		entry->dropped += frames;
+		drop->when = time( NULL );
+		drop->frames = frames;
+		drop->position = position;
+		snprintf( drop->clip, sizeof( drop->clip ), "%s", clip != NULL ? clip : "" );
+	}
+	pthread_mutex_unlock( &metrics_mutex );
+}
+
+/** Write a histogram in the Prometheus text format, in seconds.
+*/
+
+static void metrics_prometheus_histogram( mvcp_response response, const char *name, const char *labels, metrics_histogram *histogram )
+{
+	int64_t cumulative = 0;
+	int last = MELTED_METRICS_BUCKETS - 2;
+	int bucket = 0;
+
+	// Empty buckets above the longest time add nothing
+	while ( last > 0 && ( ( int64_t )1 << last ) > histogram->max * 2 )
+		last --;
+
+	for ( bucket = 0; bucket <= last; bucket ++ )
+	{
+		cumulative += histogram->buckets[ bucket ];
+		mvcp_response_printf( response, 256, "%s_bucket{%s,le=\"%g\"} %lld\n", name, labels,
+			( ( int64_t )1 << bucket ) / 1000000.0, ( long long )cumulative );
+	}
+	mvcp_response_printf( response, 256, "%s_bucket{%s,le=\"+Inf\"} %lld\n", name, labels, ( long long )histogram->count );
+	mvcp_response_printf( response, 256, "%s_sum{%s} %g\n", name, labels, histogram->total / 1000000.0 );
+	mvcp_response_printf( response, 256, "%s_count{%s} %lld\n", name, labels, ( long long )histogram->count );
+}
+
+/** Write a summary of a histogram as count, total, p50, p90, p99 and max
+	in microseconds.
+*/
+
+static void metrics_summary( char *text, size_t size, metrics_histogram *histogram )
+{
+	snprintf( text, size, "%lld %lld %lld %lld %lld %lld", ( long long )histogram->count, ( long long )histogram->total,
+		( long long )metrics_histogram_percentile( histogram, 50 ),
+		( long long )metrics_histogram_percentile( histogram, 90 ),
+		( long long )metrics_histogram_percentile( histogram, 99 ),
+		( long long )histogram->max );
+}
+
+/** Write the summary of a unit. Must be called with the mutex held.
+*/
+
+static void metrics_unit_summary( mvcp_response response, int unit, metrics_unit *entry )
+{
+	char text[ 256 ];
+
+	if ( entry->open.count > 0 )
+	{
+		metrics_summary( text, sizeof( text ), &entry->open );
+		mvcp_response_printf( response, 512, "open U%d %s %lld %lld\n", unit, text, ( long long )entry->cached, ( long long )entry->last );
+	}
+	if ( entry->frames > 0 )
+	{
+		mvcp_response_printf( response, 512, "frames U%d %lld %lld %lld\n", unit, ( long long )entry->frames, ( long long )entry->late, ( long long )entry->dropped );
+		metrics_summary( text, sizeof( text ), &entry->latency );
+		mvcp_response_printf( response, 512, "latency U%d %s\n", unit, text );
+		metrics_summary( text, sizeof( text ), &entry->jitter );
+		mvcp_response_printf( response, 512, "jitter U%d %s\n", unit, text );
+	}
+}
+
+/** Write every metric to the response, one per line, either as a summary
+	or in the Prometheus text exposition format.
+*/
+
+void melted_metrics_report( mvcp_response response, int prometheus )
+{
+	char text[ 256 ];
+	unsigned int logged = 0;
+	unsigned int dropped = 0;
+	int index = 0;
+	int phase = 0;
+
+	melted_log_counts( &logged, &dropped );
+
+	pthread_mutex_lock( &metrics_mutex );
+
+	if ( prometheus )
+	{
+		mvcp_response_printf( response, 256, "# TYPE melted_connections gauge\nmelted_connections %d\n", connections );
+		mvcp_response_printf( response, 256, "# TYPE melted_connections_total counter\nmelted_connections_total %lld\n", ( long long )connections_total );
+		mvcp_response_printf( response, 256, "# TYPE melted_status_subscribers gauge\nmelted_status_subscribers %d\n", subscribers );
+		mvcp_response_printf( response, 256, "# TYPE melted_status_queued gauge\nmelted_status_queued %d\n", queued );
+		mvcp_response_printf( response, 256, "# TYPE melted_status_queued_peak gauge\nmelted_status_queued_peak %d\n", queued_peak );
+		mvcp_response_printf( response, 256, "# TYPE melted_status_overflows_total counter\nmelted_status_overflows_total %lld\n", ( long long )overflows );
+		mvcp_response_printf( response, 256, "# TYPE melted_log_written_total counter\nmelted_log_written_total %u\n", logged );
+		mvcp_response_printf( response, 256, "# TYPE melted_log_dropped_total counter\nmelted_log_dropped_total %u\n", dropped );
+		mvcp_response_printf( response, 256, "# TYPE melted_command_seconds histogram\n" );
+		for ( index = 0; index <= MELTED_METRICS_COMMANDS; index ++ )
+		{
+			for ( phase = 0; phase < metrics_phases; phase ++ )
+			{
+				if ( commands[ index ].phases[ phase ].count == 0 )
+					continue;
+				snprintf( text, sizeof( text ), "command=\"%s\",phase=\"%s\"", commands[ index ].name, phase_names[ phase ] );
+				metrics_prometheus_histogram( response, "melted_command_seconds", text, &commands[ index ].phases[ phase ] );
+			}
+		}
+		mvcp_response_printf( response, 256, "# TYPE melted_producer_open_seconds histogram\n" );
+		for ( index = 0; index < MELTED_MAX_UNITS; index ++ )
+		{
+			if ( units[ index ] == NULL )
+				continue;
+			snprintf( text, sizeof( text ), "unit=\"U%d\"", index );
+			metrics_prometheus_histogram( response, "melted_producer_open_seconds", text, &units[ index ]->open );
+		}
+		mvcp_response_printf( response, 256, "# TYPE melted_frame_latency_seconds histogram\n" );
+		for ( index = 0; index < MELTED_MAX_UNITS; index ++ )
+		{
+			if ( units[ index ] == NULL || units[ index ]->frames == 0 )
+				continue;
+			snprintf( text, sizeof( text ), "unit=\"U%d\"", index );
+			metrics_prometheus_histogram( response, "melted_frame_latency_seconds", text, &units[ index ]->latency );
+		}
+		mvcp_response_printf( response, 256, "# TYPE melted_frame_jitter_seconds histogram\n" );
+		for ( index = 0; index < MELTED_MAX_UNITS; index ++ )
+		{
+			if ( units[ index ] == NULL || units[ index ]->frames == 0 )
+				continue;
+			snprintf( text, sizeof( text ), "unit=\"U%d\"", index );
+			metrics_prometheus_histogram( response, "melted_frame_jitter_seconds", text, &units[ index ]->jitter );
+		}
+		mvcp_response_printf( response, 256, "# TYPE melted_frames_total counter\n# TYPE melted_frames_late_total counter\n# TYPE melted_frames_dropped_total counter\n" );
+		for ( index = 0; index < MELTED_MAX_UNITS; index ++ )
+		{
+			if ( units[ index ] == NULL || units[ index ]->frames == 0 )
+				continue;
+			mvcp_response_printf( response, 512, "melted_frames_total{unit=\"U%d\"} %lld\nmelted_frames_late_total{unit=\"U%d\"} %lld\nmelted_frames_dropped_total{unit=\"U%d\"} %lld\n",
+				index, ( long long )units[ index ]->frames, index, ( long long )units[ index ]->late, index, ( long long )units[ index ]->dropped );
+		}
+	}
+	else
+	{
+		mvcp_response_printf( response, 256, "connections %d %lld\n", connections, ( long long )connections_total );
+		mvcp_response_printf( response, 256, "subscribers %d %d %d %lld\n", subscribers, queued, queued_peak, ( long long )overflows );
+		mvcp_response_printf( response, 256, "log %u %u\n", logged, dropped );
+		for ( index = 0; index <= MELTED_METRICS_COMMANDS; index ++ )
+		{
+			for ( phase = 0; phase < metrics_phases; phase ++ )
+			{
+				if ( commands[ index ].phases[ phase ].count == 0 )
+					continue;
+				metrics_summary( text, sizeof( text ), &commands[ index ].phases[ phase ] );
+				mvcp_response_printf( response, 512, "command %s %s %s\n", commands[ index ].name, phase_names[ phase ], text );
+			}
+		}
+		for ( index = 0; index < MELTED_MAX_UNITS; index ++ )
+		{
+			if ( units[ index ] == NULL )
+				continue;
+			metrics_unit_summary( response, index, units[ index ] );
+		}
+	}
+
+	pthread_mutex_unlock( &metrics_mutex );
+}
+
+/** Report the metrics of a single unit, followed by its recent drops.
+	Returns non-zero if nothing has been recorded for the unit.
+*/
+
+int melted_metrics_report_unit( mvcp_response response, int unit )
+{
+	metrics_unit *entry = NULL;
+	int index = 0;
+
+	pthread_mutex_lock( &metrics_mutex );
+
+	if ( unit >= 0 && unit < MELTED_MAX_UNITS )
+		entry = units[ unit ];
+
+	if ( entry != NULL )
+	{
+		int count = entry->drops_count < MELTED_METRICS_DROPS ? entry->drops_count : MELTED_METRICS_DROPS;
+		metrics_unit_summary( response, unit, entry );
+		for ( index = entry->drops_count - count; index < entry->drops_count; index ++ )
+		{
+			metrics_drop *drop = &entry->drops[ index % MELTED_METRICS_DROPS ];
+			mvcp_response_printf( response, 512, "drop U%d %ld %d %d \"%s\"\n", unit, ( long )drop->when, drop->frames, drop->position, drop->clip );
+		}
+	}
+
+	pthread_mutex_unlock( &metrics_mutex );
+
+	return entry == NULL;
+}
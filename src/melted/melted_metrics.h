@@ -0,0 +1,79 @@
+/*
+ * melted_metrics.h -- Server Metrics Registry
+ * Copyright (C) 2002-2015 Meltytech, LLC
+ * Author: Charles Yates <charles.yates@pandora.be>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#ifndef _MELTED_METRICS_H_
+#define _MELTED_METRICS_H_
+
+#include <stdint.h>
+#include <mvcp/mvcp_response.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+/** The phases of a command which are timed separately.
+*/
+
+typedef enum
+{
+	metrics_parse,
+	metrics_execute,
+	metrics_send,
+	metrics_phases
+}
+melted_metrics_phase;
+
+/** Number of latency buckets - bucket n holds times below 2^n microseconds
+	and the last holds everything longer.
+*/
+
+#define MELTED_METRICS_BUCKETS 24
+
+/** Number of distinct command names recorded before the rest are counted
+	as OTHER. Names are only entered by commands which were executed, so a
+	client sending garbage can't fill the table.
+*/
+
+#define MELTED_METRICS_COMMANDS 64
+
+/** Number of recent drops remembered for each unit.
+*/
+
+#define MELTED_METRICS_DROPS 16
+
+extern int64_t melted_metrics_now( void );
+extern void melted_metrics_command( const char *command, int64_t parse, int64_t execute );
+extern void melted_metrics_send( const char *command, int64_t elapsed );
+extern void melted_metrics_connection( int opened );
+extern void melted_metrics_subscriber( int subscribed );
+extern void melted_metrics_queue( int *depth, int value );
+extern void melted_metrics_overflow( void );
+extern void melted_metrics_open( int unit, int64_t elapsed, int cached );
+extern void melted_metrics_frame( int unit, int64_t latency, int64_t interval, int64_t period );
+extern void melted_metrics_drop( int unit, const char *clip, int position, int frames );
+extern void melted_metrics_report( mvcp_response response, int prometheus );
+extern int melted_metrics_report_unit( mvcp_response response, int unit );
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,376 @@
+/*
+ * melted_probe.c -- Persistent Media Probe Cache
+ * Copyright (C) 2002-2015 Meltytech, LLC
+ * Author: Charles Yates <charles.yates@pandora.be>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+/* System header files */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/* Application header files */
+#include "melted_probe.h"
+#include "melted_log.h"
+
+/** File identification - the version changes with the record layout.
+*/
+
+#define PROBE_MAGIC "MLTPROBE"
+#define PROBE_VERSION 2
+
+/** Longest resource path which is cached, and how far a lookup searches
+	from the slot a path hashes to.
+*/
+
+#define PROBE_PATH 512
+#define PROBE_DISTANCE 16
+
+/** Header at the start of the file.
+*/
+
+typedef struct
+{
+	char magic[ 8 ];
+	uint32_t version;
+	uint32_t record;
+	uint32_t slots;
+	uint32_t used;
+}
+probe_header;
+
+/** A cached resource, valid while the file keeps its modification time, to
+	the nanosecond, and size. The path is stored with its length and isn't
+	terminated - a length of 0 marks a free slot.
+*/
+
+typedef struct
+{
+	uint32_t hash;
+	uint32_t length;
+	int64_t modified;
+	int64_t nanoseconds;
+	int64_t size;
+	char path[ PROBE_PATH ];
+	melted_probe_t probe;
+}
+probe_record;
+
+static pthread_mutex_t probe_mutex = PTHREAD_MUTEX_INITIALIZER;
+static probe_header *probe_map = NULL;
+static probe_record *probe_records = NULL;
+static size_t probe_length = 0;
+static unsigned int probe_hits = 0;
+static unsigned int probe_misses = 0;
+
+/** Hash a path.
+*/
+
+static uint32_t probe_hash( const char *path )
+{
+	uint32_t hash = 2166136261u;
+	while ( *path )
+		hash = ( hash ^ ( unsigned char )*path ++ ) * 16777619u;
+	return hash;
+}
+
+/** Identify the current state of a file - returns non-zero if the resource
+	isn't a file which can be cached.
+*/
+
+static int probe_identify( const char *resource, int64_t *modified, int64_t *nanoseconds, int64_t *size )
+{
+	struct stat info;
+	if ( *resource == '\0' || strlen( resource ) > PROBE_PATH || stat( resource, &info ) != 0 || !S_ISREG( info.st_mode ) )
+		return -1;
+	*modified = ( int64_t )info.st_mtime;
+#ifdef __APPLE__
+	*nanoseconds = ( int64_t )info.st_mtimespec.tv_nsec;
+#else
+	*nanoseconds = ( int64_t )info.st_mtim.tv_nsec;
+#endif
+	*size = ( int64_t )info.st_size;
+	return 0;
+}
+
+/** Find the record of a path - must be called with the mutex held. Returns
+	the record, or the slot it should go in with found cleared.
+*/
+
+static probe_record *probe_find( const char *path, uint32_t hash, int *found )
+{
+	uint32_t slots = ( probe_length - sizeof( probe_header ) ) / sizeof( probe_record );
+	size_t length = strlen( path );
+	probe_record *empty = NULL;
+	uint32_t distance = 0;
+
+	/* The slots are counted from the mapping, whatever the file claims. */
+	if ( probe_map->slots < slots )
+		slots = probe_map->slots;
+
+	*found = 0;
+	for ( distance = 0; distance < PROBE_DISTANCE && distance < slots; distance ++ )
+	{
+		probe_record *record = &probe_records[ ( hash + distance ) % slots ];
+		if ( record->length == 0 || record->length > PROBE_PATH )
+		{
+			if ( empty == NULL )
+				empty = record;
+		}
+		else if ( record->hash == hash && record->length == length && !memcmp( record->path, path, length ) )
+		{
+			*found = 1;
+			return record;
+		}
+	}
+
+	/* When every nearby slot is taken, the one the path hashes to is reused. */
+	return empty != NULL ? empty : &probe_records[ hash % slots ];
+}
+
+/** Describe an open producer.
+*/
+
+static void probe_describe( mlt_producer producer, melted_probe probe )
+{
+	mlt_properties properties = MLT_PRODUCER_PROPERTIES( producer );
+	int streams = mlt_properties_get_int( properties, "meta.media.nb_streams" );
+	char *service = mlt_properties_get( properties, "mlt_service" );
+	size_t used = 0;
+	int index = 0;
+
+	memset( probe, 0, sizeof( melted_probe_t ) );
+	if ( service != NULL )
+		snprintf( probe->service, sizeof( probe->service ), "%s", service );
+	probe->length = mlt_producer_get_length( producer );
+	probe->fps = mlt_producer_get_fps( producer );
+	probe->width = mlt_properties_get_int( properties, "meta.media.width" );
+	probe->height = mlt_properties_get_int( properties, "meta.media.height" );
+
+	for ( index = 0; index < streams; index ++ )
+	{
+		char key[ 64 ];
+		char *type = NULL;
+		char *codec = NULL;
+
+		snprintf( key, sizeof( key ), "meta.media.%d.stream.type", index );
+		type = mlt_properties_get( properties, key );
+		snprintf( key, sizeof( key ), "meta.media.%d.codec.name", index );
+		codec = mlt_properties_get( properties, key );
+
+		if ( type != NULL && !strcmp( type, "audio" ) && probe->channels == 0 )
+		{
+			snprintf( key, sizeof( key ), "meta.media.%d.codec.channels", index );
+			probe->channels = mlt_properties_get_int( properties, key );
+			snprintf( key, sizeof( key ), "meta.media.%d.codec.sample_rate", index );
+			probe->frequency = mlt_properties_get_int( properties, key );
+		}
+
+		if ( type != NULL && used < sizeof( probe->streams ) )
+			used += snprintf( probe->streams + used, sizeof( probe->streams ) - used, "%s%s:%s",
+							  used ? " " : "", type, codec != NULL ? codec : "unknown" );
+	}
+}
+
+/** Open the cache in the file at path, holding up to slots resources, or in
+	memory for the life of the server if path is NULL. A file written by
+	another version or with another size is started afresh. Returns non-zero
+	if the cache could not be opened.
+*/
+
+int melted_probe_init( const char *path, int slots )
+{
+	size_t length = 0;
+	void *map = MAP_FAILED;
+	int error = 0;
+	int fd = -1;
+
+	if ( slots <= 0 )
+		slots = 16384;
+	length = sizeof( probe_header ) + ( size_t )slots * sizeof( probe_record );
+
+	pthread_mutex_lock( &probe_mutex );
+
+	if ( probe_map == NULL )
+	{
+		if ( path != NULL && *path != '\0' )
+		{
+			struct stat info;
+			fd = open( path, O_RDWR | O_CREAT | O_CLOEXEC, 0644 );
+			if ( fd >= 0 && ( fstat( fd, &info ) != 0 || info.st_size != ( off_t )length ) && ftruncate( fd, length ) != 0 )
+			{
+				close( fd );
+				fd = -1;
+			}
+			if ( fd >= 0 )
+				map = mmap( NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0 );
+		}
+		else
+		{
+			map = mmap( NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0 );
+		}
+
+		if ( map != MAP_FAILED )
+		{
+			probe_map = map;
+			probe_records = ( probe_record * )( probe_map + 1 );
+			probe_length = length;
+			probe_hits = probe_misses = 0;
+			if ( memcmp( probe_map->magic, PROBE_MAGIC, 8 ) || probe_map->version != PROBE_VERSION ||
+				 probe_map->record != sizeof( probe_record ) || probe_map->slots != ( uint32_t )slots )
+			{
+				memset( map, 0, length );
+				memcpy( probe_map->magic, PROBE_MAGIC, 8 );
+				probe_map->version = PROBE_VERSION;
+				probe_map->record = sizeof( probe_record );
+				probe_map->slots = slots;
+			}
+			melted_log( LOG_NOTICE, "PROBE cache %s holds %u of %d resources", path != NULL && *path ? path : "in memory", probe_map->used, slots );
+		}
+		else
+		{
+			melted_log( LOG_ERR, "PROBE unable to open the cache %s: %s", path != NULL ? path : "", strerror( errno ) );
+			error = 1;
+		}
+
+		/* The mapping keeps the file open. */
+		if ( fd >= 0 )
+			close( fd );
+	}
+
+	pthread_mutex_unlock( &probe_mutex );
+
+	return error;
+}
+
+/** Look up a resource - returns 0 and fills probe if it is cached and the
+	file is unchanged since.
+*/
+
+int melted_probe_get( const char *resource, melted_probe probe )
+{
+	int64_t modified = 0;
+	int64_t nanoseconds = 0;
+	int64_t size = 0;
+	int error = -1;
+
+	if ( probe_map == NULL || probe_identify( resource, &modified, &nanoseconds, &size ) != 0 )
+		return error;
+
+	pthread_mutex_lock( &probe_mutex );
+	if ( probe_map != NULL )
+	{
+		int found = 0;
+		probe_record *record = probe_find( resource, probe_hash( resource ), &found );
+		if ( found && record->modified == modified && record->nanoseconds == nanoseconds && record->size == size )
+		{
+			memcpy( probe, &record->probe, sizeof( melted_probe_t ) );
+			probe_hits ++;
+			error = 0;
+		}
+		else
+		{
+			probe_misses ++;
+		}
+	}
+	pthread_mutex_unlock( &probe_mutex );
+
+	return error;
+}
+
+/** Record what an open producer tells about its resource.
+*/
+
+void melted_probe_put( const char *resource, mlt_producer producer )
+{
+	melted_probe_t probe;
+	int64_t modified = 0;
+	int64_t nanoseconds = 0;
+	int64_t size = 0;
+
+	if ( probe_map == NULL || producer == NULL || probe_identify( resource, &modified, &nanoseconds, &size ) != 0 )
+		return;
+
+	probe_describe( producer, &probe );
+
+	pthread_mutex_lock( &probe_mutex );
+	if ( probe_map != NULL )
+	{
+		uint32_t hash = probe_hash( resource );
+		int found = 0;
+		probe_record *record = probe_find( resource, hash, &found );
+
+		if ( !found && ( record->length == 0 || record->length > PROBE_PATH ) )
+			probe_map->used ++;
+
+		/* The length goes last so that a torn write never matches. */
+		record->length = 0;
+		record->hash = hash;
+		record->modified = modified;
+		record->nanoseconds = nanoseconds;
+		record->size = size;
+		memcpy( &record->probe, &probe, sizeof( melted_probe_t ) );
+		memcpy( record->path, resource, strlen( resource ) );
+		record->length = strlen( resource );
+	}
+	pthread_mutex_unlock( &probe_mutex );
+}
+
+/** Describe a resource from the cache, or by opening it with the profile
+	and caching the result. Returns non-zero if it can't be opened.
+*/
+
+int melted_probe_resource( const char *resource, mlt_profile profile, melted_probe probe )
+{
+	mlt_producer producer = NULL;
+
+	if ( melted_probe_get( resource, probe ) == 0 )
+		return 0;
+
+	producer = mlt_factory_producer( profile, NULL, resource );
+	if ( producer == NULL )
+		return -1;
+
+	probe_describe( producer, probe );
+	melted_probe_put( resource, producer );
+	mlt_producer_close( producer );
+
+	return 0;
+}
+
+/** Write the cache back and release it.
+*/
+
+void melted_probe_close( )
+{
+	pthread_mutex_lock( &probe_mutex );
+	if ( probe_map != NULL )
+	{
+		melted_log( LOG_NOTICE, "PROBE cache closed after %u hits and %u misses", probe_hits, probe_misses );
+		msync( probe_map, probe_length, MS_SYNC );
+		munmap( probe_map, probe_length );
+		probe_map = NULL;
+		probe_records = NULL;
+	}
+	pthread_mutex_unlock( &probe_mutex );
+}
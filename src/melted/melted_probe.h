@@ -0,0 +1,60 @@
+/*
+ * melted_probe.h -- Persistent Media Probe Cache
+ * Copyright (C) 2002-2015 Meltytech, LLC
+ * Author: Charles Yates <charles.yates@pandora.be>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#ifndef _MELTED_PROBE_H_
+#define _MELTED_PROBE_H_
+
+#include <stdint.h>
+#include <framework/mlt.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+/** What is known about a resource without opening it - the length is in
+	frames at fps, the frame rate of the profile it was opened with. This is
+	stored on disk as is.
+*/
+
+typedef struct
+{
+	char service[ 32 ];
+	int32_t length;
+	double fps;
+	int32_t width;
+	int32_t height;
+	int32_t channels;
+	int32_t frequency;
+	char streams[ 128 ];
+}
+melted_probe_t, *melted_probe;
+
+extern int melted_probe_init( const char *path, int slots );
+extern int melted_probe_get( const char *resource, melted_probe probe );
+extern void melted_probe_put( const char *resource, mlt_producer producer );
+extern int melted_probe_resource( const char *resource, mlt_profile profile, melted_probe probe );
+extern void melted_probe_close( void );
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
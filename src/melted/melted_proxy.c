@@ -0,0 +1,657 @@
+/*
+ * melted_proxy.c -- Multiplexing Proxy Parser
+ * Copyright (C) 2002-2015 Meltytech, LLC
+ * Author: Charles Yates <charles.yates@pandora.be>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+/* System header files */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+/* Application header files */
+#ifndef MVCP_EMBEDDED
+#include <framework/mlt.h>
+#endif
+#include <mvcp/mvcp_remote.h>
+#include <mvcp/mvcp_status.h>
+#include "melted_proxy.h"
+#include "melted_unit.h"
+#include "melted_log.h"
+
+/** The last LIST response of a unit and the generation it describes. After
+	a command which changes the unit is forwarded, nothing is answered
+	locally until a USTA has been answered upstream and the status stream
+	shows the same state - a status line alone may have been sent before the
+	command ran.
+*/
+
+typedef struct
+{
+	int generation;
+	mvcp_response response;
+	int stale;
+	int expecting;
+	mvcp_status_t expected;
+}
+proxy_list;
+
+/** An upstream connection - reconnects are serialised and counted, so that
+	the callers which saw the same failure reconnect it once.
+*/
+
+typedef struct
+{
+	mvcp_parser parser;
+	pthread_mutex_t mutex;
+	unsigned int connects;
+}
+proxy_upstream;
+
+/** A downstream connection and the upstream connection it is pinned to, so
+	that its commands run in order on one connection and the batches it
+	opens belong to it upstream. The units it has a batch open on are
+	rolled back when it closes.
+*/
+
+typedef struct
+{
+	void *session;
+	proxy_upstream *upstream;
+	int *batches;
+	int batches_count;
+}
+proxy_session;
+
+/** Private proxy structure - downstream connections are spread over a pool
+	of upstream connections, the first of which also carries the STATUS
+	stream that answers USTA and validates the cached LIST and ULS responses.
+*/
+
+typedef struct
+{
+	mvcp_parser parser;
+	proxy_upstream *upstream;
+	int count;
+	unsigned int next;
+	pthread_mutex_t mutex;
+	mvcp_response units;
+	int units_count;
+	proxy_list *lists;
+	int lists_count;
+	proxy_session *sessions;
+	int sessions_count;
+}
+*melted_proxy, melted_proxy_t;
+
+/** Queries which may be answered locally.
+*/
+
+typedef enum
+{
+	proxy_forward,
+	proxy_usta,
+	proxy_list_unit,
+	proxy_uls
+}
+proxy_query;
+
+/** Unit commands which don't change the unit.
+*/
+
+static const char *proxy_queries[] = { "USTA", "LIST", "UGET", "CUES", NULL };
+
+/** Classify a command, extracting the unit of a unit query.
+*/
+
+static proxy_query melted_proxy_classify( const char *command, int *unit )
+{
+	char name[ 8 ];
+	char rest[ 2 ];
+
+	if ( !strcasecmp( command, "ULS" ) )
+		return proxy_uls;
+
+	if ( sscanf( command, "%7s %*[Uu]%d %1s", name, unit, rest ) == 2 && *unit >= 0 )
+	{
+		if ( !strcasecmp( name, "USTA" ) )
+			return proxy_usta;
+		if ( !strcasecmp( name, "LIST" ) )
+			return proxy_list_unit;
+	}
+
+	return proxy_forward;
+}
+
+/** Find the cache entry of a unit, growing the cache if needed - must be
+	called with the mutex held.
+*/
+
+static proxy_list *melted_proxy_list( melted_proxy proxy, int unit )
+{
+	if ( unit >= proxy->lists_count )
+	{
+		int count = unit + 1;
+		proxy_list *lists = realloc( proxy->lists, count * sizeof( proxy_list ) );
+		if ( lists == NULL )
+			return NULL;
+		memset( lists + proxy->lists_count, 0, ( count - proxy->lists_count ) * sizeof( proxy_list ) );
+		proxy->lists = lists;
+		proxy->lists_count = count;
+	}
+	return &proxy->lists[ unit ];
+}
+
+/** Drop the cached responses of a unit which a forwarded command may change.
+*/
+
+static void melted_proxy_invalidate( melted_proxy proxy, int unit )
+{
+	proxy_list *list = NULL;
+
+	pthread_mutex_lock( &proxy->mutex );
+	list = melted_proxy_list( proxy, unit );
+	if ( list != NULL )
+	{
+		mvcp_response_close( list->response );
+		list->response = NULL;
+		list->stale = 1;
+		list->expecting = 0;
+	}
+	pthread_mutex_unlock( &proxy->mutex );
+}
+
+/** Invalidate every unit named by a command which isn't a read only query.
+*/
+
+static void melted_proxy_changed( melted_proxy proxy, const char *command )
+{
+	char name[ 16 ];
+	const char *token = command;
+	int index = 0;
+
+	if ( sscanf( command, "%15s", name ) != 1 )
+		return;
+	for ( index = 0; proxy_queries[ index ] != NULL; index ++ )
+		if ( !strcasecmp( name, proxy_queries[ index ] ) )
+			return;
+
+	// XFER and SWAP change the unit named by their argument too
+	while ( ( token = strpbrk( token, " \t" ) ) != NULL )
+	{
+		int unit = -1;
+		token += strspn( token, " \t" );
+		if ( sscanf( token, "%*[Uu]%d", &unit ) == 1 && unit >= 0 )
+			melted_proxy_invalidate( proxy, unit );
+	}
+}
+
+/** Find the entry of a downstream connection - must be called with the
+	mutex held. Returns the index or -1.
+*/
+
+static int melted_proxy_find_session( melted_proxy proxy, void *session )
+{
+	int index = 0;
+	for ( index = 0; index < proxy->sessions_count; index ++ )
+		if ( proxy->sessions[ index ].session == session )
+			return index;
+	return -1;
+}
+
+/** Note the batches a command opens or closes - must be called with the
+	mutex held.
+*/
+
+static void melted_proxy_batch( proxy_session *entry, const char *command )
+{
+	char name[ 16 ];
+	int unit = -1;
+	int index = 0;
+
+	if ( sscanf( command, "%15s %*[Uu]%d", name, &unit ) != 2 || unit < 0 )
+		return;
+
+	for ( index = 0; index < entry->batches_count; index ++ )
+		if ( entry->batches[ index ] == unit )
+			break;
+
+	if ( !strcasecmp( name, "BEGIN" ) && index == entry->batches_count )
+	{
+		int *batches = realloc( entry->batches, ( entry->batches_count + 1 ) * sizeof( int ) );
+		if ( batches != NULL )
+		{
+			entry->batches = batches;
+			entry->batches[ entry->batches_count ++ ] = unit;
+		}
+	}
+	else if ( ( !strcasecmp( name, "COMMIT" ) || !strcasecmp( name, "ROLLBACK" ) ) && index < entry->batches_count )
+	{
+		entry->batches[ index ] = entry->batches[ -- entry->batches_count ];
+	}
+}
+
+/** Choose the upstream connection for a command of the current downstream
+	connection - the one it is pinned to, or the next in turn for a
+	connection which hasn't sent anything yet.
+*/
+
+static proxy_upstream *melted_proxy_upstream( melted_proxy proxy, const char *command )
+{
+	void *session = melted_unit_session( );
+	proxy_upstream *upstream = NULL;
+	int index = 0;
+
+	pthread_mutex_lock( &proxy->mutex );
+
+	index = melted_proxy_find_session( proxy, session );
+	if ( index < 0 )
+	{
+		proxy_session *sessions = realloc( proxy->sessions, ( proxy->sessions_count + 1 ) * sizeof( proxy_session ) );
+		if ( sessions != NULL )
+		{
+			proxy->sessions = sessions;
+			index = proxy->sessions_count ++;
+			memset( &sessions[ index ], 0, sizeof( proxy_session ) );
+			sessions[ index ].session = session;
+			sessions[ index ].upstream = &proxy->upstream[ proxy->next ++ % proxy->count ];
+		}
+	}
+
+	if ( index >= 0 )
+	{
+		upstream = proxy->sessions[ index ].upstream;
+		melted_proxy_batch( &proxy->sessions[ index ], command );
+	}
+	else
+	{
+		upstream = &proxy->upstream[ 0 ];
+	}
+
+	pthread_mutex_unlock( &proxy->mutex );
+
+	return upstream;
+}
+
+/** Connect an upstream connection unless another caller has done so since
+	connects was sampled. Returns the response of the connect, if made.
+*/
+
+static mvcp_response melted_proxy_reconnect( proxy_upstream *upstream, unsigned int connects )
+{
+	mvcp_response response = NULL;
+
+	pthread_mutex_lock( &upstream->mutex );
+	if ( upstream->connects == connects )
+	{
+		response = mvcp_parser_connect( upstream->parser );
+		upstream->connects ++;
+	}
+	pthread_mutex_unlock( &upstream->mutex );
+
+	return response;
+}
+
+/** Forward a command, retrying once on a fresh connection if the upstream
+	connection has gone.
+*/
+
+static mvcp_response melted_proxy_forward( melted_proxy proxy, char *command )
+{
+	proxy_upstream *upstream = melted_proxy_upstream( proxy, command );
+	unsigned int connects = 0;
+	mvcp_response response = NULL;
+
+	pthread_mutex_lock( &upstream->mutex );
+	connects = upstream->connects;
+	pthread_mutex_unlock( &upstream->mutex );
+
+	response = mvcp_parser_execute( upstream->parser, command );
+	if ( response == NULL )
+	{
+		mvcp_response_close( melted_proxy_reconnect( upstream, connects ) );
+		response = mvcp_parser_execute( upstream->parser, command );
+	}
+
+	return response;
+}
+
+/** Check that the status stream has caught up with the commands forwarded
+	for a unit - it shows the state of the last USTA answered upstream since
+	the unit was changed. The position only has to match when the unit isn't
+	playing.
+*/
+
+static int melted_proxy_current( melted_proxy proxy, int unit )
+{
+	mvcp_notifier notifier = mvcp_parser_get_notifier( proxy->parser );
+	int current = 1;
+
+	pthread_mutex_lock( &proxy->mutex );
+	if ( unit < proxy->lists_count && proxy->lists[ unit ].stale )
+	{
+		proxy_list *list = &proxy->lists[ unit ];
+		mvcp_status_t status;
+		current = 0;
+		if ( list->expecting )
+		{
+			mvcp_notifier_get( notifier, &status, unit );
+			current = status.status == list->expected.status && status.speed == list->expected.speed &&
+					  status.clip_index == list->expected.clip_index && status.generation == list->expected.generation &&
+					  ( status.status == unit_playing || status.position == list->expected.position );
+		}
+		if ( current )
+			list->stale = list->expecting = 0;
+	}
+	pthread_mutex_unlock( &proxy->mutex );
+
+	return current;
+}
+
+/** Answer a query from the status stream and the cached responses, or return
+	NULL if it has to go upstream.
+*/
+
+static mvcp_response melted_proxy_cached( melted_proxy proxy, proxy_query query, int unit )
+{
+	mvcp_notifier notifier = mvcp_parser_get_notifier( proxy->parser );
+	mvcp_response response = NULL;
+	mvcp_status_t status;
+
+	if ( query == proxy_uls )
+	{
+		pthread_mutex_lock( &proxy->mutex );
+		if ( proxy->units != NULL && proxy->units_count == mvcp_notifier_units( notifier ) )
+			response = mvcp_response_clone( proxy->units );
+		pthread_mutex_unlock( &proxy->mutex );
+		return response;
+	}
+
+	if ( !melted_proxy_current( proxy, unit ) )
+		return NULL;
+
+	mvcp_notifier_get( notifier, &status, unit );
+	if ( status.status == unit_unknown || status.status == unit_undefined || status.status == unit_disconnected )
+		return NULL;
+
+	if ( query == proxy_usta )
+	{
+		mvcp_notifier_line line = mvcp_notifier_get_line( notifier, unit );
+		if ( line != NULL )
+		{
+			response = mvcp_response_init( );
+			mvcp_response_set_error( response, 202, "OK" );
+			mvcp_response_write( response, line->text, line->length );
+		}
+		mvcp_notifier_release( notifier, line );
+	}
+	else if ( query == proxy_list_unit )
+	{
+		pthread_mutex_lock( &proxy->mutex );
+		if ( unit < proxy->lists_count && proxy->lists[ unit ].response != NULL && proxy->lists[ unit ].generation == status.generation )
+			response = mvcp_response_clone( proxy->lists[ unit ].response );
+		pthread_mutex_unlock( &proxy->mutex );
+	}
+
+	return response;
+}
+
+/** Remember a successful LIST or ULS response from upstream, or the state a
+	USTA answered upstream gives a unit which was changed.
+*/
+
+static void melted_proxy_store( melted_proxy proxy, proxy_query query, int unit, mvcp_response response )
+{
+	int code = mvcp_response_get_error_code( response );
+
+	if ( query == proxy_usta && code == 202 && mvcp_response_count( response ) > 1 )
+	{
+		char *line = strdup( mvcp_response_get_line( response, 1 ) );
+		pthread_mutex_lock( &proxy->mutex );
+		if ( line != NULL && unit < proxy->lists_count && proxy->lists[ unit ].stale )
+		{
+			mvcp_status_parse( &proxy->lists[ unit ].expected, line );
+			proxy->lists[ unit ].expecting = 1;
+		}
+		pthread_mutex_unlock( &proxy->mutex );
+		free( line );
+		return;
+	}
+
+	if ( code != 201 )
+		return;
+
+	pthread_mutex_lock( &proxy->mutex );
+
+	if ( query == proxy_uls )
+	{
+		mvcp_response_close( proxy->units );
+		proxy->units = mvcp_response_clone( response );
+		proxy->units_count = mvcp_notifier_units( mvcp_parser_get_notifier( proxy->parser ) );
+	}
+	else if ( query == proxy_list_unit && mvcp_response_count( response ) > 1 )
+	{
+		proxy_list *list = melted_proxy_list( proxy, unit );
+		if ( list != NULL )
+		{
+			mvcp_response_close( list->response );
+			list->response = mvcp_response_clone( response );
+			list->generation = atoi( mvcp_response_get_line( response, 1 ) );
+		}
+	}
+
+	pthread_mutex_unlock( &proxy->mutex );
+}
+
+/** Connect every upstream connection - the response is that of the first.
+*/
+
+static mvcp_response melted_proxy_connect( melted_proxy proxy )
+{
+	mvcp_response response = NULL;
+	int index = 0;
+
+	for ( index = 0; index < proxy->count; index ++ )
+	{
+		proxy_upstream *upstream = &proxy->upstream[ index ];
+		mvcp_response temp = NULL;
+		pthread_mutex_lock( &upstream->mutex );
+		temp = mvcp_parser_connect( upstream->parser );
+		upstream->connects ++;
+		pthread_mutex_unlock( &upstream->mutex );
+		if ( index == 0 )
+			response = temp;
+		else
+			mvcp_response_close( temp );
+	}
+
+	return response;
+}
+
+/** Execute a command, locally if it is a read only query which the status
+	stream shows to be unchanged.
+*/
+
+static mvcp_response melted_proxy_execute( melted_proxy proxy, char *command )
+{
+	int unit = -1;
+	proxy_query query = melted_proxy_classify( command, &unit );
+	mvcp_response response = melted_proxy_cached( proxy, query, unit );
+
+	if ( response == NULL )
+	{
+		response = melted_proxy_forward( proxy, command );
+		if ( query == proxy_forward )
+			melted_proxy_changed( proxy, command );
+		melted_proxy_store( proxy, query, unit, response );
+
+		// A unit added through us is known before the status stream reports it
+		if ( query == proxy_forward && !strncasecmp( command, "UADD", 4 ) )
+		{
+			pthread_mutex_lock( &proxy->mutex );
+			mvcp_response_close( proxy->units );
+			proxy->units = NULL;
+			pthread_mutex_unlock( &proxy->mutex );
+		}
+	}
+
+	return response;
+}
+
+/** Submit a command to be executed upstream - the callbacks of a downstream
+	connection are called in the order its commands were submitted.
+*/
+
+static int melted_proxy_submit( melted_proxy proxy, char *command, mvcp_response_callback callback, void *data )
+{
+	int error = mvcp_parser_submit( melted_proxy_upstream( proxy, command )->parser, command, callback, data );
+	melted_proxy_changed( proxy, command );
+	return error;
+}
+
+/** Forward a pushed document.
+*/
+
+static mvcp_response melted_proxy_received( melted_proxy proxy, char *command, char *doc )
+{
+	mvcp_response response = mvcp_parser_received( melted_proxy_upstream( proxy, command )->parser, command, doc );
+	melted_proxy_changed( proxy, command );
+	return response;
+}
+
+/** Forward a pushed service.
+*/
+
+static mvcp_response melted_proxy_push( melted_proxy proxy, char *command, mlt_service service )
+{
+	mvcp_response response = mvcp_parser_push( melted_proxy_upstream( proxy, command )->parser, command, service );
+	melted_proxy_changed( proxy, command );
+	return response;
+}
+
+/** Forget a downstream connection which has closed, rolling back the batches
+	it left open - the upstream connection stays open for others, so
+	upstream would keep them. Does nothing unless the parser is a proxy.
+*/
+
+void melted_proxy_end_session( mvcp_parser parser, void *session )
+{
+	melted_proxy proxy = parser != NULL && parser->execute == ( parser_execute )melted_proxy_execute ? parser->real : NULL;
+	proxy_session entry;
+	int index = -1;
+
+	if ( proxy == NULL )
+		return;
+
+	pthread_mutex_lock( &proxy->mutex );
+	index = melted_proxy_find_session( proxy, session );
+	if ( index >= 0 )
+	{
+		entry = proxy->sessions[ index ];
+		proxy->sessions[ index ] = proxy->sessions[ -- proxy->sessions_count ];
+	}
+	pthread_mutex_unlock( &proxy->mutex );
+
+	if ( index >= 0 )
+	{
+		for ( index = 0; index < entry.batches_count; index ++ )
+		{
+			char command[ 64 ];
+			snprintf( command, sizeof( command ), "ROLLBACK U%d", entry.batches[ index ] );
+			mvcp_response_close( mvcp_parser_execute( entry.upstream->parser, command ) );
+			melted_log( LOG_NOTICE, "PROXY rolled back the batch left open on U%d", entry.batches[ index ] );
+		}
+		free( entry.batches );
+	}
+}
+
+/** Close the proxy - the first upstream connection shares our notifier, which
+	is closed with our parser.
+*/
+
+static void melted_proxy_close( melted_proxy proxy )
+{
+	if ( proxy != NULL )
+	{
+		int index = 0;
+		for ( index = 0; index < proxy->count; index ++ )
+		{
+			mvcp_parser upstream = proxy->upstream[ index ].parser;
+			// The status thread keeps the notifier it started with until joined
+			if ( index == 0 )
+				upstream->notifier = NULL;
+			mvcp_parser_close( upstream );
+			pthread_mutex_destroy( &proxy->upstream[ index ].mutex );
+		}
+		for ( index = 0; index < proxy->lists_count; index ++ )
+			mvcp_response_close( proxy->lists[ index ].response );
+		for ( index = 0; index < proxy->sessions_count; index ++ )
+			free( proxy->sessions[ index ].batches );
+		mvcp_response_close( proxy->units );
+		pthread_mutex_destroy( &proxy->mutex );
+		free( proxy->lists );
+		free( proxy->sessions );
+		free( proxy->upstream );
+		free( proxy );
+	}
+}
+
+/** Construct a proxy for server:port with the given number of upstream
+	connections.
+*/
+
+mvcp_parser melted_proxy_init( char *server, int port, int connections )
+{
+	mvcp_parser parser = calloc( 1, sizeof( mvcp_parser_t ) );
+	melted_proxy proxy = calloc( 1, sizeof( melted_proxy_t ) );
+	int index = 0;
+
+	if ( connections <= 0 )
+		connections = MELTED_PROXY_CONNECTIONS;
+
+	if ( parser == NULL || proxy == NULL || ( proxy->upstream = calloc( connections, sizeof( proxy_upstream ) ) ) == NULL )
+	{
+		free( parser );
+		free( proxy );
+		return NULL;
+	}
+
+	parser->connect = (parser_connect)melted_proxy_connect;
+	parser->execute = (parser_execute)melted_proxy_execute;
+	parser->submit = (parser_submit)melted_proxy_submit;
+	parser->push = (parser_push)melted_proxy_push;
+	parser->received = (parser_received)melted_proxy_received;
+	parser->close = (parser_close)melted_proxy_close;
+	parser->real = proxy;
+
+	proxy->parser = parser;
+	proxy->count = connections;
+	pthread_mutex_init( &proxy->mutex, NULL );
+
+	for ( index = 0; index < connections; index ++ )
+	{
+		proxy->upstream[ index ].parser = mvcp_parser_init_remote( server, port );
+		pthread_mutex_init( &proxy->upstream[ index ].mutex, NULL );
+		mvcp_remote_set_status( proxy->upstream[ index ].parser, index == 0 );
+	}
+
+	// Status from the first connection is what our own subscribers see
+	proxy->upstream[ 0 ].parser->notifier = mvcp_parser_get_notifier( parser );
+
+	return parser;
+}
@@ -0,0 +1,687 @@
+/*
+ * melted_replica.c -- Hot Standby Replication
+ * Copyright (C) 2002-2015 Meltytech, LLC
+ * Author: Charles Yates <charles.yates@pandora.be>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+/* System header files */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/time.h>
+
+/* MLT header files. */
+#include <framework/mlt.h>
+
+/* Application header files */
+#include <mvcp/mvcp_remote.h>
+#include "melted_replica.h"
+#include "melted_commands.h"
+#include "melted_scheduler.h"
+#include "melted_metrics.h"
+#include "melted_server.h"
+#include "melted_log.h"
+
+/** Commands which change a unit and are replayed on the standbys. RUN is
+	left out because the commands it runs are replicated one by one.
+*/
+
+static const char *replica_commands[] =
+{
+	"UADD", "LOAD", "INSERT", "REMOVE", "CLEAN", "WIPE", "CLEAR", "MOVE", "APND",
+	"BEGIN", "COMMIT", "ROLLBACK", "CUE", "UNCUE", "PLAY", "STOP", "PAUSE",
+	"REW", "FF", "STEP", "GOTO", "SIN", "SOUT", "USET", "XFER", "SWAP", "NEXTID", NULL
+};
+
+/** An applied mutation, or a checkpoint of a unit's clip, position and speed.
+*/
+
+typedef struct
+{
+	int64_t sequence;
+	int unit;
+	char *command;
+	char *doc;
+	int checkpoint;
+	int clip;
+	int32_t position;
+	int32_t out;
+	int speed;
+	double fps;
+	int64_t stamp;
+}
+replica_record;
+
+/** A standby server and how far through the stream it is.
+*/
+
+typedef struct replica_standby_s
+{
+	char host[ 512 ];
+	int port;
+	pthread_t thread;
+	mvcp_parser parser;
+	int synced;
+	int64_t cursor;
+	int64_t since[ MELTED_MAX_UNITS ];
+	struct replica_standby_s *next;
+}
+*replica_standby, replica_standby_t;
+
+/** The commands which rebuild a unit, collected on the unit's worker.
+*/
+
+typedef struct
+{
+	int unit;
+	int64_t since;
+	replica_record *rows;
+	int count;
+	int size;
+}
+replica_snapshot;
+
+static pthread_mutex_t replica_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t replica_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t replica_stop_cond = PTHREAD_COND_INITIALIZER;
+static pthread_once_t replica_once = PTHREAD_ONCE_INIT;
+static pthread_key_t replica_key;
+static pthread_t replica_clock;
+static volatile int replica_running = 0;
+static replica_record replica_ring[ MELTED_REPLICA_QUEUE ];
+static int64_t replica_head = 0;
+static int64_t replica_latest[ MELTED_MAX_UNITS ];
+static volatile int replica_pending[ MELTED_MAX_UNITS ];
+static replica_standby replica_standbys = NULL;
+static int replica_interval = 1000;
+static int replica_tolerance = 2;
+
+static void replica_key_create( )
+{
+	pthread_key_create( &replica_key, NULL );
+}
+
+/** Wait on the stop condition for a number of milliseconds - must be called
+	with the mutex held.
+*/
+
+static void replica_sleep( int milliseconds )
+{
+	struct timeval now;
+	struct timespec until;
+
+	gettimeofday( &now, NULL );
+	until.tv_sec = now.tv_sec + milliseconds / 1000;
+	until.tv_nsec = ( now.tv_usec + ( milliseconds % 1000 ) * 1000 ) * 1000;
+	if ( until.tv_nsec >= 1000000000 )
+	{
+		until.tv_sec ++;
+		until.tv_nsec -= 1000000000;
+	}
+	pthread_cond_timedwait( &replica_stop_cond, &replica_mutex, &until );
+}
+
+/** Take the next record of the stream, overwriting the oldest - must be
+	called with the mutex held.
+*/
+
+static replica_record *replica_append( int unit )
+{
+	replica_record *record = &replica_ring[ replica_head % MELTED_REPLICA_QUEUE ];
+	free( record->command );
+	free( record->doc );
+	memset( record, 0, sizeof( replica_record ) );
+	record->sequence = replica_head ++;
+	record->unit = unit;
+	return record;
+}
+
+/** Choose whether commands executed by the calling thread are replicated.
+	The cue runner suppresses its own, as the standbys run their cues too.
+*/
+
+void melted_replica_suppress( int suppress )
+{
+	pthread_once( &replica_once, replica_key_create );
+	pthread_setspecific( replica_key, ( void * )( intptr_t )suppress );
+}
+
+/** Determine whether a command executed by the calling thread should be
+	replicated if it succeeds.
+*/
+
+int melted_replica_wanted( )
+{
+	if ( !replica_running )
+		return 0;
+	pthread_once( &replica_once, replica_key_create );
+	return pthread_getspecific( replica_key ) == NULL;
+}
+
+/** Add a successful command to the stream if it changes a unit. Unit
+	commands are added from the unit's worker, so the stream has them in
+	the order they were applied.
+*/
+
+void melted_replica_command( const char *name, int unit, const char *command )
+{
+	int index = 0;
+
+	if ( !replica_running || name == NULL || command == NULL )
+		return;
+
+	while ( replica_commands[ index ] != NULL && strcasecmp( replica_commands[ index ], name ) )
+		index ++;
+
+	if ( replica_commands[ index ] != NULL )
+	{
+		pthread_mutex_lock( &replica_mutex );
+		if ( replica_running )
+		{
+			replica_record *record = replica_append( unit );
+			record->command = strdup( command );
+			pthread_cond_broadcast( &replica_cond );
+		}
+		pthread_mutex_unlock( &replica_mutex );
+	}
+}
+
+/** Add a successful PUSH and its document to the stream.
+*/
+
+void melted_replica_document( int unit, const char *command, const char *doc )
+{
+	if ( !replica_running || command == NULL || doc == NULL )
+		return;
+
+	pthread_mutex_lock( &replica_mutex );
+	if ( replica_running )
+	{
+		replica_record *record = replica_append( unit );
+		record->command = strdup( command );
+		record->doc = strdup( doc );
+		pthread_cond_broadcast( &replica_cond );
+	}
+	pthread_mutex_unlock( &replica_mutex );
+}
+
+/** Serialise a service as the XML document a standby is sent. The caller
+	frees the result.
+*/
+
+char *melted_replica_serialise( mlt_service service )
+{
+	char *doc = NULL;
+
+	if ( service != NULL )
+	{
+		mlt_consumer consumer = mlt_factory_consumer( mlt_service_profile( service ), "xml", "buffer" );
+		if ( consumer != NULL )
+		{
+			mlt_consumer_connect( consumer, service );
+			mlt_consumer_start( consumer );
+			if ( mlt_properties_get( MLT_CONSUMER_PROPERTIES( consumer ), "buffer" ) != NULL )
+				doc = strdup( mlt_properties_get( MLT_CONSUMER_PROPERTIES( consumer ), "buffer" ) );
+			mlt_consumer_close( consumer );
+		}
+	}
+
+	return doc;
+}
+
+/** Checkpoint a unit - runs on its worker behind the commands already
+	queued for it.
+*/
+
+static void replica_checkpoint( void *arg )
+{
+	int index = ( intptr_t )arg;
+	melted_unit unit = melted_acquire_unit( index );
+	mvcp_status_t status;
+
+	if ( unit != NULL )
+	{
+		melted_unit_get_status( unit, &status );
+		pthread_mutex_lock( &replica_mutex );
+		if ( replica_running && ( status.status == unit_playing || status.status == unit_paused ) )
+		{
+			replica_record *record = replica_append( index );
+			record->checkpoint = 1;
+			record->clip = status.clip_index;
+			record->position = status.position;
+			record->out = status.out;
+			record->speed = status.speed;
+			record->fps = status.fps;
+			record->stamp = melted_metrics_now( );
+			replica_latest[ index ] = record->sequence;
+			pthread_cond_broadcast( &replica_cond );
+		}
+		pthread_mutex_unlock( &replica_mutex );
+	}
+
+	melted_release_unit( unit );
+	replica_pending[ index ] = 0;
+}
+
+/** Checkpoint every unit at the interval. A unit which hasn't reached its
+	last checkpoint yet is skipped.
+*/
+
+static void *replica_clock_run( void *arg )
+{
+	pthread_mutex_lock( &replica_mutex );
+
+	while ( replica_running )
+	{
+		replica_sleep( replica_interval );
+		if ( replica_running )
+		{
+			int count = 0;
+			int index = 0;
+
+			pthread_mutex_unlock( &replica_mutex );
+			count = melted_count_units( );
+			for ( index = 0; index < count && index < MELTED_MAX_UNITS; index ++ )
+			{
+				melted_unit unit = melted_acquire_unit( index );
+				if ( !replica_pending[ index ] && unit != NULL )
+				{
+					replica_pending[ index ] = 1;
+					melted_scheduler_submit( index, replica_checkpoint, ( void * )( intptr_t )index );
+				}
+				melted_release_unit( unit );
+			}
+			pthread_mutex_lock( &replica_mutex );
+		}
+	}
+
+	pthread_mutex_unlock( &replica_mutex );
+
+	return NULL;
+}
+
+/** Send a command, or a PUSH with its document. Returns non-zero if the
+	connection was lost - a command the standby refuses is only logged.
+*/
+
+static int replica_send( replica_standby standby, char *command, char *doc )
+{
+	mvcp_response response = NULL;
+
+	if ( doc != NULL )
+		response = mvcp_parser_received( standby->parser, command, doc );
+	else
+		response = mvcp_parser_execute( standby->parser, command );
+
+	if ( response == NULL )
+		return -1;
+
+	if ( mvcp_response_get_error_code( response ) >= 300 )
+		melted_log( LOG_WARNING, "standby %s:%d refused \"%s\" %d", standby->host, standby->port, command, mvcp_response_get_error_code( response ) );
+	mvcp_response_close( response );
+
+	return 0;
+}
+
+static void replica_snapshot_row( void *data, const char *command, mlt_service service )
+{
+	replica_snapshot *snapshot = data;
+
+	if ( snapshot->count == snapshot->size )
+	{
+		int size = snapshot->size > 0 ? snapshot->size * 2 : 64;
+		replica_record *rows = realloc( snapshot->rows, size * sizeof( replica_record ) );
+		if ( rows == NULL )
+			return;
+		snapshot->rows = rows;
+		snapshot->size = size;
+	}
+
+	memset( &snapshot->rows[ snapshot->count ], 0, sizeof( replica_record ) );
+	snapshot->rows[ snapshot->count ].command = strdup( command );
+	if ( service != NULL && ( snapshot->rows[ snapshot->count ].doc = melted_replica_serialise( service ) ) == NULL )
+	{
+		free( snapshot->rows[ snapshot->count ].command );
+		return;
+	}
+	snapshot->count ++;
+}
+
+/** Collect the commands which rebuild a unit and the point in the stream
+	they describe - runs on the unit's worker, so no command of the unit is
+	applied in between.
+*/
+
+static void replica_snapshot_unit( void *arg )
+{
+	replica_snapshot *snapshot = arg;
+	melted_unit unit = melted_acquire_unit( snapshot->unit );
+
+	pthread_mutex_lock( &replica_mutex );
+	snapshot->since = replica_head;
+	pthread_mutex_unlock( &replica_mutex );
+
+	if ( unit != NULL )
+		melted_unit_replicate( unit, replica_snapshot_row, snapshot );
+	melted_release_unit( unit );
+}
+
+/** Bring a standby which has just connected up to date. It gets the units
+	it lacks, then each unit is rebuilt and the stream resumes from the
+	oldest point the units were rebuilt at, skipping what a unit already
+	has. Returns non-zero if the connection was lost.
+*/
+
+/** Refuse a standby whose unit indices can't be made to match the primary's.
+*/
+
+static int replica_mismatch( replica_standby standby, int unit, int added )
+{
+	melted_log( LOG_ERR, "standby %s:%d would add U%d as U%d - its units don't match the primary's, not synchronising it", standby->host, standby->port, unit, added );
+	return 1;
+}
+
+static int replica_synchronise( replica_standby standby )
+{
+	mvcp_response response = mvcp_parser_execute( standby->parser, "ULS" );
+	char present[ MELTED_MAX_UNITS ];
+	int count = melted_count_units( );
+	int error = response == NULL;
+	int64_t origin = 0;
+	int index = 0;
+	int slot = 0;
+
+	memset( present, 0, sizeof( present ) );
+	for ( index = 1; !error && index < mvcp_response_count( response ); index ++ )
+	{
+		int unit = -1;
+		if ( sscanf( mvcp_response_get_line( response, index ), "U%d", &unit ) == 1 && unit >= 0 && unit < MELTED_MAX_UNITS )
+			present[ unit ] = 1;
+	}
+	mvcp_response_close( response );
+
+	pthread_mutex_lock( &replica_mutex );
+	origin = replica_head;
+	pthread_mutex_unlock( &replica_mutex );
+
+	// UADD takes the standby's lowest free slot, so the units it lacks must
+	// be exactly the lowest ones it has free or every U<n> sent later would
+	// reach the wrong unit
+	for ( index = 0, slot = 0; !error && index < count && index < MELTED_MAX_UNITS; index ++ )
+	{
+		melted_unit unit = melted_acquire_unit( index );
+		if ( unit != NULL && !present[ index ] )
+		{
+			while ( slot < MELTED_MAX_UNITS && present[ slot ] )
+				slot ++;
+			if ( slot != index )
+				error = replica_mismatch( standby, index, slot );
+			slot ++;
+		}
+		melted_release_unit( unit );
+	}
+
+	for ( index = 0; !error && index < count && index < MELTED_MAX_UNITS; index ++ )
+	{
+		melted_unit unit = melted_acquire_unit( index );
+		standby->since[ index ] = origin;
+		if ( unit != NULL && !present[ index ] )
+		{
+			char command[ 1024 ];
+			int added = -1;
+			snprintf( command, sizeof( command ), "UADD %s", mlt_properties_get( unit->properties, "constructor" ) );
+			response = mvcp_parser_execute( standby->parser, command );
+			if ( response == NULL )
+				error = -1;
+			else if ( mvcp_response_get_error_code( response ) >= 300 )
+				melted_log( LOG_WARNING, "standby %s:%d refused \"%s\" %d", standby->host, standby->port, command, mvcp_response_get_error_code( response ) );
+			else if ( sscanf( mvcp_response_get_line( response, 1 ), "U%d", &added ) != 1 || added != index )
+				error = replica_mismatch( standby, index, added );
+			mvcp_response_close( response );
+		}
+		melted_release_unit( unit );
+	}
+
+	for ( index = 0; !error && index < count && index < MELTED_MAX_UNITS; index ++ )
+	{
+		replica_snapshot snapshot;
+		melted_unit unit = melted_acquire_unit( index );
+		int row = 0;
+
+		melted_release_unit( unit );
+		if ( unit == NULL )
+			continue;
+
+		memset( &snapshot, 0, sizeof( snapshot ) );
+		snapshot.unit = index;
+		melted_scheduler_execute( index, replica_snapshot_unit, &snapshot );
+		standby->since[ index ] = snapshot.since;
+
+		for ( row = 0; row < snapshot.count; row ++ )
+		{
+			if ( !error )
+				error = replica_send( standby, snapshot.rows[ row ].command, snapshot.rows[ row ].doc );
+			free( snapshot.rows[ row ].command );
+			free( snapshot.rows[ row ].doc );
+		}
+		free( snapshot.rows );
+	}
+
+	for ( ; index < MELTED_MAX_UNITS; index ++ )
+		standby->since[ index ] = origin;
+	standby->cursor = origin;
+
+	return error;
+}
+
+static int replica_connect( replica_standby standby )
+{
+	mvcp_response response = NULL;
+	int error = 0;
+
+	// Every attempt starts from a fresh connection
+	if ( standby->parser != NULL )
+		mvcp_parser_close( standby->parser );
+	standby->parser = mvcp_parser_init_remote( standby->host, standby->port );
+	mvcp_remote_set_status( standby->parser, 0 );
+
+	response = mvcp_parser_connect( standby->parser );
+	error = response == NULL || mvcp_response_get_error_code( response ) != 100;
+	mvcp_response_close( response );
+
+	return error;
+}
+
+/** Feed a standby - reconnecting and rebuilding it whenever the connection
+	is lost or it falls further behind than the stream is kept.
+*/
+
+static void *replica_standby_run( void *arg )
+{
+	replica_standby standby = arg;
+
+	pthread_mutex_lock( &replica_mutex );
+
+	while ( replica_running )
+	{
+		replica_record *record = NULL;
+		char command[ 1024 ];
+		char *text = NULL;
+		char *doc = NULL;
+		int error = 0;
+
+		if ( !standby->synced )
+		{
+			pthread_mutex_unlock( &replica_mutex );
+			standby->synced = replica_connect( standby ) == 0 && replica_synchronise( standby ) == 0;
+			if ( standby->synced )
+				melted_log( LOG_NOTICE, "standby %s:%d is in step", standby->host, standby->port );
+			pthread_mutex_lock( &replica_mutex );
+			if ( !standby->synced && replica_running )
+				replica_sleep( 1000 );
+			continue;
+		}
+
+		if ( standby->cursor < replica_head - MELTED_REPLICA_QUEUE )
+		{
+			melted_log( LOG_WARNING, "standby %s:%d fell behind, rebuilding it", standby->host, standby->port );
+			standby->synced = 0;
+			continue;
+		}
+
+		if ( standby->cursor == replica_head )
+		{
+			pthread_cond_wait( &replica_cond, &replica_mutex );
+			continue;
+		}
+
+		record = &replica_ring[ standby->cursor ++ % MELTED_REPLICA_QUEUE ];
+
+		if ( record->unit >= 0 && record->sequence < standby->since[ record->unit ] )
+			continue;
+
+		if ( record->checkpoint )
+		{
+			// Only the latest checkpoint of a unit is worth sending
+			double position = record->position;
+			if ( record->sequence < replica_latest[ record->unit ] )
+				continue;
+			if ( record->speed != 0 && record->fps > 0 )
+				position += ( melted_metrics_now( ) - record->stamp ) / 1000000.0 * record->fps * record->speed / 1000.0;
+			if ( position < 0 || position > record->out )
+				position = record->position;
+			snprintf( command, sizeof( command ), "SYNC U%d %d %d %d %d", record->unit, record->clip, ( int )position, record->speed, replica_tolerance );
+			text = strdup( command );
+		}
+		else
+		{
+			text = strdup( record->command );
+			doc = record->doc != NULL ? strdup( record->doc ) : NULL;
+		}
+		pthread_mutex_unlock( &replica_mutex );
+
+		if ( text != NULL )
+			error = replica_send( standby, text, doc );
+		free( text );
+		free( doc );
+
+		pthread_mutex_lock( &replica_mutex );
+		if ( error )
+		{
+			melted_log( LOG_WARNING, "standby %s:%d lost", standby->host, standby->port );
+			standby->synced = 0;
+		}
+	}
+
+	pthread_mutex_unlock( &replica_mutex );
+
+	return NULL;
+}
+
+/** Start replicating to a comma separated list of standby host[:port]s,
+	checkpointing every unit at the interval in milliseconds. A standby
+	corrects a unit which is more than the tolerance in frames away from
+	its checkpoint.
+*/
+
+int melted_replica_init( const char *standbys, int interval, int tolerance )
+{
+	char *list = standbys != NULL ? strdup( standbys ) : NULL;
+	char *state = NULL;
+	char *target = NULL;
+	int error = list == NULL;
+
+	if ( error || replica_running )
+	{
+		free( list );
+		return error;
+	}
+
+	replica_interval = interval > 0 ? interval : 1000;
+	replica_tolerance = tolerance >= 0 ? tolerance : 2;
+
+	for ( target = strtok_r( list, ",", &state ); target != NULL; target = strtok_r( NULL, ",", &state ) )
+	{
+		replica_standby standby = calloc( 1, sizeof( replica_standby_t ) );
+		char *port = strrchr( target, ':' );
+		if ( standby == NULL )
+			break;
+		if ( port != NULL )
+			*port ++ = '\0';
+		strncpy( standby->host, target, sizeof( standby->host ) - 1 );
+		standby->port = port != NULL ? atoi( port ) : DEFAULT_TCP_PORT;
+		standby->next = replica_standbys;
+		replica_standbys = standby;
+	}
+	free( list );
+
+	error = replica_standbys == NULL;
+
+	if ( !error )
+	{
+		replica_standby standby = NULL;
+		replica_running = 1;
+		error = pthread_create( &replica_clock, NULL, replica_clock_run, NULL );
+		for ( standby = replica_standbys; standby != NULL; standby = standby->next )
+		{
+			melted_log( LOG_NOTICE, "Replicating to standby %s:%d", standby->host, standby->port );
+			pthread_create( &standby->thread, NULL, replica_standby_run, standby );
+		}
+	}
+
+	return error;
+}
+
+/** Stop replicating. Must be called before the units and their workers go.
+*/
+
+void melted_replica_close( )
+{
+	int index = 0;
+
+	pthread_mutex_lock( &replica_mutex );
+	if ( !replica_running )
+	{
+		pthread_mutex_unlock( &replica_mutex );
+		return;
+	}
+	replica_running = 0;
+	pthread_cond_broadcast( &replica_cond );
+	pthread_cond_broadcast( &replica_stop_cond );
+	pthread_mutex_unlock( &replica_mutex );
+
+	pthread_join( replica_clock, NULL );
+	while ( replica_standbys != NULL )
+	{
+		replica_standby standby = replica_standbys;
+		replica_standbys = standby->next;
+		pthread_join( standby->thread, NULL );
+		if ( standby->parser != NULL )
+			mvcp_parser_close( standby->parser );
+		free( standby );
+	}
+
+	for ( index = 0; index < MELTED_REPLICA_QUEUE; index ++ )
+	{
+		free( replica_ring[ index ].command );
+		free( replica_ring[ index ].doc );
+		replica_ring[ index ].command = replica_ring[ index ].doc = NULL;
+	}
+}
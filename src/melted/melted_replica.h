@@ -0,0 +1,49 @@
+/*
+ * melted_replica.h -- Hot Standby Replication
+ * Copyright (C) 2002-2015 Meltytech, LLC
+ * Author: Charles Yates <charles.yates@pandora.be>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#ifndef _MELTED_REPLICA_H_
+#define _MELTED_REPLICA_H_
+
+#include <framework/mlt_service.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+/** Mutations which may wait for the slowest standby before it has to be
+	brought up to date from scratch.
+*/
+
+#define MELTED_REPLICA_QUEUE 4096
+
+extern int melted_replica_init( const char *standbys, int interval, int tolerance );
+extern void melted_replica_close( void );
+extern void melted_replica_suppress( int suppress );
+extern int melted_replica_wanted( void );
+extern void melted_replica_command( const char *name, int unit, const char *command );
+extern void melted_replica_document( int unit, const char *command, const char *doc );
+extern char *melted_replica_serialise( mlt_service service );
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
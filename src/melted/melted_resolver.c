@@ -0,0 +1,197 @@
+/*
+ * melted_resolver.c -- Peer Name Resolver
+ * Copyright (C) 2002-2015 Meltytech, LLC
+ * Author: Charles Yates <charles.yates@pandora.be>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+/* System header files */
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+
+/* Application header files */
+#include "melted_resolver.h"
+#include "melted_log.h"
+
+/** Number of resolved peers remembered, the number of lookups which may be
+	outstanding and the number of seconds a resolved name remains valid.
+*/
+
+#define RESOLVER_CACHE 64
+#define RESOLVER_QUEUE 32
+#define RESOLVER_TTL 300
+
+/** Cache entry.
+*/
+
+typedef struct
+{
+	in_addr_t addr;
+	char name[ 256 ];
+	int resolved;
+	time_t expires;
+	unsigned long used;
+}
+resolver_entry;
+
+/** Queued lookup.
+*/
+
+typedef struct
+{
+	struct in_addr addr;
+	int fd;
+}
+resolver_request;
+
+static pthread_mutex_t resolver_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t resolver_cond = PTHREAD_COND_INITIALIZER;
+static pthread_once_t resolver_once = PTHREAD_ONCE_INIT;
+static resolver_entry resolver_cache[ RESOLVER_CACHE ];
+static resolver_request resolver_queue[ RESOLVER_QUEUE ];
+static int resolver_head = 0;
+static int resolver_count = 0;
+static unsigned long resolver_clock = 0;
+
+/** Find a cached entry - must be called with the mutex held.
+*/
+
+static resolver_entry *resolver_find( in_addr_t addr )
+{
+	int index = 0;
+	time_t now = time( NULL );
+	for ( index = 0; index < RESOLVER_CACHE; index ++ )
+		if ( resolver_cache[ index ].used != 0 && resolver_cache[ index ].addr == addr && resolver_cache[ index ].expires > now )
+			return &resolver_cache[ index ];
+	return NULL;
+}
+
+/** Store the result of a lookup, replacing the least recently used entry -
+	must be called with the mutex held.
+*/
+
+static void resolver_store( in_addr_t addr, const char *name )
+{
+	resolver_entry *entry = resolver_find( addr );
+	int index = 0;
+
+	if ( entry == NULL )
+	{
+		entry = &resolver_cache[ 0 ];
+		for ( index = 1; index < RESOLVER_CACHE; index ++ )
+			if ( resolver_cache[ index ].used < entry->used )
+				entry = &resolver_cache[ index ];
+	}
+
+	entry->addr = addr;
+	entry->resolved = name != NULL;
+	snprintf( entry->name, sizeof( entry->name ), "%s", name != NULL ? name : "" );
+	entry->expires = time( NULL ) + RESOLVER_TTL;
+	entry->used = ++ resolver_clock;
+}
+
+/** Thread which performs the queued lookups.
+*/
+
+static void *resolver_thread( void *arg )
+{
+	while ( 1 )
+	{
+		resolver_request request;
+		struct hostent *he = NULL;
+		char address[ INET_ADDRSTRLEN ];
+
+		pthread_mutex_lock( &resolver_mutex );
+		while ( resolver_count == 0 )
+			pthread_cond_wait( &resolver_cond, &resolver_mutex );
+		request = resolver_queue[ resolver_head ];
+		resolver_head = ( resolver_head + 1 ) % RESOLVER_QUEUE;
+		resolver_count --;
+		pthread_mutex_unlock( &resolver_mutex );
+
+		/* gethostbyaddr is only ever called from this thread. */
+		he = gethostbyaddr( (char *) &request.addr.s_addr, sizeof( request.addr.s_addr ), AF_INET );
+		inet_ntop( AF_INET, &request.addr, address, sizeof( address ) );
+
+		pthread_mutex_lock( &resolver_mutex );
+		resolver_store( request.addr.s_addr, he != NULL ? he->h_name : NULL );
+		pthread_mutex_unlock( &resolver_mutex );
+
+		if ( he != NULL )
+			melted_log( LOG_NOTICE, "Connection with %s (%d) resolved to %s", address, request.fd, he->h_name );
+	}
+
+	return NULL;
+}
+
+static void resolver_start( void )
+{
+	pthread_t thread;
+	pthread_attr_t attributes;
+	pthread_attr_init( &attributes );
+	pthread_attr_setdetachstate( &attributes, PTHREAD_CREATE_DETACHED );
+	pthread_create( &thread, &attributes, resolver_thread, NULL );
+	pthread_attr_destroy( &attributes );
+}
+
+/** Obtain the name of a peer without blocking. The numeric address is used
+	until the name has been resolved in the background. Returns 1 if the name
+	was found in the cache.
+*/
+
+int melted_resolver_lookup( struct in_addr addr, char *name, int size, int fd )
+{
+	resolver_entry *entry = NULL;
+	int found = 0;
+
+	inet_ntop( AF_INET, &addr, name, size );
+
+	pthread_once( &resolver_once, resolver_start );
+	pthread_mutex_lock( &resolver_mutex );
+
+	entry = resolver_find( addr.s_addr );
+	if ( entry != NULL )
+	{
+		entry->used = ++ resolver_clock;
+		if ( entry->resolved )
+			snprintf( name, size, "%s", entry->name );
+		found = entry->resolved;
+	}
+	else
+	{
+		int index = 0;
+		for ( index = 0; index < resolver_count; index ++ )
+			if ( resolver_queue[ ( resolver_head + index ) % RESOLVER_QUEUE ].addr.s_addr == addr.s_addr )
+				break;
+		if ( index == resolver_count && resolver_count < RESOLVER_QUEUE )
+		{
+			resolver_request *request = &resolver_queue[ ( resolver_head + resolver_count ) % RESOLVER_QUEUE ];
+			request->addr = addr;
+			request->fd = fd;
+			resolver_count ++;
+			pthread_cond_signal( &resolver_cond );
+		}
+	}
+
+	pthread_mutex_unlock( &resolver_mutex );
+
+	return found;
+}
@@ -0,0 +1,505 @@
+/*
+ * melted_scheduler.c -- Unit Command Scheduler
+ * Copyright (C) 2002-2015 Meltytech, LLC
+ * Author: Charles Yates <charles.yates@pandora.be>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+/* System header files */
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+/* Application header files */
+#include <mvcp/mvcp_notifier.h>
+#include "melted_scheduler.h"
+
+/** A queued request - owned by the thread waiting for it to complete, or by
+	the scheduler when nobody waits for it. A job which changes two units is
+	queued as a pair of requests, one on each unit's queue, and runs when both
+	have come up.
+*/
+
+typedef struct scheduler_request_s
+{
+	melted_scheduler_job job;
+	void *arg;
+	int done;
+	int owned;
+	int arrived;
+	struct scheduler_queue_s *queue;
+	struct scheduler_request_s *pair;
+	struct scheduler_request_s *next;
+}
+scheduler_request;
+
+/** A serial queue of requests for one unit.
+*/
+
+typedef struct scheduler_queue_s
+{
+	scheduler_request *head;
+	scheduler_request *tail;
+	int busy;
+	struct scheduler_queue_s *next;
+}
+scheduler_queue;
+
+static pthread_mutex_t scheduler_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t scheduler_ready = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t scheduler_done = PTHREAD_COND_INITIALIZER;
+static pthread_key_t scheduler_key;
+static scheduler_queue **scheduler_queues = NULL;
+static int scheduler_units = 0;
+static scheduler_queue *scheduler_head = NULL;
+static scheduler_queue *scheduler_tail = NULL;
+static pthread_t *scheduler_threads = NULL;
+static int scheduler_count = 0;
+static int scheduler_running = 0;
+
+/** Append a queue with pending requests to the ready list - must be called
+	with the mutex held.
+*/
+
+static void scheduler_ready_queue( scheduler_queue *queue )
+{
+	queue->busy = 1;
+	queue->next = NULL;
+	if ( scheduler_tail != NULL )
+		scheduler_tail->next = queue;
+	else
+		scheduler_head = queue;
+	scheduler_tail = queue;
+	pthread_cond_signal( &scheduler_ready );
+}
+
+/** Get the queue of a unit, growing the table as units are added - must be
+	called with the mutex held. Queues are never freed while the pool runs, so
+	the ready list can keep pointing at them.
+*/
+
+static scheduler_queue *scheduler_get_queue( int unit )
+{
+	if ( unit >= scheduler_units )
+	{
+		int units = scheduler_units > 0 ? scheduler_units : MAX_UNITS;
+		scheduler_queue **queues = NULL;
+
+		while ( units <= unit )
+			units *= 2;
+
+		queues = realloc( scheduler_queues, units * sizeof( scheduler_queue * ) );
+		if ( queues == NULL )
+			return NULL;
+		memset( queues + scheduler_units, 0, ( units - scheduler_units ) * sizeof( scheduler_queue * ) );
+		scheduler_queues = queues;
+		scheduler_units = units;
+	}
+
+	if ( scheduler_queues[ unit ] == NULL )
+		scheduler_queues[ unit ] = calloc( 1, sizeof( scheduler_queue ) );
+
+	return scheduler_queues[ unit ];
+}
+
+/** Complete a request which has run - must be called with the mutex held.
+	The queue parked by the other half of a pair is served again.
+*/
+
+static void scheduler_complete( scheduler_request *request )
+{
+	scheduler_request *pair = request->pair;
+
+	if ( pair != NULL )
+	{
+		scheduler_queue *parked = pair->queue;
+
+		if ( request->owned )
+			free( request < pair ? request : pair );
+		else
+			request->done = pair->done = 1;
+
+		if ( parked->head != NULL )
+			scheduler_ready_queue( parked );
+		else
+			parked->busy = 0;
+	}
+	else if ( request->owned )
+	{
+		free( request );
+	}
+	else
+	{
+		request->done = 1;
+	}
+
+	pthread_cond_broadcast( &scheduler_done );
+}
+
+/** Worker thread - takes one request at a time from the next ready queue so
+	that each unit is served in order while other units proceed in parallel.
+*/
+
+static void *scheduler_thread( void *arg )
+{
+	pthread_setspecific( scheduler_key, &scheduler_count );
+
+	pthread_mutex_lock( &scheduler_mutex );
+
+	while ( scheduler_running )
+	{
+		scheduler_queue *queue = scheduler_head;
+		scheduler_request *request = NULL;
+
+		if ( queue == NULL )
+		{
+			pthread_cond_wait( &scheduler_ready, &scheduler_mutex );
+			continue;
+		}
+
+		scheduler_head = queue->next;
+		if ( scheduler_head == NULL )
+			scheduler_tail = NULL;
+
+		request = queue->head;
+		queue->head = request->next;
+		if ( queue->head == NULL )
+			queue->tail = NULL;
+
+		/* The first of a pair to come up leaves its queue busy until the other does. */
+		if ( request->pair != NULL && !request->pair->arrived )
+		{
+			request->arrived = 1;
+			request->queue = queue;
+			continue;
+		}
+
+		pthread_mutex_unlock( &scheduler_mutex );
+		request->job( request->arg );
+		pthread_mutex_lock( &scheduler_mutex );
+
+		scheduler_complete( request );
+
+		if ( queue->head != NULL )
+			scheduler_ready_queue( queue );
+		else
+			queue->busy = 0;
+	}
+
+	pthread_mutex_unlock( &scheduler_mutex );
+
+	return NULL;
+}
+
+/** Start the worker pool.
+*/
+
+int melted_scheduler_init( int threads )
+{
+	int index = 0;
+
+	if ( threads <= 0 )
+		threads = MELTED_SCHEDULER_THREADS;
+
+	pthread_mutex_lock( &scheduler_mutex );
+
+	if ( !scheduler_running )
+	{
+		scheduler_threads = calloc( threads, sizeof( pthread_t ) );
+		if ( scheduler_threads != NULL )
+		{
+			pthread_key_create( &scheduler_key, NULL );
+			scheduler_running = 1;
+			for ( index = 0; index < threads; index ++ )
+				if ( pthread_create( &scheduler_threads[ index ], NULL, scheduler_thread, NULL ) != 0 )
+					break;
+			scheduler_count = index;
+		}
+	}
+
+	pthread_mutex_unlock( &scheduler_mutex );
+
+	return scheduler_count > 0 ? 0 : -1;
+}
+
+/** Append a request to the serial queue of a unit - must be called with the
+	mutex held.
+*/
+
+static void scheduler_queue_request( scheduler_queue *queue, scheduler_request *request )
+{
+	if ( queue->tail != NULL )
+		queue->tail->next = request;
+	else
+		queue->head = request;
+	queue->tail = request;
+
+	if ( !queue->busy )
+		scheduler_ready_queue( queue );
+}
+
+/** Run a job on the serial queue of the given unit and wait for it to finish.
+	The job runs directly on the calling thread when the scheduler is not
+	running, the unit is out of range or the caller is already a worker.
+*/
+
+void melted_scheduler_execute( int unit, melted_scheduler_job job, void *arg )
+{
+	scheduler_queue *queue = NULL;
+
+	pthread_mutex_lock( &scheduler_mutex );
+
+	if ( scheduler_running && scheduler_count > 0 && unit >= 0 && pthread_getspecific( scheduler_key ) == NULL )
+		queue = scheduler_get_queue( unit );
+
+	if ( queue != NULL )
+	{
+		scheduler_request request;
+
+		request.job = job;
+		request.arg = arg;
+		request.done = 0;
+		request.owned = 0;
+		request.next = NULL;
+
+		scheduler_queue_request( queue, &request );
+
+		while ( !request.done )
+			pthread_cond_wait( &scheduler_done, &scheduler_mutex );
+
+		pthread_mutex_unlock( &scheduler_mutex );
+	}
+	else
+	{
+		pthread_mutex_unlock( &scheduler_mutex );
+		job( arg );
+	}
+}
+
+/** Queue a job on the serial queue of the given unit without waiting for it.
+	The job runs in order with the unit's other requests, or directly on the
+	calling thread in the same cases as melted_scheduler_execute.
+*/
+
+void melted_scheduler_submit( int unit, melted_scheduler_job job, void *arg )
+{
+	scheduler_queue *queue = NULL;
+	scheduler_request *request = NULL;
+
+	pthread_mutex_lock( &scheduler_mutex );
+
+	if ( scheduler_running && scheduler_count > 0 && unit >= 0 && pthread_getspecific( scheduler_key ) == NULL )
+		queue = scheduler_get_queue( unit );
+	if ( queue != NULL )
+		request = calloc( 1, sizeof( scheduler_request ) );
+
+	if ( request != NULL )
+	{
+		request->job = job;
+		request->arg = arg;
+		request->owned = 1;
+		scheduler_queue_request( queue, request );
+		pthread_mutex_unlock( &scheduler_mutex );
+	}
+	else
+	{
+		pthread_mutex_unlock( &scheduler_mutex );
+		job( arg );
+	}
+}
+
+/** Queue a pair of requests on the queues of two units - must be called with
+	the mutex held. As both halves are queued at once, pairs sharing a unit
+	come up in the same order on every queue and can't wait on each other.
+*/
+
+static void scheduler_queue_pair( scheduler_queue *first, scheduler_queue *second, scheduler_request *pair, melted_scheduler_job job, void *arg, int owned )
+{
+	int index = 0;
+
+	for ( index = 0; index < 2; index ++ )
+	{
+		pair[ index ].job = job;
+		pair[ index ].arg = arg;
+		pair[ index ].done = 0;
+		pair[ index ].owned = owned;
+		pair[ index ].arrived = 0;
+		pair[ index ].queue = NULL;
+		pair[ index ].pair = &pair[ 1 - index ];
+		pair[ index ].next = NULL;
+	}
+
+	scheduler_queue_request( first, &pair[ 0 ] );
+	scheduler_queue_request( second, &pair[ 1 ] );
+}
+
+/** Run a job which changes two units once both of their queues have reached
+	it, so that neither unit runs anything else meanwhile, and wait for it to
+	finish. Falls back to melted_scheduler_execute on the first unit when the
+	units are the same or the second is out of range.
+*/
+
+void melted_scheduler_execute_pair( int unit, int other, melted_scheduler_job job, void *arg )
+{
+	scheduler_queue *first = NULL;
+	scheduler_queue *second = NULL;
+
+	if ( other < 0 || other == unit )
+	{
+		melted_scheduler_execute( unit, job, arg );
+		return;
+	}
+
+	pthread_mutex_lock( &scheduler_mutex );
+
+	if ( scheduler_running && scheduler_count > 0 && unit >= 0 && pthread_getspecific( scheduler_key ) == NULL )
+	{
+		first = scheduler_get_queue( unit );
+		second = scheduler_get_queue( other );
+	}
+
+	if ( first != NULL && second != NULL )
+	{
+		scheduler_request pair[ 2 ];
+
+		scheduler_queue_pair( first, second, pair, job, arg, 0 );
+
+		while ( !pair[ 0 ].done )
+			pthread_cond_wait( &scheduler_done, &scheduler_mutex );
+
+		pthread_mutex_unlock( &scheduler_mutex );
+	}
+	else
+	{
+		pthread_mutex_unlock( &scheduler_mutex );
+		job( arg );
+	}
+}
+
+/** Queue a job which changes two units without waiting for it, as for
+	melted_scheduler_execute_pair.
+*/
+
+void melted_scheduler_submit_pair( int unit, int other, melted_scheduler_job job, void *arg )
+{
+	scheduler_queue *first = NULL;
+	scheduler_queue *second = NULL;
+	scheduler_request *pair = NULL;
+
+	if ( other < 0 || other == unit )
+	{
+		melted_scheduler_submit( unit, job, arg );
+		return;
+	}
+
+	pthread_mutex_lock( &scheduler_mutex );
+
+	if ( scheduler_running && scheduler_count > 0 && unit >= 0 && pthread_getspecific( scheduler_key ) == NULL )
+	{
+		first = scheduler_get_queue( unit );
+		second = scheduler_get_queue( other );
+	}
+	if ( first != NULL && second != NULL )
+		pair = calloc( 2, sizeof( scheduler_request ) );
+
+	if ( pair != NULL )
+	{
+		scheduler_queue_pair( first, second, pair, job, arg, 1 );
+		pthread_mutex_unlock( &scheduler_mutex );
+	}
+	else
+	{
+		pthread_mutex_unlock( &scheduler_mutex );
+		job( arg );
+	}
+}
+
+/** Returns non-zero while jobs submitted from a thread other than a worker
+	are queued rather than run on that thread.
+*/
+
+int melted_scheduler_available( )
+{
+	int available = 0;
+	pthread_mutex_lock( &scheduler_mutex );
+	available = scheduler_running && scheduler_count > 0;
+	pthread_mutex_unlock( &scheduler_mutex );
+	return available;
+}
+
+/** Stop the worker pool once the current requests have completed.
+*/
+
+void melted_scheduler_close( )
+{
+	int index = 0;
+	int count = 0;
+
+	pthread_mutex_lock( &scheduler_mutex );
+	if ( scheduler_running )
+	{
+		scheduler_running = 0;
+		count = scheduler_count;
+		pthread_cond_broadcast( &scheduler_ready );
+	}
+	pthread_mutex_unlock( &scheduler_mutex );
+
+	for ( index = 0; index < count; index ++ )
+		pthread_join( scheduler_threads[ index ], NULL );
+
+	if ( count > 0 )
+	{
+		/* Anything still queued is run here so no caller is left waiting. */
+		pthread_mutex_lock( &scheduler_mutex );
+		for ( index = 0; index < scheduler_units; index ++ )
+		{
+			scheduler_request *request = scheduler_queues[ index ] != NULL ? scheduler_queues[ index ]->head : NULL;
+			while ( request != NULL )
+			{
+				scheduler_request *next = request->next;
+				scheduler_request *pair = request->pair;
+				if ( pair == NULL || pair->arrived != 2 )
+				{
+					pthread_mutex_unlock( &scheduler_mutex );
+					request->job( request->arg );
+					pthread_mutex_lock( &scheduler_mutex );
+				}
+				if ( pair == NULL && request->owned )
+					free( request );
+				else if ( pair == NULL )
+					request->done = 1;
+				else if ( pair->arrived == 0 )
+					request->arrived = 2;
+				else if ( request->owned )
+					free( request < pair ? request : pair );
+				else
+					request->done = pair->done = 1;
+				request = next;
+			}
+			free( scheduler_queues[ index ] );
+		}
+		free( scheduler_queues );
+		scheduler_queues = NULL;
+		scheduler_units = 0;
+		scheduler_head = NULL;
+		scheduler_tail = NULL;
+		scheduler_count = 0;
+		pthread_cond_broadcast( &scheduler_done );
+		pthread_mutex_unlock( &scheduler_mutex );
+		free( scheduler_threads );
+		scheduler_threads = NULL;
+	}
+}
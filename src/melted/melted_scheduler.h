@@ -0,0 +1,54 @@
+/*
+ * melted_scheduler.h -- Unit Command Scheduler
+ * Copyright (C) 2002-2015 Meltytech, LLC
+ * Author: Charles Yates <charles.yates@pandora.be>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#ifndef _MELTED_SCHEDULER_H_
+#define _MELTED_SCHEDULER_H_
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+/** Default number of worker threads.
+*/
+
+#define MELTED_SCHEDULER_THREADS 4
+
+/** A scheduled operation.
+*/
+
+typedef void ( *melted_scheduler_job )( void * );
+
+/** API for the scheduler.
+*/
+
+extern int melted_scheduler_init( int );
+extern void melted_scheduler_execute( int, melted_scheduler_job, void * );
+extern void melted_scheduler_submit( int, melted_scheduler_job, void * );
+extern void melted_scheduler_execute_pair( int, int, melted_scheduler_job, void * );
+extern void melted_scheduler_submit_pair( int, int, melted_scheduler_job, void * );
+extern int melted_scheduler_available( );
+extern void melted_scheduler_close( );
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -39,9 +39,17 @@
 /* Application header files */
 #include "melted_server.h"
 #include "melted_connection.h"
+#include "melted_event_loop.h"
 #include "melted_local.h"
 #include "melted_log.h"
 #include "melted_commands.h"
+#include "melted_batch.h"
+#include "melted_proxy.h"
+#include "melted_asrun.h"
+#include "melted_index.h"
+#include "melted_probe.h"
+#include "melted_replica.h"
+#include "melted_snapshot.h"
 #include <mvcp/mvcp_remote.h>
 #include <mvcp/mvcp_tokeniser.h>
 
@@ -147,11 +155,19 @@ static void *melted_server_run( void *arg )
 	connection_t *tmp = NULL;
 	pthread_attr_t thread_attributes;
 	socklen_t socksize;
+	int threads = mlt_properties_get_int( &server->parent, "io-threads" );
 
 	socksize = sizeof( struct sockaddr );
 
 	melted_log( LOG_NOTICE, "%s version %s listening on port %i", server->id, VERSION, server->port );
 
+	/* Use the event loop when a fixed number of I/O threads is requested. */
+	if ( threads > 0 && melted_event_loop_run( server, threads ) == 0 )
+	{
+		melted_log( LOG_NOTICE, "%s version %s server terminated.", server->id, VERSION );
+		return NULL;
+	}
+
 	/* Create the initial thread. We want all threads to be created detached so
 	   their resources get freed automatically. (CY: ... hmmph...) */
 	pthread_attr_init( &thread_attributes );
@@ -235,12 +251,20 @@ int melted_server_execute( melted_server server )
 	if ( !server->proxy )
 	{
 		melted_log( LOG_NOTICE, "Starting server on %d.", server->port );
+		if ( melted_asrun_init( mlt_properties_get( &server->parent, "asrun-file" ), mlt_properties_get( &server->parent, "asrun-format" ),
+								mlt_properties_get_int64( &server->parent, "asrun-size" ),
+								mlt_properties_get( &server->parent, "asrun-keep" ) ? mlt_properties_get_int( &server->parent, "asrun-keep" ) : 7 ) )
+			melted_log( LOG_ERR, "%s unable to start the as-run log.", server->id );
+		if ( mlt_properties_get_int( &server->parent, "index" ) && melted_index_init( mlt_properties_get_int( &server->parent, "index-rescan" ) ) )
+			melted_log( LOG_ERR, "%s unable to start the media index.", server->id );
+		if ( mlt_properties_get( &server->parent, "probe-cache" ) != NULL )
+			melted_probe_init( mlt_properties_get( &server->parent, "probe-cache" ), mlt_properties_get_int( &server->parent, "probe-cache-size" ) );
 		server->parser = melted_parser_init_local( );
 	}
 	else
 	{
 		melted_log( LOG_NOTICE, "Starting proxy for %s:%d on %d.", server->remote_server, server->remote_port, server->port );
-		server->parser = mvcp_parser_init_remote( server->remote_server, server->remote_port );
+		server->parser = melted_proxy_init( server->remote_server, server->remote_port, mlt_properties_get_int( &server->parent, "proxy-connections" ) );
 	}
 
 	response = mvcp_parser_connect( server->parser );
@@ -251,7 +275,10 @@ int melted_server_execute( melted_server server )
 		if ( response != NULL && !server->proxy && server->config != NULL )
 		{
 			mvcp_response_close( response );
-			response = mvcp_parser_run( server->parser, server->config );
+			if ( mlt_properties_get_int( &server->parent, "parallel-startup" ) )
+				response = melted_batch_run( server->parser, server->config );
+			else
+				response = mvcp_parser_run( server->parser, server->config );
 
 			if ( mvcp_response_count( response ) > 1 )
 			{
@@ -266,6 +293,24 @@ int melted_server_execute( melted_server server )
 		{
 			int result;
 			mvcp_response_close( response );
+			/* the units of the last snapshot are rebuilt before the next is written */
+			if ( !server->proxy && mlt_properties_get( &server->parent, "snapshot" ) != NULL )
+			{
+				if ( mlt_properties_get_int( &server->parent, "restore" ) )
+					melted_snapshot_restore( server->parser, mlt_properties_get( &server->parent, "snapshot" ) );
+				if ( melted_snapshot_init( mlt_properties_get( &server->parent, "snapshot" ), mlt_properties_get_int( &server->parent, "snapshot-interval" ) ) )
+					melted_log( LOG_ERR, "%s unable to start snapshots.", server->id );
+			}
+			else if ( mlt_properties_get_int( &server->parent, "restore" ) )
+			{
+				melted_log( LOG_ERR, "%s has no snapshot to restore.", server->id );
+			}
+			/* the standbys are brought up to date with what the configuration built */
+			if ( !server->proxy && mlt_properties_get( &server->parent, "replicate" ) != NULL &&
+				 melted_replica_init( mlt_properties_get( &server->parent, "replicate" ),
+									  mlt_properties_get_int( &server->parent, "replicate-interval" ),
+									  mlt_properties_get( &server->parent, "replicate-tolerance" ) ? mlt_properties_get_int( &server->parent, "replicate-tolerance" ) : 2 ) )
+				melted_log( LOG_ERR, "%s unable to start replication.", server->id );
 			result = pthread_create( &server->thread, NULL, melted_server_run, server );
 			if ( result )
 			{
@@ -302,9 +347,14 @@ void melted_server_shutdown( melted_server server )
 	{
 		server->shutdown = 1;
 		pthread_join( server->thread, NULL );
+		melted_replica_close( );
+		melted_snapshot_close( );
 		melted_server_set_config( server, NULL );
 		mvcp_parser_close( server->parser );
 		server->parser = NULL;
+		melted_asrun_close( );
+		melted_index_close( );
+		melted_probe_close( );
 		close( server->socket );
 	}
 }
@@ -0,0 +1,744 @@
+/*
+ * melted_snapshot.c -- Unit State Snapshots
+ * Copyright (C) 2002-2015 Meltytech, LLC
+ * Author: Charles Yates <charles.yates@pandora.be>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+/* System header files */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/time.h>
+
+/* MLT header files. */
+#include <framework/mlt.h>
+
+/* Application header files */
+#include "melted_snapshot.h"
+#include "melted_batch.h"
+#include "melted_commands.h"
+#include "melted_loader.h"
+#include "melted_replica.h"
+#include "melted_scheduler.h"
+#include "melted_log.h"
+
+/** File identification - the version changes with the layout.
+*/
+
+#define SNAPSHOT_MAGIC "MLTSNAP"
+#define SNAPSHOT_VERSION 2
+
+/** Header at the start of the file, followed by the records of the units.
+	Numbers are stored as is, so a snapshot is only read on the kind of
+	machine which wrote it.
+*/
+
+typedef struct
+{
+	char magic[ 8 ];
+	uint32_t version;
+	uint32_t units;
+	int64_t stamp;
+	uint32_t length;
+	uint32_t checksum;
+}
+snapshot_header;
+
+/* A unit is recorded as its index, state, speed, current clip and position,
+   the id its next clip will be given, the number of its settings and clips,
+   and its constructor. The settings follow as "name=value" strings, then
+   each clip as its id, in and out points, whether it is a document and its
+   file or document. Strings are stored as their length and bytes. */
+
+/** A growing buffer of the records written or the records being read.
+*/
+
+typedef struct
+{
+	char *data;
+	size_t size;
+	size_t used;
+	int error;
+}
+snapshot_buffer;
+
+/** The records of one unit, written on the unit's worker.
+*/
+
+typedef struct
+{
+	int unit;
+	snapshot_buffer *buffer;
+	int clips;
+}
+snapshot_capture;
+
+/** What is restored once every clip of a unit is in place.
+*/
+
+typedef struct
+{
+	int unit;
+	int status;
+	int speed;
+	int clip;
+	int32_t position;
+	int next_id;
+	int clips;
+}
+snapshot_unit;
+
+static pthread_mutex_t snapshot_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t snapshot_write_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t snapshot_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t snapshot_thread;
+static volatile int snapshot_running = 0;
+static char *snapshot_file = NULL;
+static int snapshot_interval = MELTED_SNAPSHOT_INTERVAL;
+static uint32_t snapshot_last = 0;
+
+/** Checksum the records.
+*/
+
+static uint32_t snapshot_hash( const char *data, size_t length )
+{
+	uint32_t hash = 2166136261u;
+	while ( length -- )
+		hash = ( hash ^ ( unsigned char )*data ++ ) * 16777619u;
+	return hash;
+}
+
+static void snapshot_put( snapshot_buffer *buffer, const void *data, size_t length )
+{
+	if ( !buffer->error && buffer->used + length > buffer->size )
+	{
+		size_t size = buffer->size > 0 ? buffer->size * 2 : 65536;
+		char *grown = NULL;
+		while ( size < buffer->used + length )
+			size *= 2;
+		if ( ( grown = realloc( buffer->data, size ) ) != NULL )
+		{
+			buffer->data = grown;
+			buffer->size = size;
+		}
+		else
+		{
+			buffer->error = 1;
+		}
+	}
+	if ( !buffer->error )
+	{
+		memcpy( buffer->data + buffer->used, data, length );
+		buffer->used += length;
+	}
+}
+
+static void snapshot_put_int( snapshot_buffer *buffer, int32_t value )
+{
+	snapshot_put( buffer, &value, sizeof( value ) );
+}
+
+static void snapshot_put_string( snapshot_buffer *buffer, const char *value )
+{
+	uint32_t length = value != NULL ? strlen( value ) : 0;
+	snapshot_put( buffer, &length, sizeof( length ) );
+	snapshot_put( buffer, value, length );
+}
+
+static void snapshot_get( snapshot_buffer *buffer, void *data, size_t length )
+{
+	if ( buffer->error || buffer->size - buffer->used < length )
+	{
+		buffer->error = 1;
+		memset( data, 0, length );
+	}
+	else
+	{
+		memcpy( data, buffer->data + buffer->used, length );
+		buffer->used += length;
+	}
+}
+
+static int32_t snapshot_get_int( snapshot_buffer *buffer )
+{
+	int32_t value = 0;
+	snapshot_get( buffer, &value, sizeof( value ) );
+	return value;
+}
+
+/** Read a string - the caller must free it.
+*/
+
+static char *snapshot_get_string( snapshot_buffer *buffer )
+{
+	uint32_t length = 0;
+	char *value = NULL;
+
+	snapshot_get( buffer, &length, sizeof( length ) );
+	if ( !buffer->error && buffer->size - buffer->used >= length && ( value = malloc( length + 1 ) ) != NULL )
+	{
+		memcpy( value, buffer->data + buffer->used, length );
+		value[ length ] = '\0';
+		buffer->used += length;
+	}
+	else
+	{
+		buffer->error = 1;
+	}
+
+	return value;
+}
+
+/** Record a clip. A document is serialised the first time and kept on the
+	cut until its in or out point changes.
+*/
+
+static void snapshot_clip( void *arg, const char *file, mlt_producer cut, int32_t in, int32_t out )
+{
+	snapshot_capture *capture = arg;
+	const char *doc = NULL;
+
+	if ( file == NULL )
+	{
+		mlt_properties properties = MLT_PRODUCER_PROPERTIES( cut );
+		doc = mlt_properties_get( properties, "_snapshot_doc" );
+		if ( doc == NULL || mlt_properties_get_int( properties, "_snapshot_in" ) != in ||
+			 mlt_properties_get_int( properties, "_snapshot_out" ) != out )
+		{
+			char *serialised = melted_replica_serialise( MLT_PRODUCER_SERVICE( cut ) );
+			if ( serialised == NULL )
+				return;
+			mlt_properties_set( properties, "_snapshot_doc", serialised );
+			mlt_properties_set_int( properties, "_snapshot_in", in );
+			mlt_properties_set_int( properties, "_snapshot_out", out );
+			free( serialised );
+			doc = mlt_properties_get( properties, "_snapshot_doc" );
+		}
+	}
+
+	snapshot_put_int( capture->buffer, melted_unit_clip_id( cut ) );
+	snapshot_put_int( capture->buffer, in );
+	snapshot_put_int( capture->buffer, out );
+	snapshot_put_int( capture->buffer, doc != NULL );
+	snapshot_put_string( capture->buffer, doc != NULL ? doc : file );
+	capture->clips ++;
+}
+
+/** Record a unit - runs on the unit's worker, so no command of the unit is
+	applied in between.
+*/
+
+static void snapshot_capture_unit( void *arg )
+{
+	snapshot_capture *capture = arg;
+	melted_unit unit = melted_acquire_unit( capture->unit );
+
+	if ( unit != NULL )
+	{
+		snapshot_buffer *buffer = capture->buffer;
+		mlt_properties settings = mlt_properties_get_data( unit->properties, "settings", NULL );
+		int count = settings != NULL ? mlt_properties_count( settings ) : 0;
+		mvcp_status_t status;
+		size_t clips = 0;
+		int index = 0;
+
+		melted_unit_get_status( unit, &status );
+		snapshot_put_int( buffer, capture->unit );
+		snapshot_put_int( buffer, status.status );
+		snapshot_put_int( buffer, status.speed );
+		snapshot_put_int( buffer, status.clip_index );
+		snapshot_put_int( buffer, status.position );
+		snapshot_put_int( buffer, melted_unit_next_id( unit ) );
+		snapshot_put_int( buffer, count );
+		clips = buffer->used;
+		snapshot_put_int( buffer, 0 );
+		snapshot_put_string( buffer, mlt_properties_get( unit->properties, "constructor" ) );
+
+		for ( index = 0; index < count; index ++ )
+		{
+			char setting[ 4096 ];
+			snprintf( setting, sizeof( setting ), "%s=%s", mlt_properties_get_name( settings, index ), mlt_properties_get_value( settings, index ) );
+			snapshot_put_string( buffer, setting );
+		}
+
+		melted_unit_clips( unit, snapshot_clip, capture );
+
+		// The number of clips is only known once they're all recorded
+		if ( !buffer->error )
+			memcpy( buffer->data + clips, &capture->clips, sizeof( int32_t ) );
+	}
+
+	melted_release_unit( unit );
+}
+
+/** Write the state of every unit to a file, replacing it at once so that a
+	crash leaves either the old snapshot or the new one. When only is set,
+	nothing is written if the state is the same as the last snapshot.
+	Returns non-zero if the snapshot could not be written.
+*/
+
+static int snapshot_save( const char *path, int only )
+{
+	snapshot_buffer buffer;
+	snapshot_header header;
+	char temp[ 1024 ];
+	FILE *file = NULL;
+	int count = melted_count_units( );
+	int error = 0;
+	int index = 0;
+
+	if ( path == NULL || *path == '\0' )
+		return -1;
+
+	memset( &buffer, 0, sizeof( buffer ) );
+	memset( &header, 0, sizeof( header ) );
+	memcpy( header.magic, SNAPSHOT_MAGIC, sizeof( SNAPSHOT_MAGIC ) );
+	header.version = SNAPSHOT_VERSION;
+
+	pthread_mutex_lock( &snapshot_write_mutex );
+
+	for ( index = 0; index < count; index ++ )
+	{
+		melted_unit unit = melted_acquire_unit( index );
+		if ( unit != NULL )
+		{
+			snapshot_capture capture = { index, &buffer, 0 };
+			melted_scheduler_execute( index, snapshot_capture_unit, &capture );
+			header.units ++;
+		}
+		melted_release_unit( unit );
+	}
+
+	header.stamp = ( int64_t )time( NULL );
+	header.length = buffer.used;
+	header.checksum = snapshot_hash( buffer.data, buffer.used );
+	error = buffer.error;
+
+	if ( !error && only && header.checksum == snapshot_last )
+	{
+		free( buffer.data );
+		pthread_mutex_unlock( &snapshot_write_mutex );
+		return 0;
+	}
+
+	snprintf( temp, sizeof( temp ), "%s.tmp", path );
+	if ( !error && ( file = fopen( temp, "wb" ) ) != NULL )
+	{
+		error = fwrite( &header, sizeof( header ), 1, file ) != 1 ||
+				( buffer.used > 0 && fwrite( buffer.data, buffer.used, 1, file ) != 1 ) ||
+				fflush( file ) != 0 || fsync( fileno( file ) ) != 0;
+		error = fclose( file ) != 0 || error;
+		error = error || rename( temp, path ) != 0;
+		if ( error )
+			unlink( temp );
+	}
+	else
+	{
+		error = 1;
+	}
+
+	if ( error )
+		melted_log( LOG_ERR, "SNAPSHOT unable to write %s: %s", path, strerror( errno ) );
+	else
+		snapshot_last = header.checksum;
+
+	pthread_mutex_unlock( &snapshot_write_mutex );
+
+	free( buffer.data );
+
+	return error;
+}
+
+/** Wait on the condition for a number of milliseconds - must be called with
+	the mutex held.
+*/
+
+static void snapshot_sleep( int milliseconds )
+{
+	struct timeval now;
+	struct timespec until;
+
+	gettimeofday( &now, NULL );
+	until.tv_sec = now.tv_sec + milliseconds / 1000;
+	until.tv_nsec = ( now.tv_usec + ( milliseconds % 1000 ) * 1000 ) * 1000;
+	if ( until.tv_nsec >= 1000000000 )
+	{
+		until.tv_sec ++;
+		until.tv_nsec -= 1000000000;
+	}
+	pthread_cond_timedwait( &snapshot_cond, &snapshot_mutex, &until );
+}
+
+/** Snapshot the units at the interval.
+*/
+
+static void *snapshot_run( void *arg )
+{
+	pthread_mutex_lock( &snapshot_mutex );
+
+	while ( snapshot_running )
+	{
+		snapshot_sleep( snapshot_interval );
+		if ( snapshot_running )
+		{
+			pthread_mutex_unlock( &snapshot_mutex );
+			snapshot_save( snapshot_file, 1 );
+			pthread_mutex_lock( &snapshot_mutex );
+		}
+	}
+
+	pthread_mutex_unlock( &snapshot_mutex );
+
+	return NULL;
+}
+
+/** Start snapshotting the units to the file, every interval milliseconds or
+	only on demand and at shutdown if the interval is negative. Returns
+	non-zero if the snapshots could not be started.
+*/
+
+int melted_snapshot_init( const char *path, int interval )
+{
+	int error = path == NULL || *path == '\0' || snapshot_file != NULL;
+
+	if ( !error )
+	{
+		snapshot_file = strdup( path );
+		snapshot_interval = interval != 0 ? interval : MELTED_SNAPSHOT_INTERVAL;
+		if ( snapshot_interval > 0 )
+		{
+			snapshot_running = 1;
+			error = pthread_create( &snapshot_thread, NULL, snapshot_run, NULL ) != 0;
+			snapshot_running = !error;
+		}
+		if ( snapshot_interval > 0 )
+			melted_log( LOG_NOTICE, "SNAPSHOT units to %s every %dms", path, snapshot_interval );
+		else
+			melted_log( LOG_NOTICE, "SNAPSHOT units to %s on demand", path );
+	}
+
+	return error;
+}
+
+/** Return the file snapshots are written to, or NULL if there is none.
+*/
+
+const char *melted_snapshot_path( )
+{
+	return snapshot_file;
+}
+
+/** Write a snapshot now, to the given file or the one snapshots are written
+	to if path is NULL. Returns non-zero if it could not be written.
+*/
+
+int melted_snapshot_write( const char *path )
+{
+	return snapshot_save( path != NULL ? path : snapshot_file, 0 );
+}
+
+/** Read a snapshot file and check that it is complete. Returns the records
+	and fills the header, or returns NULL.
+*/
+
+static char *snapshot_read( const char *path, snapshot_header *header )
+{
+	FILE *file = fopen( path, "rb" );
+	char *data = NULL;
+	int error = file == NULL;
+
+	if ( !error )
+		error = fread( header, sizeof( snapshot_header ), 1, file ) != 1 ||
+				memcmp( header->magic, SNAPSHOT_MAGIC, sizeof( SNAPSHOT_MAGIC ) ) || header->version != SNAPSHOT_VERSION;
+	if ( !error )
+		error = ( data = malloc( header->length + 1 ) ) == NULL ||
+				( header->length > 0 && fread( data, header->length, 1, file ) != 1 ) ||
+				snapshot_hash( data, header->length ) != header->checksum;
+	if ( file != NULL )
+		fclose( file );
+
+	if ( error )
+	{
+		free( data );
+		data = NULL;
+	}
+
+	return data;
+}
+
+/** Execute a restoring command, logging the ones which fail. Returns the
+	response, which the caller must close.
+*/
+
+static mvcp_response snapshot_execute( mvcp_parser parser, char *command, char *doc )
+{
+	mvcp_response response = NULL;
+
+	if ( doc != NULL )
+		response = mvcp_parser_received( parser, command, doc );
+	else
+		response = melted_batch_execute( parser, command );
+
+	if ( mvcp_response_get_error_code( response ) >= 300 )
+		melted_log( LOG_WARNING, "SNAPSHOT restoring \"%s\" failed with %d", command, mvcp_response_get_error_code( response ) );
+
+	return response;
+}
+
+/** Choose the unit to restore a recorded unit into - the unit with the same
+	index if it was built with the same constructor, or a new one. Returns
+	the index or -1.
+*/
+
+static int snapshot_unit_for( mvcp_parser parser, int index, const char *constructor )
+{
+	melted_unit unit = melted_acquire_unit( index );
+	char command[ 1024 ];
+	mvcp_response response = NULL;
+	int same = unit != NULL && !strcmp( mlt_properties_get( unit->properties, "constructor" ), constructor );
+
+	melted_release_unit( unit );
+
+	if ( same )
+	{
+		snprintf( command, sizeof( command ), "CLEAR U%d", index );
+	}
+	else
+	{
+		snprintf( command, sizeof( command ), "UADD %s", constructor );
+		index = -1;
+	}
+
+	response = snapshot_execute( parser, command, NULL );
+	if ( mvcp_response_get_error_code( response ) / 100 != 2 )
+		index = -1;
+	else if ( !same && mvcp_response_count( response ) > 1 )
+		sscanf( mvcp_response_get_line( response, 1 ), "U%d", &index );
+	mvcp_response_close( response );
+
+	return index;
+}
+
+/** Give the next clip of a unit its recorded id. Files are opened on the
+	loader and only take their id as they are added, so the files queued
+	before are waited for - that only happens where the ids aren't in
+	sequence, as after a clip was removed.
+*/
+
+static void snapshot_clip_id( mvcp_parser parser, snapshot_unit *unit, int id, int *expected )
+{
+	char command[ 64 ];
+
+	if ( id <= 0 || id == *expected )
+		return;
+
+	melted_loader_wait( unit->unit );
+	snprintf( command, sizeof( command ), "NEXTID U%d %d", unit->unit, id );
+	mvcp_response_close( snapshot_execute( parser, command, NULL ) );
+	*expected = id;
+}
+
+/** Rebuild the units recorded in a snapshot file through the parser. Units
+	recorded with the same constructor as one which already exists with the
+	same index are cleared and reused, others are added. Every file is opened
+	on the loader, so the clips of all the units open in parallel, and the
+	units go back to their clip, position and speed once all of their clips
+	are in place. Returns the number of units restored or -1 if the snapshot
+	could not be read. Files whose names hold a quote or a line break can't be
+	given in a command and are left out.
+*/
+
+int melted_snapshot_restore( mvcp_parser parser, const char *path )
+{
+	struct timespec start;
+	struct timespec end;
+	snapshot_header header;
+	snapshot_buffer buffer;
+	snapshot_unit *units = NULL;
+	char command[ 1024 ];
+	char *line = NULL;
+	mvcp_response response = NULL;
+	int restored = 0;
+	int clips = 0;
+	int index = 0;
+
+	memset( &buffer, 0, sizeof( buffer ) );
+	clock_gettime( CLOCK_MONOTONIC, &start );
+
+	if ( path == NULL || ( buffer.data = snapshot_read( path, &header ) ) == NULL )
+	{
+		melted_log( LOG_ERR, "SNAPSHOT unable to restore from %s", path != NULL ? path : "" );
+		return -1;
+	}
+	buffer.size = header.length;
+
+	units = calloc( header.units + 1, sizeof( snapshot_unit ) );
+
+	for ( index = 0; units != NULL && index < ( int )header.units && !buffer.error; index ++ )
+	{
+		snapshot_unit *unit = &units[ restored ];
+		int recorded = snapshot_get_int( &buffer );
+		int settings = 0;
+		int count = 0;
+		char *constructor = NULL;
+		int expected = 0;
+		int i = 0;
+
+		unit->status = snapshot_get_int( &buffer );
+		unit->speed = snapshot_get_int( &buffer );
+		unit->clip = snapshot_get_int( &buffer );
+		unit->position = snapshot_get_int( &buffer );
+		unit->next_id = snapshot_get_int( &buffer );
+		settings = snapshot_get_int( &buffer );
+		count = snapshot_get_int( &buffer );
+		constructor = snapshot_get_string( &buffer );
+		unit->unit = buffer.error ? -1 : snapshot_unit_for( parser, recorded, constructor );
+
+		if ( unit->unit >= 0 && unit->unit != recorded )
+			melted_log( LOG_WARNING, "SNAPSHOT restoring U%d as U%d", recorded, unit->unit );
+		else if ( unit->unit < 0 )
+			melted_log( LOG_ERR, "SNAPSHOT unable to restore U%d with %s", recorded, constructor != NULL ? constructor : "" );
+		free( constructor );
+
+		for ( i = 0; i < settings && !buffer.error; i ++ )
+		{
+			char *setting = snapshot_get_string( &buffer );
+			if ( unit->unit >= 0 && setting != NULL && ( line = malloc( strlen( setting ) + 32 ) ) != NULL )
+			{
+				sprintf( line, "USET U%d %s", unit->unit, setting );
+				mvcp_response_close( snapshot_execute( parser, line, NULL ) );
+				free( line );
+			}
+			free( setting );
+		}
+
+		for ( i = 0; i < count && !buffer.error; i ++ )
+		{
+			int id = snapshot_get_int( &buffer );
+			int32_t in = snapshot_get_int( &buffer );
+			int32_t out = snapshot_get_int( &buffer );
+			int doc = snapshot_get_int( &buffer );
+			char *value = snapshot_get_string( &buffer );
+
+			if ( unit->unit >= 0 && value != NULL && doc )
+			{
+				// A document goes after the files of the unit queued before it
+				snapshot_clip_id( parser, unit, id, &expected );
+				melted_loader_wait( unit->unit );
+				snprintf( command, sizeof( command ), "PUSH U%d", unit->unit );
+				mvcp_response_close( snapshot_execute( parser, command, value ) );
+				unit->clips ++;
+				expected ++;
+			}
+			else if ( unit->unit >= 0 && value != NULL && strpbrk( value, "\"\r\n" ) != NULL )
+			{
+				melted_log( LOG_WARNING, "SNAPSHOT unable to restore %s on U%d - the name can't be quoted", value, unit->unit );
+			}
+			else if ( unit->unit >= 0 && value != NULL && ( line = malloc( strlen( value ) + 64 ) ) != NULL )
+			{
+				snapshot_clip_id( parser, unit, id, &expected );
+				sprintf( line, "APND U%d \"%s\" %d %d", unit->unit, value, in, out );
+				response = snapshot_execute( parser, line, NULL );
+				if ( mvcp_response_get_error_code( response ) / 100 == 2 )
+					expected ++;
+				else
+					expected = 0;
+				mvcp_response_close( response );
+				free( line );
+				unit->clips ++;
+			}
+			free( value );
+		}
+
+		clips += unit->clips;
+		if ( unit->unit >= 0 )
+			restored ++;
+	}
+
+	if ( buffer.error )
+		melted_log( LOG_ERR, "SNAPSHOT %s is damaged - restored %d units", path, restored );
+
+	// The units go back to where they were once all of the clips are open
+	melted_loader_wait( -1 );
+
+	for ( index = 0; index < restored; index ++ )
+	{
+		snapshot_unit *unit = &units[ index ];
+
+		// Clips added later count on from the recorded ids
+		if ( unit->next_id > 0 )
+		{
+			snprintf( command, sizeof( command ), "NEXTID U%d %d", unit->unit, unit->next_id );
+			mvcp_response_close( snapshot_execute( parser, command, NULL ) );
+		}
+
+		if ( unit->clips == 0 || ( unit->status != unit_playing && unit->status != unit_paused && unit->status != unit_stopped ) )
+			continue;
+
+		snprintf( command, sizeof( command ), "GOTO U%d %d %d", unit->unit, unit->position, unit->clip );
+		mvcp_response_close( snapshot_execute( parser, command, NULL ) );
+		if ( unit->status == unit_playing )
+			snprintf( command, sizeof( command ), "PLAY U%d %d", unit->unit, unit->speed );
+		else if ( unit->status == unit_paused )
+			snprintf( command, sizeof( command ), "PAUSE U%d", unit->unit );
+		else
+			snprintf( command, sizeof( command ), "STOP U%d", unit->unit );
+		mvcp_response_close( snapshot_execute( parser, command, NULL ) );
+	}
+
+	clock_gettime( CLOCK_MONOTONIC, &end );
+	melted_log( LOG_NOTICE, "SNAPSHOT restored %d units with %d clips from %s, written %lds earlier, in %.3fs",
+				restored, clips, path, ( long )( time( NULL ) - header.stamp ),
+				( end.tv_sec - start.tv_sec ) + ( end.tv_nsec - start.tv_nsec ) / 1000000000.0 );
+
+	free( units );
+	free( buffer.data );
+
+	return restored;
+}
+
+/** Stop the periodic snapshots and write a last one. Must be called before
+	the units and their workers go.
+*/
+
+void melted_snapshot_close( )
+{
+	if ( snapshot_file == NULL )
+		return;
+
+	pthread_mutex_lock( &snapshot_mutex );
+	if ( snapshot_running )
+	{
+		snapshot_running = 0;
+		pthread_cond_broadcast( &snapshot_cond );
+		pthread_mutex_unlock( &snapshot_mutex );
+		pthread_join( snapshot_thread, NULL );
+	}
+	else
+	{
+		pthread_mutex_unlock( &snapshot_mutex );
+	}
+
+	snapshot_save( snapshot_file, 0 );
+	free( snapshot_file );
+	snapshot_file = NULL;
+}
@@ -0,0 +1,262 @@
+/*
+ * melted_trace.c -- Request Tracing
+ * Copyright (C) 2002-2015 Meltytech, LLC
+ * Author: Charles Yates <charles.yates@pandora.be>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+/* System header files */
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+
+/* Application header files */
+#include "melted_trace.h"
+#include "melted_metrics.h"
+#include "melted_commands.h"
+#include "melted_log.h"
+
+/** A command traced from the line being received to the first frame shown
+	after it changed its unit.
+*/
+
+typedef struct
+{
+	melted_trace trace;
+	char id[ MELTED_TRACE_ID ];
+	char command[ 128 ];
+	int unit;
+	int watching;
+	int ended;
+	int64_t stamps[ trace_points ];
+}
+trace_span;
+
+static pthread_mutex_t trace_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t trace_once = PTHREAD_ONCE_INIT;
+static pthread_key_t trace_key;
+static trace_span trace_ring[ MELTED_TRACE_RING ];
+static melted_trace trace_next = 0;
+static volatile int trace_waiting[ MELTED_MAX_UNITS ];
+
+static const char *trace_names[ trace_points ] = { "received", "dispatched", "locked", "executed", "flushed", "shown" };
+
+static void trace_key_create( )
+{
+	pthread_key_create( &trace_key, NULL );
+}
+
+/** Find the span of a trace which is still in the ring - must be called with
+	the mutex held.
+*/
+
+static trace_span *trace_find( melted_trace trace )
+{
+	trace_span *span = &trace_ring[ trace % MELTED_TRACE_RING ];
+	return trace != 0 && span->trace == trace ? span : NULL;
+}
+
+/** Log a span once its response is sent and, for unit commands, a frame has
+	been shown - must be called with the mutex held.
+*/
+
+static void trace_complete( trace_span *span )
+{
+	char text[ 512 ];
+	int64_t previous = span->stamps[ trace_received ];
+	int length = 0;
+	int point;
+
+	if ( !span->ended || span->watching )
+		return;
+
+	for ( point = trace_dispatched; point < trace_points; point ++ )
+	{
+		if ( span->stamps[ point ] == 0 )
+			continue;
+		length += snprintf( text + length, sizeof( text ) - length, " %s +%d", trace_names[ point ], ( int )( span->stamps[ point ] - previous ) );
+		previous = span->stamps[ point ];
+		if ( length >= sizeof( text ) )
+			break;
+	}
+
+	melted_log( LOG_INFO, "TRACE %s \"%s\"%s", span->id, span->command, text );
+}
+
+/** Start tracing a command which is prefixed by @id, moving the command past
+	the prefix. Returns 0 if the command isn't traced.
+*/
+
+melted_trace melted_trace_begin( char **command )
+{
+	trace_span *span = NULL;
+	melted_trace trace = 0;
+	char *id = *command;
+	size_t length = 0;
+
+	if ( id == NULL || *id != '@' )
+		return 0;
+
+	id ++;
+	length = strcspn( id, " \t" );
+	*command = id + length + strspn( id + length, " \t" );
+
+	pthread_mutex_lock( &trace_mutex );
+	if ( ++ trace_next == 0 )
+		trace_next = 1;
+	trace = trace_next;
+	span = &trace_ring[ trace % MELTED_TRACE_RING ];
+	if ( span->trace != 0 && span->watching && span->unit >= 0 && span->unit < MELTED_MAX_UNITS )
+		trace_waiting[ span->unit ] --;
+	memset( span, 0, sizeof( trace_span ) );
+	span->trace = trace;
+	span->unit = -1;
+	snprintf( span->id, sizeof( span->id ), "%.*s", ( int )length, id );
+	snprintf( span->command, sizeof( span->command ), "%s", *command );
+	span->stamps[ trace_received ] = melted_metrics_now( );
+	pthread_mutex_unlock( &trace_mutex );
+
+	return trace;
+}
+
+/** Set the command traced on this thread so the parser can find it.
+*/
+
+void melted_trace_set_current( melted_trace trace )
+{
+	pthread_once( &trace_once, trace_key_create );
+	pthread_setspecific( trace_key, ( void * )( intptr_t )trace );
+}
+
+/** The command traced on this thread.
+*/
+
+melted_trace melted_trace_current( )
+{
+	pthread_once( &trace_once, trace_key_create );
+	return ( melted_trace )( intptr_t )pthread_getspecific( trace_key );
+}
+
+/** Stamp a point of a traced command.
+*/
+
+void melted_trace_stamp( melted_trace trace, melted_trace_point point )
+{
+	if ( trace != 0 )
+	{
+		trace_span *span = NULL;
+		pthread_mutex_lock( &trace_mutex );
+		if ( ( span = trace_find( trace ) ) != NULL )
+			span->stamps[ point ] = melted_metrics_now( );
+		pthread_mutex_unlock( &trace_mutex );
+	}
+}
+
+/** Wait for the next frame shown on the unit the traced command changed.
+*/
+
+void melted_trace_watch( melted_trace trace, int unit )
+{
+	if ( trace != 0 && unit >= 0 && unit < MELTED_MAX_UNITS )
+	{
+		trace_span *span = NULL;
+		pthread_mutex_lock( &trace_mutex );
+		if ( ( span = trace_find( trace ) ) != NULL && !span->watching )
+		{
+			span->unit = unit;
+			span->watching = 1;
+			trace_waiting[ unit ] ++;
+		}
+		pthread_mutex_unlock( &trace_mutex );
+	}
+}
+
+/** Stamp the traced commands waiting for a frame on the unit - called for
+	every frame shown, so nothing is locked unless a trace is waiting.
+*/
+
+void melted_trace_frame( int unit )
+{
+	if ( unit >= 0 && unit < MELTED_MAX_UNITS && trace_waiting[ unit ] > 0 )
+	{
+		int64_t now = melted_metrics_now( );
+		int index;
+
+		pthread_mutex_lock( &trace_mutex );
+		for ( index = 0; index < MELTED_TRACE_RING && trace_waiting[ unit ] > 0; index ++ )
+		{
+			trace_span *span = &trace_ring[ index ];
+			if ( span->trace != 0 && span->watching && span->unit == unit )
+			{
+				span->stamps[ trace_shown ] = now;
+				span->watching = 0;
+				trace_waiting[ unit ] --;
+				trace_complete( span );
+			}
+		}
+		pthread_mutex_unlock( &trace_mutex );
+	}
+}
+
+/** Stamp the response of a traced command as sent.
+*/
+
+void melted_trace_end( melted_trace trace )
+{
+	if ( trace != 0 )
+	{
+		trace_span *span = NULL;
+		pthread_mutex_lock( &trace_mutex );
+		if ( ( span = trace_find( trace ) ) != NULL && !span->ended )
+		{
+			span->stamps[ trace_flushed ] = melted_metrics_now( );
+			span->ended = 1;
+			trace_complete( span );
+		}
+		pthread_mutex_unlock( &trace_mutex );
+	}
+}
+
+/** Report the recent traces, oldest first, with the microseconds from the
+	command being received to each point (-1 when not reached).
+*/
+
+void melted_trace_report( mvcp_response response )
+{
+	melted_trace last = 0;
+	int index;
+
+	pthread_mutex_lock( &trace_mutex );
+	last = trace_next;
+	for ( index = MELTED_TRACE_RING - 1; index >= 0; index -- )
+	{
+		trace_span *span = trace_find( last - index );
+		char text[ 256 ];
+		int length = 0;
+		int point;
+
+		if ( span == NULL )
+			continue;
+
+		for ( point = trace_dispatched; point < trace_points; point ++ )
+			length += snprintf( text + length, sizeof( text ) - length, " %d",
+								span->stamps[ point ] ? ( int )( span->stamps[ point ] - span->stamps[ trace_received ] ) : -1 );
+
+		mvcp_response_printf( response, 1024, "%s U%d%s \"%s\"\n", span->id, span->unit, text, span->command );
+	}
+	pthread_mutex_unlock( &trace_mutex );
+}
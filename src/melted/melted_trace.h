@@ -0,0 +1,74 @@
+/*
+ * melted_trace.h -- Request Tracing
+ * Copyright (C) 2002-2015 Meltytech, LLC
+ * Author: Charles Yates <charles.yates@pandora.be>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#ifndef _MELTED_TRACE_H_
+#define _MELTED_TRACE_H_
+
+#include <mvcp/mvcp_response.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+/** A traced command - 0 when the command isn't traced.
+*/
+
+typedef unsigned int melted_trace;
+
+/** The points at which a traced command is stamped.
+*/
+
+typedef enum
+{
+	trace_received,
+	trace_dispatched,
+	trace_locked,
+	trace_executed,
+	trace_flushed,
+	trace_shown,
+	trace_points
+}
+melted_trace_point;
+
+/** Number of recent traces kept for STATS TRACE.
+*/
+
+#define MELTED_TRACE_RING 256
+
+/** Longest trace id kept.
+*/
+
+#define MELTED_TRACE_ID 64
+
+extern melted_trace melted_trace_begin( char **command );
+extern void melted_trace_set_current( melted_trace trace );
+extern melted_trace melted_trace_current( void );
+extern void melted_trace_stamp( melted_trace trace, melted_trace_point point );
+extern void melted_trace_watch( melted_trace trace, int unit );
+extern void melted_trace_frame( int unit );
+extern void melted_trace_end( melted_trace trace );
+extern void melted_trace_report( mvcp_response response );
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -22,6 +22,11 @@
 #include <config.h>
 #endif
 
+/* Needed for thread affinity on linux */
+#if defined( __linux__ ) && !defined( _GNU_SOURCE )
+#define _GNU_SOURCE
+#endif
+
 #include <stdio.h>
 #include <unistd.h>
 #include <sys/ioctl.h>
@@ -34,17 +39,60 @@
 #include <errno.h>
 #include <signal.h>
 #include <limits.h>
+#include <sched.h>
+#include <pthread.h>
 
 #include <sys/mman.h>
 
 #include "melted_unit.h"
 #include "melted_log.h"
 #include "melted_local.h"
+#include "melted_cache.h"
+#include "melted_cue.h"
+#include "melted_metrics.h"
+#include "melted_trace.h"
+#include "melted_probe.h"
 
 #include <framework/mlt.h>
 
 /* Forward references */
+static int melted_unit_read_status( melted_unit, mvcp_status );
+static void melted_unit_publish_status( melted_unit, mvcp_status );
 static void melted_unit_status_communicate( melted_unit );
+static void melted_unit_frame_shown( mlt_consumer, melted_unit, mlt_frame );
+static void melted_unit_frame_rendered( mlt_consumer, melted_unit, mlt_frame );
+
+/** Number of play list edits remembered for LIST SINCE.
+*/
+
+#define MELTED_UNIT_JOURNAL 256
+
+/** Number of position only status updates sent per second of playback when
+	the status-interval property is not set.
+*/
+
+#define MELTED_UNIT_STATUS_RATE 5
+
+/** A journalled play list edit - the row is only kept for '+' and '='.
+*/
+
+typedef struct
+{
+	int generation;
+	char operation;
+	int index;
+	int dest;
+	char *row;
+}
+journal_entry;
+
+struct melted_unit_journal_s
+{
+	journal_entry entries[ MELTED_UNIT_JOURNAL ];
+	int head;
+	int count;
+	int horizon;
+};
 
 /** Allocate a new playout unit.
 
@@ -74,6 +122,12 @@ melted_unit melted_unit_init( int index, char *constructor )
 		mlt_properties_init( this->properties, this );
 		mlt_properties_set_int( this->properties, "unit", index );
 		mlt_properties_set_int( this->properties, "generation", 0 );
+		pthread_mutex_init( &this->status_mutex, NULL );
+		pthread_mutex_init( &this->prefetch_mutex, NULL );
+		pthread_cond_init( &this->prefetch_cond, NULL );
+		melted_asrun_clip_init( &this->asrun );
+		this->prefetch_clip = -1;
+		this->journal = calloc( 1, sizeof( struct melted_unit_journal_s ) );
 		mlt_properties_set( this->properties, "constructor", constructor );
 		mlt_properties_set( this->properties, "id", id );
 		mlt_properties_set( this->properties, "arg", arg );
@@ -81,6 +135,9 @@ melted_unit melted_unit_init( int index, char *constructor )
 		mlt_properties_set_data( this->properties, "consumer", consumer, 0, ( mlt_destructor )mlt_consumer_close, NULL );
 		mlt_properties_set_data( this->properties, "playlist", playlist, 0, ( mlt_destructor )mlt_playlist_close, NULL );
 		mlt_consumer_connect( consumer, MLT_PLAYLIST_SERVICE( playlist ) );
+		mlt_events_listen( MLT_CONSUMER_PROPERTIES( consumer ), this, "consumer-frame-show", ( mlt_listener )melted_unit_frame_shown );
+		mlt_events_listen( MLT_CONSUMER_PROPERTIES( consumer ), this, "consumer-frame-render", ( mlt_listener )melted_unit_frame_rendered );
+		melted_unit_status_communicate( this );
 	}
 
 	return this;
@@ -113,20 +170,295 @@ static void melted_unit_status_communicate( melted_unit unit )
 		mvcp_notifier notifier = mlt_properties_get_data( properties, "notifier", NULL );
 		mvcp_status_t status;
 
+		if ( melted_unit_read_status( unit, &status ) != 0 )
+			return;
+
+		melted_unit_publish_status( unit, &status );
+
 		if ( root_dir != NULL && notifier != NULL )
 		{
-			if ( melted_unit_get_status( unit, &status ) == 0 )
-				/* if ( !( ( status.status == unit_playing || status.status == unit_paused ) &&
+			/* if ( !( ( status.status == unit_playing || status.status == unit_paused ) &&
 						strcmp( status.clip, "" ) && 
 				    	!strcmp( status.tail_clip, "" ) && 
 						status.position == 0 && 
 						status.in == 0 && 
 						status.out == 0 ) ) */
-					mvcp_notifier_put( notifier, &status );
+			mvcp_notifier_put( notifier, &status );
+		}
+	}
+}
+
+/** Pre-roll the clips following the current one so that their first frames
+	are already in the disk cache when the playlist reaches them. Each clip
+	is read through a producer of its own - the cuts in the play list belong
+	to the consumer, which may be reading from them at the same time.
+*/
+
+static void melted_unit_prefetch_clips( melted_unit unit, int current, int count )
+{
+	mlt_properties properties = unit->properties;
+	mlt_playlist playlist = mlt_properties_get_data( properties, "playlist", NULL );
+	mlt_consumer consumer = mlt_properties_get_data( properties, "consumer", NULL );
+	mlt_profile profile = mlt_service_profile( MLT_CONSUMER_SERVICE( consumer ) );
+	int index = 0;
+
+	for ( index = current + 1; index <= current + count; index ++ )
+	{
+		mlt_playlist_clip_info info;
+		char *resource = NULL;
+		int32_t in = 0;
+
+		mlt_service_lock( MLT_PLAYLIST_SERVICE( playlist ) );
+		if ( index < mlt_playlist_count( playlist ) && mlt_playlist_get_clip_info( playlist, &info, index ) == 0 &&
+			 info.cut != NULL && info.resource != NULL && info.resource[ 0 ] != '\0' && info.resource[ 0 ] != '<' &&
+			 !mlt_properties_get_int( MLT_PRODUCER_PROPERTIES( info.cut ), "_melted_prefetched" ) )
+		{
+			resource = strdup( info.resource );
+			in = info.frame_in;
+			mlt_properties_set_int( MLT_PRODUCER_PROPERTIES( info.cut ), "_melted_prefetched", 1 );
 		}
+		mlt_service_unlock( MLT_PLAYLIST_SERVICE( playlist ) );
+
+		if ( resource != NULL && profile != NULL )
+		{
+			mlt_producer producer = mlt_factory_producer( profile, NULL, resource );
+			mlt_frame frame = NULL;
+			if ( producer != NULL )
+			{
+				mlt_producer_seek( producer, in );
+				if ( mlt_service_get_frame( MLT_PRODUCER_SERVICE( producer ), &frame, 0 ) == 0 && frame != NULL )
+				{
+					uint8_t *image = NULL;
+					mlt_image_format format = mlt_image_yuv422;
+					int width = profile->width;
+					int height = profile->height;
+					mlt_frame_get_image( frame, &image, &format, &width, &height, 0 );
+					mlt_frame_close( frame );
+				}
+				mlt_producer_close( producer );
+				melted_log( LOG_DEBUG, "prefetched clip %d", index );
+			}
+		}
+		free( resource );
 	}
 }
 
+/** Prefetch thread - waits for the current clip to change.
+*/
+
+static void *melted_unit_prefetch_thread( void *arg )
+{
+	melted_unit unit = arg;
+
+	pthread_mutex_lock( &unit->prefetch_mutex );
+	while ( unit->prefetch_running )
+	{
+		if ( unit->prefetch_clip >= 0 )
+		{
+			int current = unit->prefetch_clip;
+			mlt_playlist playlist = mlt_properties_get_data( unit->properties, "playlist", NULL );
+			int count = mlt_properties_get_int( MLT_PLAYLIST_PROPERTIES( playlist ), "prefetch" );
+			unit->prefetch_clip = -1;
+			pthread_mutex_unlock( &unit->prefetch_mutex );
+			melted_unit_prefetch_clips( unit, current, count );
+			pthread_mutex_lock( &unit->prefetch_mutex );
+		}
+		else
+		{
+			pthread_cond_wait( &unit->prefetch_cond, &unit->prefetch_mutex );
+		}
+	}
+	pthread_mutex_unlock( &unit->prefetch_mutex );
+
+	return NULL;
+}
+
+/** Request the clips following the current one to be prefetched.
+*/
+
+static void melted_unit_prefetch( melted_unit unit, int current )
+{
+	pthread_mutex_lock( &unit->prefetch_mutex );
+	if ( !unit->prefetch_running )
+		unit->prefetch_running = pthread_create( &unit->prefetch_thread, NULL, melted_unit_prefetch_thread, unit ) == 0;
+	unit->prefetch_clip = current;
+	pthread_cond_signal( &unit->prefetch_cond );
+	pthread_mutex_unlock( &unit->prefetch_mutex );
+}
+
+/** Stamp each frame as it is rendered so the time until it is shown can be
+	measured.
+*/
+
+static void melted_unit_frame_rendered( mlt_consumer consumer, melted_unit unit, mlt_frame frame )
+{
+	if ( frame != NULL )
+		mlt_properties_set_int64( MLT_FRAME_PROPERTIES( frame ), "_melted_rendered", melted_metrics_now( ) );
+}
+
+/** Record how well the consumer is keeping up - the time from rendering to
+	showing each frame, the jitter between frames and the frames which never
+	reached the output, either because the gap since the last frame spans
+	several periods or because the position skipped ahead. Gaps or latencies
+	longer than the frame-threshold property (milliseconds) are logged with
+	the clip on air. A skip is only counted within a clip and since the last
+	seek.
+*/
+
+static void melted_unit_frame_timing( melted_unit unit, mlt_frame frame, mvcp_status status )
+{
+	mlt_properties properties = unit->properties;
+	mlt_playlist playlist = mlt_properties_get_data( properties, "playlist", NULL );
+	int threshold = mlt_properties_get_int( MLT_PLAYLIST_PROPERTIES( playlist ), "frame-threshold" );
+	int64_t now = melted_metrics_now( );
+	int64_t rendered = frame != NULL ? mlt_properties_get_int64( MLT_FRAME_PROPERTIES( frame ), "_melted_rendered" ) : 0;
+	int64_t shown = mlt_properties_get_int64( properties, "_frame_shown" );
+	int position = frame != NULL ? mlt_frame_get_position( frame ) : 0;
+	int clip = mlt_playlist_get_clip_index_at( playlist, position );
+	int64_t period = status->fps > 0 ? 1000000 / status->fps : 40000;
+	int64_t latency = rendered > 0 ? now - rendered : -1;
+	int64_t interval = 0;
+	int dropped = 0;
+
+	// Gaps while paused, stopped or shuttling aren't drops
+	if ( status->status != unit_playing || status->speed == 0 )
+	{
+		mlt_properties_set_int64( properties, "_frame_shown", 0 );
+		return;
+	}
+
+	if ( shown > 0 )
+	{
+		int skipped = 0;
+		if ( status->speed == 1000 && clip == mlt_properties_get_int( properties, "_frame_clip" ) )
+			skipped = position - mlt_properties_get_int( properties, "_frame_position" ) - 1;
+		interval = now - shown;
+		dropped = ( interval + period / 2 ) / period - 1;
+		if ( skipped > dropped )
+			dropped = skipped;
+	}
+
+	mlt_properties_set_int64( properties, "_frame_shown", now );
+	mlt_properties_set_int( properties, "_frame_position", position );
+	mlt_properties_set_int( properties, "_frame_clip", clip );
+
+	melted_metrics_frame( status->unit, latency, interval, period );
+	if ( dropped > 0 )
+		melted_metrics_drop( status->unit, status->clip, status->position, dropped );
+
+	if ( threshold > 0 && ( interval > threshold * 1000 || latency > threshold * 1000 ) )
+		melted_log( LOG_WARNING, "U%d frame shown %d ms after rendering and %d ms after the last (%d dropped) at \"%s\" pos %d", status->unit,
+					( int )( latency / 1000 ), ( int )( interval / 1000 ), dropped, status->clip, status->position );
+}
+
+/** Forget the last frame shown, so that the jump of a seek or an edit isn't
+	counted as dropped frames.
+*/
+
+static void melted_unit_timing_reset( melted_unit unit )
+{
+	mlt_properties_set_int64( unit->properties, "_frame_shown", 0 );
+}
+
+/** Publish the status as frames are shown. Changes of clip, state or
+	playlist are sent immediately, otherwise the position is sent every
+	status-interval frames (0 disables position updates).
+*/
+
+/** Replace the clip fields of the status with those of the clip the frame
+	belongs to. Returns the stable id of the clip, or -1 if the frame isn't
+	from a clip of the play list.
+*/
+
+static int melted_unit_shown_status( melted_unit unit, mlt_frame frame, mvcp_status status )
+{
+	mlt_playlist playlist = mlt_properties_get_data( unit->properties, "playlist", NULL );
+	mlt_position position = mlt_frame_get_position( frame );
+	mlt_playlist_clip_info info;
+	int clip = 0;
+	int id = -1;
+
+	mlt_service_lock( MLT_PLAYLIST_SERVICE( playlist ) );
+	clip = mlt_playlist_get_clip_index_at( playlist, position );
+	if ( mlt_playlist_get_clip_info( playlist, &info, clip ) == 0 && info.cut != NULL &&
+		 info.resource != NULL && strcmp( info.resource, "" ) )
+	{
+		char *title = mlt_properties_get( MLT_PRODUCER_PROPERTIES( info.producer ), "title" );
+		if ( title == NULL )
+			title = strip_root( unit, info.resource );
+		strncpy( status->clip, title, sizeof( status->clip ) );
+		status->clip_index = clip;
+		status->fps = info.fps;
+		status->in = info.frame_in;
+		status->out = info.frame_out;
+		status->position = position - info.start + info.frame_in;
+		status->length = info.frame_count;
+		id = mlt_properties_get_int( MLT_PRODUCER_PROPERTIES( info.cut ), "_melted_id" );
+	}
+	mlt_service_unlock( MLT_PLAYLIST_SERVICE( playlist ) );
+
+	return id;
+}
+
+static void melted_unit_frame_shown( mlt_consumer consumer, melted_unit unit, mlt_frame frame )
+{
+	mlt_properties properties = unit->properties;
+	mvcp_notifier notifier = mlt_properties_get_data( properties, "notifier", NULL );
+	mlt_playlist playlist = mlt_properties_get_data( properties, "playlist", NULL );
+	char *value = mlt_properties_get( MLT_PLAYLIST_PROPERTIES( playlist ), "status-interval" );
+	int interval = 0;
+	int frames = mlt_properties_get_int( properties, "_status_frames" ) + 1;
+	int changed = 0;
+	mvcp_status_t status;
+	mvcp_status_t shown;
+	int id = -1;
+
+	if ( melted_unit_read_status( unit, &status ) != 0 )
+		return;
+
+	if ( value != NULL )
+		interval = atoi( value );
+	else if ( status.fps > MELTED_UNIT_STATUS_RATE )
+		interval = ( int )( status.fps / MELTED_UNIT_STATUS_RATE + 0.5 );
+	else
+		interval = 1;
+
+	// The play list runs ahead of the consumer - as-run and cues follow the frame shown
+	shown = status;
+	id = melted_unit_shown_status( unit, frame, &shown );
+
+	melted_unit_publish_status( unit, &status );
+	melted_asrun_frame( &unit->asrun, &shown );
+	melted_trace_frame( status.unit );
+	melted_unit_frame_timing( unit, frame, &status );
+
+	if ( melted_cue_waiting( ) && id != -1 )
+		melted_cue_frame( status.unit, shown.clip_index, id, shown.position );
+
+	changed = status.clip_index != mlt_properties_get_int( properties, "_status_clip" ) ||
+			  status.generation != mlt_properties_get_int( properties, "_status_generation" );
+
+	if ( changed && mlt_properties_get_int( MLT_PLAYLIST_PROPERTIES( playlist ), "prefetch" ) > 0 )
+		melted_unit_prefetch( unit, status.clip_index );
+
+	// State and clip changes go out on their frame, position only updates every interval frames
+	changed = changed || status.status != mlt_properties_get_int( properties, "_status_state" ) ||
+			  status.speed != mlt_properties_get_int( properties, "_status_speed" );
+
+	if ( changed || ( interval > 0 && frames >= interval ) )
+	{
+		mlt_properties_set_int( properties, "_status_clip", status.clip_index );
+		mlt_properties_set_int( properties, "_status_state", status.status );
+		mlt_properties_set_int( properties, "_status_speed", status.speed );
+		mlt_properties_set_int( properties, "_status_generation", status.generation );
+		if ( notifier != NULL )
+			mvcp_notifier_put( notifier, &status );
+		frames = 0;
+	}
+
+	mlt_properties_set_int( properties, "_status_frames", frames );
+}
+
 /** Set the notifier info
 */
 
@@ -144,32 +476,382 @@ void melted_unit_set_notifier( melted_unit this, mvcp_notifier notifier, char *r
 	melted_unit_status_communicate( this );
 }
 
-/** Create or locate a producer for the file specified.
+/** Obtain the producer cache of the unit, creating or resizing it according
+	to the cache-size property. Returns NULL when caching is disabled.
+*/
+
+static melted_cache melted_unit_cache( melted_unit unit )
+{
+	mlt_properties properties = unit->properties;
+	mlt_playlist playlist = mlt_properties_get_data( properties, "playlist", NULL );
+	int size = mlt_properties_get_int( MLT_PLAYLIST_PROPERTIES( playlist ), "cache-size" );
+	melted_cache cache = mlt_properties_get_data( properties, "_cache", NULL );
+
+	if ( size != mlt_properties_get_int( properties, "_cache_size" ) )
+	{
+		cache = size > 0 ? melted_cache_init( size ) : NULL;
+		mlt_properties_set_data( properties, "_cache", cache, 0, ( mlt_destructor )melted_cache_close, NULL );
+		mlt_properties_set_int( properties, "_cache_size", size );
+	}
+
+	return cache;
+}
+
+/** Create or locate a producer for the file specified using the profile and
+	producer properties of the unit. Safe to call off the unit's command queue.
 */
 
-static mlt_producer locate_producer( melted_unit unit, char *file )
+mlt_producer melted_unit_open( melted_unit unit, char *file )
 {
 	// Try to get the profile from the consumer
 	mlt_consumer consumer = mlt_properties_get_data( unit->properties, "consumer", NULL );
 	mlt_properties m_prop = mlt_properties_get_data( unit->properties, "producer", NULL );
-	mlt_producer producer;
+	mlt_producer producer = NULL;
 	mlt_profile profile = NULL;
+	melted_cache cache = NULL;
+	melted_probe_t probe;
+	int probed = 0;
+	int64_t start = melted_metrics_now( );
 
 	if ( consumer != NULL )
 	{
 		profile = mlt_service_profile( MLT_CONSUMER_SERVICE( consumer ) );
 	}
 
-	producer = mlt_factory_producer( profile, NULL, file );
+	// The cache may be replaced by a cache-size change from the unit queue
+	mlt_properties_lock( unit->properties );
+	cache = melted_unit_cache( unit );
+	if ( cache != NULL )
+		producer = melted_cache_get( cache, file );
+	mlt_properties_unlock( unit->properties );
+
+	if ( producer != NULL )
+	{
+		melted_log( LOG_DEBUG, "reusing cached producer for %s", file );
+		melted_metrics_open( mlt_properties_get_int( unit->properties, "unit" ), melted_metrics_now( ) - start, 1 );
+		return producer;
+	}
+
+	// Naming the service found last time saves the loader from detecting it
+	if ( strchr( file, ':' ) == NULL && melted_probe_get( file, &probe ) == 0 && probe.service[ 0 ] != '\0' )
+	{
+		char resource[ 1024 + sizeof( probe.service ) ];
+		snprintf( resource, sizeof( resource ), "%s:%s", probe.service, file );
+		producer = mlt_factory_producer( profile, NULL, resource );
+		probed = producer != NULL;
+	}
+
+	if ( producer == NULL )
+		producer = mlt_factory_producer( profile, NULL, file );
 	if( producer )
 	{
 		mlt_properties p_prop = mlt_producer_properties( producer );
+		if ( !probed )
+			melted_probe_put( file, producer );
 		mlt_properties_inherit ( p_prop, m_prop );
+		mlt_properties_lock( unit->properties );
+		cache = melted_unit_cache( unit );
+		if ( cache != NULL )
+			melted_cache_put( cache, file, producer );
+		mlt_properties_unlock( unit->properties );
 	}
 
+	melted_metrics_open( mlt_properties_get_int( unit->properties, "unit" ), melted_metrics_now( ) - start, 0 );
+
 	return producer;
 }
 
+/** Format the LIST row of a clip into the buffer given.
+*/
+
+static int format_clip( melted_unit unit, mlt_playlist playlist, int index, char *row, size_t size )
+{
+	mlt_playlist_clip_info info;
+	char *title = NULL;
+
+	if ( mlt_playlist_get_clip_info( playlist, &info, index ) != 0 )
+		return -1;
+
+	title = mlt_properties_get( MLT_PRODUCER_PROPERTIES( info.producer ), "title" );
+	if ( title == NULL )
+		title = strip_root( unit, info.resource );
+
+	return snprintf( row, size, "%d \"%s\" %d %d %d %d %.2f %d\n",
+					 index,
+					 title,
+					 info.frame_in,
+					 info.frame_out,
+					 info.frame_count,
+					 info.length,
+					 info.fps,
+					 mlt_properties_get_int( MLT_PRODUCER_PROPERTIES( info.cut ), "_melted_id" ) );
+}
+
+/** Give the clip at the index its stable id, or a new one if id is 0.
+*/
+
+static void assign_clip_id( melted_unit unit, mlt_playlist playlist, int index, int id )
+{
+	mlt_producer cut = mlt_playlist_get_clip( playlist, index );
+
+	if ( cut != NULL )
+	{
+		if ( id <= 0 )
+		{
+			id = mlt_properties_get_int( unit->properties, "_clip_id" ) + 1;
+			mlt_properties_set_int( unit->properties, "_clip_id", id );
+		}
+		mlt_properties_set_int( MLT_PRODUCER_PROPERTIES( cut ), "_melted_id", id );
+	}
+}
+
+/** The stable id of a clip of the play list.
+*/
+
+int melted_unit_clip_id( mlt_producer cut )
+{
+	return mlt_properties_get_int( MLT_PRODUCER_PROPERTIES( cut ), "_melted_id" );
+}
+
+/** The id the next clip added to the unit will be given.
+*/
+
+int melted_unit_next_id( melted_unit unit )
+{
+	return mlt_properties_get_int( unit->properties, "_clip_id" ) + 1;
+}
+
+/** Set the id the next clip added to the unit will be given - later clips
+	count on from it.
+*/
+
+void melted_unit_set_next_id( melted_unit unit, int id )
+{
+	mlt_properties_set_int( unit->properties, "_clip_id", id > 0 ? id - 1 : 0 );
+}
+
+/** Journal an edit that takes effect at the next generation. Rows are copied
+	from the play list as it is now, so call this after making the change.
+*/
+
+static void journal_edit( melted_unit unit, char operation, int index, int dest )
+{
+	melted_unit_journal journal = unit->journal;
+	mlt_playlist playlist = mlt_properties_get_data( unit->properties, "playlist", NULL );
+	journal_entry *entry = NULL;
+	char row[ 10240 ];
+
+	if ( journal == NULL )
+		return;
+
+	entry = &journal->entries[ ( journal->head + journal->count ) % MELTED_UNIT_JOURNAL ];
+	if ( journal->count == MELTED_UNIT_JOURNAL )
+	{
+		// Overwrite the oldest and remember that its generation is incomplete
+		journal->horizon = entry->generation;
+		free( entry->row );
+		journal->head = ( journal->head + 1 ) % MELTED_UNIT_JOURNAL;
+	}
+	else
+	{
+		journal->count ++;
+	}
+
+	entry->generation = mlt_properties_get_int( unit->properties, "generation" ) + 1;
+	entry->operation = operation;
+	entry->index = index;
+	entry->dest = dest;
+	entry->row = NULL;
+	if ( ( operation == '+' || operation == '=' ) && format_clip( unit, playlist, index, row, sizeof( row ) ) > 0 )
+		entry->row = strdup( row );
+}
+
+/** Journal a play list which has been replaced whole - a reset followed by
+	every clip it now holds.
+*/
+
+static void journal_playlist( melted_unit unit, mlt_playlist playlist )
+{
+	int i = 0;
+
+	journal_edit( unit, '*', 0, 0 );
+	for ( i = 0; i < mlt_playlist_count( playlist ); i ++ )
+		journal_edit( unit, '+', i, 0 );
+}
+
+/** Keep play list index arguments within the range MLT clamps them to.
+*/
+
+static int clamp_index( int index, int count )
+{
+	return index < 0 ? 0 : index >= count ? count - 1 : index;
+}
+
+/** Play list changes shared by the immediate and batched paths - these must
+	be called with the play list locked.
+*/
+
+static void playlist_insert( melted_unit unit, mlt_playlist playlist, mlt_producer producer, int index, int32_t in, int32_t out )
+{
+	if ( mlt_playlist_insert( playlist, producer, index, in, out ) == 0 )
+	{
+		index = clamp_index( index, mlt_playlist_count( playlist ) );
+		assign_clip_id( unit, playlist, index, 0 );
+		journal_edit( unit, '+', index, 0 );
+	}
+}
+
+static void playlist_append( melted_unit unit, mlt_playlist playlist, mlt_producer producer, int32_t in, int32_t out, int id )
+{
+	if ( mlt_playlist_append_io( playlist, producer, in, out ) == 0 )
+	{
+		assign_clip_id( unit, playlist, mlt_playlist_count( playlist ) - 1, id );
+		journal_edit( unit, '+', mlt_playlist_count( playlist ) - 1, 0 );
+	}
+}
+
+static void playlist_remove( melted_unit unit, mlt_playlist playlist, int index )
+{
+	if ( mlt_playlist_remove( playlist, index ) == 0 )
+		journal_edit( unit, '-', index, 0 );
+}
+
+static void playlist_move( melted_unit unit, mlt_playlist playlist, int src, int dest )
+{
+	int count = mlt_playlist_count( playlist );
+	if ( count > 0 && mlt_playlist_move( playlist, src, dest ) == 0 )
+		journal_edit( unit, '>', clamp_index( src, count ), clamp_index( dest, count ) );
+}
+
+/** Play list edit operations that can be batched.
+*/
+
+typedef enum
+{
+	edit_insert,
+	edit_append,
+	edit_remove,
+	edit_move
+}
+edit_operation;
+
+struct melted_unit_edit_s
+{
+	edit_operation operation;
+	mlt_producer producer;
+	int index;
+	int dest;
+	int32_t in;
+	int32_t out;
+	struct melted_unit_edit_s *next;
+};
+
+static pthread_key_t session_key;
+static pthread_once_t session_once = PTHREAD_ONCE_INIT;
+
+static void session_key_create( )
+{
+	pthread_key_create( &session_key, NULL );
+}
+
+/** Set the session (the client connection) whose command runs on this thread.
+*/
+
+void melted_unit_set_session( void *session )
+{
+	pthread_once( &session_once, session_key_create );
+	pthread_setspecific( session_key, session );
+}
+
+/** The session whose command runs on this thread - NULL for commands the
+	server issues itself.
+*/
+
+void *melted_unit_session( )
+{
+	pthread_once( &session_once, session_key_create );
+	return pthread_getspecific( session_key );
+}
+
+/** Record an edit while a batch is open. Returns 0 if no batch is open and
+	the edit should be applied immediately, and -1 if the batch belongs to
+	another session and the edit is refused.
+*/
+
+static int record_edit( melted_unit unit, edit_operation operation, mlt_producer producer, int index, int dest, int32_t in, int32_t out )
+{
+	melted_unit_edit edit = NULL;
+
+	if ( !unit->batching )
+		return 0;
+	if ( unit->batch_session != melted_unit_session( ) )
+		return -1;
+
+	edit = calloc( 1, sizeof( struct melted_unit_edit_s ) );
+	if ( edit != NULL )
+	{
+		edit->operation = operation;
+		edit->producer = producer;
+		edit->index = index;
+		edit->dest = dest;
+		edit->in = in;
+		edit->out = out;
+		if ( producer != NULL )
+			mlt_properties_inc_ref( MLT_PRODUCER_PROPERTIES( producer ) );
+		if ( unit->batch_tail != NULL )
+			unit->batch_tail->next = edit;
+		else
+			unit->batch_head = edit;
+		unit->batch_tail = edit;
+	}
+
+	return 1;
+}
+
+/** Apply a recorded edit - must be called with the play list locked.
+*/
+
+static void apply_edit( melted_unit unit, mlt_playlist playlist, melted_unit_edit edit )
+{
+	switch( edit->operation )
+	{
+		case edit_insert:
+			playlist_insert( unit, playlist, edit->producer, edit->index, edit->in, edit->out );
+			break;
+		case edit_append:
+			playlist_append( unit, playlist, edit->producer, edit->in, edit->out, 0 );
+			break;
+		case edit_remove:
+			playlist_remove( unit, playlist, edit->index );
+			break;
+		case edit_move:
+			playlist_move( unit, playlist, edit->index, edit->dest );
+			break;
+	}
+}
+
+/** Discard the recorded edits and close the batch.
+*/
+
+static int release_edits( melted_unit unit )
+{
+	int count = 0;
+
+	while ( unit->batch_head != NULL )
+	{
+		melted_unit_edit edit = unit->batch_head;
+		unit->batch_head = edit->next;
+		mlt_producer_close( edit->producer );
+		free( edit );
+		count ++;
+	}
+	unit->batch_tail = NULL;
+	unit->batch_session = NULL;
+	unit->batching = 0;
+
+	return count;
+}
+
 /** Update the generation count.
 */
 
@@ -192,8 +874,46 @@ static void clear_unit( melted_unit unit )
 
 	mlt_service_lock( MLT_PLAYLIST_SERVICE( playlist ) );
 	mlt_playlist_clear( playlist );
+	journal_edit( unit, '*', 0, 0 );
 	mlt_producer_seek( producer, 0 );
 	mlt_properties_set_int( MLT_CONSUMER_PROPERTIES(consumer), "refresh", 1 );
+	melted_unit_timing_reset( unit );
+	mlt_service_unlock( MLT_PLAYLIST_SERVICE( playlist ) );
+
+	update_generation( unit );
+}
+
+/** Remove the clips before and/or after the playing clip in place. The
+	playing clip's producer, the play list position and the consumer's
+	buffered frames are left alone, so trimming a live unit does not
+	disturb the output.
+*/
+
+static void trim_unit( melted_unit unit, int before, int after )
+{
+	mlt_properties properties = unit->properties;
+	mlt_playlist playlist = mlt_properties_get_data( properties, "playlist", NULL );
+	mlt_playlist_clip_info info;
+	int current = 0;
+	int count = 0;
+
+	mlt_service_lock( MLT_PLAYLIST_SERVICE( playlist ) );
+	current = mlt_playlist_current_clip( playlist );
+	count = mlt_playlist_count( playlist );
+
+	if ( mlt_playlist_get_clip_info( playlist, &info, current ) == 0 && info.producer != NULL )
+	{
+		if ( after )
+			while ( -- count > current )
+				playlist_remove( unit, playlist, count );
+
+		if ( before && info.start > 0 )
+		{
+			mlt_playlist_remove_region( playlist, 0, info.start );
+			while ( current -- > 0 )
+				journal_edit( unit, '-', 0, 0 );
+		}
+	}
 	mlt_service_unlock( MLT_PLAYLIST_SERVICE( playlist ) );
 
 	update_generation( unit );
@@ -204,84 +924,220 @@ static void clear_unit( melted_unit unit )
 
 static void clean_unit( melted_unit unit )
 {
+	trim_unit( unit, 1, 1 );
+}
+
+/** Remove everything up to the current clip from the unit.
+*/
+
+static void wipe_unit( melted_unit unit )
+{
+	trim_unit( unit, 1, 0 );
+}
+
+/** Generate a report on all loaded clips.
+*/
+
+void melted_unit_report_list( melted_unit unit, mvcp_response response )
+{
+	int i;
 	mlt_properties properties = unit->properties;
+	int generation = mlt_properties_get_int( properties, "generation" );
 	mlt_playlist playlist = mlt_properties_get_data( properties, "playlist", NULL );
-	mlt_consumer consumer = mlt_properties_get_data( properties, "consumer", NULL );
-	mlt_playlist_clip_info info;
-	int current = mlt_playlist_current_clip( playlist );
-	mlt_producer producer = MLT_PLAYLIST_PRODUCER( playlist );
-	mlt_position position = mlt_producer_frame( producer );
-	double speed = mlt_producer_get_speed( producer );
-	mlt_playlist_get_clip_info( playlist, &info, current );
+	char row[ 10240 ];
 
-	if ( info.producer != NULL )
+	mvcp_response_printf( response, 1024, "%d\n", generation );
+		
+	for ( i = 0; i < mlt_playlist_count( playlist ); i ++ )
 	{
-		mlt_properties_inc_ref( MLT_PRODUCER_PROPERTIES( info.producer ) );
-		position -= info.start;
-		clear_unit( unit );
-		mlt_service_lock( MLT_PLAYLIST_SERVICE( playlist ) );
-		mlt_playlist_append_io( playlist, info.producer, info.frame_in, info.frame_out );
-		mlt_producer_seek( producer, position );
-		mlt_producer_set_speed( producer, speed );
-		mlt_properties_set_int( MLT_CONSUMER_PROPERTIES(consumer), "refresh", 1 );
-		mlt_service_unlock( MLT_PLAYLIST_SERVICE( playlist ) );
-		mlt_producer_close( info.producer );
+		int length = format_clip( unit, playlist, i, row, sizeof( row ) );
+		if ( length > 0 )
+			mvcp_response_write( response, row, length );
+	}
+	mvcp_response_printf( response, 1024, "\n" );
+}
+
+/** Report the play list edits made after the given generation, or the full
+	list if the journal no longer covers it.
+*/
+
+void melted_unit_report_changes( melted_unit unit, mvcp_response response, int since )
+{
+	melted_unit_journal journal = unit->journal;
+	int generation = mlt_properties_get_int( unit->properties, "generation" );
+	int i;
+
+	if ( journal == NULL || since < journal->horizon || since > generation )
+	{
+		melted_unit_report_list( unit, response );
+		return;
+	}
+
+	mvcp_response_printf( response, 1024, "%d %d\n", generation, since );
+
+	for ( i = 0; i < journal->count; i ++ )
+	{
+		journal_entry *entry = &journal->entries[ ( journal->head + i ) % MELTED_UNIT_JOURNAL ];
+		if ( entry->generation <= since )
+			continue;
+		switch( entry->operation )
+		{
+			case '+':
+			case '=':
+				mvcp_response_printf( response, 10240, "%c %s", entry->operation, entry->row != NULL ? entry->row : "\n" );
+				break;
+			case '-':
+				mvcp_response_printf( response, 1024, "- %d\n", entry->index );
+				break;
+			case '>':
+				mvcp_response_printf( response, 1024, "> %d %d\n", entry->index, entry->dest );
+				break;
+			case '*':
+				mvcp_response_printf( response, 1024, "*\n" );
+				break;
+		}
+	}
+	mvcp_response_printf( response, 1024, "\n" );
+}
+
+/** Describe each clip of the unit: its file relative to the root with its in
+	and out points, or a NULL file with the cut when the clip wasn't opened
+	from a file.
+*/
+
+void melted_unit_clips( melted_unit unit, melted_unit_clip callback, void *data )
+{
+	mlt_playlist playlist = mlt_properties_get_data( unit->properties, "playlist", NULL );
+	int i;
+
+	mlt_service_lock( MLT_PLAYLIST_SERVICE( playlist ) );
+	for ( i = 0; i < mlt_playlist_count( playlist ); i ++ )
+	{
+		mlt_playlist_clip_info info;
+		if ( mlt_playlist_get_clip_info( playlist, &info, i ) != 0 )
+			continue;
+		if ( info.resource == NULL || info.resource[ 0 ] == '\0' || info.resource[ 0 ] == '<' )
+			callback( data, NULL, info.cut, info.frame_in, info.frame_out );
+		else
+			callback( data, strip_root( unit, info.resource ), info.cut, info.frame_in, info.frame_out );
+	}
+	mlt_service_unlock( MLT_PLAYLIST_SERVICE( playlist ) );
+}
+
+/** Turns the clips of a unit into the commands which rebuild them.
+*/
+
+typedef struct
+{
+	int unit;
+	melted_unit_command callback;
+	void *data;
+}
+replicate_clips;
+
+static void replicate_clip( void *arg, const char *file, mlt_producer cut, int32_t in, int32_t out )
+{
+	replicate_clips *clips = arg;
+	char command[ 4096 ];
+
+	// Give the clip the same id, so that #id references resolve alike
+	snprintf( command, sizeof( command ), "NEXTID U%d %d", clips->unit, melted_unit_clip_id( cut ) );
+	clips->callback( clips->data, command, NULL );
+
+	if ( file == NULL )
+	{
+		snprintf( command, sizeof( command ), "PUSH U%d", clips->unit );
+		clips->callback( clips->data, command, MLT_PRODUCER_SERVICE( cut ) );
+	}
+	else
+	{
+		snprintf( command, sizeof( command ), "APND U%d \"%s\" %d %d", clips->unit, file, in, out );
+		clips->callback( clips->data, command, NULL );
+	}
+}
+
+/** Describe the unit as the commands which rebuild it on another server: its
+	clips with their ids followed by its position and speed. Clips which
+	weren't opened from a file are passed as the service to PUSH.
+*/
+
+void melted_unit_replicate( melted_unit unit, melted_unit_command callback, void *data )
+{
+	int index = mlt_properties_get_int( unit->properties, "unit" );
+	replicate_clips clips = { index, callback, data };
+	mvcp_status_t status;
+	char command[ 4096 ];
+
+	snprintf( command, sizeof( command ), "CLEAR U%d", index );
+	callback( data, command, NULL );
+
+	melted_unit_clips( unit, replicate_clip, &clips );
+	snprintf( command, sizeof( command ), "NEXTID U%d %d", index, melted_unit_next_id( unit ) );
+	callback( data, command, NULL );
+
+	melted_unit_get_status( unit, &status );
+	if ( status.status == unit_playing || status.status == unit_paused || status.status == unit_stopped )
+	{
+		snprintf( command, sizeof( command ), "GOTO U%d %d %d", index, status.position, status.clip_index );
+		callback( data, command, NULL );
+		if ( status.status == unit_playing )
+			snprintf( command, sizeof( command ), "PLAY U%d %d", index, status.speed );
+		else if ( status.status == unit_paused )
+			snprintf( command, sizeof( command ), "PAUSE U%d", index );
+		else
+			snprintf( command, sizeof( command ), "STOP U%d", index );
+		callback( data, command, NULL );
 	}
-	
-	update_generation( unit );
 }
 
-/** Remove everything up to the current clip from the unit.
+/** Add a name to the clip index unless an earlier clip already has it.
 */
 
-static void wipe_unit( melted_unit unit )
+static void index_clip( mlt_properties index, const char *prefix, const char *name, int clip )
 {
-	mlt_properties properties = unit->properties;
-	mlt_playlist playlist = mlt_properties_get_data( properties, "playlist", NULL );
-	mlt_playlist_clip_info info;
-	int current = mlt_playlist_current_clip( playlist );
-	mlt_playlist_get_clip_info( playlist, &info, current );
+	char key[ 4096 ];
 
-	if ( info.producer != NULL && info.start > 0 )
-	{
-		mlt_service_lock( MLT_PLAYLIST_SERVICE( playlist ) );
-		mlt_playlist_remove_region( playlist, 0, info.start );
-		mlt_service_unlock( MLT_PLAYLIST_SERVICE( playlist ) );
-	}
-	
-	update_generation( unit );
+	if ( name == NULL )
+		return;
+
+	snprintf( key, sizeof( key ), "%s%s", prefix, name );
+	if ( mlt_properties_get( index, key ) == NULL )
+		mlt_properties_set_int( index, key, clip + 1 );
 }
 
-/** Generate a report on all loaded clips.
+/** Find a clip by "#id" or by "@title" or "@file" (as shown by LIST). The
+	index is a hash rebuilt at most once per generation. Returns -1 if there
+	is no such clip.
 */
 
-void melted_unit_report_list( melted_unit unit, mvcp_response response )
+int melted_unit_find_clip( melted_unit unit, char *key )
 {
-	int i;
 	mlt_properties properties = unit->properties;
-	int generation = mlt_properties_get_int( properties, "generation" );
 	mlt_playlist playlist = mlt_properties_get_data( properties, "playlist", NULL );
+	int generation = mlt_properties_get_int( properties, "generation" );
+	mlt_properties index = mlt_properties_get_data( properties, "_clip_index", NULL );
 
-	mvcp_response_printf( response, 1024, "%d\n", generation );
-		
-	for ( i = 0; i < mlt_playlist_count( playlist ); i ++ )
+	if ( index == NULL || mlt_properties_get_int( properties, "_clip_index_generation" ) != generation )
 	{
-		mlt_playlist_clip_info info;
-		char *title;
-		mlt_playlist_get_clip_info( playlist , &info, i );
-		title = mlt_properties_get( MLT_PRODUCER_PROPERTIES( info.producer ), "title" );
-		if ( title == NULL )
-			title = strip_root( unit, info.resource );
-		mvcp_response_printf( response, 10240, "%d \"%s\" %d %d %d %d %.2f\n", 
-								 i, 
-								 title,
-								 info.frame_in, 
-								 info.frame_out,
-								 info.frame_count, 
-								 info.length, 
-								 info.fps );
+		int i;
+
+		index = mlt_properties_new( );
+		mlt_properties_set_data( properties, "_clip_index", index, 0, ( mlt_destructor )mlt_properties_close, NULL );
+		mlt_properties_set_int( properties, "_clip_index_generation", generation );
+
+		for ( i = 0; i < mlt_playlist_count( playlist ); i ++ )
+		{
+			mlt_playlist_clip_info info;
+			if ( mlt_playlist_get_clip_info( playlist, &info, i ) == 0 && info.producer != NULL )
+			{
+				index_clip( index, "#", mlt_properties_get( MLT_PRODUCER_PROPERTIES( info.cut ), "_melted_id" ), i );
+				index_clip( index, "@", mlt_properties_get( MLT_PRODUCER_PROPERTIES( info.producer ), "title" ), i );
+				index_clip( index, "@", strip_root( unit, info.resource ), i );
+			}
+		}
 	}
-	mvcp_response_printf( response, 1024, "\n" );
+
+	return mlt_properties_get_int( index, key ) - 1;
 }
 
 /** Load a clip into the unit clearing existing play list.
@@ -296,20 +1152,12 @@ void melted_unit_report_list( melted_unit unit, mvcp_response response )
 mvcp_error_code melted_unit_load( melted_unit unit, char *clip, int32_t in, int32_t out, int flush )
 {
 	// Now try to create a producer
-	mlt_producer instance = locate_producer( unit, clip );
+	mlt_producer instance = melted_unit_open( unit, clip );
 
 	if ( instance != NULL )
 	{
-		mlt_properties properties = unit->properties;
-		mlt_playlist playlist = mlt_properties_get_data( properties, "playlist", NULL );
-		int original = mlt_producer_get_playtime( MLT_PLAYLIST_PRODUCER( playlist ) );
-		mlt_service_lock( MLT_PLAYLIST_SERVICE( playlist ) );
-		mlt_playlist_append_io( playlist, instance, in, out );
-		mlt_playlist_remove_region( playlist, 0, original );
-		mlt_service_unlock( MLT_PLAYLIST_SERVICE( playlist ) );
+		melted_unit_load_producer( unit, instance, in, out, flush );
 		melted_log( LOG_DEBUG, "loaded clip %s", clip );
-		update_generation( unit );
-		melted_unit_status_communicate( unit );
 		mlt_producer_close( instance );
 		return mvcp_ok;
 	}
@@ -317,34 +1165,88 @@ mvcp_error_code melted_unit_load( melted_unit unit, char *clip, int32_t in, int3
 	return mvcp_invalid_file;
 }
 
+/** Replace the play list of the unit with an already opened producer.
+
+    \param unit A melted_unit handle.
+    \param instance The producer (the caller retains its reference).
+    \param in   The starting frame (-1 for 0)
+	\param out  The ending frame (-1 for maximum)
+*/
+
+mvcp_error_code melted_unit_load_producer( melted_unit unit, mlt_producer instance, int32_t in, int32_t out, int flush )
+{
+	mlt_properties properties = unit->properties;
+	mlt_playlist playlist = mlt_properties_get_data( properties, "playlist", NULL );
+	mlt_consumer consumer = mlt_properties_get_data( properties, "consumer", NULL );
+	int original = 0;
+	mlt_service_lock( MLT_PLAYLIST_SERVICE( playlist ) );
+	original = mlt_producer_get_playtime( MLT_PLAYLIST_PRODUCER( playlist ) );
+	mlt_playlist_append_io( playlist, instance, in, out );
+	mlt_playlist_remove_region( playlist, 0, original );
+	assign_clip_id( unit, playlist, 0, 0 );
+	journal_edit( unit, '*', 0, 0 );
+	journal_edit( unit, '+', 0, 0 );
+	mlt_service_unlock( MLT_PLAYLIST_SERVICE( playlist ) );
+	// Without a flush, frames already buffered from the previous clip play out
+	if ( flush && consumer != NULL )
+		mlt_consumer_purge( consumer );
+	update_generation( unit );
+	melted_unit_status_communicate( unit );
+	return mvcp_ok;
+}
+
 mvcp_error_code melted_unit_insert( melted_unit unit, char *clip, int index, int32_t in, int32_t out )
 {
-	mlt_producer instance = locate_producer( unit, clip );
+	mlt_producer instance = melted_unit_open( unit, clip );
 
 	if ( instance != NULL )
 	{
-		mlt_properties properties = unit->properties;
-		mlt_playlist playlist = mlt_properties_get_data( properties, "playlist", NULL );
+		mvcp_error_code error = mvcp_ok;
 		fprintf( stderr, "inserting clip %s before %d\n", clip, index );
-		mlt_service_lock( MLT_PLAYLIST_SERVICE( playlist ) );
-		mlt_playlist_insert( playlist, instance, index, in, out );
-		mlt_service_unlock( MLT_PLAYLIST_SERVICE( playlist ) );
+		error = melted_unit_insert_producer( unit, instance, index, in, out );
 		melted_log( LOG_DEBUG, "inserted clip %s at %d", clip, index );
-		update_generation( unit );
-		melted_unit_status_communicate( unit );
 		mlt_producer_close( instance );
-		return mvcp_ok;
+		return error;
 	}
 
 	return mvcp_invalid_file;
 }
 
+/** Insert an already opened producer before the given clip index.
+*/
+
+mvcp_error_code melted_unit_insert_producer( melted_unit unit, mlt_producer instance, int index, int32_t in, int32_t out )
+{
+	mlt_properties properties = unit->properties;
+	mlt_playlist playlist = mlt_properties_get_data( properties, "playlist", NULL );
+	switch ( record_edit( unit, edit_insert, instance, index, 0, in, out ) )
+	{
+		case 1:
+			return mvcp_ok;
+		case -1:
+			return mvcp_invalid_command;
+	}
+	mlt_service_lock( MLT_PLAYLIST_SERVICE( playlist ) );
+	playlist_insert( unit, playlist, instance, index, in, out );
+	mlt_service_unlock( MLT_PLAYLIST_SERVICE( playlist ) );
+	update_generation( unit );
+	melted_unit_status_communicate( unit );
+	return mvcp_ok;
+}
+
 mvcp_error_code melted_unit_remove( melted_unit unit, int index )
 {
 	mlt_properties properties = unit->properties;
 	mlt_playlist playlist = mlt_properties_get_data( properties, "playlist", NULL );
+	switch ( record_edit( unit, edit_remove, NULL, index, 0, 0, 0 ) )
+	{
+		case 1:
+			return mvcp_ok;
+		case -1:
+			return mvcp_invalid_command;
+	}
 	mlt_service_lock( MLT_PLAYLIST_SERVICE( playlist ) );
-	mlt_playlist_remove( playlist, index );
+	playlist_remove( unit, playlist, index );
 	mlt_service_unlock( MLT_PLAYLIST_SERVICE( playlist ) );
 	melted_log( LOG_DEBUG, "removed clip at %d", index );
 	update_generation( unit );
@@ -382,8 +1284,15 @@ mvcp_error_code melted_unit_move( melted_unit unit, int src, int dest )
 {
 	mlt_properties properties = unit->properties;
 	mlt_playlist playlist = mlt_properties_get_data( properties, "playlist", NULL );
+	switch ( record_edit( unit, edit_move, NULL, src, dest, 0, 0 ) )
+	{
+		case 1:
+			return mvcp_ok;
+		case -1:
+			return mvcp_invalid_command;
+	}
 	mlt_service_lock( MLT_PLAYLIST_SERVICE( playlist ) );
-	mlt_playlist_move( playlist, src, dest );
+	playlist_move( unit, playlist, src, dest );
 	mlt_service_unlock( MLT_PLAYLIST_SERVICE( playlist ) );
 	melted_log( LOG_DEBUG, "moved clip %d to %d", src, dest );
 	update_generation( unit );
@@ -391,6 +1300,72 @@ mvcp_error_code melted_unit_move( melted_unit unit, int src, int dest )
 	return mvcp_ok;
 }
 
+/** Start recording INSERT, APND, REMOVE and MOVE edits for the unit. The
+	batch belongs to the session which opens it - the edits of other sessions
+	are refused until it is committed or rolled back. Fails if a batch is
+	already open.
+*/
+
+mvcp_error_code melted_unit_begin( melted_unit unit )
+{
+	if ( unit->batching )
+		return mvcp_invalid_command;
+	unit->batching = 1;
+	unit->batch_session = melted_unit_session( );
+	return mvcp_ok;
+}
+
+/** Apply the recorded edits in order under a single lock, with one
+	generation change and one status notification.
+*/
+
+mvcp_error_code melted_unit_commit( melted_unit unit )
+{
+	mlt_properties properties = unit->properties;
+	mlt_playlist playlist = mlt_properties_get_data( properties, "playlist", NULL );
+	melted_unit_edit edit = NULL;
+	int count = 0;
+
+	if ( !unit->batching || unit->batch_session != melted_unit_session( ) )
+		return mvcp_invalid_command;
+
+	mlt_service_lock( MLT_PLAYLIST_SERVICE( playlist ) );
+	for ( edit = unit->batch_head; edit != NULL; edit = edit->next )
+		apply_edit( unit, playlist, edit );
+	mlt_service_unlock( MLT_PLAYLIST_SERVICE( playlist ) );
+
+	count = release_edits( unit );
+	melted_log( LOG_DEBUG, "committed %d edits", count );
+
+	if ( count > 0 )
+	{
+		update_generation( unit );
+		melted_unit_status_communicate( unit );
+	}
+
+	return mvcp_ok;
+}
+
+/** Discard the recorded edits.
+*/
+
+mvcp_error_code melted_unit_rollback( melted_unit unit )
+{
+	if ( !unit->batching || unit->batch_session != melted_unit_session( ) )
+		return mvcp_invalid_command;
+	melted_log( LOG_DEBUG, "discarded %d edits", release_edits( unit ) );
+	return mvcp_ok;
+}
+
+/** Discard a batch left open by a session which has ended.
+*/
+
+void melted_unit_end_session( melted_unit unit, void *session )
+{
+	if ( unit->batching && unit->batch_session == session )
+		melted_log( LOG_NOTICE, "discarded %d edits of a closed connection", release_edits( unit ) );
+}
+
 /** Add a clip to the unit play list.
 
     \todo error handling
@@ -402,25 +1377,41 @@ mvcp_error_code melted_unit_move( melted_unit unit, int src, int dest )
 
 mvcp_error_code melted_unit_append( melted_unit unit, char *clip, int32_t in, int32_t out )
 {
-	mlt_producer instance = locate_producer( unit, clip );
+	mlt_producer instance = melted_unit_open( unit, clip );
 
 	if ( instance != NULL )
 	{
-		mlt_properties properties = unit->properties;
-		mlt_playlist playlist = mlt_properties_get_data( properties, "playlist", NULL );
-		mlt_service_lock( MLT_PLAYLIST_SERVICE( playlist ) );
-		mlt_playlist_append_io( playlist, instance, in, out );
+		mvcp_error_code error = melted_unit_append_producer( unit, instance, in, out );
 		melted_log( LOG_DEBUG, "appended clip %s", clip );
-		mlt_service_unlock( MLT_PLAYLIST_SERVICE( playlist ) );
-		update_generation( unit );
-		melted_unit_status_communicate( unit );
 		mlt_producer_close( instance );
-		return mvcp_ok;
+		return error;
 	}
 
 	return mvcp_invalid_file;
 }
 
+/** Add an already opened producer to the unit play list.
+*/
+
+mvcp_error_code melted_unit_append_producer( melted_unit unit, mlt_producer instance, int32_t in, int32_t out )
+{
+	mlt_properties properties = unit->properties;
+	mlt_playlist playlist = mlt_properties_get_data( properties, "playlist", NULL );
+	switch ( record_edit( unit, edit_append, instance, 0, 0, in, out ) )
+	{
+		case 1:
+			return mvcp_ok;
+		case -1:
+			return mvcp_invalid_command;
+	}
+	mlt_service_lock( MLT_PLAYLIST_SERVICE( playlist ) );
+	playlist_append( unit, playlist, instance, in, out, 0 );
+	mlt_service_unlock( MLT_PLAYLIST_SERVICE( playlist ) );
+	update_generation( unit );
+	melted_unit_status_communicate( unit );
+	return mvcp_ok;
+}
+
 /** Add an mlt_service to the playlist
 
     \param unit A melted_unit handle.
@@ -432,7 +1423,11 @@ mvcp_error_code melted_unit_append_service( melted_unit unit, mlt_service servic
 	mlt_properties properties = unit->properties;
 	mlt_playlist playlist = mlt_properties_get_data( properties, "playlist", NULL );
 	mlt_service_lock( MLT_PLAYLIST_SERVICE( playlist ) );
-	mlt_playlist_append( playlist, ( mlt_producer )service );
+	if ( mlt_playlist_append( playlist, ( mlt_producer )service ) == 0 )
+	{
+		assign_clip_id( unit, playlist, mlt_playlist_count( playlist ) - 1, 0 );
+		journal_edit( unit, '+', mlt_playlist_count( playlist ) - 1, 0 );
+	}
 	mlt_service_unlock( MLT_PLAYLIST_SERVICE( playlist ) );
 	melted_log( LOG_DEBUG, "appended clip" );
 	update_generation( unit );
@@ -440,6 +1435,103 @@ mvcp_error_code melted_unit_append_service( melted_unit unit, mlt_service servic
 	return mvcp_ok;
 }
 
+#ifdef __linux__
+
+/** Parse a cpu list such as "0,2-3" into a cpu set. Returns the number of
+	cpus in the set.
+*/
+
+static int parse_cpu_list( const char *list, cpu_set_t *set )
+{
+	const char *ptr = list;
+
+	CPU_ZERO( set );
+
+	while ( *ptr != '\0' )
+	{
+		char *end = NULL;
+		long first = strtol( ptr, &end, 10 );
+		long last = first;
+
+		if ( end == ptr )
+			break;
+		if ( *end == '-' )
+		{
+			ptr = end + 1;
+			last = strtol( ptr, &end, 10 );
+			if ( end == ptr )
+				break;
+		}
+		for ( ; first <= last && first < CPU_SETSIZE; first ++ )
+			if ( first >= 0 )
+				CPU_SET( first, set );
+		ptr = *end == ',' ? end + 1 : end;
+		if ( *end != ',' )
+			break;
+	}
+
+	return CPU_COUNT( set );
+}
+
+#endif
+
+/** Start the consumer of the unit. Threads inherit the scheduling policy and
+	affinity of the thread that creates them, so the cpu-affinity and
+	rt-priority unit properties are applied to the calling thread only while
+	the consumer starts its threads, leaving this thread as it was.
+*/
+
+static void melted_unit_start_consumer( melted_unit unit, mlt_consumer consumer )
+{
+#ifdef __linux__
+	mlt_playlist playlist = mlt_properties_get_data( unit->properties, "playlist", NULL );
+	char *affinity = mlt_properties_get( MLT_PLAYLIST_PROPERTIES( playlist ), "cpu-affinity" );
+	int priority = mlt_properties_get_int( MLT_PLAYLIST_PROPERTIES( playlist ), "rt-priority" );
+	pthread_t self = pthread_self( );
+	cpu_set_t saved_set, set;
+	struct sched_param saved_param, param;
+	int saved_policy = SCHED_OTHER;
+	int restore_set = 0;
+	int restore_param = 0;
+
+	if ( !mlt_consumer_is_stopped( consumer ) || ( affinity == NULL && priority <= 0 ) )
+	{
+		mlt_consumer_start( consumer );
+		return;
+	}
+
+	if ( affinity != NULL && parse_cpu_list( affinity, &set ) > 0 &&
+		 pthread_getaffinity_np( self, sizeof( saved_set ), &saved_set ) == 0 )
+	{
+		int error = 0;
+		if ( ( error = pthread_setaffinity_np( self, sizeof( set ), &set ) ) == 0 )
+			restore_set = 1;
+		else
+			melted_log( LOG_WARNING, "unable to set cpu-affinity %s: %s", affinity, strerror( error ) );
+	}
+
+	if ( priority > 0 && pthread_getschedparam( self, &saved_policy, &saved_param ) == 0 )
+	{
+		int error = 0;
+		memset( &param, 0, sizeof( param ) );
+		param.sched_priority = priority;
+		if ( ( error = pthread_setschedparam( self, SCHED_FIFO, &param ) ) == 0 )
+			restore_param = 1;
+		else
+			melted_log( LOG_WARNING, "unable to set rt-priority %d: %s", priority, strerror( error ) );
+	}
+
+	mlt_consumer_start( consumer );
+
+	if ( restore_param )
+		pthread_setschedparam( self, saved_policy, &saved_param );
+	if ( restore_set )
+		pthread_setaffinity_np( self, sizeof( saved_set ), &saved_set );
+#else
+	mlt_consumer_start( consumer );
+#endif
+}
+
 /** Start playing the unit.
 
     \todo error handling
@@ -455,7 +1547,7 @@ void melted_unit_play( melted_unit_t *unit, int speed )
 	mlt_producer producer = MLT_PLAYLIST_PRODUCER( playlist );
 	mlt_consumer consumer = mlt_properties_get_data( unit->properties, "consumer", NULL );
 	mlt_producer_set_speed( producer, ( double )speed / 1000 );
-	mlt_consumer_start( consumer );
+	melted_unit_start_consumer( unit, consumer );
 	mlt_properties_set_int( MLT_CONSUMER_PROPERTIES(consumer), "refresh", 1 );
 	melted_unit_status_communicate( unit );
 }
@@ -474,6 +1566,7 @@ void melted_unit_terminate( melted_unit unit )
 	mlt_producer producer = MLT_PLAYLIST_PRODUCER( playlist );
 	mlt_producer_set_speed( producer, 0 );
 	mlt_consumer_stop( consumer );
+	melted_asrun_end( &unit->asrun, "stopped" );
 	melted_unit_status_communicate( unit );
 }
 
@@ -489,45 +1582,160 @@ int melted_unit_has_terminated( melted_unit unit )
 	return mlt_consumer_is_stopped( consumer );
 }
 
-/** Transfer the currently loaded clip to another unit
+/** Determine if a play list property describes the content rather than the
+	configuration of the unit which owns the play list.
 */
 
-int melted_unit_transfer( melted_unit dest_unit, melted_unit src_unit )
+static int is_content_property( const char *name )
 {
-	int i;
-	mlt_properties dest_properties = dest_unit->properties;
-	mlt_playlist dest_playlist = mlt_properties_get_data( dest_properties, "playlist", NULL );
-	mlt_properties src_properties = src_unit->properties;
-	mlt_playlist src_playlist = mlt_properties_get_data( src_properties, "playlist", NULL );
-	mlt_playlist tmp_playlist = mlt_playlist_init( );
+	return name[ 0 ] == '_' || !strncmp( name, "meta.", 5 ) ||
+		   !strcmp( name, "mlt_type" ) || !strcmp( name, "mlt_service" ) || !strcmp( name, "resource" ) ||
+		   !strcmp( name, "length" ) || !strcmp( name, "in" ) || !strcmp( name, "out" );
+}
+
+/** Replace the configuration held on one play list with that of another.
+*/
 
-	for ( i = 0; i < mlt_playlist_count( src_playlist ); i ++ )
+static void copy_settings( mlt_properties dest, mlt_properties src )
+{
+	int i = 0;
+
+	for ( i = 0; i < mlt_properties_count( dest ); i ++ )
 	{
-		mlt_playlist_clip_info info;
-		mlt_playlist_get_clip_info( src_playlist, &info, i );
-		if ( info.producer != NULL )
-			mlt_playlist_append_io( tmp_playlist, info.producer, info.frame_in, info.frame_out );
+		char *name = mlt_properties_get_name( dest, i );
+		if ( !is_content_property( name ) && mlt_properties_get_value( dest, i ) != NULL && mlt_properties_get( src, name ) == NULL )
+			mlt_properties_set( dest, name, NULL );
 	}
 
-	clear_unit( src_unit );
+	for ( i = 0; i < mlt_properties_count( src ); i ++ )
+	{
+		char *name = mlt_properties_get_name( src, i );
+		char *value = mlt_properties_get_value( src, i );
+		if ( !is_content_property( name ) && value != NULL )
+			mlt_properties_set( dest, name, value );
+	}
+}
 
-	mlt_service_lock( MLT_PLAYLIST_SERVICE( dest_playlist ) );
+/** Move the play list of src to dest under the locks of both units, taken in
+	unit order. The play lists are exchanged whole - each unit keeps its
+	configuration, speed and clip id sequence and its consumer is connected
+	to the other play list - when swapping, or when transferring to a unit
+	with nothing loaded. Otherwise the clips of src are appended to dest.
+	XFER and SWAP run with the scheduler queues of both units held, so no
+	command of either unit is working on a play list meanwhile.
+*/
 
-	for ( i = 0; i < mlt_playlist_count( tmp_playlist ); i ++ )
+static void move_playlist( melted_unit dest, melted_unit src, int swap )
+{
+	int ordered = mlt_properties_get_int( dest->properties, "unit" ) < mlt_properties_get_int( src->properties, "unit" );
+	melted_unit first = ordered ? dest : src;
+	melted_unit second = ordered ? src : dest;
+	mlt_consumer dest_consumer = mlt_properties_get_data( dest->properties, "consumer", NULL );
+	mlt_consumer src_consumer = mlt_properties_get_data( src->properties, "consumer", NULL );
+	mlt_playlist dest_playlist = NULL;
+	mlt_playlist src_playlist = NULL;
+
+	mlt_properties_lock( first->properties );
+	mlt_properties_lock( second->properties );
+	mlt_service_lock( MLT_PLAYLIST_SERVICE( ( mlt_playlist )mlt_properties_get_data( first->properties, "playlist", NULL ) ) );
+	mlt_service_lock( MLT_PLAYLIST_SERVICE( ( mlt_playlist )mlt_properties_get_data( second->properties, "playlist", NULL ) ) );
+
+	dest_playlist = mlt_properties_get_data( dest->properties, "playlist", NULL );
+	src_playlist = mlt_properties_get_data( src->properties, "playlist", NULL );
+
+	if ( swap || mlt_playlist_count( dest_playlist ) == 0 )
 	{
-		mlt_playlist_clip_info info;
-		mlt_playlist_get_clip_info( tmp_playlist, &info, i );
-		if ( info.producer != NULL )
-			mlt_playlist_append_io( dest_playlist, info.producer, info.frame_in, info.frame_out );
+		double dest_speed = mlt_producer_get_speed( MLT_PLAYLIST_PRODUCER( dest_playlist ) );
+		double src_speed = mlt_producer_get_speed( MLT_PLAYLIST_PRODUCER( src_playlist ) );
+		int dest_id = mlt_properties_get_int( dest->properties, "_clip_id" );
+		int src_id = mlt_properties_get_int( src->properties, "_clip_id" );
+		mlt_properties settings = mlt_properties_new( );
+
+		copy_settings( settings, MLT_PLAYLIST_PROPERTIES( dest_playlist ) );
+		copy_settings( MLT_PLAYLIST_PROPERTIES( dest_playlist ), MLT_PLAYLIST_PROPERTIES( src_playlist ) );
+		copy_settings( MLT_PLAYLIST_PROPERTIES( src_playlist ), settings );
+		mlt_properties_close( settings );
+
+		// Each unit and consumer holds a reference which the other takes over
+		mlt_properties_inc_ref( MLT_PLAYLIST_PROPERTIES( dest_playlist ) );
+		mlt_properties_inc_ref( MLT_PLAYLIST_PROPERTIES( src_playlist ) );
+		mlt_properties_set_data( dest->properties, "playlist", src_playlist, 0, ( mlt_destructor )mlt_playlist_close, NULL );
+		mlt_properties_set_data( src->properties, "playlist", dest_playlist, 0, ( mlt_destructor )mlt_playlist_close, NULL );
+		mlt_consumer_connect( dest_consumer, MLT_PLAYLIST_SERVICE( src_playlist ) );
+		mlt_consumer_connect( src_consumer, MLT_PLAYLIST_SERVICE( dest_playlist ) );
+
+		// Status changes of each play list are reported for its new owner
+		mlt_properties_set_data( MLT_PLAYLIST_PROPERTIES( src_playlist ), "notifier_arg", dest, 0, NULL, NULL );
+		mlt_properties_set_data( MLT_PLAYLIST_PROPERTIES( dest_playlist ), "notifier_arg", src, 0, NULL, NULL );
+		mlt_properties_set_data( MLT_PLAYLIST_PROPERTIES( src_playlist ), "notifier", melted_unit_status_communicate, 0, NULL, NULL );
+		mlt_properties_set_data( MLT_PLAYLIST_PROPERTIES( dest_playlist ), "notifier", melted_unit_status_communicate, 0, NULL, NULL );
+
+		// Clip ids stay unique within both units
+		mlt_properties_set_int( dest->properties, "_clip_id", dest_id > src_id ? dest_id : src_id );
+		mlt_properties_set_int( src->properties, "_clip_id", dest_id > src_id ? dest_id : src_id );
+
+		mlt_producer_set_speed( MLT_PLAYLIST_PRODUCER( src_playlist ), dest_speed );
+		mlt_producer_set_speed( MLT_PLAYLIST_PRODUCER( dest_playlist ), src_speed );
+		if ( !swap )
+		{
+			mlt_producer_seek( MLT_PLAYLIST_PRODUCER( src_playlist ), 0 );
+			mlt_producer_seek( MLT_PLAYLIST_PRODUCER( dest_playlist ), 0 );
+		}
+
+		journal_playlist( dest, src_playlist );
+		journal_playlist( src, dest_playlist );
 	}
+	else
+	{
+		int i = 0;
+
+		for ( i = 0; i < mlt_playlist_count( src_playlist ); i ++ )
+		{
+			mlt_playlist_clip_info info;
+			mlt_playlist_get_clip_info( src_playlist, &info, i );
+			if ( info.producer != NULL )
+				playlist_append( dest, dest_playlist, info.producer, info.frame_in, info.frame_out, 0 );
+		}
+
+		mlt_playlist_clear( src_playlist );
+		journal_edit( src, '*', 0, 0 );
+		mlt_producer_seek( MLT_PLAYLIST_PRODUCER( src_playlist ), 0 );
+	}
+
+	mlt_properties_set_int( MLT_CONSUMER_PROPERTIES( dest_consumer ), "refresh", 1 );
+	mlt_properties_set_int( MLT_CONSUMER_PROPERTIES( src_consumer ), "refresh", 1 );
+	melted_unit_timing_reset( dest );
+	melted_unit_timing_reset( src );
 
-	mlt_service_unlock( MLT_PLAYLIST_SERVICE( dest_playlist ) );
+	mlt_service_unlock( MLT_PLAYLIST_SERVICE( ( mlt_playlist )mlt_properties_get_data( second->properties, "playlist", NULL ) ) );
+	mlt_service_unlock( MLT_PLAYLIST_SERVICE( ( mlt_playlist )mlt_properties_get_data( first->properties, "playlist", NULL ) ) );
+	mlt_properties_unlock( second->properties );
+	mlt_properties_unlock( first->properties );
 
-	update_generation( dest_unit );
-	melted_unit_status_communicate( dest_unit );
+	mlt_consumer_purge( dest_consumer );
+	mlt_consumer_purge( src_consumer );
+
+	update_generation( dest );
+	update_generation( src );
+	melted_unit_status_communicate( dest );
+	melted_unit_status_communicate( src );
+}
+
+/** Transfer the play list of a unit to another unit.
+*/
+
+int melted_unit_transfer( melted_unit dest_unit, melted_unit src_unit )
+{
+	move_playlist( dest_unit, src_unit, 0 );
+	return 0;
+}
 
-	mlt_playlist_close( tmp_playlist );
+/** Exchange the play lists of two units.
+*/
 
+int melted_unit_swap( melted_unit dest_unit, melted_unit src_unit )
+{
+	move_playlist( dest_unit, src_unit, 1 );
 	return 0;
 }
 
@@ -542,7 +1750,7 @@ int melted_unit_is_offline( melted_unit unit )
 /** Obtain the status for a given unit
 */
 
-int melted_unit_get_status( melted_unit unit, mvcp_status status )
+static int melted_unit_read_status( melted_unit unit, mvcp_status status )
 {
 	int error = unit == NULL;
 
@@ -553,10 +1761,13 @@ int melted_unit_get_status( melted_unit unit, mvcp_status status )
 		mlt_properties properties = unit->properties;
 		mlt_playlist playlist = mlt_properties_get_data( properties, "playlist", NULL );
 		mlt_producer producer = MLT_PLAYLIST_PRODUCER( playlist );
-		mlt_producer clip = mlt_playlist_current( playlist );
-
+		mlt_producer clip = NULL;
 		mlt_playlist_clip_info info;
-		int clip_index = mlt_playlist_current_clip( playlist );
+		int clip_index = 0;
+
+		mlt_service_lock( MLT_PLAYLIST_SERVICE( playlist ) );
+		clip = mlt_playlist_current( playlist );
+		clip_index = mlt_playlist_current_clip( playlist );
 		mlt_playlist_get_clip_info( playlist, &info, clip_index );
 
 		if ( info.resource != NULL && strcmp( info.resource, "" ) )
@@ -576,9 +1787,10 @@ int melted_unit_get_status( melted_unit unit, mvcp_status status )
 			status->tail_out = info.frame_out;
 			status->tail_position = mlt_producer_frame( clip );
 			status->tail_length = mlt_producer_get_length( clip );
-			status->clip_index = mlt_playlist_current_clip( playlist );
+			status->clip_index = clip_index;
 			status->seek_flag = 1;
 		}
+		mlt_service_unlock( MLT_PLAYLIST_SERVICE( playlist ) );
 
 		status->generation = mlt_properties_get_int( properties, "generation" );
 
@@ -600,6 +1812,49 @@ int melted_unit_get_status( melted_unit unit, mvcp_status status )
 	return error;
 }
 
+/** Publish a status as the unit's snapshot. Writers are serialised by the
+	mutex, readers only spin on the sequence which is odd during an update.
+*/
+
+static void melted_unit_publish_status( melted_unit unit, mvcp_status status )
+{
+	pthread_mutex_lock( &unit->status_mutex );
+	unit->status_sequence ++;
+	__sync_synchronize( );
+	mvcp_status_copy( &unit->status, status );
+	__sync_synchronize( );
+	unit->status_sequence ++;
+	pthread_mutex_unlock( &unit->status_mutex );
+}
+
+/** Get a consistent copy of the most recently published status - this never
+	touches the play list or waits for the consumer.
+*/
+
+int melted_unit_get_status( melted_unit unit, mvcp_status status )
+{
+	unsigned int sequence = 0;
+
+	if ( unit == NULL )
+	{
+		memset( status, 0, sizeof( mvcp_status_t ) );
+		status->status = unit_undefined;
+		return 1;
+	}
+
+	do
+	{
+		while ( ( sequence = unit->status_sequence ) & 1 )
+			sched_yield( );
+		__sync_synchronize( );
+		mvcp_status_copy( status, &unit->status );
+		__sync_synchronize( );
+	}
+	while ( sequence != unit->status_sequence );
+
+	return 0;
+}
+
 /** Change position in the playlist.
 */
 
@@ -636,6 +1891,7 @@ void melted_unit_change_position( melted_unit unit, int clip, int32_t position )
 		
 		mlt_producer_seek( producer, frame_start + frame_offset - info.frame_in );
 		mlt_properties_set_int( MLT_CONSUMER_PROPERTIES(consumer), "refresh", 1 );
+		melted_unit_timing_reset( unit );
 	}
 
 	melted_unit_status_communicate( unit );
@@ -667,6 +1923,8 @@ int melted_unit_set_clip_in( melted_unit unit, int index, int32_t position )
 		melted_unit_play( unit, 0 );
 		mlt_service_lock( MLT_PLAYLIST_SERVICE( playlist ) );
 		error = mlt_playlist_resize_clip( playlist, index, position, info.frame_out );
+		if ( error == 0 )
+			journal_edit( unit, '=', index, 0 );
 		mlt_service_unlock( MLT_PLAYLIST_SERVICE( playlist ) );
 		update_generation( unit );
 		melted_unit_change_position( unit, index, 0 );
@@ -690,6 +1948,8 @@ int melted_unit_set_clip_out( melted_unit unit, int index, int32_t position )
 		melted_unit_play( unit, 0 );
 		mlt_service_lock( MLT_PLAYLIST_SERVICE( playlist ) );
 		error = mlt_playlist_resize_clip( playlist, index, info.frame_in, position );
+		if ( error == 0 )
+			journal_edit( unit, '=', index, 0 );
 		mlt_service_unlock( MLT_PLAYLIST_SERVICE( playlist ) );
 		update_generation( unit );
 		melted_unit_status_communicate( unit );
@@ -711,6 +1971,7 @@ void melted_unit_step( melted_unit unit, int32_t offset )
 	mlt_position position = mlt_producer_frame( producer );
 	mlt_producer_seek( producer, position + offset );
 	mlt_properties_set_int( MLT_CONSUMER_PROPERTIES(consumer), "refresh", 1 );
+	melted_unit_timing_reset( unit );
 }
 
 /** Set the unit's clip mode regarding in and out points.
@@ -752,9 +2013,16 @@ void melted_unit_step( melted_unit unit, int32_t offset )
 	//return dv_player_get_eof_action( player );
 //}
 
+/** Set a property of the unit's play list, or of its producer or consumer
+	with a "producer." or "consumer." prefix. Properties which are set are
+	remembered in the unit's "settings" so that they can be restored.
+*/
+
 int melted_unit_set( melted_unit unit, char *name_value )
 {
 	mlt_properties properties = NULL;
+	char *setting = name_value;
+	int error = 0;
 
 	if ( strncmp( name_value, "consumer.", 9 ) )
 	{
@@ -776,7 +2044,27 @@ int melted_unit_set( melted_unit unit, char *name_value )
 		name_value += 9;
 	}
 
-	return mlt_properties_parse( properties, name_value );
+	error = mlt_properties_parse( properties, name_value );
+
+	if ( error == 0 && strchr( setting, '=' ) != NULL )
+	{
+		mlt_properties settings = mlt_properties_get_data( unit->properties, "settings", NULL );
+		char *name = strdup( setting );
+		if ( settings == NULL )
+		{
+			settings = mlt_properties_new( );
+			mlt_properties_set_data( unit->properties, "settings", settings, 0, ( mlt_destructor )mlt_properties_close, NULL );
+		}
+		if ( name != NULL )
+		{
+			char *value = strchr( name, '=' );
+			*value ++ = '\0';
+			mlt_properties_set( settings, name, value );
+			free( name );
+		}
+	}
+
+	return error;
 }
 
 char *melted_unit_get( melted_unit unit, char *name )
@@ -794,10 +2082,35 @@ char *melted_unit_get( melted_unit unit, char *name )
 
 void melted_unit_close( melted_unit unit )
 {
+	int i;
+
 	if ( unit != NULL )
 	{
 		melted_log( LOG_DEBUG, "closing unit..." );
 		melted_unit_terminate( unit );
+		pthread_mutex_lock( &unit->prefetch_mutex );
+		if ( unit->prefetch_running )
+		{
+			unit->prefetch_running = 0;
+			pthread_cond_signal( &unit->prefetch_cond );
+			pthread_mutex_unlock( &unit->prefetch_mutex );
+			pthread_join( unit->prefetch_thread, NULL );
+		}
+		else
+		{
+			pthread_mutex_unlock( &unit->prefetch_mutex );
+		}
+		pthread_mutex_destroy( &unit->status_mutex );
+		pthread_mutex_destroy( &unit->prefetch_mutex );
+		pthread_cond_destroy( &unit->prefetch_cond );
+		melted_asrun_clip_close( &unit->asrun );
+		release_edits( unit );
+		if ( unit->journal != NULL )
+		{
+			for ( i = 0; i < MELTED_UNIT_JOURNAL; i ++ )
+				free( unit->journal->entries[ i ].row );
+			free( unit->journal );
+		}
 		mlt_properties_close( unit->properties );
 		free( unit );
 		melted_log( LOG_DEBUG, "... unit closed." );
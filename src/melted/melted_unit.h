@@ -26,30 +26,86 @@
 #include <framework/mlt_properties.h>
 #include <mvcp/mvcp.h>
 
+#include "melted_asrun.h"
+
 #ifdef __cplusplus
 extern "C"
 {
 #endif
 
+/** A play list edit recorded between BEGIN and COMMIT.
+*/
+
+typedef struct melted_unit_edit_s *melted_unit_edit;
+
+/** A bounded journal of play list edits for LIST SINCE.
+*/
+
+typedef struct melted_unit_journal_s *melted_unit_journal;
+
+/** Receives the commands which rebuild a unit, with the service to send
+	when the command is a PUSH.
+*/
+
+typedef void ( *melted_unit_command )( void *, const char *, mlt_service );
+
+/** Receives each clip of a unit - the file is NULL when the clip wasn't
+	opened from one.
+*/
+
+typedef void ( *melted_unit_clip )( void *, const char *, mlt_producer, int32_t, int32_t );
+
 typedef struct
 {
 	mlt_properties properties;
+	int refs;
+	pthread_mutex_t status_mutex;
+	volatile unsigned int status_sequence;
+	mvcp_status_t status;
+	pthread_t prefetch_thread;
+	pthread_mutex_t prefetch_mutex;
+	pthread_cond_t prefetch_cond;
+	int prefetch_running;
+	int prefetch_clip;
+	int batching;
+	void *batch_session;
+	melted_unit_edit batch_head;
+	melted_unit_edit batch_tail;
+	melted_unit_journal journal;
+	melted_asrun_clip_t asrun;
 } 
 melted_unit_t, *melted_unit;
 
 extern melted_unit         melted_unit_init( int index, char *arg );
 extern void 				melted_unit_report_list( melted_unit unit, mvcp_response response );
+extern void 				melted_unit_report_changes( melted_unit unit, mvcp_response response, int since );
+extern void                 melted_unit_replicate( melted_unit unit, melted_unit_command callback, void *data );
+extern int                  melted_unit_clip_id( mlt_producer cut );
+extern int                  melted_unit_next_id( melted_unit unit );
+extern void                 melted_unit_set_next_id( melted_unit unit, int id );
+extern void                 melted_unit_clips( melted_unit unit, melted_unit_clip callback, void *data );
 extern void                 melted_unit_allow_stdin( melted_unit unit, int flag );
 extern mvcp_error_code   melted_unit_load( melted_unit unit, char *clip, int32_t in, int32_t out, int flush );
 extern mvcp_error_code 	melted_unit_insert( melted_unit unit, char *clip, int index, int32_t in, int32_t out );
 extern mvcp_error_code   melted_unit_append( melted_unit unit, char *clip, int32_t in, int32_t out );
 extern mvcp_error_code   melted_unit_append_service( melted_unit unit, mlt_service service );
+extern mlt_producer         melted_unit_open( melted_unit unit, char *clip );
+extern mvcp_error_code   melted_unit_load_producer( melted_unit unit, mlt_producer producer, int32_t in, int32_t out, int flush );
+extern mvcp_error_code   melted_unit_insert_producer( melted_unit unit, mlt_producer producer, int index, int32_t in, int32_t out );
+extern mvcp_error_code   melted_unit_append_producer( melted_unit unit, mlt_producer producer, int32_t in, int32_t out );
 extern mvcp_error_code 	melted_unit_remove( melted_unit unit, int index );
 extern mvcp_error_code 	melted_unit_clean( melted_unit unit );
 extern mvcp_error_code 	melted_unit_wipe( melted_unit unit );
 extern mvcp_error_code 	melted_unit_clear( melted_unit unit );
 extern mvcp_error_code 	melted_unit_move( melted_unit unit, int src, int dest );
+extern mvcp_error_code 	melted_unit_begin( melted_unit unit );
+extern mvcp_error_code 	melted_unit_commit( melted_unit unit );
+extern mvcp_error_code 	melted_unit_rollback( melted_unit unit );
+extern void 				melted_unit_end_session( melted_unit unit, void *session );
+extern void 				melted_unit_set_session( void *session );
+extern void 				*melted_unit_session( void );
 extern int                  melted_unit_transfer( melted_unit dest_unit, melted_unit src_unit );
+extern int                  melted_unit_swap( melted_unit dest_unit, melted_unit src_unit );
 extern void                 melted_unit_play( melted_unit_t *unit, int speed );
 extern void                 melted_unit_terminate( melted_unit );
 extern int                  melted_unit_has_terminated( melted_unit );
@@ -69,6 +125,7 @@ extern void                 melted_unit_restore( melted_unit );
 extern int					melted_unit_set( melted_unit, char *name_value );
 extern char *				melted_unit_get( melted_unit, char *name );
 extern int					melted_unit_get_current_clip( melted_unit );
+extern int					melted_unit_find_clip( melted_unit, char *key );
 
 
 #ifdef __cplusplus
@@ -29,9 +29,12 @@
 #include <string.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <limits.h>
 
 #include "melted_unit.h"
 #include "melted_commands.h"
+#include "melted_loader.h"
+#include "melted_cue.h"
 #include "melted_log.h"
 
 
@@ -59,6 +62,27 @@ void get_fullname( command_argument cmd_arg, char *fullname, size_t len, char *f
 	}
 }
 
+/** Check for a trailing ASYNC token, which follows the clip and any in/out.
+*/
+
+static int is_async( command_argument cmd_arg )
+{
+	command_value_t *last = melted_command_arg( cmd_arg, cmd_arg->argc - 1 );
+	return cmd_arg->argc > 3 && last != NULL && !strcasecmp( last->string, "ASYNC" );
+}
+
+/** Queue an asynchronous request and report its job id.
+*/
+
+static int submit_async( command_argument cmd_arg, melted_loader_operation operation, char *fullname, int index, int32_t in, int32_t out, int flush )
+{
+	int id = melted_loader_submit( cmd_arg->unit, operation, fullname, index, in, out, flush );
+	if ( id < 0 )
+		return RESPONSE_TOO_MANY_FILES;
+	mvcp_response_printf( cmd_arg->response, 1024, "%d\n", id );
+	return RESPONSE_SUCCESS;
+}
+
 int melted_load( command_argument cmd_arg )
 {
 	melted_unit unit = melted_get_unit(cmd_arg->unit);
@@ -78,11 +102,14 @@ int melted_load( command_argument cmd_arg )
 	else
 	{
 		int32_t in = -1, out = -1;
-		if ( mvcp_tokeniser_count( cmd_arg->tokeniser ) == 5 )
+		int async = is_async( cmd_arg );
+		if ( cmd_arg->argc - async == 5 )
 		{
-			in = atol( mvcp_tokeniser_get_string( cmd_arg->tokeniser, 3 ) );
-			out = atol( mvcp_tokeniser_get_string( cmd_arg->tokeniser, 4 ) );
+			in = cmd_arg->argv[ 3 ].number;
+			out = cmd_arg->argv[ 4 ].number;
 		}
+		if ( async )
+			return submit_async( cmd_arg, melted_loader_load, fullname, 0, in, out, flush );
 		if ( melted_unit_load( unit, fullname, in, out, flush ) != mvcp_ok )
 			return RESPONSE_BAD_FILE;
 	}
@@ -95,25 +122,42 @@ int melted_list( command_argument cmd_arg )
 
 	if ( unit != NULL )
 	{
-		melted_unit_report_list( unit, cmd_arg->response );
+		if ( cmd_arg->argc > 3 && !strcasecmp( cmd_arg->argv[ 2 ].string, "SINCE" ) )
+			melted_unit_report_changes( unit, cmd_arg->response, cmd_arg->argv[ 3 ].number );
+		else
+			melted_unit_report_list( unit, cmd_arg->response );
 		return RESPONSE_SUCCESS;
 	}
 
 	return RESPONSE_INVALID_UNIT;
 }
 
+/** Returned by parse_clip when a clip id or name is not in the play list.
+*/
+
+#define UNKNOWN_CLIP INT_MIN
+
+/** Parse a clip index, an offset from the current clip, a "#id" or a "@name".
+*/
+
 static int parse_clip( command_argument cmd_arg, int arg )
 {
 	melted_unit unit = melted_get_unit(cmd_arg->unit);
 	int clip = melted_unit_get_current_clip( unit );
 	
-	if ( mvcp_tokeniser_count( cmd_arg->tokeniser ) > arg )
+	if ( melted_command_arg( cmd_arg, arg ) != NULL )
 	{
-		char *token = mvcp_tokeniser_get_string( cmd_arg->tokeniser, arg );
+		char *token = cmd_arg->argv[ arg ].string;
 		if ( token[ 0 ] == '+' )
 			clip += atoi( token + 1 );
 		else if ( token[ 0 ] == '-' )
 			clip -= atoi( token + 1 );
+		else if ( token[ 0 ] == '#' || token[ 0 ] == '@' )
+		{
+			clip = melted_unit_find_clip( unit, token );
+			if ( clip < 0 )
+				clip = UNKNOWN_CLIP;
+		}
 		else
 			clip = atoi( token );
 	}
@@ -134,18 +178,26 @@ int melted_insert( command_argument cmd_arg )
 	else
 	{
 		long in = -1, out = -1;
-		int index = parse_clip( cmd_arg, 3 );
+		int async = is_async( cmd_arg );
+		int index = cmd_arg->argc - async > 3 ? parse_clip( cmd_arg, 3 ) : melted_unit_get_current_clip( unit );
 		
-		if ( mvcp_tokeniser_count( cmd_arg->tokeniser ) == 6 )
+		if ( cmd_arg->argc - async == 6 )
 		{
-			in = atoi( mvcp_tokeniser_get_string( cmd_arg->tokeniser, 4 ) );
-			out = atoi( mvcp_tokeniser_get_string( cmd_arg->tokeniser, 5 ) );
+			in = cmd_arg->argv[ 4 ].number;
+			out = cmd_arg->argv[ 5 ].number;
 		}
+
+		if ( index == UNKNOWN_CLIP )
+			return RESPONSE_OUT_OF_RANGE;
+		if ( async )
+			return submit_async( cmd_arg, melted_loader_insert, fullname, index, in, out, 0 );
 		
 		switch( melted_unit_insert( unit, fullname, index, in, out ) )
 		{
 			case mvcp_ok:
 				return RESPONSE_SUCCESS;
+			case mvcp_invalid_command:
+				return RESPONSE_ERROR;
 			default:
 				return RESPONSE_BAD_FILE;
 		}
@@ -162,9 +214,18 @@ int melted_remove( command_argument cmd_arg )
 	else
 	{
 		int index = parse_clip( cmd_arg, 2 );
-			
-		if ( melted_unit_remove( unit, index ) != mvcp_ok )
-			return RESPONSE_BAD_FILE;
+
+		if ( index == UNKNOWN_CLIP )
+			return RESPONSE_OUT_OF_RANGE;
+		switch ( melted_unit_remove( unit, index ) )
+		{
+			case mvcp_ok:
+				break;
+			case mvcp_invalid_command:
+				return RESPONSE_ERROR;
+			default:
+				return RESPONSE_BAD_FILE;
+		}
 	}
 	return RESPONSE_SUCCESS;
 }
@@ -217,13 +278,22 @@ int melted_move( command_argument cmd_arg )
 	
 	if ( unit != NULL )
 	{
-		if ( mvcp_tokeniser_count( cmd_arg->tokeniser ) > 2 )
+		if ( cmd_arg->argc > 2 )
 		{
 			int src = parse_clip( cmd_arg, 2 );
 			int dest = parse_clip( cmd_arg, 3 );
-			
-			if ( melted_unit_move( unit, src, dest ) != mvcp_ok )
-				return RESPONSE_BAD_FILE;
+
+			if ( src == UNKNOWN_CLIP || dest == UNKNOWN_CLIP )
+				return RESPONSE_OUT_OF_RANGE;
+			switch ( melted_unit_move( unit, src, dest ) )
+			{
+				case mvcp_ok:
+					break;
+				case mvcp_invalid_command:
+					return RESPONSE_ERROR;
+				default:
+					return RESPONSE_BAD_FILE;
+			}
 		}
 		else
 		{
@@ -251,15 +321,20 @@ int melted_append( command_argument cmd_arg )
 	else
 	{
 		int32_t in = -1, out = -1;
-		if ( mvcp_tokeniser_count( cmd_arg->tokeniser ) == 5 )
+		int async = is_async( cmd_arg );
+		if ( cmd_arg->argc - async == 5 )
 		{
-			in = atol( mvcp_tokeniser_get_string( cmd_arg->tokeniser, 3 ) );
-			out = atol( mvcp_tokeniser_get_string( cmd_arg->tokeniser, 4 ) );
+			in = cmd_arg->argv[ 3 ].number;
+			out = cmd_arg->argv[ 4 ].number;
 		}
+		if ( async )
+			return submit_async( cmd_arg, melted_loader_append, fullname, 0, in, out, 0 );
 		switch ( melted_unit_append( unit, fullname, in, out ) )
 		{
 			case mvcp_ok:
 				return RESPONSE_SUCCESS;
+			case mvcp_invalid_command:
+				return RESPONSE_ERROR;
 			default:
 				return RESPONSE_BAD_FILE;
 		}
@@ -267,6 +342,95 @@ int melted_append( command_argument cmd_arg )
 	return RESPONSE_SUCCESS;
 }
 
+int melted_begin( command_argument cmd_arg )
+{
+	melted_unit unit = melted_get_unit(cmd_arg->unit);
+
+	if ( unit == NULL )
+		return RESPONSE_INVALID_UNIT;
+	else if ( melted_unit_begin( unit ) != mvcp_ok )
+		return RESPONSE_ERROR;
+	return RESPONSE_SUCCESS;
+}
+
+int melted_commit( command_argument cmd_arg )
+{
+	melted_unit unit = melted_get_unit(cmd_arg->unit);
+
+	if ( unit == NULL )
+		return RESPONSE_INVALID_UNIT;
+	else if ( melted_unit_commit( unit ) != mvcp_ok )
+		return RESPONSE_ERROR;
+	return RESPONSE_SUCCESS;
+}
+
+int melted_rollback( command_argument cmd_arg )
+{
+	melted_unit unit = melted_get_unit(cmd_arg->unit);
+
+	if ( unit == NULL )
+		return RESPONSE_INVALID_UNIT;
+	else if ( melted_unit_rollback( unit ) != mvcp_ok )
+		return RESPONSE_ERROR;
+	return RESPONSE_SUCCESS;
+}
+
+/** Skip a number of words in the raw command text.
+*/
+
+static char *skip_words( char *text, int count )
+{
+	while ( text != NULL && count -- > 0 )
+	{
+		text += strspn( text, " \t" );
+		text += strcspn( text, " \t" );
+	}
+	if ( text != NULL )
+		text += strspn( text, " \t" );
+	return text;
+}
+
+int melted_cue( command_argument cmd_arg )
+{
+	melted_unit unit = melted_get_unit(cmd_arg->unit);
+	char *when = (char*) cmd_arg->argument;
+	char *text = skip_words( cmd_arg->command, 3 );
+	char *command = NULL;
+	int id = -1;
+
+	if ( unit == NULL )
+		return RESPONSE_INVALID_UNIT;
+	else if ( text == NULL || *text == '\0' || ( command = strndup( text, strcspn( text, "\r\n" ) ) ) == NULL )
+		return RESPONSE_MISSING_ARG;
+	id = melted_cue_add( cmd_arg->unit, when, command );
+	free( command );
+	if ( id < 0 )
+		return RESPONSE_OUT_OF_RANGE;
+	mvcp_response_printf( cmd_arg->response, 1024, "%d\n", id );
+	return RESPONSE_SUCCESS_1;
+}
+
+int melted_list_cues( command_argument cmd_arg )
+{
+	melted_unit unit = melted_get_unit(cmd_arg->unit);
+
+	if ( unit == NULL )
+		return RESPONSE_INVALID_UNIT;
+	melted_cue_report( cmd_arg->unit, cmd_arg->response );
+	return RESPONSE_SUCCESS_N;
+}
+
+int melted_uncue( command_argument cmd_arg )
+{
+	melted_unit unit = melted_get_unit(cmd_arg->unit);
+
+	if ( unit == NULL )
+		return RESPONSE_INVALID_UNIT;
+	else if ( melted_cue_remove( cmd_arg->unit, *( int * )cmd_arg->argument ) != 0 )
+		return RESPONSE_OUT_OF_RANGE;
+	return RESPONSE_SUCCESS;
+}
+
 int melted_push( command_argument cmd_arg, mlt_service service )
 {
 	melted_unit unit = melted_get_unit(cmd_arg->unit);
@@ -313,8 +477,8 @@ int melted_play( command_argument cmd_arg )
 	else
 	{
 		int speed = 1000;
-		if ( mvcp_tokeniser_count( cmd_arg->tokeniser ) == 3 )
-			speed = atoi( mvcp_tokeniser_get_string( cmd_arg->tokeniser, 2 ) );
+		if ( cmd_arg->argc == 3 )
+			speed = cmd_arg->argv[ 2 ].number;
 		melted_unit_play( unit, speed );
 	}
 
@@ -376,6 +540,8 @@ int melted_goto( command_argument cmd_arg )
 	else
 	{
 		int clip = parse_clip( cmd_arg, 3 );
+		if ( clip == UNKNOWN_CLIP )
+			return RESPONSE_OUT_OF_RANGE;
 		melted_unit_change_position( unit, clip, *(int*) cmd_arg->argument );
 	}
 	return RESPONSE_SUCCESS;
@@ -396,14 +562,16 @@ int melted_ff( command_argument cmd_arg )
 int melted_set_in_point( command_argument cmd_arg )
 {
 	melted_unit unit = melted_get_unit(cmd_arg->unit);
-	int clip = parse_clip( cmd_arg, 3 );
 
 	if ( unit == NULL )
 		return RESPONSE_INVALID_UNIT;
 	else
 	{
+		int clip = parse_clip( cmd_arg, 3 );
 		int position = *(int *) cmd_arg->argument;
 
+		if ( clip == UNKNOWN_CLIP )
+			return RESPONSE_OUT_OF_RANGE;
 		switch( melted_unit_set_clip_in( unit, clip, position ) )
 		{
 			case -1:
@@ -418,14 +586,16 @@ int melted_set_in_point( command_argument cmd_arg )
 int melted_set_out_point( command_argument cmd_arg )
 {
 	melted_unit unit = melted_get_unit(cmd_arg->unit);
-	int clip = parse_clip( cmd_arg, 3 );
 	
 	if ( unit == NULL )
 		return RESPONSE_INVALID_UNIT;
 	else
 	{
+		int clip = parse_clip( cmd_arg, 3 );
 		int position = *(int *) cmd_arg->argument;
 
+		if ( clip == UNKNOWN_CLIP )
+			return RESPONSE_OUT_OF_RANGE;
 		switch( melted_unit_set_clip_out( unit, clip, position ) )
 		{
 			case -1:
@@ -484,22 +654,96 @@ int melted_get_unit_property( command_argument cmd_arg )
 }
 
 
-int melted_transfer( command_argument cmd_arg )
+/** Find the target unit of XFER or SWAP, which must differ from the unit.
+	The target isn't the command's own unit, so it is returned with a
+	reference held which the caller must release. The dispatcher holds the
+	queues of both units while the command runs.
+*/
+
+static melted_unit get_target_unit( command_argument cmd_arg, melted_unit src_unit )
 {
-	melted_unit src_unit = melted_get_unit(cmd_arg->unit);
 	int dest_unit_id = -1;
 	char *string = (char*) cmd_arg->argument;
 	if ( string != NULL && ( string[ 0 ] == 'U' || string[ 0 ] == 'u' ) && strlen( string ) > 1 )
 		dest_unit_id = atoi( string + 1 );
-	
+
 	if ( src_unit != NULL && dest_unit_id != -1 )
 	{
-		melted_unit dest_unit = melted_get_unit( dest_unit_id );
+		melted_unit dest_unit = melted_acquire_unit( dest_unit_id );
 		if ( dest_unit != NULL && !melted_unit_is_offline(dest_unit) && dest_unit != src_unit )
-		{
-			melted_unit_transfer( dest_unit, src_unit );
-			return RESPONSE_SUCCESS;
-		}
+			return dest_unit;
+		melted_release_unit( dest_unit );
 	}
-	return RESPONSE_INVALID_UNIT;
+	return NULL;
+}
+
+int melted_transfer( command_argument cmd_arg )
+{
+	melted_unit src_unit = melted_get_unit(cmd_arg->unit);
+	melted_unit dest_unit = get_target_unit( cmd_arg, src_unit );
+
+	if ( dest_unit == NULL )
+		return RESPONSE_INVALID_UNIT;
+	melted_unit_transfer( dest_unit, src_unit );
+	melted_release_unit( dest_unit );
+	return RESPONSE_SUCCESS;
+}
+
+int melted_swap( command_argument cmd_arg )
+{
+	melted_unit src_unit = melted_get_unit(cmd_arg->unit);
+	melted_unit dest_unit = get_target_unit( cmd_arg, src_unit );
+
+	if ( dest_unit == NULL )
+		return RESPONSE_INVALID_UNIT;
+	melted_unit_swap( dest_unit, src_unit );
+	melted_release_unit( dest_unit );
+	return RESPONSE_SUCCESS;
+}
+
+/** Bring a unit to a checkpoint of its primary - the clip, frame and speed -
+	if it is further than the tolerance away, so that a standby stays close
+	without seeking on every checkpoint.
+*/
+
+int melted_sync( command_argument cmd_arg )
+{
+	melted_unit unit = melted_get_unit(cmd_arg->unit);
+	mvcp_status_t status;
+	int clip = 0;
+	int position = 0;
+	int speed = 0;
+	int tolerance = 0;
+
+	if ( unit == NULL || melted_unit_is_offline( unit ) )
+		return RESPONSE_INVALID_UNIT;
+	if ( cmd_arg->argc < 5 )
+		return RESPONSE_MISSING_ARG;
+
+	clip = cmd_arg->argv[ 2 ].number;
+	position = cmd_arg->argv[ 3 ].number;
+	speed = cmd_arg->argv[ 4 ].number;
+	tolerance = cmd_arg->argc > 5 ? cmd_arg->argv[ 5 ].number : 0;
+
+	melted_unit_get_status( unit, &status );
+	if ( status.status == unit_not_loaded || status.status == unit_undefined )
+		return RESPONSE_OUT_OF_RANGE;
+	if ( status.clip_index != clip || abs( status.position - position ) > tolerance )
+		melted_unit_change_position( unit, clip, position );
+	if ( status.status == unit_stopped || status.speed != speed )
+		melted_unit_play( unit, speed );
+
+	return RESPONSE_SUCCESS;
+}
+
+int melted_next_id( command_argument cmd_arg )
+{
+	melted_unit unit = melted_get_unit( cmd_arg->unit );
+
+	if ( unit == NULL )
+		return RESPONSE_INVALID_UNIT;
+	else if ( *( int* )cmd_arg->argument <= 0 )
+		return RESPONSE_OUT_OF_RANGE;
+	melted_unit_set_next_id( unit, *( int* )cmd_arg->argument );
+	return RESPONSE_SUCCESS;
 }
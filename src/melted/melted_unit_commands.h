@@ -29,6 +29,7 @@ extern "C"
 {
 #endif
 
+extern void get_fullname( command_argument, char *, size_t, char * );
 extern response_codes melted_list( command_argument );
 extern response_codes melted_load( command_argument );
 extern response_codes melted_insert( command_argument );
@@ -38,6 +39,12 @@ extern response_codes melted_wipe( command_argument );
 extern response_codes melted_clear( command_argument );
 extern response_codes melted_move( command_argument );
 extern response_codes melted_append( command_argument );
+extern response_codes melted_begin( command_argument );
+extern response_codes melted_commit( command_argument );
+extern response_codes melted_rollback( command_argument );
+extern response_codes melted_cue( command_argument );
+extern response_codes melted_list_cues( command_argument );
+extern response_codes melted_uncue( command_argument );
 extern response_codes melted_play( command_argument );
 extern response_codes melted_stop( command_argument );
 extern response_codes melted_pause( command_argument );
@@ -51,6 +58,9 @@ extern response_codes melted_get_unit_status( command_argument );
 extern response_codes melted_set_unit_property( command_argument );
 extern response_codes melted_get_unit_property( command_argument );
 extern response_codes melted_transfer( command_argument );
+extern response_codes melted_swap( command_argument );
+extern response_codes melted_sync( command_argument );
+extern response_codes melted_next_id( command_argument );
 extern response_codes melted_push( command_argument, mlt_service );
 extern response_codes melted_receive( command_argument, char * );
 
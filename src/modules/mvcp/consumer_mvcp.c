@@ -30,6 +30,241 @@
 static int consumer_is_stopped( mlt_consumer this );
 static int consumer_start( mlt_consumer this );
 
+/** A connection shared by all mvcp consumers pushing to the same server:port.
+	Sends are pipelined - the mutex is only held while a document is written,
+	and each completes when its response arrives. A connection found to have
+	gone is replaced by the next send.
+*/
+
+typedef struct pool_entry_s
+{
+	char *server;
+	int port;
+	mvcp_parser parser;
+	mvcp connection;
+	volatile int failed;
+	pthread_mutex_t mutex;
+	struct pool_entry_s *next;
+}
+*pool_entry;
+
+/** A send in flight - completed from the connection's reader thread.
+*/
+
+typedef struct
+{
+	mlt_consumer consumer;
+	pool_entry entry;
+	int unit;
+	char *command;
+	int async;
+	int done;
+	int error;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+}
+*consumer_send;
+
+static pthread_mutex_t pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pool_entry pool = NULL;
+
+/** Close all pooled connections - registered with the factory for clean up.
+*/
+
+static void pool_close( void *ignored )
+{
+	pthread_mutex_lock( &pool_mutex );
+	while ( pool != NULL )
+	{
+		pool_entry next = pool->next;
+		if ( pool->connection != NULL )
+			mvcp_close( pool->connection );
+		if ( pool->parser != NULL )
+			mvcp_parser_close( pool->parser );
+		pthread_mutex_destroy( &pool->mutex );
+		free( pool->server );
+		free( pool );
+		pool = next;
+	}
+	pthread_mutex_unlock( &pool_mutex );
+}
+
+/** Find or create the pool entry for server:port. The connection itself is
+	only made when the first push is sent.
+*/
+
+static pool_entry pool_fetch( const char *server, int port )
+{
+	pool_entry entry = NULL;
+
+	pthread_mutex_lock( &pool_mutex );
+	for ( entry = pool; entry != NULL; entry = entry->next )
+		if ( entry->port == port && !strcmp( entry->server, server ) )
+			break;
+
+	if ( entry == NULL )
+	{
+		entry = calloc( 1, sizeof( struct pool_entry_s ) );
+		if ( entry != NULL )
+		{
+			if ( pool == NULL )
+				mlt_factory_register_for_clean_up( &pool, pool_close );
+			entry->server = strdup( server );
+			entry->port = port;
+			pthread_mutex_init( &entry->mutex, NULL );
+			entry->next = pool;
+			pool = entry;
+		}
+	}
+	pthread_mutex_unlock( &pool_mutex );
+
+	return entry;
+}
+
+/** Drop the connection of a pool entry - must be called with its mutex held
+	and never from the connection's reader thread.
+*/
+
+static void pool_drop( pool_entry entry )
+{
+	if ( entry->connection != NULL )
+		mvcp_close( entry->connection );
+	if ( entry->parser != NULL )
+		mvcp_parser_close( entry->parser );
+	entry->connection = NULL;
+	entry->parser = NULL;
+	entry->failed = 0;
+}
+
+/** Complete a send with its response.
+*/
+
+static void consumer_send_done( void *arg, mvcp_response response )
+{
+	consumer_send send = arg;
+	int code = mvcp_response_get_error_code( response );
+
+	// The connection has gone, so the next send reconnects
+	if ( response == NULL )
+		send->entry->failed = 1;
+	mvcp_response_close( response );
+
+	pthread_mutex_lock( &send->mutex );
+	send->error = code / 100 != 2;
+	if ( send->error )
+	{
+		fprintf( stderr, "Send failed on %s:%d %s u%d (%d)\n", send->entry->server, send->entry->port, send->command, send->unit, code );
+		mlt_properties_set_int( MLT_CONSUMER_PROPERTIES( send->consumer ), "_error", 1 );
+	}
+	if ( send->async )
+		mlt_consumer_stopped( send->consumer );
+	send->done = 1;
+	pthread_cond_broadcast( &send->cond );
+	pthread_mutex_unlock( &send->mutex );
+}
+
+/** Send a doc over the pooled connection, connecting first if required and
+	without waiting for the response, which completes the send. Returns
+	non-zero if it could not be sent, in which case the send is not completed.
+*/
+
+static int pool_send( pool_entry entry, consumer_send send, char *doc )
+{
+	int error = 1;
+	char *command = malloc( strlen( send->command ) + 32 );
+
+	if ( command == NULL )
+		return error;
+	sprintf( command, "PUSH U%d %s", send->unit, send->command );
+
+	pthread_mutex_lock( &entry->mutex );
+
+	if ( entry->failed )
+		pool_drop( entry );
+
+	if ( entry->connection == NULL )
+	{
+		entry->parser = mvcp_parser_init_remote( entry->server, entry->port );
+		// Only responses are wanted, not the status stream
+		mvcp_remote_set_status( entry->parser, 0 );
+		entry->connection = mvcp_init( entry->parser );
+		if ( mvcp_connect( entry->connection ) != mvcp_ok )
+		{
+			fprintf( stderr, "Unable to connect to the server at %s:%d\n", entry->server, entry->port );
+			pool_drop( entry );
+		}
+	}
+
+	if ( entry->connection != NULL )
+	{
+		error = mvcp_remote_submit_received( entry->parser, command, doc, consumer_send_done, send );
+		if ( error )
+			pool_drop( entry );
+	}
+
+	pthread_mutex_unlock( &entry->mutex );
+
+	free( command );
+
+	return error;
+}
+
+/** Serialise a service to xml. When the service carries a _mvcp_revision,
+	the doc is kept on the service and reused until the revision changes, so
+	the same graph pushed to several units or servers is serialised once.
+*/
+
+static char *service_serialise( mlt_service service )
+{
+	mlt_properties properties = MLT_SERVICE_PROPERTIES( service );
+	char *revision = mlt_properties_get( properties, "_mvcp_revision" );
+	char *doc = NULL;
+	mlt_consumer consumer = NULL;
+
+	if ( revision != NULL && mlt_properties_get( properties, "_mvcp_xml" ) != NULL &&
+		 mlt_properties_get( properties, "_mvcp_xml_revision" ) != NULL &&
+		 !strcmp( revision, mlt_properties_get( properties, "_mvcp_xml_revision" ) ) )
+		return strdup( mlt_properties_get( properties, "_mvcp_xml" ) );
+
+	consumer = mlt_factory_consumer( NULL, "xml", "buffer" );
+	if ( consumer != NULL )
+	{
+		// Temporary hack
+		mlt_properties_set( MLT_CONSUMER_PROPERTIES( consumer ), "store", "nle_" );
+		mlt_consumer_connect( consumer, service );
+		mlt_consumer_start( consumer );
+		doc = mlt_properties_get( MLT_CONSUMER_PROPERTIES( consumer ), "buffer" );
+		doc = doc != NULL ? strdup( doc ) : NULL;
+		mlt_consumer_close( consumer );
+	}
+
+	if ( revision != NULL && doc != NULL )
+	{
+		mlt_properties_set( properties, "_mvcp_xml", doc );
+		mlt_properties_set( properties, "_mvcp_xml_revision", revision );
+	}
+
+	return doc;
+}
+
+/** Wait for a send to complete and release it.
+*/
+
+static void consumer_send_close( consumer_send send )
+{
+	if ( send != NULL )
+	{
+		pthread_mutex_lock( &send->mutex );
+		while ( !send->done )
+			pthread_cond_wait( &send->cond, &send->mutex );
+		pthread_mutex_unlock( &send->mutex );
+		pthread_mutex_destroy( &send->mutex );
+		pthread_cond_destroy( &send->cond );
+		free( send->command );
+		free( send );
+	}
+}
+
 /** This is what will be called by the factory
 */
 
@@ -90,8 +325,8 @@ static int consumer_start( mlt_consumer this )
 	char *title = mlt_properties_get( properties, "title" );
 	char command[ 2048 ];
 
-	// If this is a reuse, then a mvcp object will exist
-	mvcp connection = mlt_properties_get_data( properties, "connection", NULL );
+	// Send asynchronously if requested
+	int async = mlt_properties_get_int( properties, "async" );
 
 	// Special case - we can get a doc too...
 	char *doc = mlt_properties_get( properties, "xml" );
@@ -114,51 +349,53 @@ static int consumer_start( mlt_consumer this )
 		strcat( command, "\"" );
 	}
 
+	// Wait for any previous send from this consumer to complete
+	mlt_properties_set_data( properties, "_send", NULL, 0, NULL, NULL );
+
 	if ( service != NULL || doc != NULL )
 	{
-		// Initiate the connection if required
-		if ( connection == NULL )
+		// Use the connection shared with other consumers for this server
+		pool_entry entry = pool_fetch( server, port );
+		consumer_send send = NULL;
+
+		// Serialise the service, reusing the doc if it hasn't changed
+		doc = doc == NULL ? service_serialise( service ) : strdup( doc );
+
+		if ( entry != NULL && doc != NULL )
+			send = calloc( 1, sizeof( *send ) );
+
+		if ( send != NULL && ( send->command = strdup( command ) ) != NULL )
 		{
-			mvcp_parser parser = mvcp_parser_init_remote( server, port );
-			connection = mvcp_init( parser );
-			if ( mvcp_connect( connection ) == mvcp_ok )
+			int sent = 0;
+			send->consumer = this;
+			send->entry = entry;
+			send->unit = unit;
+			send->async = async;
+			pthread_mutex_init( &send->mutex, NULL );
+			pthread_cond_init( &send->cond, NULL );
+
+			sent = pool_send( entry, send, doc ) == 0;
+			if ( !sent )
 			{
-				mlt_properties_set_data( properties, "connection", connection, 0, ( mlt_destructor )mvcp_close, NULL );
-				mlt_properties_set_data( properties, "parser", parser, 0, ( mlt_destructor )mvcp_parser_close, NULL );
+				send->async = 0;
+				consumer_send_done( send, NULL );
 			}
-			else
+			free( doc );
+
+			// An asynchronous send completes when its response arrives
+			if ( async && sent )
 			{
-				fprintf( stderr, "Unable to connect to the server at %s:%d\n", server, port );
-				mlt_properties_set_int( properties, "_error", 1 );
-				mvcp_close( connection );
-				mvcp_parser_close( parser );
-				connection = NULL;
+				mlt_properties_set_data( properties, "_send", send, 0, ( mlt_destructor )consumer_send_close, NULL );
+				return 0;
 			}
+			consumer_send_close( send );
 		}
-
-		// If we have connection, push the service over
-		if ( connection != NULL )
+		else
 		{
-			if ( doc == NULL )
-			{
-				int error;
-
-				// Push the service
-				error = mvcp_unit_push( connection, unit, command, service );
-
-				// Report error
-				if ( error != mvcp_ok )
-					fprintf( stderr, "Push failed on %s:%d %s u%d (%d)\n", server, port, command, unit, error );
-			}
-			else
-			{
-				// Push the service
-				int error = mvcp_unit_receive( connection, unit, command, doc );
-
-				// Report error
-				if ( error != mvcp_ok )
-					fprintf( stderr, "Send failed on %s:%d %s u%d (%d)\n", server, port, command, unit, error );
-			}
+			mlt_properties_set_int( properties, "_error", 1 );
+			if ( send != NULL )
+				free( send );
+			free( doc );
 		}
 	}
 	
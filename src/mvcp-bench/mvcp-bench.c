@@ -0,0 +1,510 @@
+/*
+ * mvcp-bench.c -- MVCP Load Generator and Latency Benchmark
+ * Copyright (C) 2002-2015 Meltytech, LLC
+ * Author: Charles Yates <charles.yates@pandora.be>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+/* System header files */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <pthread.h>
+
+/* Application header files */
+#include <mvcp/mvcp.h>
+#include <mvcp/mvcp_remote.h>
+
+/** Commands which can be mixed.
+*/
+
+typedef enum
+{
+	bench_usta,
+	bench_list,
+	bench_apnd,
+	bench_goto,
+	bench_push,
+	bench_commands
+}
+bench_command;
+
+static const char *bench_names[] = { "USTA", "LIST", "APND", "GOTO", "PUSH" };
+
+/** Number of GOTO send times remembered for matching status changes.
+*/
+
+#define BENCH_MARKERS 4096
+
+/** A growable set of latencies in microseconds.
+*/
+
+typedef struct
+{
+	double *values;
+	int count;
+	int size;
+	int errors;
+}
+bench_samples;
+
+/** Benchmark configuration and shared state.
+*/
+
+typedef struct
+{
+	char *server;
+	int port;
+	int unit;
+	int connections;
+	int subscribers;
+	int commands;
+	int duration;
+	int weights[ bench_commands ];
+	int weight_total;
+	char *clip;
+	char *xml;
+	int range;
+	volatile int running;
+	pthread_mutex_t mutex;
+	int position;
+	double markers[ BENCH_MARKERS ];
+	bench_samples samples[ bench_commands ];
+	bench_samples status;
+}
+bench_t, *bench;
+
+/** The current time in microseconds.
+*/
+
+static double bench_now( )
+{
+	struct timespec now;
+	clock_gettime( CLOCK_MONOTONIC, &now );
+	return now.tv_sec * 1000000.0 + now.tv_nsec / 1000.0;
+}
+
+/** Add a latency to a set of samples.
+*/
+
+static void bench_samples_add( bench_samples *samples, double value )
+{
+	if ( samples->count == samples->size )
+	{
+		int size = samples->size == 0 ? 1024 : samples->size * 2;
+		double *values = realloc( samples->values, size * sizeof( double ) );
+		if ( values == NULL )
+			return;
+		samples->values = values;
+		samples->size = size;
+	}
+	samples->values[ samples->count ++ ] = value;
+}
+
+/** Move the samples of a thread into the totals.
+*/
+
+static void bench_samples_merge( bench this, bench_samples *total, bench_samples *samples )
+{
+	int index = 0;
+	pthread_mutex_lock( &this->mutex );
+	for ( index = 0; index < samples->count; index ++ )
+		bench_samples_add( total, samples->values[ index ] );
+	total->errors += samples->errors;
+	pthread_mutex_unlock( &this->mutex );
+	free( samples->values );
+	memset( samples, 0, sizeof( bench_samples ) );
+}
+
+static int bench_compare( const void *a, const void *b )
+{
+	double x = *( const double * )a;
+	double y = *( const double * )b;
+	return x < y ? -1 : x > y;
+}
+
+/** Fetch a percentile from sorted samples.
+*/
+
+static double bench_percentile( bench_samples *samples, double percent )
+{
+	int index = ( int )( samples->count * percent / 100.0 );
+	if ( samples->count == 0 )
+		return 0;
+	if ( index >= samples->count )
+		index = samples->count - 1;
+	return samples->values[ index ];
+}
+
+/** Print a row of the report with times in milliseconds.
+*/
+
+static void bench_report( const char *name, bench_samples *samples, double elapsed )
+{
+	qsort( samples->values, samples->count, sizeof( double ), bench_compare );
+	printf( "%-8s %8d %6d %10.1f %9.3f %9.3f %9.3f %9.3f\n", name, samples->count, samples->errors,
+			elapsed > 0 ? samples->count / elapsed : 0,
+			bench_percentile( samples, 50 ) / 1000.0, bench_percentile( samples, 99 ) / 1000.0,
+			bench_percentile( samples, 99.9 ) / 1000.0,
+			samples->count > 0 ? samples->values[ samples->count - 1 ] / 1000.0 : 0 );
+}
+
+/** Choose the next command from the weighted mix.
+*/
+
+static bench_command bench_choose( bench this, unsigned int *seed )
+{
+	int choice = rand_r( seed ) % this->weight_total;
+	int index = 0;
+	for ( index = 0; index < bench_commands - 1; index ++ )
+	{
+		if ( choice < this->weights[ index ] )
+			break;
+		choice -= this->weights[ index ];
+	}
+	return index;
+}
+
+/** Choose the position of the next GOTO and remember when it was sent.
+*/
+
+static int bench_marker( bench this )
+{
+	int position = 0;
+	pthread_mutex_lock( &this->mutex );
+	position = this->position;
+	this->position = ( this->position + 1 ) % this->range;
+	this->markers[ position % BENCH_MARKERS ] = bench_now( );
+	pthread_mutex_unlock( &this->mutex );
+	return position;
+}
+
+/** Issue one command and return the result.
+*/
+
+static mvcp_error_code bench_execute( bench this, mvcp client, bench_command command )
+{
+	mvcp_error_code error = mvcp_ok;
+	mvcp_status_t status;
+	mvcp_list list = NULL;
+
+	switch( command )
+	{
+		case bench_usta:
+			error = mvcp_unit_status( client, this->unit, &status );
+			break;
+		case bench_list:
+			list = mvcp_list_init( client, this->unit );
+			error = list != NULL ? mvcp_list_get_error_code( list ) : mvcp_malloc_failed;
+			mvcp_list_close( list );
+			break;
+		case bench_apnd:
+			error = mvcp_unit_append( client, this->unit, this->clip, -1, -1 );
+			break;
+		case bench_goto:
+			error = mvcp_unit_goto( client, this->unit, bench_marker( this ) );
+			break;
+		case bench_push:
+			error = mvcp_unit_receive( client, this->unit, "", this->xml );
+			break;
+		default:
+			break;
+	}
+
+	return error;
+}
+
+/** Thread which replays the command mix over one control connection.
+*/
+
+static void *bench_control( void *arg )
+{
+	bench this = arg;
+	mvcp_parser parser = mvcp_parser_init_remote( this->server, this->port );
+	mvcp client = NULL;
+	bench_samples samples[ bench_commands ];
+	unsigned int seed = ( unsigned int )( bench_now( ) ) ^ ( unsigned int )( intptr_t )&seed;
+	int count = 0;
+	int index = 0;
+
+	memset( samples, 0, sizeof( samples ) );
+
+	// Status is measured by the subscribers
+	mvcp_remote_set_status( parser, 0 );
+	client = mvcp_init( parser );
+
+	if ( mvcp_connect( client ) != mvcp_ok )
+	{
+		fprintf( stderr, "Unable to connect to %s:%d\n", this->server, this->port );
+		this->running = 0;
+	}
+
+	while ( this->running && ( this->commands == 0 || count < this->commands ) )
+	{
+		bench_command command = bench_choose( this, &seed );
+		double start = bench_now( );
+		mvcp_error_code error = bench_execute( this, client, command );
+		if ( error == mvcp_ok )
+			bench_samples_add( &samples[ command ], bench_now( ) - start );
+		else
+			samples[ command ].errors ++;
+		count ++;
+	}
+
+	for ( index = 0; index < bench_commands; index ++ )
+		bench_samples_merge( this, &this->samples[ index ], &samples[ index ] );
+
+	mvcp_close( client );
+	mvcp_parser_close( parser );
+
+	return NULL;
+}
+
+/** Thread which times the arrival of the status changes caused by GOTO.
+*/
+
+static void *bench_subscriber( void *arg )
+{
+	bench this = arg;
+	mvcp_parser parser = mvcp_parser_init_remote( this->server, this->port );
+	mvcp_response response = mvcp_parser_connect( parser );
+	mvcp_notifier notifier = mvcp_parser_get_notifier( parser );
+	unsigned int cursor = mvcp_notifier_cursor( notifier );
+	bench_samples samples;
+	int last = -1;
+
+	memset( &samples, 0, sizeof( samples ) );
+
+	if ( response == NULL )
+		fprintf( stderr, "Unable to subscribe to %s:%d\n", this->server, this->port );
+	mvcp_response_close( response );
+
+	while ( this->running )
+	{
+		mvcp_status_t status;
+		int result = mvcp_notifier_next( notifier, &cursor, &status, 100 );
+
+		if ( result == 0 && status.unit == this->unit && status.position != last &&
+			 status.position >= 0 && status.position < this->range )
+		{
+			double sent = 0;
+			pthread_mutex_lock( &this->mutex );
+			sent = this->markers[ status.position % BENCH_MARKERS ];
+			pthread_mutex_unlock( &this->mutex );
+			if ( sent > 0 )
+				bench_samples_add( &samples, bench_now( ) - sent );
+			last = status.position;
+		}
+		else if ( result == EOVERFLOW )
+		{
+			samples.errors ++;
+		}
+	}
+
+	bench_samples_merge( this, &this->status, &samples );
+	mvcp_parser_close( parser );
+
+	return NULL;
+}
+
+/** Build an MLT XML document of at least the given size - a colour clip
+	followed by enough play list entries to fill it.
+*/
+
+static char *bench_document( int size )
+{
+	const char *head = "<?xml version=\"1.0\"?>\n<mlt>\n<producer id=\"bench\"><property name=\"resource\">colour:black</property></producer>\n<playlist id=\"playlist\">\n";
+	const char *entry = "<entry producer=\"bench\" in=\"0\" out=\"0\"/>\n";
+	const char *tail = "</playlist>\n</mlt>\n";
+	int entries = ( size - ( int )strlen( head ) - ( int )strlen( tail ) ) / ( int )strlen( entry ) + 1;
+	char *xml = malloc( strlen( head ) + strlen( tail ) + entries * strlen( entry ) + 1 );
+	char *ptr = xml;
+
+	if ( xml != NULL )
+	{
+		ptr += sprintf( ptr, "%s", head );
+		while ( entries -- > 0 )
+			ptr += sprintf( ptr, "%s", entry );
+		sprintf( ptr, "%s", tail );
+	}
+
+	return xml;
+}
+
+/** Parse a command mix such as USTA:50,LIST:20,GOTO:30.
+*/
+
+static int bench_mix( bench this, char *mix )
+{
+	char *copy = strdup( mix );
+	char *item = NULL;
+	char *save = NULL;
+	int error = 0;
+
+	memset( this->weights, 0, sizeof( this->weights ) );
+	this->weight_total = 0;
+
+	for ( item = strtok_r( copy, ",", &save ); item != NULL && !error; item = strtok_r( NULL, ",", &save ) )
+	{
+		char *weight = strchr( item, ':' );
+		int index = 0;
+
+		if ( weight != NULL )
+			*weight ++ = '\0';
+		for ( index = 0; index < bench_commands; index ++ )
+			if ( !strcasecmp( item, bench_names[ index ] ) )
+				break;
+		if ( index == bench_commands )
+		{
+			fprintf( stderr, "Unknown command in mix: %s\n", item );
+			error = 1;
+		}
+		else
+		{
+			this->weights[ index ] = weight != NULL ? atoi( weight ) : 1;
+			this->weight_total += this->weights[ index ];
+		}
+	}
+
+	free( copy );
+	return error || this->weight_total <= 0;
+}
+
+static void usage( )
+{
+	fprintf( stderr, "Usage: mvcp-bench [options]\n"
+		"  -s server     server name (default localhost)\n"
+		"  -p port       server port (default 5250)\n"
+		"  -u unit       unit to exercise (default 0)\n"
+		"  -c count      concurrent control connections (default 1)\n"
+		"  -m count      STATUS subscribers (default 1)\n"
+		"  -n count      commands per connection, 0 for no limit (default 1000)\n"
+		"  -t seconds    stop after this many seconds, 0 for no limit (default 0)\n"
+		"  -x mix        weighted command mix (default USTA:40,LIST:30,GOTO:30)\n"
+		"                from USTA, LIST, APND, GOTO and PUSH\n"
+		"  -f clip       clip appended by APND (default colour:black)\n"
+		"  -X bytes      size of the XML sent by PUSH (default 1048576)\n"
+		"  -r frames     GOTO positions cycle through 0 to frames-1 (default 100)\n" );
+}
+
+int main( int argc, char **argv )
+{
+	bench_t this;
+	pthread_t *threads = NULL;
+	int threads_count = 0;
+	int size = 1048576;
+	double start = 0;
+	double elapsed = 0;
+	int index = 0;
+	int option = 0;
+
+	memset( &this, 0, sizeof( this ) );
+	this.server = "localhost";
+	this.port = 5250;
+	this.connections = 1;
+	this.subscribers = 1;
+	this.commands = 1000;
+	this.clip = "colour:black";
+	this.range = 100;
+	bench_mix( &this, "USTA:40,LIST:30,GOTO:30" );
+
+	while ( ( option = getopt( argc, argv, "s:p:u:c:m:n:t:x:f:X:r:h" ) ) != -1 )
+	{
+		switch( option )
+		{
+			case 's': this.server = optarg; break;
+			case 'p': this.port = atoi( optarg ); break;
+			case 'u': this.unit = atoi( optarg ); break;
+			case 'c': this.connections = atoi( optarg ); break;
+			case 'm': this.subscribers = atoi( optarg ); break;
+			case 'n': this.commands = atoi( optarg ); break;
+			case 't': this.duration = atoi( optarg ); break;
+			case 'f': this.clip = optarg; break;
+			case 'X': size = atoi( optarg ); break;
+			case 'r': this.range = atoi( optarg ); break;
+			case 'x':
+				if ( bench_mix( &this, optarg ) )
+					return 1;
+				break;
+			default:
+				usage( );
+				return option != 'h';
+		}
+	}
+
+	if ( this.connections <= 0 || this.subscribers < 0 || this.range <= 0 ||
+		 ( this.commands == 0 && this.duration == 0 ) )
+	{
+		usage( );
+		return 1;
+	}
+
+	if ( this.weights[ bench_push ] > 0 && ( this.xml = bench_document( size ) ) == NULL )
+		return 1;
+
+	pthread_mutex_init( &this.mutex, NULL );
+	threads = calloc( this.connections + this.subscribers, sizeof( pthread_t ) );
+	this.running = 1;
+
+	// Subscribers are given a moment to receive the initial status of every unit
+	for ( index = 0; index < this.subscribers; index ++ )
+		pthread_create( &threads[ threads_count ++ ], NULL, bench_subscriber, &this );
+	if ( this.subscribers > 0 )
+		sleep( 1 );
+
+	start = bench_now( );
+	for ( index = 0; index < this.connections; index ++ )
+		pthread_create( &threads[ threads_count ++ ], NULL, bench_control, &this );
+
+	if ( this.duration > 0 )
+	{
+		while ( this.running && bench_now( ) - start < this.duration * 1000000.0 )
+			usleep( 100000 );
+		this.running = 0;
+	}
+
+	for ( index = this.subscribers; index < threads_count; index ++ )
+		pthread_join( threads[ index ], NULL );
+	elapsed = ( bench_now( ) - start ) / 1000000.0;
+
+	// Let the last status changes arrive before the subscribers stop
+	if ( this.subscribers > 0 )
+		sleep( 1 );
+	this.running = 0;
+	for ( index = 0; index < this.subscribers; index ++ )
+		pthread_join( threads[ index ], NULL );
+
+	printf( "%d connections, %d subscribers, %.2f seconds\n", this.connections, this.subscribers, elapsed );
+	printf( "%-8s %8s %6s %10s %9s %9s %9s %9s\n", "command", "count", "errors", "per sec", "p50 ms", "p99 ms", "p99.9 ms", "max ms" );
+	for ( index = 0; index < bench_commands; index ++ )
+		if ( this.weights[ index ] > 0 )
+			bench_report( bench_names[ index ], &this.samples[ index ], elapsed );
+	if ( this.subscribers > 0 )
+		bench_report( "STATUS", &this.status, elapsed );
+
+	for ( index = 0; index < bench_commands; index ++ )
+		free( this.samples[ index ].values );
+	free( this.status.values );
+	free( this.xml );
+	free( threads );
+	pthread_mutex_destroy( &this.mutex );
+
+	return 0;
+}
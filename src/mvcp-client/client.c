@@ -71,7 +71,7 @@ extern mvcp_error_code client_select_unit( client );
 extern mvcp_error_code client_execute( client );
 extern mvcp_error_code client_load( client );
 extern mvcp_error_code client_transport( client );
-static void *client_status_thread( void * );
+static void client_status_changed( void *, mvcp_status, int );
 
 /** Connected menu definition. 
 */
@@ -103,6 +103,7 @@ client client_init( mvcp_parser parser )
 			this->queues[ index ].unit = index;
 			this->queues[ index ].position = -1;
 		}
+		pthread_mutex_init( &this->queue_mutex, NULL );
 		this->parser = parser;
 	}
 	return this;
@@ -155,12 +156,18 @@ void client_show_status( client demo, mvcp_status status )
 	}
 }
 
-/** Determine action to carry out as dictated by the client unit queue.
+/** Determine action to carry out as dictated by the client unit queue - must
+	be called with the queue mutex held.
 */
 
-void client_queue_action( client demo, mvcp_status status )
+static void client_queue_apply( client demo, mvcp_status status )
 {
-	client_queue queue = &demo->queues[ status->unit ];
+	client_queue queue = NULL;
+
+	/* The demo only manages queues for the first MAX_UNITS units. */
+	if ( status->unit < 0 || status->unit >= MAX_UNITS )
+		return;
+	queue = &demo->queues[ status->unit ];
 
 	/* SPECIAL CASE STATUS NOTIFICATIONS TO IGNORE */
 
@@ -196,27 +203,27 @@ void client_queue_action( client demo, mvcp_status status )
 	}
 }
 
-/** Status thread.
+/** Act on a status change - the queues are shared by the status thread and
+	the menus.
 */
 
-static void *client_status_thread( void *arg )
+void client_queue_action( client demo, mvcp_status status )
 {
-	client demo = arg;
-	mvcp_status_t status;
-	mvcp_notifier notifier = mvcp_get_notifier( demo->dv );
+	pthread_mutex_lock( &demo->queue_mutex );
+	client_queue_apply( demo, status );
+	pthread_mutex_unlock( &demo->queue_mutex );
+}
 
-	while ( !demo->terminated )
-	{
-		if ( mvcp_notifier_wait( notifier, &status ) == 0 )
-		{
-			client_queue_action( demo, &status );
-			client_show_status( demo, &status );
-			if ( status.status == unit_disconnected )
-				demo->disconnected = 1;
-		}
-	}
+/** Status change callback - invoked from the status thread.
+*/
 
-	return NULL;
+static void client_status_changed( void *arg, mvcp_status status, int changed )
+{
+	client demo = arg;
+	client_queue_action( demo, status );
+	client_show_status( demo, status );
+	if ( status->status == unit_disconnected )
+		demo->disconnected = 1;
 }
 
 /** Turn on/off status display.
@@ -456,13 +463,15 @@ mvcp_error_code client_queue_add( client demo, client_queue queue, char *file )
 	mvcp_status_t status;
 	mvcp_notifier notifier = mvcp_get_notifier( demo->dv );
 
+	mvcp_notifier_get( notifier, &status, queue->unit );
+
+	pthread_mutex_lock( &demo->queue_mutex );
 	if ( ( queue->tail + 1 ) % 50 == queue->head )
 		queue->head = ( queue->head + 1 ) % 50;
 	strcpy( queue->list[ queue->tail ], file );
 	queue->tail = ( queue->tail + 1 ) % 50;
-
-	mvcp_notifier_get( notifier, &status, queue->unit );
-	mvcp_notifier_put( notifier, &status );
+	client_queue_apply( demo, &status );
+	pthread_mutex_unlock( &demo->queue_mutex );
 
 	return mvcp_ok;
 }
@@ -480,7 +489,11 @@ mvcp_error_code client_queue_maintenance( client demo, client_queue queue )
 		printf( "Activate queueing? [Y] " );
 		ch = get_keypress( );
 		if ( ch == 'y' || ch == 'Y' || ch == '\r' )
+		{
+			pthread_mutex_lock( &demo->queue_mutex );
 			queue->mode = 1;
+			pthread_mutex_unlock( &demo->queue_mutex );
+		}
 		printf( "\n\n" );
 	}
 
@@ -493,9 +506,11 @@ mvcp_error_code client_queue_maintenance( client demo, client_queue queue )
 
 		while ( !terminated )
 		{
-			int first = ( queue->position + 1 ) % 50;
-			int index = first;
+			int first = 0;
+			int index = 0;
 
+			pthread_mutex_lock( &demo->queue_mutex );
+			first = index = ( queue->position + 1 ) % 50;
 			if ( first == queue->tail )
 				index = first = queue->head;
 
@@ -526,6 +541,7 @@ mvcp_error_code client_queue_maintenance( client demo, client_queue queue )
 				printf( "0 = exit, t = turn off queueing, c = clear queue\n\n" );
 				last_position = queue->position;
 			}
+			pthread_mutex_unlock( &demo->queue_mutex );
 
 			client_change_status( demo, 1 );
 			
@@ -538,11 +554,15 @@ mvcp_error_code client_queue_maintenance( client demo, client_queue queue )
 					break;
 				case 't':
 					terminated = 1;
+					pthread_mutex_lock( &demo->queue_mutex );
 					queue->mode = 0;
+					pthread_mutex_unlock( &demo->queue_mutex );
 					break;
 				case 'c':
+					pthread_mutex_lock( &demo->queue_mutex );
 					queue->head = queue->tail = 0;
 					queue->position = -1;
+					pthread_mutex_unlock( &demo->queue_mutex );
 					last_position = -2;
 					break;
 			}
@@ -997,11 +1017,9 @@ void client_run( client this )
 	this->dv = mvcp_init( this->parser );
 	if ( mvcp_connect( this->dv ) == mvcp_ok )
 	{
-		pthread_create( &this->thread, NULL, client_status_thread, this );
+		this->subscription = mvcp_subscribe( this->dv, -1, mvcp_change_all, client_status_changed, this );
 		client_run_menu( this, &connected_menu );
-		this->terminated = 1;
-		pthread_join( this->thread, NULL );
-		this->terminated = 0;
+		mvcp_unsubscribe( this->dv, this->subscription );
 	}
 	else
 	{
@@ -1019,5 +1037,6 @@ void client_run( client this )
 
 void client_close( client demo )
 {
+	pthread_mutex_destroy( &demo->queue_mutex );
 	free( demo );
 }
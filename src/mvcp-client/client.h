@@ -52,8 +52,8 @@ typedef struct
 	char current_directory[ 512 ];
 	char last_directory[ 512 ];
 	int showing;
-	int terminated;
-	pthread_t thread;
+	int subscription;
+	pthread_mutex_t queue_mutex;
 	client_queue_t queues[ MAX_UNITS ];
 }
 *client, client_t;
@@ -0,0 +1,264 @@
+/*
+ * mvcp-fleet.c -- Parallel MVCP Client for Several Servers
+ * Copyright (C) 2002-2015 Meltytech, LLC
+ * Author: Charles Yates <charles.yates@pandora.be>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+/* System header files */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <pthread.h>
+
+/* Application header files */
+#include <mvcp/mvcp_fleet.h>
+
+/** Serialises the output of the status threads.
+*/
+
+static pthread_mutex_t output_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/** Print the status changes of every server.
+*/
+
+static void fleet_status( void *arg, int server, mvcp_status status, int changes )
+{
+	mvcp_fleet fleet = arg;
+	char line[ 5120 ];
+	mvcp_status_serialise( status, line, sizeof( line ) );
+	pthread_mutex_lock( &output_mutex );
+	printf( "%s: %s", mvcp_fleet_name( fleet, server ), line );
+	fflush( stdout );
+	pthread_mutex_unlock( &output_mutex );
+}
+
+/** Add a server given as host[:port][=tag,tag...].
+*/
+
+static int fleet_add( mvcp_fleet fleet, char *arg, int port )
+{
+	char *copy = strdup( arg );
+	char *tags = strchr( copy, '=' );
+	char *colon = NULL;
+	int index = -1;
+
+	if ( tags != NULL )
+		*tags ++ = '\0';
+	if ( ( colon = strchr( copy, ':' ) ) != NULL )
+	{
+		*colon = '\0';
+		port = atoi( colon + 1 );
+	}
+	if ( strcmp( copy, "" ) )
+		index = mvcp_fleet_add( fleet, copy, port, tags );
+	if ( index < 0 )
+		fprintf( stderr, "Invalid server: %s\n", arg );
+
+	free( copy );
+	return index;
+}
+
+/** Read a whole file into a string.
+*/
+
+static char *fleet_read( const char *file )
+{
+	FILE *input = fopen( file, "rb" );
+	char *buffer = NULL;
+	long size = 0;
+
+	if ( input != NULL && fseek( input, 0, SEEK_END ) == 0 && ( size = ftell( input ) ) >= 0 &&
+		 fseek( input, 0, SEEK_SET ) == 0 && ( buffer = malloc( size + 1 ) ) != NULL )
+	{
+		if ( fread( buffer, 1, size, input ) == size )
+		{
+			buffer[ size ] = '\0';
+		}
+		else
+		{
+			free( buffer );
+			buffer = NULL;
+		}
+	}
+	if ( input != NULL )
+		fclose( input );
+
+	return buffer;
+}
+
+/** Run a command line on the fleet - "@tags" in front selects the servers
+	and "PUSH Un file" sends the contents of a file. Returns non-zero if any
+	server failed.
+*/
+
+static int fleet_run( mvcp_fleet fleet, char *line )
+{
+	mvcp_fleet_replies replies = NULL;
+	char *tags = NULL;
+	int index = 0;
+
+	line[ strcspn( line, "\r\n" ) ] = '\0';
+	if ( line[ 0 ] == '@' )
+	{
+		tags = line + 1;
+		line += strcspn( line, " \t" );
+		if ( *line != '\0' )
+			*line ++ = '\0';
+	}
+	line += strspn( line, " \t" );
+	if ( !strcmp( line, "" ) )
+		return 0;
+
+	mvcp_fleet_connect( fleet );
+
+	if ( !strncasecmp( line, "PUSH ", 5 ) )
+	{
+		char unit[ 32 ] = "";
+		char file[ 1024 ] = "";
+		char *doc = NULL;
+
+		if ( sscanf( line + 5, "%31s %1023s", unit, file ) != 2 )
+		{
+			fprintf( stderr, "Usage: PUSH unit file\n" );
+			return 1;
+		}
+		if ( ( doc = fleet_read( file ) ) == NULL )
+		{
+			fprintf( stderr, "Unable to read %s\n", file );
+			return 1;
+		}
+		replies = mvcp_fleet_receive( fleet, tags, doc, "PUSH %s", unit );
+		free( doc );
+	}
+	else
+	{
+		replies = mvcp_fleet_execute( fleet, tags, "%s", line );
+	}
+
+	if ( replies == NULL )
+		return 1;
+
+	pthread_mutex_lock( &output_mutex );
+	for ( index = 0; index < replies->count; index ++ )
+	{
+		mvcp_fleet_reply reply = &replies->replies[ index ];
+		if ( reply->response == NULL )
+		{
+			printf( "%s: unavailable\n", reply->name );
+		}
+		else
+		{
+			int count = mvcp_response_count( reply->response );
+			int i = 0;
+			printf( "%s: %s\n", reply->name, mvcp_response_get_line( reply->response, 0 ) );
+			for ( i = 1; i < count; i ++ )
+				if ( strcmp( mvcp_response_get_line( reply->response, i ), "" ) )
+					printf( "%s:   %s\n", reply->name, mvcp_response_get_line( reply->response, i ) );
+		}
+	}
+	printf( "%d ok, %d failed\n", replies->count - replies->failed, replies->failed );
+	fflush( stdout );
+	pthread_mutex_unlock( &output_mutex );
+
+	index = replies->failed;
+	mvcp_fleet_replies_close( replies );
+	return index != 0;
+}
+
+static void usage( )
+{
+	fprintf( stderr, "Usage: mvcp-fleet [options] server[:port][=tag,tag...] ...\n"
+		"  -p port       default server port (default 5250)\n"
+		"  -c command    run the command instead of reading commands from stdin\n"
+		"  -w            print the status changes of every server until interrupted\n"
+		"Commands are sent to every server, or to those matching @tag,tag... in\n"
+		"front of the command. PUSH unit file sends the contents of a file.\n" );
+}
+
+int main( int argc, char **argv )
+{
+	mvcp_fleet fleet = mvcp_fleet_init( );
+	char **commands = calloc( argc, sizeof( char * ) );
+	int commands_count = 0;
+	int port = 5250;
+	int watch = 0;
+	int error = 0;
+	int option = 0;
+	int index = 0;
+
+	while ( ( option = getopt( argc, argv, "p:c:wh" ) ) != -1 )
+	{
+		switch( option )
+		{
+			case 'p': port = atoi( optarg ); break;
+			case 'c': commands[ commands_count ++ ] = optarg; break;
+			case 'w': watch = 1; break;
+			default:
+				usage( );
+				return option != 'h';
+		}
+	}
+
+	if ( optind >= argc )
+	{
+		usage( );
+		return 1;
+	}
+
+	for ( index = optind; index < argc; index ++ )
+		if ( fleet_add( fleet, argv[ index ], port ) < 0 )
+			return 1;
+
+	if ( watch )
+		mvcp_fleet_subscribe( fleet, NULL, -1, mvcp_change_all, fleet_status, fleet );
+
+	if ( mvcp_fleet_connect( fleet ) < mvcp_fleet_count( fleet ) )
+	{
+		for ( index = 0; index < mvcp_fleet_count( fleet ); index ++ )
+			if ( !mvcp_fleet_connected( fleet, index ) )
+				fprintf( stderr, "Unable to connect to %s\n", mvcp_fleet_name( fleet, index ) );
+	}
+
+	if ( commands_count > 0 )
+	{
+		for ( index = 0; index < commands_count; index ++ )
+		{
+			char *line = strdup( commands[ index ] );
+			error |= fleet_run( fleet, line );
+			free( line );
+		}
+	}
+	else
+	{
+		char line[ 10240 ];
+		while ( fgets( line, sizeof( line ), stdin ) != NULL )
+			error |= fleet_run( fleet, line );
+	}
+
+	while ( watch )
+	{
+		sleep( 1 );
+		mvcp_fleet_connect( fleet );
+	}
+
+	mvcp_fleet_close( fleet );
+	free( commands );
+
+	return error;
+}
@@ -23,6 +23,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdarg.h>
+#include <time.h>
 
 /* Application header files */
 #include "mvcp.h"
@@ -114,20 +115,36 @@ static mvcp_error_code mvcp_get_error_code( mvcp this, mvcp_response response )
 	return error;
 }
 
-/** Execute a command.
+/** Microseconds on the monotonic clock.
+*/
+
+static int64_t mvcp_trace_now( )
+{
+	struct timespec now;
+	clock_gettime( CLOCK_MONOTONIC, &now );
+	return ( int64_t )now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+/** Execute a command, prefixed by the trace id when one is set.
 */
 
 mvcp_error_code mvcp_execute( mvcp this, size_t size, const char *format, ... )
 {
 	mvcp_error_code error = mvcp_server_unavailable;
-	char *command = malloc( size );
+	size_t prefix = this != NULL && this->trace[ 0 ] != '\0' ? strlen( this->trace ) + 2 : 0;
+	char *command = malloc( size + prefix );
 	if ( this != NULL && command != NULL )
 	{
 		va_list list;
 		va_start( list, format );
-		if ( vsnprintf( command, size, format, list ) != 0 )
+		if ( prefix != 0 )
+			sprintf( command, "@%s ", this->trace );
+		if ( vsnprintf( command + prefix, size, format, list ) != 0 )
 		{
+			int64_t start = mvcp_trace_now( );
 			mvcp_response response = mvcp_parser_execute( this->parser, command );
+			if ( prefix != 0 )
+				this->trace_time = mvcp_trace_now( ) - start;
 			mvcp_set_last_response( this, response );
 			error = mvcp_get_error_code( this, response );
 		}
@@ -571,6 +588,89 @@ mvcp_error_code mvcp_unit_status( mvcp this, int unit, mvcp_status status )
 	return error;
 }
 
+/** Get the status of every unit in one request - at most count statuses are
+	stored, in unit order. A server without ASTA is asked for each unit in
+	turn. Returns the number of statuses stored or -1 on error.
+*/
+
+int mvcp_units_status( mvcp this, mvcp_status statuses, int count )
+{
+	int stored = -1;
+
+	if ( mvcp_execute( this, 1024, "ASTA" ) == mvcp_ok )
+	{
+		mvcp_response response = this->last_response;
+		int index = 0;
+
+		stored = 0;
+		for ( index = 1; index < mvcp_response_count( response ) && stored < count; index ++ )
+		{
+			char *line = mvcp_response_get_line( response, index );
+			if ( *line != '\0' )
+			{
+				memset( &statuses[ stored ], 0, sizeof( mvcp_status_t ) );
+				mvcp_status_parse( &statuses[ stored ++ ], line );
+			}
+		}
+	}
+	else if ( mvcp_response_get_error_code( this->last_response ) == 400 )
+	{
+		mvcp_units units = mvcp_units_init( this );
+		int index = 0;
+
+		if ( mvcp_units_get_error_code( units ) == mvcp_ok )
+			stored = 0;
+		for ( index = 0; stored >= 0 && index < mvcp_units_count( units ) && stored < count; index ++ )
+		{
+			mvcp_unit_entry_t entry;
+			if ( mvcp_units_get( units, index, &entry ) == mvcp_ok && mvcp_unit_status( this, entry.unit, &statuses[ stored ] ) == mvcp_ok )
+				stored ++;
+		}
+		mvcp_units_close( units );
+	}
+
+	return stored;
+}
+
+/** Describe a clip without loading it (PROBE).
+*/
+
+mvcp_error_code mvcp_probe( mvcp this, const char *clip, mvcp_probe_entry entry )
+{
+	mvcp_error_code error = mvcp_execute( this, 2048, "PROBE \"%s\"", clip );
+	memset( entry, 0, sizeof( mvcp_probe_entry_t ) );
+	if ( error == mvcp_ok )
+	{
+		char *line = mvcp_response_get_line( this->last_response, 1 );
+		mvcp_tokeniser tokeniser = mvcp_tokeniser_init( );
+		mvcp_tokeniser_parse_new( tokeniser, line, " " );
+
+		if ( mvcp_tokeniser_count( tokeniser ) >= 9 )
+		{
+			int index = 0;
+			for ( index = 0; index < mvcp_tokeniser_count( tokeniser ); index ++ )
+				mvcp_util_strip( mvcp_tokeniser_get_string( tokeniser, index ), '\"' );
+			strncpy( entry->clip, mvcp_tokeniser_get_string( tokeniser, 0 ), sizeof( entry->clip ) - 1 );
+			entry->length = atoi( mvcp_tokeniser_get_string( tokeniser, 1 ) );
+			entry->fps = atof( mvcp_tokeniser_get_string( tokeniser, 2 ) );
+			strncpy( entry->service, mvcp_tokeniser_get_string( tokeniser, 3 ), sizeof( entry->service ) - 1 );
+			entry->width = atoi( mvcp_tokeniser_get_string( tokeniser, 4 ) );
+			entry->height = atoi( mvcp_tokeniser_get_string( tokeniser, 5 ) );
+			entry->channels = atoi( mvcp_tokeniser_get_string( tokeniser, 6 ) );
+			entry->frequency = atoi( mvcp_tokeniser_get_string( tokeniser, 7 ) );
+			strncpy( entry->streams, mvcp_tokeniser_get_string( tokeniser, 8 ), sizeof( entry->streams ) - 1 );
+			if ( entry->length < 0 )
+				error = mvcp_invalid_file;
+		}
+		else
+		{
+			error = mvcp_invalid_file;
+		}
+		mvcp_tokeniser_close( tokeniser );
+	}
+	return error;
+}
+
 /** Transfer the current settings of unit src to unit dest.
 */
 
@@ -579,6 +679,14 @@ mvcp_error_code mvcp_unit_transfer( mvcp this, int src, int dest )
 	return mvcp_execute( this, 1024, "XFER U%d U%d", src, dest );
 }
 
+/** Exchange the play lists of units a and b.
+*/
+
+mvcp_error_code mvcp_unit_swap( mvcp this, int a, int b )
+{
+	return mvcp_execute( this, 1024, "SWAP U%d U%d", a, b );
+}
+
 /** Obtain the parsers notifier.
 */
 
@@ -590,6 +698,46 @@ mvcp_notifier mvcp_get_notifier( mvcp this )
 		return NULL;
 }
 
+/** Register a callback for the status changes of a unit (or of every unit if
+	the unit is negative) matching a mask of mvcp_change values. Changes which
+	arrive together are coalesced into one call per unit. Returns the id of
+	the subscription or -1.
+*/
+
+int mvcp_subscribe( mvcp this, int unit, int mask, mvcp_notifier_callback callback, void *data )
+{
+	mvcp_notifier notifier = mvcp_get_notifier( this );
+	if ( notifier != NULL )
+		return mvcp_notifier_subscribe( notifier, unit, mask, callback, data );
+	else
+		return -1;
+}
+
+/** Cancel a subscription.
+*/
+
+void mvcp_unsubscribe( mvcp this, int id )
+{
+	mvcp_notifier notifier = mvcp_get_notifier( this );
+	if ( notifier != NULL )
+		mvcp_notifier_unsubscribe( notifier, id );
+}
+
+/** Read the cached status of a unit without waiting on the status thread -
+	returns the number of statuses received for the unit (see
+	mvcp_notifier_snapshot).
+*/
+
+unsigned int mvcp_unit_snapshot( mvcp this, int unit, mvcp_status status )
+{
+	mvcp_notifier notifier = mvcp_get_notifier( this );
+	if ( notifier != NULL )
+		return mvcp_notifier_snapshot( notifier, status, unit );
+	memset( status, 0, sizeof( mvcp_status_t ) );
+	status->unit = unit;
+	return 0;
+}
+
 /** List the contents of the specified directory.
 */
 
@@ -729,6 +877,8 @@ mvcp_error_code mvcp_list_get( mvcp_list list, int index, mvcp_list_entry entry
 			entry->max = atol( mvcp_tokeniser_get_string( tokeniser, 4 ) );
 			entry->size = atol( mvcp_tokeniser_get_string( tokeniser, 5 ) );
 			entry->fps = atof( mvcp_tokeniser_get_string( tokeniser, 6 ) );
+			if ( mvcp_tokeniser_count( tokeniser ) > 7 )
+				entry->id = atoi( mvcp_tokeniser_get_string( tokeniser, 7 ) );
 		}
 		else
 		{
@@ -966,6 +1116,32 @@ const char *mvcp_error_description( mvcp_error_code error )
 	return msg;
 }
 
+/** Attach a trace id to the commands which follow, or stop tracing with NULL.
+	The server records when each traced command reaches it, is dispatched,
+	gets its unit, finishes and is answered, and for unit commands when the
+	next frame is shown - see STATS TRACE.
+*/
+
+void mvcp_set_trace( mvcp this, const char *id )
+{
+	if ( this != NULL )
+	{
+		if ( id != NULL )
+			snprintf( this->trace, sizeof( this->trace ), "%s", id );
+		else
+			this->trace[ 0 ] = '\0';
+	}
+}
+
+/** Get the microseconds from sending the last traced command to receiving its
+	response.
+*/
+
+int64_t mvcp_get_trace_time( mvcp this )
+{
+	return this != NULL ? this->trace_time : 0;
+}
+
 /** Close the mvcp structure.
 */
 
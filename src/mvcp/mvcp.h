@@ -78,6 +78,8 @@ typedef struct
 {
 	mvcp_parser parser;
 	mvcp_response last_response;
+	char trace[ 64 ];
+	int64_t trace_time;
 }
 *mvcp, mvcp_t;
 
@@ -129,10 +131,34 @@ extern mvcp_error_code mvcp_unit_clear_in_out( mvcp, int );
 extern mvcp_error_code mvcp_unit_set( mvcp, int, const char *, const char * );
 extern mvcp_error_code mvcp_unit_get( mvcp, int, char *, char *, int );
 extern mvcp_error_code mvcp_unit_status( mvcp, int, mvcp_status );
+extern int mvcp_units_status( mvcp, mvcp_status, int );
 extern mvcp_error_code mvcp_unit_transfer( mvcp, int, int );
+extern mvcp_error_code mvcp_unit_swap( mvcp, int, int );
+
+/** Probe entry structure - the length is in frames at fps.
+*/
+
+typedef struct
+{
+	char clip[ 2048 ];
+	int32_t length;
+	double fps;
+	char service[ 32 ];
+	int width;
+	int height;
+	int channels;
+	int frequency;
+	char streams[ 128 ];
+}
+*mvcp_probe_entry, mvcp_probe_entry_t;
+
+extern mvcp_error_code mvcp_probe( mvcp, const char *, mvcp_probe_entry );
 
 /* Notifier functionality. */
 extern mvcp_notifier mvcp_get_notifier( mvcp );
+extern int mvcp_subscribe( mvcp, int, int, mvcp_notifier_callback, void * );
+extern void mvcp_unsubscribe( mvcp, int );
+extern unsigned int mvcp_unit_snapshot( mvcp, int, mvcp_status );
 
 /** Structure for the directory.
 */
@@ -185,6 +211,7 @@ typedef struct
 	int32_t max;
 	int32_t size;
 	float fps;
+	int id;
 }
 *mvcp_list_entry, mvcp_list_entry_t;
 
@@ -253,6 +280,8 @@ extern void mvcp_units_close( mvcp_units );
 /* Miscellaenous functions */
 extern mvcp_response mvcp_get_last_response( mvcp );
 extern const char *mvcp_error_description( mvcp_error_code );
+extern void mvcp_set_trace( mvcp, const char * );
+extern int64_t mvcp_get_trace_time( mvcp );
 
 /* Courtesy functions. */
 extern mvcp_error_code mvcp_execute( mvcp, size_t, const char *, ... );
@@ -0,0 +1,573 @@
+/*
+ * mvcp_fleet.c -- Parallel Control of Several Servers
+ * Copyright (C) 2002-2015 Meltytech, LLC
+ * Author: Charles Yates <charles.yates@pandora.be>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+/* System header files */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <pthread.h>
+
+/* Application header files */
+#include "mvcp_fleet.h"
+#include "mvcp_remote.h"
+
+/** Subscription of a fleet callback to the notifier of one server.
+*/
+
+typedef struct mvcp_fleet_link_s
+{
+	struct mvcp_fleet_subscription_s *subscription;
+	int server;
+	int id;
+	struct mvcp_fleet_link_s *next;
+}
+*mvcp_fleet_link, mvcp_fleet_link_t;
+
+/** Subscription to the status changes of the servers matching the tags.
+*/
+
+typedef struct mvcp_fleet_subscription_s
+{
+	int id;
+	char *tags;
+	int unit;
+	int mask;
+	mvcp_fleet_callback callback;
+	void *data;
+	mvcp_fleet_link links;
+	struct mvcp_fleet_subscription_s *next;
+}
+*mvcp_fleet_subscription, mvcp_fleet_subscription_t;
+
+/** A server in the fleet.
+*/
+
+typedef struct
+{
+	char *host;
+	int port;
+	char *name;
+	char *tags;
+	mvcp_parser parser;
+	int connected;
+}
+*mvcp_fleet_server, mvcp_fleet_server_t;
+
+/** Private fleet structure.
+*/
+
+struct mvcp_fleet_s
+{
+	mvcp_fleet_server *servers;
+	int count;
+	int size;
+	mvcp_fleet_subscription subscriptions;
+	int subscription_id;
+};
+
+/** Construct an empty fleet.
+*/
+
+mvcp_fleet mvcp_fleet_init( )
+{
+	return calloc( 1, sizeof( struct mvcp_fleet_s ) );
+}
+
+/** Forward reference.
+*/
+
+static int mvcp_fleet_link_server( mvcp_fleet, mvcp_fleet_subscription, int );
+
+/** Add a server with a comma separated list of tags, which may be NULL.
+	The server is not contacted until mvcp_fleet_connect. Returns the index
+	of the server or -1.
+*/
+
+int mvcp_fleet_add( mvcp_fleet this, const char *host, int port, const char *tags )
+{
+	mvcp_fleet_server server = NULL;
+	mvcp_fleet_subscription subscription = NULL;
+
+	if ( this == NULL || host == NULL )
+		return -1;
+
+	if ( this->count == this->size )
+	{
+		int size = this->size == 0 ? 16 : this->size * 2;
+		mvcp_fleet_server *servers = realloc( this->servers, size * sizeof( mvcp_fleet_server ) );
+		if ( servers == NULL )
+			return -1;
+		this->servers = servers;
+		this->size = size;
+	}
+
+	server = calloc( 1, sizeof( mvcp_fleet_server_t ) );
+	if ( server == NULL )
+		return -1;
+
+	server->host = strdup( host );
+	server->port = port;
+	server->name = malloc( strlen( host ) + 16 );
+	server->tags = strdup( tags != NULL ? tags : "" );
+	server->parser = mvcp_parser_init_remote( server->host, port );
+
+	if ( server->name == NULL || server->tags == NULL || server->parser == NULL || server->parser->real == NULL )
+	{
+		mvcp_parser_close( server->parser );
+		free( server->host );
+		free( server->name );
+		free( server->tags );
+		free( server );
+		return -1;
+	}
+
+	sprintf( server->name, "%s:%d", host, port );
+	this->servers[ this->count ++ ] = server;
+
+	/* Existing subscriptions extend to the new server */
+	for ( subscription = this->subscriptions; subscription != NULL; subscription = subscription->next )
+		if ( mvcp_fleet_matches( this, this->count - 1, subscription->tags ) )
+			mvcp_fleet_link_server( this, subscription, this->count - 1 );
+
+	return this->count - 1;
+}
+
+/** Return the number of servers in the fleet.
+*/
+
+int mvcp_fleet_count( mvcp_fleet this )
+{
+	return this != NULL ? this->count : 0;
+}
+
+/** Return the "host:port" name of a server.
+*/
+
+const char *mvcp_fleet_name( mvcp_fleet this, int index )
+{
+	return this != NULL && index >= 0 && index < this->count ? this->servers[ index ]->name : NULL;
+}
+
+/** Determine if a server is connected - a server is disconnected when a
+	connect fails or one of its responses does not arrive.
+*/
+
+int mvcp_fleet_connected( mvcp_fleet this, int index )
+{
+	return this != NULL && index >= 0 && index < this->count && this->servers[ index ]->connected;
+}
+
+/** Determine if a term is one of the words of a comma separated list.
+*/
+
+static int mvcp_fleet_listed( const char *list, const char *term, int length )
+{
+	while ( *list != '\0' )
+	{
+		int size = strcspn( list, "," );
+		if ( size == length && !strncmp( list, term, length ) )
+			return 1;
+		list += size;
+		if ( *list == ',' )
+			list ++;
+	}
+	return 0;
+}
+
+/** Determine if a server is selected by a comma separated list of tags. A
+	server is selected by any of its own tags, its host or its name, while a
+	NULL, empty or "*" selection matches every server.
+*/
+
+int mvcp_fleet_matches( mvcp_fleet this, int index, const char *tags )
+{
+	mvcp_fleet_server server = NULL;
+
+	if ( this == NULL || index < 0 || index >= this->count )
+		return 0;
+	if ( tags == NULL || !strcmp( tags, "" ) || !strcmp( tags, "*" ) )
+		return 1;
+
+	server = this->servers[ index ];
+	while ( *tags != '\0' )
+	{
+		int length = strcspn( tags, "," );
+		if ( length > 0 &&
+			 ( mvcp_fleet_listed( server->tags, tags, length ) ||
+			   ( strlen( server->host ) == length && !strncmp( server->host, tags, length ) ) ||
+			   ( strlen( server->name ) == length && !strncmp( server->name, tags, length ) ) ) )
+			return 1;
+		tags += length;
+		if ( *tags == ',' )
+			tags ++;
+	}
+	return 0;
+}
+
+/** Connect a server - run on a thread of its own by mvcp_fleet_connect.
+*/
+
+static void *mvcp_fleet_connect_thread( void *arg )
+{
+	mvcp_fleet_server server = arg;
+	mvcp_response response = mvcp_parser_connect( server->parser );
+	server->connected = response != NULL && mvcp_response_get_error_code( response ) == 100;
+	mvcp_response_close( response );
+	return NULL;
+}
+
+/** Connect every server which is not connected, all at the same time, so the
+	fleet takes as long as its slowest server. Returns the number of servers
+	connected.
+*/
+
+int mvcp_fleet_connect( mvcp_fleet this )
+{
+	pthread_t *threads = NULL;
+	int *started = NULL;
+	int connected = 0;
+	int index = 0;
+
+	if ( this == NULL || this->count == 0 )
+		return 0;
+
+	threads = calloc( this->count, sizeof( pthread_t ) );
+	started = calloc( this->count, sizeof( int ) );
+
+	for ( index = 0; index < this->count; index ++ )
+	{
+		mvcp_fleet_server server = this->servers[ index ];
+		if ( server->connected )
+			continue;
+		if ( threads != NULL && started != NULL )
+			started[ index ] = pthread_create( &threads[ index ], NULL, mvcp_fleet_connect_thread, server ) == 0;
+		if ( started == NULL || !started[ index ] )
+			mvcp_fleet_connect_thread( server );
+	}
+
+	for ( index = 0; index < this->count; index ++ )
+	{
+		if ( started != NULL && started[ index ] )
+			pthread_join( threads[ index ], NULL );
+		connected += this->servers[ index ]->connected;
+	}
+
+	free( threads );
+	free( started );
+
+	return connected;
+}
+
+/** Send a command, or a document when one is given, to every connected
+	server matching the tags and wait for all the responses. Every command is
+	written before any response is awaited, so the fleet answers in the time
+	of its slowest server rather than the sum of them all.
+*/
+
+static mvcp_fleet_replies mvcp_fleet_send( mvcp_fleet this, const char *tags, char *command, char *doc )
+{
+	mvcp_fleet_replies replies = calloc( 1, sizeof( mvcp_fleet_replies_t ) );
+	mvcp_future *futures = NULL;
+	int index = 0;
+
+	if ( replies == NULL )
+		return NULL;
+
+	replies->replies = calloc( this->count + 1, sizeof( mvcp_fleet_reply_t ) );
+	futures = calloc( this->count + 1, sizeof( mvcp_future ) );
+	if ( replies->replies == NULL || futures == NULL )
+	{
+		free( futures );
+		mvcp_fleet_replies_close( replies );
+		return NULL;
+	}
+
+	for ( index = 0; index < this->count; index ++ )
+	{
+		mvcp_fleet_server server = this->servers[ index ];
+		mvcp_fleet_reply reply = &replies->replies[ replies->count ];
+
+		if ( !mvcp_fleet_matches( this, index, tags ) )
+			continue;
+
+		reply->server = index;
+		reply->name = server->name;
+
+		if ( !server->connected )
+		{
+			/* Nothing to send - the reply stays empty */
+		}
+		else if ( doc == NULL )
+		{
+			futures[ replies->count ] = mvcp_parser_submit_future( server->parser, command );
+		}
+		else if ( ( futures[ replies->count ] = mvcp_future_init( ) ) != NULL )
+		{
+			if ( mvcp_remote_submit_received( server->parser, command, doc, mvcp_future_complete, futures[ replies->count ] ) != 0 )
+				mvcp_future_complete( futures[ replies->count ], NULL );
+		}
+
+		replies->count ++;
+	}
+
+	for ( index = 0; index < replies->count; index ++ )
+	{
+		mvcp_fleet_reply reply = &replies->replies[ index ];
+		reply->response = mvcp_future_wait( futures[ index ] );
+		reply->code = reply->response != NULL ? mvcp_response_get_error_code( reply->response ) : -1;
+		if ( reply->response == NULL )
+			this->servers[ reply->server ]->connected = 0;
+		if ( reply->code / 100 != 2 )
+			replies->failed ++;
+	}
+
+	free( futures );
+
+	return replies;
+}
+
+/** Execute a printf style command on every server matching the tags.
+*/
+
+mvcp_fleet_replies mvcp_fleet_execute( mvcp_fleet this, const char *tags, const char *format, ... )
+{
+	mvcp_fleet_replies replies = NULL;
+	char *command = malloc( 10240 );
+	if ( this != NULL && command != NULL )
+	{
+		va_list list;
+		va_start( list, format );
+		if ( vsnprintf( command, 10240, format, list ) != 0 )
+			replies = mvcp_fleet_send( this, tags, command, NULL );
+		va_end( list );
+	}
+	free( command );
+	return replies;
+}
+
+/** Send a MLT XML document with a printf style command (usually
+	"PUSH U0 ...") to every server matching the tags.
+*/
+
+mvcp_fleet_replies mvcp_fleet_receive( mvcp_fleet this, const char *tags, char *doc, const char *format, ... )
+{
+	mvcp_fleet_replies replies = NULL;
+	char *command = malloc( 10240 );
+	if ( this != NULL && doc != NULL && command != NULL )
+	{
+		va_list list;
+		va_start( list, format );
+		if ( vsnprintf( command, 10240, format, list ) != 0 )
+			replies = mvcp_fleet_send( this, tags, command, doc );
+		va_end( list );
+	}
+	free( command );
+	return replies;
+}
+
+/** Push a service to every server matching the tags - the service is
+	serialised once for the whole fleet.
+*/
+
+mvcp_fleet_replies mvcp_fleet_push( mvcp_fleet this, const char *tags, mlt_service service, const char *format, ... )
+{
+	mvcp_fleet_replies replies = NULL;
+#ifndef MVCP_EMBEDDED
+	char *command = malloc( 10240 );
+	if ( this != NULL && service != NULL && command != NULL )
+	{
+		va_list list;
+		va_start( list, format );
+		if ( vsnprintf( command, 10240, format, list ) != 0 )
+		{
+			mlt_consumer consumer = mlt_factory_consumer( NULL, "xml", "buffer" );
+			if ( consumer != NULL )
+			{
+				mlt_properties properties = MLT_CONSUMER_PROPERTIES( consumer );
+				char *buffer = NULL;
+				mlt_properties_set( properties, "store", "nle_" );
+				mlt_consumer_connect( consumer, service );
+				mlt_consumer_start( consumer );
+				buffer = mlt_properties_get( properties, "buffer" );
+				if ( buffer != NULL )
+					replies = mvcp_fleet_send( this, tags, command, buffer );
+				mlt_consumer_close( consumer );
+			}
+		}
+		va_end( list );
+	}
+	free( command );
+#endif
+	return replies;
+}
+
+/** Close the replies and their responses.
+*/
+
+void mvcp_fleet_replies_close( mvcp_fleet_replies replies )
+{
+	if ( replies != NULL )
+	{
+		int index = 0;
+		for ( index = 0; replies->replies != NULL && index < replies->count; index ++ )
+			mvcp_response_close( replies->replies[ index ].response );
+		free( replies->replies );
+		free( replies );
+	}
+}
+
+/** Copy the last status received for a unit of a server without contacting
+	it. Returns non-zero if the server is not in the fleet.
+*/
+
+int mvcp_fleet_status( mvcp_fleet this, int index, int unit, mvcp_status status )
+{
+	if ( this == NULL || index < 0 || index >= this->count || status == NULL )
+		return -1;
+	mvcp_notifier_snapshot( mvcp_parser_get_notifier( this->servers[ index ]->parser ), status, unit );
+	return 0;
+}
+
+/** Forward the change of a server's unit to the fleet callback.
+*/
+
+static void mvcp_fleet_changed( void *arg, mvcp_status status, int changes )
+{
+	mvcp_fleet_link link = arg;
+	link->subscription->callback( link->subscription->data, link->server, status, changes );
+}
+
+/** Subscribe a fleet subscription to the notifier of one server.
+*/
+
+static int mvcp_fleet_link_server( mvcp_fleet this, mvcp_fleet_subscription subscription, int index )
+{
+	mvcp_fleet_link link = calloc( 1, sizeof( mvcp_fleet_link_t ) );
+	mvcp_notifier notifier = mvcp_parser_get_notifier( this->servers[ index ]->parser );
+
+	if ( link == NULL || notifier == NULL )
+	{
+		free( link );
+		return -1;
+	}
+
+	link->subscription = subscription;
+	link->server = index;
+	link->id = mvcp_notifier_subscribe( notifier, subscription->unit, subscription->mask, mvcp_fleet_changed, link );
+	if ( link->id < 0 )
+	{
+		free( link );
+		return -1;
+	}
+
+	link->next = subscription->links;
+	subscription->links = link;
+	return 0;
+}
+
+/** Register a callback for the changes of a unit (or every unit if negative)
+	on every server matching the tags, including servers added later. The
+	callback is invoked from the status thread of each server, so callbacks
+	for different servers may run at the same time. Returns the id of the
+	subscription or -1.
+*/
+
+int mvcp_fleet_subscribe( mvcp_fleet this, const char *tags, int unit, int mask, mvcp_fleet_callback callback, void *data )
+{
+	mvcp_fleet_subscription subscription = NULL;
+	int index = 0;
+
+	if ( this == NULL || callback == NULL || ( subscription = calloc( 1, sizeof( mvcp_fleet_subscription_t ) ) ) == NULL )
+		return -1;
+
+	subscription->id = ++ this->subscription_id;
+	subscription->tags = tags != NULL ? strdup( tags ) : NULL;
+	subscription->unit = unit;
+	subscription->mask = mask;
+	subscription->callback = callback;
+	subscription->data = data;
+
+	for ( index = 0; index < this->count; index ++ )
+		if ( mvcp_fleet_matches( this, index, tags ) )
+			mvcp_fleet_link_server( this, subscription, index );
+
+	subscription->next = this->subscriptions;
+	this->subscriptions = subscription;
+
+	return subscription->id;
+}
+
+/** Cancel a subscription - the callback is not invoked again once this
+	returns.
+*/
+
+void mvcp_fleet_unsubscribe( mvcp_fleet this, int id )
+{
+	mvcp_fleet_subscription *previous = this != NULL ? &this->subscriptions : NULL;
+
+	while ( previous != NULL && *previous != NULL )
+	{
+		mvcp_fleet_subscription subscription = *previous;
+		if ( subscription->id == id )
+		{
+			while ( subscription->links != NULL )
+			{
+				mvcp_fleet_link link = subscription->links;
+				subscription->links = link->next;
+				mvcp_notifier_unsubscribe( mvcp_parser_get_notifier( this->servers[ link->server ]->parser ), link->id );
+				free( link );
+			}
+			*previous = subscription->next;
+			free( subscription->tags );
+			free( subscription );
+			break;
+		}
+		previous = &subscription->next;
+	}
+}
+
+/** Close the fleet and disconnect all its servers.
+*/
+
+void mvcp_fleet_close( mvcp_fleet this )
+{
+	if ( this != NULL )
+	{
+		int index = 0;
+		while ( this->subscriptions != NULL )
+			mvcp_fleet_unsubscribe( this, this->subscriptions->id );
+		for ( index = 0; index < this->count; index ++ )
+		{
+			mvcp_fleet_server server = this->servers[ index ];
+			mvcp_parser_close( server->parser );
+			free( server->host );
+			free( server->name );
+			free( server->tags );
+			free( server );
+		}
+		free( this->servers );
+		free( this );
+	}
+}
@@ -0,0 +1,92 @@
+/*
+ * mvcp_fleet.h -- Parallel Control of Several Servers
+ * Copyright (C) 2002-2015 Meltytech, LLC
+ * Author: Charles Yates <charles.yates@pandora.be>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef _MVCP_FLEET_H_
+#define _MVCP_FLEET_H_
+
+/* Application header files */
+#include "mvcp_parser.h"
+#include "mvcp_status.h"
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+/** Response of one server to a fleet operation - the code is -1 and the
+	response NULL when the server could not be reached.
+*/
+
+typedef struct
+{
+	int server;
+	const char *name;
+	int code;
+	mvcp_response response;
+}
+*mvcp_fleet_reply, mvcp_fleet_reply_t;
+
+/** Responses of all the servers selected by a fleet operation, in the order
+	they were added to the fleet.
+*/
+
+typedef struct
+{
+	int count;
+	int failed;
+	mvcp_fleet_reply_t *replies;
+}
+*mvcp_fleet_replies, mvcp_fleet_replies_t;
+
+/** Callback invoked with the index of the server, the status of one of its
+	units and the mask of mvcp_change values which changed.
+*/
+
+typedef void ( *mvcp_fleet_callback )( void *, int, mvcp_status, int );
+
+/** A set of servers controlled together.
+*/
+
+typedef struct mvcp_fleet_s *mvcp_fleet;
+
+/** API for the fleet.
+*/
+
+extern mvcp_fleet mvcp_fleet_init( );
+extern int mvcp_fleet_add( mvcp_fleet, const char *, int, const char * );
+extern int mvcp_fleet_count( mvcp_fleet );
+extern const char *mvcp_fleet_name( mvcp_fleet, int );
+extern int mvcp_fleet_connected( mvcp_fleet, int );
+extern int mvcp_fleet_matches( mvcp_fleet, int, const char * );
+extern int mvcp_fleet_connect( mvcp_fleet );
+extern mvcp_fleet_replies mvcp_fleet_execute( mvcp_fleet, const char *, const char *, ... );
+extern mvcp_fleet_replies mvcp_fleet_receive( mvcp_fleet, const char *, char *, const char *, ... );
+extern mvcp_fleet_replies mvcp_fleet_push( mvcp_fleet, const char *, mlt_service, const char *, ... );
+extern void mvcp_fleet_replies_close( mvcp_fleet_replies );
+extern int mvcp_fleet_status( mvcp_fleet, int, int, mvcp_status );
+extern int mvcp_fleet_subscribe( mvcp_fleet, const char *, int, int, mvcp_fleet_callback, void * );
+extern void mvcp_fleet_unsubscribe( mvcp_fleet, int );
+extern void mvcp_fleet_close( mvcp_fleet );
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,407 @@
+/*
+ * mvcp_microbench.c -- Protocol Microbenchmarks
+ * Copyright (C) 2002-2015 Meltytech, LLC
+ * Author: Charles Yates <charles.yates@pandora.be>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/* System header files */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+/* Application header files */
+#include "mvcp_tokeniser.h"
+#include "mvcp_response.h"
+#include "mvcp_status.h"
+#include "mvcp_notifier.h"
+
+/** A long quoted path with multibyte characters, as sent by playout systems.
+*/
+
+#define MICROBENCH_CLIP "/srv/media/Archiv/Ñandú Producciones/2015 – Sommerfest/Übertragung «Finale» Teil 01 – Größe 1080i50.mov"
+
+/** Number of rows in a LIST response and of STATUS subscribers.
+*/
+
+#define MICROBENCH_ROWS 1000
+#define MICROBENCH_SUBSCRIBERS 64
+
+/** A benchmark - runs the given number of operations and returns how many
+	were done, which may differ from the request for batched operations.
+*/
+
+typedef long ( *microbench_function )( void *, long );
+
+/** Minimum time in microseconds spent on each benchmark.
+*/
+
+static double target = 500000;
+
+static double microbench_now( )
+{
+	struct timespec now;
+	clock_gettime( CLOCK_MONOTONIC, &now );
+	return now.tv_sec * 1000000.0 + now.tv_nsec / 1000.0;
+}
+
+/** Run a benchmark with doubling iteration counts until it takes at least
+	the target time, and print a tab separated result row.
+*/
+
+static void microbench_run( const char *name, microbench_function function, void *data )
+{
+	long iterations = 1;
+	long done = 0;
+	double elapsed = 0;
+
+	while ( 1 )
+	{
+		double start = microbench_now( );
+		done = function( data, iterations );
+		elapsed = microbench_now( ) - start;
+		if ( elapsed >= target || iterations >= ( 1L << 40 ) )
+			break;
+		iterations = elapsed > 0 && elapsed < target / 8 ? iterations * 8 : iterations * 2;
+	}
+
+	printf( "%s\t%ld\t%.1f\t%.0f\n", name, done, elapsed * 1000.0 / done, done / ( elapsed / 1000000.0 ) );
+	fflush( stdout );
+}
+
+/** Tokenise a LOAD of a long quoted path.
+*/
+
+static long bench_tokeniser_parse( void *data, long iterations )
+{
+	const char *command = "LOAD U0 \"" MICROBENCH_CLIP "\" 0 1499";
+	mvcp_tokeniser_t storage;
+	mvcp_tokeniser tokeniser = mvcp_tokeniser_init_inline( &storage );
+	long index = 0;
+
+	for ( index = 0; index < iterations; index ++ )
+		if ( mvcp_tokeniser_parse_new( tokeniser, ( char * )command, " " ) != 5 )
+			abort( );
+
+	mvcp_tokeniser_close( tokeniser );
+	return iterations;
+}
+
+/** Format the rows of a LIST response one at a time.
+*/
+
+static long bench_response_printf( void *data, long iterations )
+{
+	long index = 0;
+	int row = 0;
+
+	for ( index = 0; index < iterations; index ++ )
+	{
+		mvcp_response response = mvcp_response_init( );
+		mvcp_response_set_error( response, 201, "OK" );
+		mvcp_response_printf( response, 1024, "%d\n", 42 );
+		for ( row = 0; row < MICROBENCH_ROWS; row ++ )
+			mvcp_response_printf( response, 1024, "%d \"%s\" %d %d %d %d %.2f\n", row, MICROBENCH_CLIP, 0, 1499, 1500, 1500, 25.0 );
+		mvcp_response_close( response );
+	}
+
+	return iterations;
+}
+
+/** Write a complete LIST body to a response in a single call.
+*/
+
+static long bench_response_write( void *data, long iterations )
+{
+	const char *body = data;
+	int length = strlen( body );
+	long index = 0;
+
+	for ( index = 0; index < iterations; index ++ )
+	{
+		mvcp_response response = mvcp_response_init( );
+		mvcp_response_set_error( response, 201, "OK" );
+		mvcp_response_write( response, body, length );
+		if ( mvcp_response_count( response ) < MICROBENCH_ROWS + 2 )
+			abort( );
+		mvcp_response_close( response );
+	}
+
+	return iterations;
+}
+
+/** Fill in a playing status with realistic values.
+*/
+
+static void microbench_status( mvcp_status status, int position )
+{
+	memset( status, 0, sizeof( mvcp_status_t ) );
+	status->unit = 0;
+	status->status = unit_playing;
+	snprintf( status->clip, sizeof( status->clip ), "%s", MICROBENCH_CLIP );
+	status->position = position;
+	status->speed = 1000;
+	status->fps = 25.0;
+	status->in = 0;
+	status->out = 1499;
+	status->length = 1500;
+	snprintf( status->tail_clip, sizeof( status->tail_clip ), "%s", MICROBENCH_CLIP );
+	status->tail_position = 0;
+	status->tail_in = 0;
+	status->tail_out = 1499;
+	status->tail_length = 1500;
+	status->seek_flag = 1;
+	status->generation = 7;
+	status->clip_index = 3;
+}
+
+static long bench_status_serialise( void *data, long iterations )
+{
+	mvcp_status_t status;
+	char text[ 10240 ];
+	long index = 0;
+
+	microbench_status( &status, 0 );
+	for ( index = 0; index < iterations; index ++ )
+	{
+		status.position = index & 1023;
+		mvcp_status_serialise( &status, text, sizeof( text ) );
+	}
+
+	return iterations;
+}
+
+static long bench_status_parse( void *data, long iterations )
+{
+	mvcp_status_t status;
+	char text[ 10240 ];
+	long index = 0;
+
+	microbench_status( &status, 500 );
+	mvcp_status_serialise( &status, text, sizeof( text ) );
+	for ( index = 0; index < iterations; index ++ )
+		mvcp_status_parse( &status, text );
+
+	return iterations;
+}
+
+/** Serialise and parse the delta of a position change.
+*/
+
+static long bench_status_delta( void *data, long iterations )
+{
+	mvcp_status_t previous, status, result;
+	char text[ 10240 ];
+	long index = 0;
+
+	microbench_status( &previous, 0 );
+	microbench_status( &result, 0 );
+	for ( index = 0; index < iterations; index ++ )
+	{
+		microbench_status( &status, ( int )( index & 1023 ) + 1 );
+		mvcp_status_serialise_delta( &previous, &status, text, sizeof( text ) );
+		mvcp_status_parse_delta( &result, text );
+		previous.position = status.position;
+	}
+
+	return iterations;
+}
+
+/** Shared state of the notifier fan-out benchmark.
+*/
+
+typedef struct
+{
+	mvcp_notifier notifier;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	long delivered;
+	long overflows;
+	int running;
+}
+microbench_fanout;
+
+static void *microbench_subscriber( void *arg )
+{
+	microbench_fanout *fanout = arg;
+	unsigned int cursor = mvcp_notifier_cursor( fanout->notifier );
+	mvcp_notifier_line line = NULL;
+
+	while ( fanout->running )
+	{
+		int result = mvcp_notifier_next_line( fanout->notifier, &cursor, &line, 100 );
+		if ( result == 0 || result == EOVERFLOW )
+		{
+			pthread_mutex_lock( &fanout->mutex );
+			if ( result == 0 )
+				fanout->delivered ++;
+			else
+				fanout->overflows ++;
+			pthread_cond_signal( &fanout->cond );
+			pthread_mutex_unlock( &fanout->mutex );
+		}
+		mvcp_notifier_release( fanout->notifier, line );
+	}
+
+	return NULL;
+}
+
+/** Put a status change and wait until every subscriber has received it -
+	the time per operation is the fan-out latency to all subscribers.
+*/
+
+static long bench_notifier_fanout( void *data, long iterations )
+{
+	microbench_fanout *fanout = data;
+	mvcp_status_t status;
+	long index = 0;
+
+	for ( index = 0; index < iterations; index ++ )
+	{
+		long expected = 0;
+		microbench_status( &status, ( int )( index & 1023 ) );
+		pthread_mutex_lock( &fanout->mutex );
+		expected = fanout->delivered + fanout->overflows + MICROBENCH_SUBSCRIBERS;
+		pthread_mutex_unlock( &fanout->mutex );
+		mvcp_notifier_put( fanout->notifier, &status );
+		pthread_mutex_lock( &fanout->mutex );
+		while ( fanout->delivered + fanout->overflows < expected )
+			pthread_cond_wait( &fanout->cond, &fanout->mutex );
+		pthread_mutex_unlock( &fanout->mutex );
+	}
+
+	return iterations;
+}
+
+/** Put status changes as fast as possible - subscribers which fall more
+	than the ring behind count as overflows.
+*/
+
+static long bench_notifier_put( void *data, long iterations )
+{
+	microbench_fanout *fanout = data;
+	mvcp_status_t status;
+	long index = 0;
+
+	for ( index = 0; index < iterations; index ++ )
+	{
+		microbench_status( &status, ( int )( index & 1023 ) );
+		mvcp_notifier_put( fanout->notifier, &status );
+	}
+
+	return iterations;
+}
+
+static void usage( )
+{
+	fprintf( stderr, "Usage: mvcp-microbench [-t milliseconds] [benchmark ...]\n" );
+}
+
+/** Check if the benchmark was selected on the command line.
+*/
+
+static int selected( int argc, char **argv, const char *name )
+{
+	int index = 0;
+	for ( index = 0; index < argc; index ++ )
+		if ( strstr( name, argv[ index ] ) != NULL )
+			return 1;
+	return argc == 0;
+}
+
+int main( int argc, char **argv )
+{
+	microbench_fanout fanout;
+	pthread_t threads[ MICROBENCH_SUBSCRIBERS ];
+	char *body = malloc( ( MICROBENCH_ROWS + 2 ) * ( strlen( MICROBENCH_CLIP ) + 64 ) );
+	char *ptr = body;
+	int option = 0;
+	int index = 0;
+
+	while ( ( option = getopt( argc, argv, "t:h" ) ) != -1 )
+	{
+		if ( option == 't' && atoi( optarg ) > 0 )
+		{
+			target = atoi( optarg ) * 1000.0;
+		}
+		else
+		{
+			usage( );
+			return option != 'h';
+		}
+	}
+	argc -= optind;
+	argv += optind;
+
+	ptr += sprintf( ptr, "%d\n", 42 );
+	for ( index = 0; index < MICROBENCH_ROWS; index ++ )
+		ptr += sprintf( ptr, "%d \"%s\" %d %d %d %d %.2f\n", index, MICROBENCH_CLIP, 0, 1499, 1500, 1500, 25.0 );
+	sprintf( ptr, "\n" );
+
+	printf( "# benchmark\toperations\tns/op\top/s\n" );
+
+	if ( selected( argc, argv, "tokeniser_parse_new" ) )
+		microbench_run( "tokeniser_parse_new", bench_tokeniser_parse, NULL );
+	if ( selected( argc, argv, "response_printf_list1000" ) )
+		microbench_run( "response_printf_list1000", bench_response_printf, NULL );
+	if ( selected( argc, argv, "response_write_list1000" ) )
+		microbench_run( "response_write_list1000", bench_response_write, body );
+	if ( selected( argc, argv, "status_serialise" ) )
+		microbench_run( "status_serialise", bench_status_serialise, NULL );
+	if ( selected( argc, argv, "status_parse" ) )
+		microbench_run( "status_parse", bench_status_parse, NULL );
+	if ( selected( argc, argv, "status_delta" ) )
+		microbench_run( "status_delta", bench_status_delta, NULL );
+
+	if ( selected( argc, argv, "notifier_fanout64" ) || selected( argc, argv, "notifier_put64" ) )
+	{
+		memset( &fanout, 0, sizeof( fanout ) );
+		fanout.notifier = mvcp_notifier_init( );
+		fanout.running = 1;
+		pthread_mutex_init( &fanout.mutex, NULL );
+		pthread_cond_init( &fanout.cond, NULL );
+		for ( index = 0; index < MICROBENCH_SUBSCRIBERS; index ++ )
+			pthread_create( &threads[ index ], NULL, microbench_subscriber, &fanout );
+
+		// Let every subscriber take its cursor before the first change
+		usleep( 100000 );
+
+		if ( selected( argc, argv, "notifier_fanout64" ) )
+			microbench_run( "notifier_fanout64", bench_notifier_fanout, &fanout );
+		if ( selected( argc, argv, "notifier_put64" ) )
+		{
+			long overflows = fanout.overflows;
+			microbench_run( "notifier_put64", bench_notifier_put, &fanout );
+			usleep( 200000 );
+			printf( "notifier_put64_overflows\t%ld\t0\t0\n", fanout.overflows - overflows );
+		}
+
+		fanout.running = 0;
+		for ( index = 0; index < MICROBENCH_SUBSCRIBERS; index ++ )
+			pthread_join( threads[ index ], NULL );
+		mvcp_notifier_close( fanout.notifier );
+		pthread_cond_destroy( &fanout.cond );
+		pthread_mutex_destroy( &fanout.mutex );
+	}
+
+	free( body );
+
+	return 0;
+}
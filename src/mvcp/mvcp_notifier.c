@@ -27,11 +27,81 @@
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <sched.h>
 #include <sys/time.h>
 
 /* Application header files */
 #include "mvcp_notifier.h"
 
+/** Create a serialised line with a single reference.
+*/
+
+static mvcp_notifier_line mvcp_notifier_line_init( const char *text )
+{
+	int length = strlen( text );
+	mvcp_notifier_line line = malloc( sizeof( mvcp_notifier_line_t ) + length + 1 );
+	if ( line != NULL )
+	{
+		line->refs = 1;
+		line->length = length;
+		line->text = ( char * )( line + 1 );
+		memcpy( line->text, text, length + 1 );
+	}
+	return line;
+}
+
+/** Drop a reference - must be called with the mutex held.
+*/
+
+static void mvcp_notifier_line_release( mvcp_notifier_line line )
+{
+	if ( line != NULL && -- line->refs == 0 )
+		free( line );
+}
+
+/** Make room for the stored status of a unit - must be called with the
+	mutex held. Returns non-zero if the unit can not be stored.
+*/
+
+static int mvcp_notifier_grow( mvcp_notifier this, int unit )
+{
+	if ( unit >= this->units )
+	{
+		int units = this->units > 0 ? this->units : MAX_UNITS;
+		mvcp_status store = NULL;
+		mvcp_notifier_line *store_lines = NULL;
+		int *pending = NULL;
+		int index = 0;
+
+		while ( units <= unit )
+			units *= 2;
+
+		store = realloc( this->store, units * sizeof( mvcp_status_t ) );
+		if ( store == NULL )
+			return -1;
+		this->store = store;
+		store_lines = realloc( this->store_lines, units * sizeof( mvcp_notifier_line ) );
+		if ( store_lines == NULL )
+			return -1;
+		this->store_lines = store_lines;
+		pending = realloc( this->pending, units * sizeof( int ) );
+		if ( pending == NULL )
+			return -1;
+		this->pending = pending;
+
+		for ( index = this->units; index < units; index ++ )
+		{
+			char text[ 10240 ];
+			this->pending[ index ] = 0;
+			memset( &this->store[ index ], 0, sizeof( mvcp_status_t ) );
+			this->store[ index ].unit = index;
+			this->store_lines[ index ] = mvcp_notifier_line_init( mvcp_status_serialise( &this->store[ index ], text, sizeof( text ) ) );
+		}
+		this->units = units;
+	}
+	return 0;
+}
+
 /** Notifier initialisation.
 */
 
@@ -40,11 +110,10 @@ mvcp_notifier mvcp_notifier_init( )
 	mvcp_notifier this = calloc( 1, sizeof( mvcp_notifier_t ) );
 	if ( this != NULL )
 	{
-		int index = 0;
 		pthread_mutex_init( &this->mutex, NULL );
 		pthread_cond_init( &this->cond, NULL );
-		for ( index = 0; index < MAX_UNITS; index ++ )
-			this->store[ index ].unit = index;
+		pthread_mutex_init( &this->subscriber_mutex, NULL );
+		mvcp_notifier_grow( this, MAX_UNITS - 1 );
 	}
 	return this;
 }
@@ -55,7 +124,7 @@ mvcp_notifier mvcp_notifier_init( )
 void mvcp_notifier_get( mvcp_notifier this, mvcp_status status, int unit )
 {
 	pthread_mutex_lock( &this->mutex );
-	if ( unit >= 0 && unit < MAX_UNITS )
+	if ( unit >= 0 && unit < this->units )
 		mvcp_status_copy( status, &this->store[ unit ] );
 	else
 		memset( status, 0, sizeof( mvcp_status_t ) );
@@ -64,6 +133,19 @@ void mvcp_notifier_get( mvcp_notifier this, mvcp_status status, int unit )
 	pthread_mutex_unlock( &this->mutex );
 }
 
+/** Get the number of unit slots - every unit with a stored status is below
+	this.
+*/
+
+int mvcp_notifier_units( mvcp_notifier this )
+{
+	int units = 0;
+	pthread_mutex_lock( &this->mutex );
+	units = this->units;
+	pthread_mutex_unlock( &this->mutex );
+	return units;
+}
+
 /** Wait on a new status.
 */
 
@@ -86,16 +168,447 @@ int mvcp_notifier_wait( mvcp_notifier this, mvcp_status status )
 	return error;
 }
 
-/** Put a new status.
+/** Obtain a cursor positioned after the most recent status change. A
+	subscriber should take its cursor before fetching the stored status of
+	each unit so that no change is missed.
+*/
+
+unsigned int mvcp_notifier_cursor( mvcp_notifier this )
+{
+	unsigned int cursor = 0;
+	pthread_mutex_lock( &this->mutex );
+	cursor = this->sequence;
+	pthread_mutex_unlock( &this->mutex );
+	return cursor;
+}
+
+/** Fetch the next status change after the cursor, waiting up to timeout
+	milliseconds (or indefinitely if negative) for one to arrive. Returns 0
+	and advances the cursor on success, ETIMEDOUT if nothing arrived, or
+	EOVERFLOW if the subscriber fell more than MVCP_NOTIFIER_RING changes
+	behind - the cursor is then moved to the present and the subscriber
+	should fetch the stored status of every unit again.
+*/
+
+static int mvcp_notifier_fetch( mvcp_notifier this, unsigned int *cursor, mvcp_status status, mvcp_notifier_line *line, mvcp_notifier_line *delta, int timeout )
+{
+	struct timeval now;
+	struct timespec until;
+	int error = 0;
+
+	gettimeofday( &now, NULL );
+	until.tv_sec = now.tv_sec + timeout / 1000;
+	until.tv_nsec = now.tv_usec * 1000 + ( timeout % 1000 ) * 1000000;
+	if ( until.tv_nsec >= 1000000000 )
+	{
+		until.tv_sec ++;
+		until.tv_nsec -= 1000000000;
+	}
+
+	pthread_mutex_lock( &this->mutex );
+
+	while ( !error && this->sequence == *cursor )
+	{
+		if ( timeout < 0 )
+			error = pthread_cond_wait( &this->cond, &this->mutex );
+		else
+			error = pthread_cond_timedwait( &this->cond, &this->mutex, &until );
+	}
+
+	if ( this->sequence - *cursor > MVCP_NOTIFIER_RING )
+	{
+		*cursor = this->sequence;
+		error = EOVERFLOW;
+	}
+	else if ( this->sequence != *cursor )
+	{
+		int index = *cursor % MVCP_NOTIFIER_RING;
+		if ( status != NULL )
+			mvcp_status_copy( status, &this->ring[ index ] );
+		if ( line != NULL && ( *line = this->ring_lines[ index ] ) != NULL )
+			( *line )->refs ++;
+		if ( delta != NULL && ( *delta = this->ring_deltas[ index ] ) != NULL )
+			( *delta )->refs ++;
+		( *cursor ) ++;
+		error = 0;
+	}
+
+	pthread_mutex_unlock( &this->mutex );
+
+	return error;
+}
+
+/** Fetch the next status change after the cursor.
+*/
+
+int mvcp_notifier_next( mvcp_notifier this, unsigned int *cursor, mvcp_status status, int timeout )
+{
+	return mvcp_notifier_fetch( this, cursor, status, NULL, NULL, timeout );
+}
+
+/** Fetch the next status change after the cursor as a shared serialised
+	line - as mvcp_notifier_next otherwise. The line must be returned with
+	mvcp_notifier_release.
+*/
+
+int mvcp_notifier_next_line( mvcp_notifier this, unsigned int *cursor, mvcp_notifier_line *line, int timeout )
+{
+	*line = NULL;
+	return mvcp_notifier_fetch( this, cursor, NULL, line, NULL, timeout );
+}
+
+/** Fetch the next status change after the cursor as both the full line and
+	the line holding only the fields which changed (see
+	mvcp_status_serialise_delta). Either may be NULL if not required.
+*/
+
+int mvcp_notifier_next_lines( mvcp_notifier this, unsigned int *cursor, mvcp_notifier_line *line, mvcp_notifier_line *delta, int timeout )
+{
+	if ( line != NULL )
+		*line = NULL;
+	if ( delta != NULL )
+		*delta = NULL;
+	return mvcp_notifier_fetch( this, cursor, NULL, line, delta, timeout );
+}
+
+/** Obtain the shared serialised line of the stored status of a unit. The
+	line must be returned with mvcp_notifier_release.
+*/
+
+mvcp_notifier_line mvcp_notifier_get_line( mvcp_notifier this, int unit )
+{
+	mvcp_notifier_line line = NULL;
+	pthread_mutex_lock( &this->mutex );
+	if ( unit >= 0 && unit < this->units && ( line = this->store_lines[ unit ] ) != NULL )
+		line->refs ++;
+	pthread_mutex_unlock( &this->mutex );
+	return line;
+}
+
+/** Return a line obtained from the notifier.
+*/
+
+void mvcp_notifier_release( mvcp_notifier this, mvcp_notifier_line line )
+{
+	pthread_mutex_lock( &this->mutex );
+	mvcp_notifier_line_release( line );
+	pthread_mutex_unlock( &this->mutex );
+}
+
+/** Replace the lock free snapshot of a unit - must be called with the mutex
+	held. Pages are never released before the notifier is closed, so readers
+	can use them without locking.
+*/
+
+static void mvcp_notifier_publish( mvcp_notifier this, mvcp_status status )
+{
+	int page = status->unit / MVCP_NOTIFIER_PAGE;
+	mvcp_notifier_slot slot = NULL;
+
+	if ( page >= MVCP_NOTIFIER_PAGES )
+		return;
+
+	if ( this->pages[ page ] == NULL )
+	{
+		mvcp_notifier_slot slots = calloc( MVCP_NOTIFIER_PAGE, sizeof( mvcp_notifier_slot_t ) );
+		if ( slots == NULL )
+			return;
+		__sync_synchronize( );
+		this->pages[ page ] = slots;
+	}
+
+	slot = &this->pages[ page ][ status->unit % MVCP_NOTIFIER_PAGE ];
+	slot->sequence ++;
+	__sync_synchronize( );
+	mvcp_status_copy( &slot->status, status );
+	__sync_synchronize( );
+	slot->sequence ++;
+}
+
+/** Get a consistent copy of the most recent status of a unit without taking
+	any lock. Returns the number of statuses received for the unit, so a
+	caller can tell cheaply whether anything happened since its last read -
+	0 means none was received or the unit has no snapshot, in which case the
+	status is that of mvcp_notifier_get.
+*/
+
+unsigned int mvcp_notifier_snapshot( mvcp_notifier this, mvcp_status status, int unit )
+{
+	mvcp_notifier_slot slots = NULL;
+	mvcp_notifier_slot slot = NULL;
+	unsigned int sequence = 0;
+
+	if ( unit >= 0 && unit < MVCP_NOTIFIER_PAGE * MVCP_NOTIFIER_PAGES )
+		slots = this->pages[ unit / MVCP_NOTIFIER_PAGE ];
+	__sync_synchronize( );
+
+	if ( slots == NULL || slots[ unit % MVCP_NOTIFIER_PAGE ].sequence == 0 )
+	{
+		mvcp_notifier_get( this, status, unit );
+		return 0;
+	}
+
+	slot = &slots[ unit % MVCP_NOTIFIER_PAGE ];
+	do
+	{
+		while ( ( sequence = slot->sequence ) & 1 )
+			sched_yield( );
+		__sync_synchronize( );
+		mvcp_status_copy( status, &slot->status );
+		__sync_synchronize( );
+	}
+	while ( sequence != slot->sequence );
+
+	return sequence / 2;
+}
+
+/** Determine if the calling thread is the one invoking the callbacks.
+*/
+
+static int mvcp_notifier_dispatching( mvcp_notifier this )
+{
+	return this->dispatching && pthread_equal( this->dispatcher, pthread_self( ) );
+}
+
+/** Take the next unit with undelivered changes, scanning from *from and
+	starting over while changes arrive behind the scan. Returns the changes
+	and copies the stored status, or 0 if nothing is pending.
+*/
+
+static int mvcp_notifier_take( mvcp_notifier this, int *from, mvcp_status status )
+{
+	int changed = 0;
+
+	pthread_mutex_lock( &this->mutex );
+	while ( changed == 0 )
+	{
+		if ( *from == 0 )
+		{
+			if ( !this->pending_any )
+				break;
+			this->pending_any = 0;
+		}
+
+		while ( *from < this->units && this->pending[ *from ] == 0 )
+			( *from ) ++;
+
+		if ( *from < this->units )
+		{
+			changed = this->pending[ *from ];
+			this->pending[ *from ] = 0;
+			mvcp_status_copy( status, &this->store[ *from ] );
+			( *from ) ++;
+		}
+		else if ( this->pending_any )
+		{
+			*from = 0;
+		}
+		else
+		{
+			break;
+		}
+	}
+	pthread_mutex_unlock( &this->mutex );
+
+	return changed;
+}
+
+/** Invoke the callbacks of all pending changes - each unit is reported once
+	with the latest status and every change since it was last reported.
+*/
+
+static void mvcp_notifier_dispatch( mvcp_notifier this )
+{
+	mvcp_notifier_subscriber *previous = NULL;
+	mvcp_status_t status;
+	int changed = 0;
+	int from = 0;
+
+	pthread_mutex_lock( &this->subscriber_mutex );
+	this->dispatcher = pthread_self( );
+	this->dispatching = 1;
+
+	while ( ( changed = mvcp_notifier_take( this, &from, &status ) ) != 0 )
+	{
+		mvcp_notifier_subscriber subscriber = NULL;
+		for ( subscriber = this->subscribers; subscriber != NULL; subscriber = subscriber->next )
+		{
+			if ( subscriber->callback != NULL && ( subscriber->mask & changed ) &&
+				 ( subscriber->unit < 0 || subscriber->unit == status.unit ) )
+				subscriber->callback( subscriber->data, &status, subscriber->mask & changed );
+		}
+	}
+
+	this->dispatching = 0;
+
+	/* Subscriptions cancelled by the callbacks are removed here. */
+	previous = &this->subscribers;
+	while ( *previous != NULL )
+	{
+		mvcp_notifier_subscriber subscriber = *previous;
+		if ( subscriber->callback == NULL )
+		{
+			*previous = subscriber->next;
+			free( subscriber );
+		}
+		else
+		{
+			previous = &subscriber->next;
+		}
+	}
+
+	pthread_mutex_unlock( &this->subscriber_mutex );
+}
+
+/** Register a callback for the changes of a unit (or every unit if negative)
+	which match the mask of mvcp_change values. Callbacks are invoked from the
+	thread which puts the status - for a remote parser, the status thread -
+	and must return promptly. Returns the id of the subscription or -1.
+*/
+
+int mvcp_notifier_subscribe( mvcp_notifier this, int unit, int mask, mvcp_notifier_callback callback, void *data )
+{
+	mvcp_notifier_subscriber subscriber = NULL;
+	int nested = mvcp_notifier_dispatching( this );
+	int id = 0;
+
+	if ( callback == NULL || ( subscriber = calloc( 1, sizeof( mvcp_notifier_subscriber_t ) ) ) == NULL )
+		return -1;
+
+	subscriber->unit = unit;
+	subscriber->mask = mask;
+	subscriber->callback = callback;
+	subscriber->data = data;
+
+	if ( !nested )
+		pthread_mutex_lock( &this->subscriber_mutex );
+	id = subscriber->id = ++ this->subscriber_id;
+	subscriber->next = this->subscribers;
+	this->subscribers = subscriber;
+	if ( !nested )
+		pthread_mutex_unlock( &this->subscriber_mutex );
+
+	pthread_mutex_lock( &this->mutex );
+	this->subscribed ++;
+	pthread_mutex_unlock( &this->mutex );
+
+	return id;
+}
+
+/** Cancel a subscription - the callback is not invoked again once this
+	returns. This may be called from the callback itself.
+*/
+
+void mvcp_notifier_unsubscribe( mvcp_notifier this, int id )
+{
+	mvcp_notifier_subscriber *previous = NULL;
+	int nested = mvcp_notifier_dispatching( this );
+	int found = 0;
+
+	if ( !nested )
+		pthread_mutex_lock( &this->subscriber_mutex );
+	for ( previous = &this->subscribers; *previous != NULL; previous = &( *previous )->next )
+	{
+		mvcp_notifier_subscriber subscriber = *previous;
+		if ( subscriber->id == id && subscriber->callback != NULL )
+		{
+			found = 1;
+			if ( nested )
+			{
+				subscriber->callback = NULL;
+			}
+			else
+			{
+				*previous = subscriber->next;
+				free( subscriber );
+			}
+			break;
+		}
+	}
+	if ( !nested )
+		pthread_mutex_unlock( &this->subscriber_mutex );
+
+	if ( found )
+	{
+		pthread_mutex_lock( &this->mutex );
+		this->subscribed --;
+		pthread_mutex_unlock( &this->mutex );
+	}
+}
+
+/** Defer the callbacks of the statuses put until the matching flush, so that
+	a burst of statuses is reported once per unit.
+*/
+
+void mvcp_notifier_hold( mvcp_notifier this )
+{
+	pthread_mutex_lock( &this->mutex );
+	this->held ++;
+	pthread_mutex_unlock( &this->mutex );
+}
+
+/** End a hold and invoke the callbacks of the changes deferred by it.
+*/
+
+void mvcp_notifier_flush( mvcp_notifier this )
+{
+	int dispatch = 0;
+	pthread_mutex_lock( &this->mutex );
+	if ( this->held > 0 )
+		this->held --;
+	dispatch = this->held == 0 && this->pending_any;
+	pthread_mutex_unlock( &this->mutex );
+	if ( dispatch && !mvcp_notifier_dispatching( this ) )
+		mvcp_notifier_dispatch( this );
+}
+
+/** Put a new status - this never waits for cursor subscribers, but invokes
+	the callbacks of any changes unless they are held.
 */
 
 void mvcp_notifier_put( mvcp_notifier this, mvcp_status status )
 {
+	/* Serialised once here and shared by every subscriber. */
+	char text[ 10240 ];
+	mvcp_notifier_line line = mvcp_notifier_line_init( mvcp_status_serialise( status, text, sizeof( text ) ) );
+	mvcp_notifier_line delta = NULL;
+	int dispatch = 0;
+	int index = 0;
+
 	pthread_mutex_lock( &this->mutex );
+	if ( status->unit < 0 || mvcp_notifier_grow( this, status->unit ) != 0 )
+	{
+		pthread_mutex_unlock( &this->mutex );
+		mvcp_notifier_release( this, line );
+		return;
+	}
+	index = this->sequence % MVCP_NOTIFIER_RING;
+	delta = mvcp_notifier_line_init( mvcp_status_serialise_delta( &this->store[ status->unit ], status, text, sizeof( text ) ) );
+	mvcp_notifier_line_release( this->ring_deltas[ index ] );
+	this->ring_deltas[ index ] = delta;
+	if ( this->subscribed > 0 )
+	{
+		int changed = mvcp_status_changes( &this->store[ status->unit ], status );
+		this->pending[ status->unit ] |= changed;
+		this->pending_any |= changed != 0;
+		dispatch = this->held == 0 && this->pending_any;
+	}
 	mvcp_status_copy( &this->store[ status->unit ], status );
+	mvcp_notifier_publish( this, status );
 	mvcp_status_copy( &this->last, status );
+	mvcp_status_copy( &this->ring[ index ], status );
+	mvcp_notifier_line_release( this->store_lines[ status->unit ] );
+	mvcp_notifier_line_release( this->ring_lines[ index ] );
+	this->store_lines[ status->unit ] = line;
+	this->ring_lines[ index ] = line;
+	if ( line != NULL )
+		line->refs ++;
+	this->sequence ++;
 	pthread_cond_broadcast( &this->cond );
 	pthread_mutex_unlock( &this->mutex );
+
+	if ( dispatch && !mvcp_notifier_dispatching( this ) )
+		mvcp_notifier_dispatch( this );
 }
 
 /** Communicate a disconnected status for all units to all waiting.
@@ -105,12 +618,14 @@ void mvcp_notifier_disconnected( mvcp_notifier notifier )
 {
 	int unit = 0;
 	mvcp_status_t status;
-	for ( unit = 0; unit < MAX_UNITS; unit ++ )
+	mvcp_notifier_hold( notifier );
+	for ( unit = 0; unit < mvcp_notifier_units( notifier ); unit ++ )
 	{
 		mvcp_notifier_get( notifier, &status, unit );
 		status.status = unit_disconnected;
 		mvcp_notifier_put( notifier, &status );
 	}
+	mvcp_notifier_flush( notifier );
 }
 
 /** Close the notifier - note that all access must be stopped before we call this.
@@ -120,6 +635,26 @@ void mvcp_notifier_close( mvcp_notifier this )
 {
 	if ( this != NULL )
 	{
+		int index = 0;
+		for ( index = 0; index < this->units; index ++ )
+			mvcp_notifier_line_release( this->store_lines[ index ] );
+		free( this->store_lines );
+		free( this->store );
+		free( this->pending );
+		for ( index = 0; index < MVCP_NOTIFIER_PAGES; index ++ )
+			free( this->pages[ index ] );
+		while ( this->subscribers != NULL )
+		{
+			mvcp_notifier_subscriber subscriber = this->subscribers;
+			this->subscribers = subscriber->next;
+			free( subscriber );
+		}
+		pthread_mutex_destroy( &this->subscriber_mutex );
+		for ( index = 0; index < MVCP_NOTIFIER_RING; index ++ )
+		{
+			mvcp_notifier_line_release( this->ring_lines[ index ] );
+			mvcp_notifier_line_release( this->ring_deltas[ index ] );
+		}
 		pthread_mutex_destroy( &this->mutex );
 		pthread_cond_destroy( &this->cond );
 		free( this );
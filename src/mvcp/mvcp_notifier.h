@@ -32,8 +32,66 @@ extern "C"
 {
 #endif
 
+/** Number of unit slots the notifier starts with - it grows as units are
+	added.
+*/
+
 #define MAX_UNITS 16
 
+/** Number of status changes retained for subscribers.
+*/
+
+#define MVCP_NOTIFIER_RING 128
+
+/** Number of units in each page of snapshots and the number of pages - units
+	beyond MVCP_NOTIFIER_PAGE * MVCP_NOTIFIER_PAGES have no snapshot.
+*/
+
+#define MVCP_NOTIFIER_PAGE 16
+#define MVCP_NOTIFIER_PAGES 64
+
+/** Snapshot of the status of a unit which readers copy without locking - the
+	sequence is odd while the status is being replaced.
+*/
+
+typedef struct
+{
+	volatile unsigned int sequence;
+	mvcp_status_t status;
+}
+*mvcp_notifier_slot, mvcp_notifier_slot_t;
+
+/** Callback invoked with the status of a unit and the mask of mvcp_change
+	values which changed.
+*/
+
+typedef void ( *mvcp_notifier_callback )( void *, mvcp_status, int );
+
+/** Subscription to the changes of one or all units.
+*/
+
+typedef struct mvcp_notifier_subscriber_s
+{
+	int id;
+	int unit;
+	int mask;
+	mvcp_notifier_callback callback;
+	void *data;
+	struct mvcp_notifier_subscriber_s *next;
+}
+*mvcp_notifier_subscriber, mvcp_notifier_subscriber_t;
+
+/** Shared, reference counted serialised status line.
+*/
+
+typedef struct
+{
+	int refs;
+	int length;
+	char *text;
+}
+*mvcp_notifier_line, mvcp_notifier_line_t;
+
 /** Status notifier definition.
 */
 
@@ -42,14 +100,42 @@ typedef struct
 	pthread_mutex_t mutex;
 	pthread_cond_t cond;
 	mvcp_status_t last;
-	mvcp_status_t store[ MAX_UNITS ];
+	mvcp_status store;
+	mvcp_notifier_line *store_lines;
+	int units;
+	mvcp_status_t ring[ MVCP_NOTIFIER_RING ];
+	mvcp_notifier_line ring_lines[ MVCP_NOTIFIER_RING ];
+	mvcp_notifier_line ring_deltas[ MVCP_NOTIFIER_RING ];
+	unsigned int sequence;
+	int *pending;
+	int pending_any;
+	int held;
+	int subscribed;
+	mvcp_notifier_slot pages[ MVCP_NOTIFIER_PAGES ];
+	pthread_mutex_t subscriber_mutex;
+	mvcp_notifier_subscriber subscribers;
+	int subscriber_id;
+	pthread_t dispatcher;
+	int dispatching;
 }
 *mvcp_notifier, mvcp_notifier_t;
 
 extern mvcp_notifier mvcp_notifier_init( );
 extern void mvcp_notifier_get( mvcp_notifier, mvcp_status, int );
+extern int mvcp_notifier_units( mvcp_notifier );
 extern int mvcp_notifier_wait( mvcp_notifier, mvcp_status );
+extern unsigned int mvcp_notifier_cursor( mvcp_notifier );
+extern int mvcp_notifier_next( mvcp_notifier, unsigned int *, mvcp_status, int );
+extern mvcp_notifier_line mvcp_notifier_get_line( mvcp_notifier, int );
+extern int mvcp_notifier_next_line( mvcp_notifier, unsigned int *, mvcp_notifier_line *, int );
+extern int mvcp_notifier_next_lines( mvcp_notifier, unsigned int *, mvcp_notifier_line *, mvcp_notifier_line *, int );
+extern void mvcp_notifier_release( mvcp_notifier, mvcp_notifier_line );
 extern void mvcp_notifier_put( mvcp_notifier, mvcp_status );
+extern unsigned int mvcp_notifier_snapshot( mvcp_notifier, mvcp_status, int );
+extern int mvcp_notifier_subscribe( mvcp_notifier, int, int, mvcp_notifier_callback, void * );
+extern void mvcp_notifier_unsubscribe( mvcp_notifier, int );
+extern void mvcp_notifier_hold( mvcp_notifier );
+extern void mvcp_notifier_flush( mvcp_notifier );
 extern void mvcp_notifier_disconnected( mvcp_notifier );
 extern void mvcp_notifier_close( mvcp_notifier );
 
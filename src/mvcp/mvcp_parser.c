@@ -23,6 +23,7 @@
 #include <stdarg.h>
 #include <stdlib.h>
 #include <string.h>
+#include <pthread.h>
 
 /* Application header files */
 #include "mvcp_parser.h"
@@ -33,7 +34,8 @@
 
 mvcp_response mvcp_parser_connect( mvcp_parser parser )
 {
-	parser->notifier = mvcp_notifier_init( );
+	if ( parser->notifier == NULL )
+		parser->notifier = mvcp_notifier_init( );
 	return parser->connect( parser->real );
 }
 
@@ -45,6 +47,92 @@ mvcp_response mvcp_parser_execute( mvcp_parser parser, char *command )
 	return parser->execute( parser->real, command );
 }
 
+/** Submit a command without waiting for its response. Parsers which can
+	pipeline send the command straight away and call the callback from
+	another thread when the response arrives, in the order submitted. Other
+	parsers execute the command and call the callback before returning.
+	Returns non-zero if the command could not be sent, in which case the
+	callback is not called.
+*/
+
+int mvcp_parser_submit( mvcp_parser parser, char *command, mvcp_response_callback callback, void *data )
+{
+	if ( parser->submit != NULL )
+		return parser->submit( parser->real, command, callback, data );
+	callback( data, mvcp_parser_execute( parser, command ) );
+	return 0;
+}
+
+/** Private future structure.
+*/
+
+struct mvcp_future_s
+{
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	int done;
+	mvcp_response response;
+};
+
+/** Construct a future - a parser completes it with mvcp_future_complete.
+*/
+
+mvcp_future mvcp_future_init( )
+{
+	mvcp_future future = calloc( 1, sizeof( struct mvcp_future_s ) );
+	if ( future != NULL )
+	{
+		pthread_mutex_init( &future->mutex, NULL );
+		pthread_cond_init( &future->cond, NULL );
+	}
+	return future;
+}
+
+/** Complete a future - this is a mvcp_response_callback.
+*/
+
+void mvcp_future_complete( void *arg, mvcp_response response )
+{
+	mvcp_future future = arg;
+	pthread_mutex_lock( &future->mutex );
+	future->response = response;
+	future->done = 1;
+	pthread_cond_signal( &future->cond );
+	pthread_mutex_unlock( &future->mutex );
+}
+
+/** Submit a command and return a future for its response.
+*/
+
+mvcp_future mvcp_parser_submit_future( mvcp_parser parser, char *command )
+{
+	mvcp_future future = mvcp_future_init( );
+	if ( future != NULL && mvcp_parser_submit( parser, command, mvcp_future_complete, future ) != 0 )
+		future->done = 1;
+	return future;
+}
+
+/** Wait for the response of a future and release the future. The caller
+	must close the response, which is NULL if the command failed.
+*/
+
+mvcp_response mvcp_future_wait( mvcp_future future )
+{
+	mvcp_response response = NULL;
+	if ( future != NULL )
+	{
+		pthread_mutex_lock( &future->mutex );
+		while ( !future->done )
+			pthread_cond_wait( &future->cond, &future->mutex );
+		response = future->response;
+		pthread_mutex_unlock( &future->mutex );
+		pthread_cond_destroy( &future->cond );
+		pthread_mutex_destroy( &future->mutex );
+		free( future );
+	}
+	return response;
+}
+
 /** Push a service via the parser.
 */
 
@@ -46,6 +46,13 @@ typedef mvcp_response (*parser_received)( void *, char *, char * );
 typedef mvcp_response (*parser_push)( void *, char *, mlt_service );
 typedef void (*parser_close)( void * );
 
+/** Called with the response to a submitted command, which the callback
+	must close. The response is NULL if the command could not be completed.
+*/
+
+typedef void (*mvcp_response_callback)( void *, mvcp_response );
+typedef int (*parser_submit)( void *, char *, mvcp_response_callback, void * );
+
 /** Structure for the mvcp parser.
 */
 
@@ -58,9 +65,15 @@ typedef struct
 	parser_close close;
 	void *real;
 	mvcp_notifier notifier;
+	parser_submit submit;
 }
 *mvcp_parser, mvcp_parser_t;
 
+/** A response which will arrive later.
+*/
+
+typedef struct mvcp_future_s *mvcp_future;
+
 /** API for the parser - note that no constructor is defined here.
 */
 
@@ -69,6 +82,11 @@ extern mvcp_response mvcp_parser_push( mvcp_parser, char *, mlt_service );
 extern mvcp_response mvcp_parser_received( mvcp_parser, char *, char * );
 extern mvcp_response mvcp_parser_execute( mvcp_parser, char * );
 extern mvcp_response mvcp_parser_executef( mvcp_parser, const char *, ... );
+extern int mvcp_parser_submit( mvcp_parser, char *, mvcp_response_callback, void * );
+extern mvcp_future mvcp_parser_submit_future( mvcp_parser, char * );
+extern mvcp_future mvcp_future_init( );
+extern void mvcp_future_complete( void *, mvcp_response );
+extern mvcp_response mvcp_future_wait( mvcp_future );
 extern mvcp_response mvcp_parser_run_file( mvcp_parser parser, FILE *file );
 extern mvcp_response mvcp_parser_run( mvcp_parser, char * );
 extern mvcp_notifier mvcp_parser_get_notifier( mvcp_parser );
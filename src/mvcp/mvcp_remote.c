@@ -25,6 +25,9 @@
 #include <signal.h>
 #include <errno.h>
 #include <pthread.h>
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
 
 /* Application header files */
 #ifndef MVCP_EMBEDDED
@@ -34,9 +37,39 @@
 #endif
 #include "mvcp_remote.h"
 #include "mvcp_socket.h"
-#include "mvcp_tokeniser.h"
 #include "mvcp_util.h"
 
+/** Documents smaller than this are always pushed uncompressed.
+*/
+
+#define MVCP_REMOTE_DEFLATE_MIN 16384
+
+/** Buffered reader for a socket - bytes after the end of one response are
+	kept for the next.
+*/
+
+typedef struct
+{
+	mvcp_socket socket;
+	char *data;
+	int size;
+	int start;
+	int used;
+	int *running;
+}
+*mvcp_remote_reader, mvcp_remote_reader_t;
+
+/** A command which was sent and awaits its response.
+*/
+
+typedef struct mvcp_remote_request_s
+{
+	mvcp_response_callback callback;
+	void *data;
+	struct mvcp_remote_request_s *next;
+}
+*mvcp_remote_request;
+
 /** Private mvcp_remote structure.
 */
 
@@ -51,6 +84,19 @@ typedef struct
 	mvcp_parser parser;
 	pthread_mutex_t mutex;
 	int connected;
+	int timeout;
+	int compression;
+	int deflate;
+	int status_off;
+	int status_started;
+	mvcp_remote_reader_t reader;
+	pthread_t reader_thread;
+	int reader_started;
+	int reading;
+	pthread_mutex_t queue_mutex;
+	pthread_cond_t queue_cond;
+	mvcp_remote_request head;
+	mvcp_remote_request tail;
 }
 *mvcp_remote, mvcp_remote_t;
 
@@ -59,10 +105,13 @@ typedef struct
 
 static mvcp_response mvcp_remote_connect( mvcp_remote );
 static mvcp_response mvcp_remote_execute( mvcp_remote, char * );
+static int mvcp_remote_submit( mvcp_remote, char *, mvcp_response_callback, void * );
 static mvcp_response mvcp_remote_receive( mvcp_remote, char *, char * );
 static mvcp_response mvcp_remote_push( mvcp_remote, char *, mlt_service );
 static void mvcp_remote_close( mvcp_remote );
-static int mvcp_remote_read_response( mvcp_socket, mvcp_response );
+static int mvcp_remote_read_response( mvcp_remote_reader, mvcp_response );
+static char *mvcp_remote_reader_line( mvcp_remote_reader, int * );
+static int mvcp_remote_reader_fill( mvcp_remote_reader );
 
 /** MVCP Parser constructor.
 */
@@ -76,6 +125,7 @@ mvcp_parser mvcp_parser_init_remote( char *server, int port )
 	{
 		parser->connect = (parser_connect)mvcp_remote_connect;
 		parser->execute = (parser_execute)mvcp_remote_execute;
+		parser->submit = (parser_submit)mvcp_remote_submit;
 		parser->push = (parser_push)mvcp_remote_push;
 		parser->received = (parser_received)mvcp_remote_receive;
 		parser->close = (parser_close)mvcp_remote_close;
@@ -86,57 +136,99 @@ mvcp_parser mvcp_parser_init_remote( char *server, int port )
 			remote->parser = parser;
 			remote->server = strdup( server );
 			remote->port = port;
+			remote->timeout = 1000;
+			remote->compression = 6;
 			pthread_mutex_init( &remote->mutex, NULL );
+			pthread_mutex_init( &remote->queue_mutex, NULL );
+			pthread_cond_init( &remote->queue_cond, NULL );
 		}
 	}
 	return parser;
 }
 
-/** Thread for receiving and distributing the status information.
+/** Set the time in milliseconds a read from the server waits before the
+	connection is checked for shutdown - takes effect on the next connect.
+*/
+
+void mvcp_remote_set_timeout( mvcp_parser parser, int timeout )
+{
+	mvcp_remote remote = parser != NULL ? parser->real : NULL;
+	if ( remote != NULL )
+		remote->timeout = timeout;
+}
+
+/** Set the zlib level from 1 to 9 used to compress PUSH documents for a
+	server which accepts them, or 0 to always send them uncompressed.
+*/
+
+void mvcp_remote_set_compression( mvcp_parser parser, int level )
+{
+	mvcp_remote remote = parser != NULL ? parser->real : NULL;
+	if ( remote != NULL )
+		remote->compression = level < 0 ? 0 : level > 9 ? 9 : level;
+}
+
+/** Choose whether the next connect also opens the STATUS connection which
+	feeds the parser's notifier - on by default.
+*/
+
+void mvcp_remote_set_status( mvcp_parser parser, int enabled )
+{
+	mvcp_remote remote = parser != NULL ? parser->real : NULL;
+	if ( remote != NULL )
+		remote->status_off = !enabled;
+}
+
+/** Thread for receiving and distributing the status information. Lines are
+	split from a reader's buffer as they arrive and each is parsed directly
+	into the status, so the work done is linear in the bytes received.
 */
 
 static void *mvcp_remote_status_thread( void *arg )
 {
 	mvcp_remote remote = arg;
-	char temp[ 10240 ];
-	int length = 0;
-	int offset = 0;
-	mvcp_tokeniser tokeniser = mvcp_tokeniser_init( );
+	mvcp_remote_reader_t reader = { remote->status, NULL, 0, 0, 0, NULL };
 	mvcp_notifier notifier = mvcp_parser_get_notifier( remote->parser );
 	mvcp_status_t status;
-	int index = 0;
+	int length = 0;
 
-	mvcp_socket_write_data( remote->status, "STATUS\r\n", 8 );
+	/* Servers which don't support delta mode treat this as a plain STATUS. */
+	mvcp_socket_write_data( remote->status, "STATUS DELTA\r\n", 14 );
 
-	while ( !remote->terminated && 
-			( length = mvcp_socket_read_data( remote->status, temp + offset, sizeof( temp ) ) ) >= 0 )
+	while ( !remote->terminated && length >= 0 )
 	{
-		if ( strchr( temp, '\n' ) == NULL )
-		{
-			offset = length;
-			continue;
-		}
-		offset = 0;
-		mvcp_tokeniser_parse_new( tokeniser, temp, "\n" );
-		for ( index = 0; index < mvcp_tokeniser_count( tokeniser ); index ++ )
+		int chars = 0;
+		char *line = NULL;
+
+		/* Callbacks see each unit once per read, however many lines it held. */
+		mvcp_notifier_hold( notifier );
+
+		while ( ( line = mvcp_remote_reader_line( &reader, &chars ) ) != NULL )
 		{
-			char *line = mvcp_tokeniser_get_string( tokeniser, index );
-			if ( line[ strlen( line ) - 1 ] == '\r' )
+			line[ -- chars ] = '\0';
+			if ( chars > 0 && line[ chars - 1 ] == '\r' )
+				line[ -- chars ] = '\0';
+			if ( chars == 0 )
+				continue;
+
+			if ( mvcp_status_is_delta( line ) )
 			{
-				mvcp_util_chomp( line );
-				mvcp_status_parse( &status, line );
-				mvcp_notifier_put( notifier, &status );
+				mvcp_notifier_get( notifier, &status, atoi( line ) );
+				mvcp_status_parse_delta( &status, line );
 			}
 			else
 			{
-				strcpy( temp, line );
-				offset = strlen( temp );
+				mvcp_status_parse( &status, line );
 			}
+			mvcp_notifier_put( notifier, &status );
 		}
+
+		mvcp_notifier_flush( notifier );
+		length = mvcp_remote_reader_fill( &reader );
 	}
 
 	mvcp_notifier_disconnected( notifier );
-	mvcp_tokeniser_close( tokeniser );
+	free( reader.data );
 	remote->terminated = 1;
 
 	return NULL;
@@ -147,6 +239,87 @@ static void *mvcp_remote_status_thread( void *arg )
 
 static void mvcp_remote_disconnect( mvcp_remote remote );
 
+/** Complete the requests in flight with a NULL response.
+*/
+
+static void mvcp_remote_fail_requests( mvcp_remote remote )
+{
+	mvcp_remote_request request = NULL;
+
+	pthread_mutex_lock( &remote->queue_mutex );
+	request = remote->head;
+	remote->head = remote->tail = NULL;
+	remote->reading = 0;
+	pthread_mutex_unlock( &remote->queue_mutex );
+
+	while ( request != NULL )
+	{
+		mvcp_remote_request next = request->next;
+		request->callback( request->data, NULL );
+		free( request );
+		request = next;
+	}
+}
+
+/** Thread for reading the responses to the commands in flight. Responses
+	arrive in the order the commands were sent, so each completes the oldest
+	request.
+*/
+
+static void *mvcp_remote_reader_thread( void *arg )
+{
+	mvcp_remote remote = arg;
+	int stopped = 0;
+	int error = 0;
+
+	while ( !error )
+	{
+		mvcp_remote_request request = NULL;
+		mvcp_response response = NULL;
+
+		pthread_mutex_lock( &remote->queue_mutex );
+		while ( remote->reading && remote->head == NULL )
+			pthread_cond_wait( &remote->queue_cond, &remote->queue_mutex );
+		stopped = error = !remote->reading;
+		pthread_mutex_unlock( &remote->queue_mutex );
+
+		if ( error )
+			break;
+
+		response = mvcp_response_init( );
+		error = mvcp_remote_read_response( &remote->reader, response );
+
+		if ( !error )
+		{
+			pthread_mutex_lock( &remote->queue_mutex );
+			request = remote->head;
+			remote->head = request->next;
+			if ( remote->head == NULL )
+				remote->tail = NULL;
+			pthread_mutex_unlock( &remote->queue_mutex );
+			request->callback( request->data, response );
+			free( request );
+		}
+		else
+		{
+			mvcp_response_close( response );
+		}
+	}
+
+	mvcp_remote_fail_requests( remote );
+
+	/* The command socket has gone, so the next connect has to start afresh
+	   even while the status connection is still up. */
+	if ( !stopped )
+	{
+		pthread_mutex_lock( &remote->queue_mutex );
+		remote->terminated = 1;
+		pthread_mutex_unlock( &remote->queue_mutex );
+	}
+
+	return NULL;
+}
+
 /** Connect to the server.
 */
 
@@ -160,68 +333,240 @@ static mvcp_response mvcp_remote_connect( mvcp_remote remote )
 	{
 		signal( SIGPIPE, SIG_IGN );
 
+		/* The server is asked whether it takes compressed pushes on the first one */
+		remote->deflate = -1;
+
 		remote->socket = mvcp_socket_init( remote->server, remote->port );
 		remote->status = mvcp_socket_init( remote->server, remote->port );
+		mvcp_socket_set_timeout( remote->socket, remote->timeout );
+		mvcp_socket_set_timeout( remote->status, remote->timeout );
+		remote->reader.socket = remote->socket;
+		remote->reader.start = remote->reader.used = 0;
+		remote->reader.running = NULL;
 
 		if ( mvcp_socket_connect( remote->socket ) == 0 )
 		{
 			response = mvcp_response_init( );
-			mvcp_remote_read_response( remote->socket, response );
+			mvcp_remote_read_response( &remote->reader, response );
+		}
+		else
+		{
+			/* Nothing to disconnect later, so the next attempt starts afresh */
+			mvcp_socket_close( remote->socket );
+			mvcp_socket_close( remote->status );
+			remote->socket = remote->status = NULL;
+			remote->reader.socket = NULL;
 		}
 
-		if ( response != NULL && mvcp_socket_connect( remote->status ) == 0 )
+		if ( response != NULL && remote->status_off )
+		{
+			remote->connected = 1;
+		}
+		else if ( response != NULL && mvcp_socket_connect( remote->status ) == 0 )
 		{
+			mvcp_remote_reader_t reader = { remote->status, NULL, 0, 0, 0, NULL };
 			mvcp_response status_response = mvcp_response_init( );
-			mvcp_remote_read_response( remote->status, status_response );
+			mvcp_remote_read_response( &reader, status_response );
 			if ( mvcp_response_get_error_code( status_response ) == 100 )
-				pthread_create( &remote->thread, NULL, mvcp_remote_status_thread, remote );
+				remote->status_started = pthread_create( &remote->thread, NULL, mvcp_remote_status_thread, remote ) == 0;
 			mvcp_response_close( status_response );
+			free( reader.data );
 			remote->connected = 1;
 		}
+
+		if ( response != NULL )
+		{
+			remote->reader.running = &remote->reading;
+			remote->reading = 1;
+			remote->reader_started = pthread_create( &remote->reader_thread, NULL, mvcp_remote_reader_thread, remote ) == 0;
+			remote->reading = remote->reader_started;
+		}
 	}
 
 	return response;
 }
 
+/** Queue a request for a command which has been written - must be called
+	with the write mutex held so that the queue is in the order sent.
+*/
+
+static int mvcp_remote_queue( mvcp_remote remote, mvcp_response_callback callback, void *data )
+{
+	mvcp_remote_request request = calloc( 1, sizeof( struct mvcp_remote_request_s ) );
+	int error = request == NULL;
+
+	pthread_mutex_lock( &remote->queue_mutex );
+	if ( !error && remote->reading )
+	{
+		request->callback = callback;
+		request->data = data;
+		if ( remote->tail != NULL )
+			remote->tail->next = request;
+		else
+			remote->head = request;
+		remote->tail = request;
+		pthread_cond_signal( &remote->queue_cond );
+	}
+	else
+	{
+		free( request );
+		error = 1;
+	}
+	pthread_mutex_unlock( &remote->queue_mutex );
+
+	return error;
+}
+
+/** Write a command and its terminator in a single write. Returns non-zero
+	on failure.
+*/
+
+static int mvcp_remote_write_line( mvcp_socket socket, const char *command, int length )
+{
+	char buffer[ 1024 ];
+	char *line = length + 2 <= sizeof( buffer ) ? buffer : malloc( length + 2 );
+	int error = line == NULL;
+
+	if ( !error )
+	{
+		memcpy( line, command, length );
+		memcpy( line + length, "\r\n", 2 );
+		error = mvcp_socket_write_data( socket, line, length + 2 ) != length + 2;
+	}
+
+	if ( line != buffer )
+		free( line );
+
+	return error;
+}
+
+/** Send a command without waiting for the response. Commands from any number
+	of threads may be in flight at once.
+*/
+
+static int mvcp_remote_submit( mvcp_remote remote, char *command, mvcp_response_callback callback, void *data )
+{
+	int error = 1;
+	int length = strlen( command );
+
+	pthread_mutex_lock( &remote->mutex );
+	if ( remote->reading && mvcp_remote_write_line( remote->socket, command, length ) == 0 )
+		error = mvcp_remote_queue( remote, callback, data );
+	pthread_mutex_unlock( &remote->mutex );
+
+	return error;
+}
+
 /** Execute the command.
 */
 
 static mvcp_response mvcp_remote_execute( mvcp_remote remote, char *command )
 {
-	mvcp_response response = NULL;
-	pthread_mutex_lock( &remote->mutex );
-	if ( mvcp_socket_write_data( remote->socket, command, strlen( command ) ) == strlen( command ) )
+	return mvcp_future_wait( mvcp_parser_submit_future( remote->parser, command ) );
+}
+
+/** Compress a document for a PUSH if it's large enough and the server
+	accepts DEFLATE - the first large push asks it with ENCODING. Returns the
+	compressed document and its size, or the document itself if it is to be
+	sent as is.
+*/
+
+static char *mvcp_remote_deflate( mvcp_remote remote, char *buffer, int *size )
+{
+	char *output = buffer;
+#ifdef HAVE_ZLIB
+	if ( remote->compression > 0 && *size >= MVCP_REMOTE_DEFLATE_MIN )
 	{
-		response = mvcp_response_init( );
-		mvcp_socket_write_data( remote->socket, "\r\n", 2 );
-		mvcp_remote_read_response( remote->socket, response );
+		if ( remote->deflate < 0 )
+		{
+			mvcp_response response = mvcp_remote_execute( remote, "ENCODING DEFLATE" );
+			remote->deflate = mvcp_response_get_error_code( response ) == 200;
+			mvcp_response_close( response );
+		}
+
+		if ( remote->deflate )
+		{
+			uLongf length = compressBound( *size );
+			output = malloc( length );
+			if ( output != NULL && compress2( ( Bytef * )output, &length, ( Bytef * )buffer, *size, remote->compression ) == Z_OK && length < *size )
+			{
+				*size = length;
+			}
+			else
+			{
+				free( output );
+				output = buffer;
+			}
+		}
 	}
-	pthread_mutex_unlock( &remote->mutex );
-	return response;
+#endif
+	return output;
 }
 
-/** Push a MLT XML document to the server.
+/** Send a MLT XML document to the server without waiting for the response.
+	Large documents are compressed when the server accepts it, with
+	"DEFLATE {bytes}" as the length line.
 */
 
-static mvcp_response mvcp_remote_receive( mvcp_remote remote, char *command, char *buffer )
+static int mvcp_remote_submit_document( mvcp_remote remote, char *command, char *buffer, mvcp_response_callback callback, void *data )
 {
-	mvcp_response response = NULL;
+	int length = strlen( command );
+	int size = strlen( buffer );
+	char *body = mvcp_remote_deflate( remote, buffer, &size );
+	int error = 0;
+	char temp[ 32 ];
+
+	if ( body != buffer )
+		sprintf( temp, "DEFLATE %d", size );
+	else
+		sprintf( temp, "%d", size );
+
 	pthread_mutex_lock( &remote->mutex );
-	if ( mvcp_socket_write_data( remote->socket, command, strlen( command ) ) == strlen( command ) )
+	if ( remote->reading && mvcp_socket_write_data( remote->socket, command, length ) == length )
 	{
-		char temp[ 20 ];
-		int length = strlen( buffer );
-		response = mvcp_response_init( );
 		mvcp_socket_write_data( remote->socket, "\r\n", 2 );
-		sprintf( temp, "%d", length );
 		mvcp_socket_write_data( remote->socket, temp, strlen( temp ) );
 		mvcp_socket_write_data( remote->socket, "\r\n", 2 );
-		mvcp_socket_write_data( remote->socket, buffer, length );
+		mvcp_socket_write_data( remote->socket, body, size );
 		mvcp_socket_write_data( remote->socket, "\r\n", 2 );
-		mvcp_remote_read_response( remote->socket, response );
+		error = mvcp_remote_queue( remote, callback, data );
+	}
+	else
+	{
+		error = 1;
 	}
 	pthread_mutex_unlock( &remote->mutex );
-	return response;
+
+	if ( body != buffer )
+		free( body );
+
+	return error;
+}
+
+/** Push a MLT XML document to the server.
+*/
+
+static mvcp_response mvcp_remote_receive( mvcp_remote remote, char *command, char *buffer )
+{
+	mvcp_future future = mvcp_future_init( );
+
+	if ( future != NULL && mvcp_remote_submit_document( remote, command, buffer, mvcp_future_complete, future ) != 0 )
+		mvcp_future_complete( future, NULL );
+
+	return mvcp_future_wait( future );
+}
+
+/** Send a MLT XML document without waiting for the response, which is given
+	to the callback as for mvcp_parser_submit. Returns non-zero if it could
+	not be sent or the parser isn't a remote one, in which case the callback
+	is not called.
+*/
+
+int mvcp_remote_submit_received( mvcp_parser parser, char *command, char *doc, mvcp_response_callback callback, void *data )
+{
+	int remote_parser = parser != NULL && parser->received == ( parser_received )mvcp_remote_receive;
+	mvcp_remote remote = remote_parser ? parser->real : NULL;
+	return remote == NULL || command == NULL || doc == NULL || mvcp_remote_submit_document( remote, command, doc, callback, data );
 }
 
 /** Push a producer to the server.
@@ -255,10 +600,23 @@ static void mvcp_remote_disconnect( mvcp_remote remote )
 {
 	if ( remote != NULL && remote->terminated )
 	{
-		if ( remote->connected )
+		mvcp_socket_shutdown( remote->status );
+		mvcp_socket_shutdown( remote->socket );
+		if ( remote->status_started )
 			pthread_join( remote->thread, NULL );
-		mvcp_socket_close( remote->status );
-		mvcp_socket_close( remote->socket );
+		remote->status_started = 0;
+		pthread_mutex_lock( &remote->queue_mutex );
+		remote->reading = 0;
+		pthread_cond_signal( &remote->queue_cond );
+		pthread_mutex_unlock( &remote->queue_mutex );
+		if ( remote->reader_started )
+			pthread_join( remote->reader_thread, NULL );
+		remote->reader_started = 0;
+		if ( remote->status != NULL )
+			mvcp_socket_close( remote->status );
+		if ( remote->socket != NULL )
+			mvcp_socket_close( remote->socket );
+		remote->socket = remote->status = NULL;
 		remote->connected = 0;
 		remote->terminated = 0;
 	}
@@ -274,40 +632,118 @@ static void mvcp_remote_close( mvcp_remote remote )
 		remote->terminated = 1;
 		mvcp_remote_disconnect( remote );
 		pthread_mutex_destroy( &remote->mutex );
+		pthread_mutex_destroy( &remote->queue_mutex );
+		pthread_cond_destroy( &remote->queue_cond );
+		free( remote->reader.data );
 		free( remote->server );
 		free( remote );
 	}
 }
 
-/** Read response. 
+/** Return the next complete line in the reader's buffer and its length,
+	including the line feed, or NULL if no complete line is buffered. The
+	line remains in the buffer until the next fill.
+*/
+
+static char *mvcp_remote_reader_line( mvcp_remote_reader reader, int *chars )
+{
+	char *start = reader->data + reader->start;
+	char *lf = reader->used > reader->start ? memchr( start, '\n', reader->used - reader->start ) : NULL;
+
+	if ( lf == NULL )
+		return NULL;
+
+	*chars = lf - start + 1;
+	reader->start += *chars;
+	return start;
+}
+
+/** Read more data from the socket into the reader's buffer. The partial line
+	is moved to the front first, so each byte is scanned and moved at most a
+	bounded number of times. Returns the number of bytes read, 0 on timeout
+	or -1 on error.
+*/
+
+static int mvcp_remote_reader_fill( mvcp_remote_reader reader )
+{
+	int length = 0;
+
+	if ( reader->start > 0 )
+	{
+		memmove( reader->data, reader->data + reader->start, reader->used - reader->start );
+		reader->used -= reader->start;
+		reader->start = 0;
+	}
+	if ( reader->size - reader->used < 1024 )
+	{
+		int size = reader->size == 0 ? 10240 : reader->size * 2;
+		char *data = realloc( reader->data, size );
+		if ( data == NULL )
+			return -1;
+		reader->data = data;
+		reader->size = size;
+	}
+
+	length = mvcp_socket_read_data( reader->socket, reader->data + reader->used, reader->size - reader->used );
+	if ( length > 0 )
+		reader->used += length;
+
+	return length;
+}
+
+/** Read response. Lines are taken from the reader's buffer, which is only
+	refilled from the socket when no complete line is buffered. The status
+	code is parsed once from the first line, after which only the length of
+	each new line decides whether the response is complete - 201 and 500
+	end with an empty line, 202 after one line of data and anything else
+	after the status line. Returns non-zero if the connection failed before
+	the response was complete.
 */
 
-static int mvcp_remote_read_response( mvcp_socket socket, mvcp_response response )
+static int mvcp_remote_read_response( mvcp_remote_reader reader, mvcp_response response )
 {
-	char temp[ 10240 ];
-	int length;
+	int code = -1;
+	int lines = 0;
 	int terminated = 0;
 
-	while ( !terminated && ( length = mvcp_socket_read_data( socket, temp, 10240 ) ) >= 0 )
+	while ( !terminated )
 	{
-		int position = 0;
-		temp[ length ] = '\0';
-		mvcp_response_write( response, temp, length );
-		position = mvcp_response_count( response ) - 1;
-		if ( position < 0 || temp[ strlen( temp ) - 1 ] != '\n' )
-			continue;
-		switch( mvcp_response_get_error_code( response ) )
+		int chars = 0;
+		char *start = mvcp_remote_reader_line( reader, &chars );
+
+		if ( start == NULL )
 		{
-			case 201:
-			case 500:
-				terminated = !strcmp( mvcp_response_get_line( response, position ), "" );
-				break;
-			case 202:
-				terminated = mvcp_response_count( response ) >= 2;
-				break;
-			default:
-				terminated = 1;
-				break;
+			int length = mvcp_remote_reader_fill( reader );
+			if ( length < 0 || ( length == 0 && reader->running != NULL && !*reader->running ) )
+				return -1;
+		}
+		else
+		{
+			int blank = chars == 1 || ( chars == 2 && start[ 0 ] == '\r' );
+
+			mvcp_response_write( response, start, chars );
+
+			if ( lines ++ == 0 )
+			{
+				char *end = NULL;
+				code = strtol( start, &end, 10 );
+				if ( end == start )
+					code = 0;
+			}
+
+			switch( code )
+			{
+				case 201:
+				case 500:
+					terminated = lines > 1 && blank;
+					break;
+				case 202:
+					terminated = lines >= 2;
+					break;
+				default:
+					terminated = 1;
+					break;
+			}
 		}
 	}
 
@@ -33,6 +33,10 @@ extern "C"
 */
 
 extern mvcp_parser mvcp_parser_init_remote( char *, int );
+extern void mvcp_remote_set_timeout( mvcp_parser, int );
+extern void mvcp_remote_set_compression( mvcp_parser, int );
+extern void mvcp_remote_set_status( mvcp_parser, int );
+extern int mvcp_remote_submit_received( mvcp_parser, char *, char *, mvcp_response_callback, void * );
 
 #ifdef __cplusplus
 }
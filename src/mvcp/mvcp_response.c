@@ -23,18 +23,65 @@
 #include <stdlib.h>
 #include <stdarg.h>
 #include <string.h>
+#include <pthread.h>
 
 /* Application header files */
 #include "mvcp_response.h"
 
+/** A chunk of the arena holding the text of the lines.
+*/
+
+#define MVCP_RESPONSE_CHUNK 16384
+
+struct mvcp_response_chunk_s
+{
+	struct mvcp_response_chunk_s *next;
+	int size;
+	int used;
+	char *data;
+};
+
+/** Spare responses - mvcp_response_close keeps one reset response per thread
+	which the next mvcp_response_init on that thread takes, so a connection
+	executing one command after another reuses the same arena.
+*/
+
+static pthread_once_t mvcp_response_once = PTHREAD_ONCE_INIT;
+static pthread_key_t mvcp_response_key;
+
+static void mvcp_response_free( mvcp_response );
+
+static void mvcp_response_spare_close( void *spare )
+{
+	mvcp_response_free( spare );
+}
+
+static void mvcp_response_key_init( )
+{
+	pthread_key_create( &mvcp_response_key, mvcp_response_spare_close );
+}
+
 /** Construct a new MVCP response.
 */
 
 mvcp_response mvcp_response_init( )
 {
-	mvcp_response response = malloc( sizeof( mvcp_response_t ) );
+	mvcp_response response = NULL;
+
+	pthread_once( &mvcp_response_once, mvcp_response_key_init );
+	response = pthread_getspecific( mvcp_response_key );
+
 	if ( response != NULL )
-		memset( response, 0, sizeof( mvcp_response_t ) );
+	{
+		pthread_setspecific( mvcp_response_key, NULL );
+	}
+	else
+	{
+		response = malloc( sizeof( mvcp_response_t ) );
+		if ( response != NULL )
+			memset( response, 0, sizeof( mvcp_response_t ) );
+	}
+
 	return response;
 }
 
@@ -105,6 +152,17 @@ char *mvcp_response_get_line( mvcp_response response, int index )
 		return NULL;
 }
 
+/** Get the length of the line of text at the given index, as written.
+*/
+
+int mvcp_response_get_length( mvcp_response response, int index )
+{
+	if ( index < response->count )
+		return response->lengths[ index ];
+	else
+		return 0;
+}
+
 /** Return the number of lines of text in the response.
 */
 
@@ -116,6 +174,106 @@ int mvcp_response_count( mvcp_response response )
 		return 0;
 }
 
+/** Take space for a number of bytes from the arena.
+*/
+
+static char *mvcp_response_alloc( mvcp_response response, int bytes )
+{
+	mvcp_response_chunk chunk = response->current;
+	char *data = NULL;
+
+	if ( chunk == NULL || chunk->size - chunk->used < bytes )
+	{
+		int size = bytes > MVCP_RESPONSE_CHUNK ? bytes : MVCP_RESPONSE_CHUNK;
+		chunk = malloc( sizeof( struct mvcp_response_chunk_s ) + size );
+		if ( chunk == NULL )
+			return NULL;
+		chunk->next = NULL;
+		chunk->size = size;
+		chunk->used = 0;
+		chunk->data = ( char * )( chunk + 1 );
+		if ( response->current != NULL )
+			response->current->next = chunk;
+		else
+			response->chunks = chunk;
+		response->current = chunk;
+	}
+
+	data = chunk->data + chunk->used;
+	chunk->used += bytes;
+
+	return data;
+}
+
+/** Make room for the given number of further lines and bytes of text, so a
+	large response can be written without growing the tables or the arena on
+	the way.
+*/
+
+int mvcp_response_reserve( mvcp_response response, int lines, int bytes )
+{
+	if ( response->count + lines > response->size )
+	{
+		int size = response->size == 0 ? 64 : response->size;
+		char **array = NULL;
+		int *lengths = NULL;
+		while ( size < response->count + lines )
+			size *= 2;
+		array = realloc( response->array, size * sizeof( char * ) );
+		if ( array != NULL )
+			response->array = array;
+		lengths = array != NULL ? realloc( response->lengths, size * sizeof( int ) ) : NULL;
+		if ( lengths == NULL )
+			return -1;
+		response->lengths = lengths;
+		response->size = size;
+	}
+
+	if ( bytes > 0 && ( response->current == NULL || response->current->size - response->current->used < bytes ) )
+	{
+		/* Take the space from a fresh chunk and hand it straight back */
+		if ( mvcp_response_alloc( response, bytes ) == NULL )
+			return -1;
+		response->current->used -= bytes;
+	}
+
+	return 0;
+}
+
+/** Append text to a line. The last line written is extended in place when
+	it is at the end of the arena, otherwise it is copied to fresh space.
+*/
+
+static int mvcp_response_append( mvcp_response response, int index, const char *text, int chars )
+{
+	mvcp_response_chunk chunk = response->current;
+	char *line = response->array[ index ];
+	int length = response->lengths[ index ];
+
+	if ( line != NULL && chunk != NULL && line + length + 1 == chunk->data + chunk->used && chunk->size - chunk->used >= chars )
+	{
+		chunk->used += chars;
+	}
+	else
+	{
+		char *copy = mvcp_response_alloc( response, length + chars + 1 );
+		if ( copy == NULL )
+			return -1;
+		if ( length > 0 )
+			memcpy( copy, line, length );
+		line = response->array[ index ] = copy;
+	}
+
+	memcpy( line + length, text, chars );
+	length += chars;
+	line[ length ] = '\0';
+	if ( length > 0 && line[ length - 1 ] == '\r' )
+		line[ -- length ] = '\0';
+	response->lengths[ index ] = length;
+
+	return 0;
+}
+
 /** Set the error and description associated to the response.
 */
 
@@ -123,34 +281,54 @@ void mvcp_response_set_error( mvcp_response response, int error_code, const char
 {
 	if ( response->count == 0 )
 	{
-		mvcp_response_printf( response, 10240, "%d %s\n", error_code, error_string );
+		mvcp_response_printf( response, strlen( error_string ) + 16, "%d %s\n", error_code, error_string );
 	}
 	else
 	{
-		char temp[ 10240 ];
-		int length = sprintf( temp, "%d %s", error_code, error_string );
-		response->array[ 0 ] = realloc( response->array[ 0 ], length + 1 );
-		strcpy( response->array[ 0 ], temp );
+		int length = snprintf( NULL, 0, "%d %s", error_code, error_string );
+		char *line = mvcp_response_alloc( response, length + 1 );
+		if ( line != NULL )
+		{
+			sprintf( line, "%d %s", error_code, error_string );
+			response->array[ 0 ] = line;
+			response->lengths[ 0 ] = length;
+		}
 	}
 }
 
-/** Write formatted text to the response. 
+/** Write formatted text to the response. At most size - 1 characters are
+	written.
 */
 
 int mvcp_response_printf( mvcp_response response, size_t size, const char *format, ... )
 {
+	char buffer[ 512 ];
+	char *text = buffer;
 	int length = 0;
-	char *text = malloc( size );
-	if ( text != NULL )
+	va_list list;
+
+	va_start( list, format );
+	length = vsnprintf( buffer, size < sizeof( buffer ) ? size : sizeof( buffer ), format, list );
+	va_end( list );
+
+	/* Only text longer than the stack buffer needs a second pass */
+	if ( length >= ( int )sizeof( buffer ) && size > sizeof( buffer ) )
 	{
-		va_list list;
+		size_t needed = ( size_t )length + 1 < size ? ( size_t )length + 1 : size;
+		text = malloc( needed );
+		if ( text == NULL )
+			return 0;
 		va_start( list, format );
-		length = vsnprintf( text, size, format, list );
-		if ( length != 0 )
-			mvcp_response_write( response, text, length );
+		vsnprintf( text, needed, format, list );
 		va_end( list );
-		free( text );
 	}
+
+	if ( length > 0 && size > 0 )
+		mvcp_response_write( response, text, ( size_t )length < size ? length : ( int )size - 1 );
+
+	if ( text != buffer )
+		free( text );
+
 	return length;
 }
 
@@ -165,21 +343,20 @@ int mvcp_response_write( mvcp_response response, const char *text, int size )
 	while ( size > 0 )
 	{
 		int index = response->count - 1;
-		const char *lf = strchr( ptr, '\n' );
-		int length_of_string = 0;
-
-		/* Make sure we have space in the dynamic array. */
-		if ( !response->append && response->count >= response->size - 1 )
-		{
-			response->size += 50;
-			response->array = realloc( response->array, response->size * sizeof( char * ) );
-		}
+		const char *lf = memchr( ptr, '\n', size );
 
-		/* Make sure the array is valid, or we're really in trouble */
-		if ( response->array == NULL )
+		/* Make sure we have space in the line tables. */
+		if ( !response->append && response->count >= response->size )
 		{
-			ret = 0;
-			break;
+			int lines = response->size == 0 ? 64 : response->size * 2;
+			char **array = realloc( response->array, lines * sizeof( char * ) );
+			int *lengths = array != NULL ? realloc( response->lengths, lines * sizeof( int ) ) : NULL;
+			if ( array != NULL )
+				response->array = array;
+			if ( lengths == NULL )
+				break;
+			response->lengths = lengths;
+			response->size = lines;
 		}
 
 		/* Now, if we're appending to the previous write (ie: if it wasn't
@@ -189,35 +366,23 @@ int mvcp_response_write( mvcp_response response, const char *text, int size )
 		if ( !response->append )
 		{
 			response->array[ ++ index ] = NULL;
+			response->lengths[ index ] = 0;
 			response->count ++;
 		}
-		else
-		{
-			length_of_string = strlen( response->array[ index ] );
-		}
-
-		/* Now we need to know how to handle the current ptr with respect to lf. */
-		/* TODO: tidy up and error check... sigh... tested for many, many 1000s of lines */
 
 		if ( lf == NULL )
 		{
-			response->array[ index ] = realloc( response->array[ index ], length_of_string + size + 1 );
-			memcpy( response->array[ index ] + length_of_string, ptr, size );
-			response->array[ index ][ length_of_string + size ] = '\0';
-			if ( ( length_of_string + size ) > 0 && response->array[ index ][ length_of_string + size - 1 ] == '\r' )
-				response->array[ index ][ length_of_string + size - 1 ] = '\0';
-			size = 0;
+			if ( mvcp_response_append( response, index, ptr, size ) != 0 )
+				break;
 			ret += size;
+			size = 0;
 			response->append = 1;
 		}
 		else
 		{
 			int chars = lf - ptr;
-			response->array[ index ] = realloc( response->array[ index ], length_of_string + chars + 1 );
-			memcpy( response->array[ index ] + length_of_string, ptr, chars );
-			response->array[ index ][ length_of_string + chars ] = '\0';
-			if ( ( length_of_string + chars ) > 0 && response->array[ index ][ length_of_string + chars - 1 ] == '\r' )
-				response->array[ index ][ length_of_string + chars - 1 ] = '\0';
+			if ( mvcp_response_append( response, index, ptr, chars ) != 0 )
+				break;
 			ptr = ptr + chars + 1;
 			size -= ( chars + 1 );
 			response->append = 0;
@@ -228,6 +393,47 @@ int mvcp_response_write( mvcp_response response, const char *text, int size )
 	return ret;
 }
 
+/** Empty the response so it can be used again. The first chunk of the arena
+	is kept.
+*/
+
+void mvcp_response_reset( mvcp_response response )
+{
+	if ( response != NULL )
+	{
+		mvcp_response_chunk chunk = response->chunks;
+		if ( chunk != NULL )
+		{
+			while ( chunk->next != NULL )
+			{
+				mvcp_response_chunk next = chunk->next->next;
+				free( chunk->next );
+				chunk->next = next;
+			}
+			chunk->used = 0;
+		}
+		response->current = chunk;
+		response->count = 0;
+		response->append = 0;
+	}
+}
+
+/** Release the response and its arena.
+*/
+
+static void mvcp_response_free( mvcp_response response )
+{
+	while ( response->chunks != NULL )
+	{
+		mvcp_response_chunk next = response->chunks->next;
+		free( response->chunks );
+		response->chunks = next;
+	}
+	free( response->array );
+	free( response->lengths );
+	free( response );
+}
+
 /** Close the response.
 */
 
@@ -235,10 +441,11 @@ void mvcp_response_close( mvcp_response response )
 {
 	if ( response != NULL )
 	{
-		int index = 0;
-		for ( index = 0; index < response->count; index ++ )
-			free( response->array[ index ] );
-		free( response->array );
-		free( response );
+		pthread_once( &mvcp_response_once, mvcp_response_key_init );
+		mvcp_response_reset( response );
+		if ( pthread_getspecific( mvcp_response_key ) == NULL )
+			pthread_setspecific( mvcp_response_key, response );
+		else
+			mvcp_response_free( response );
 	}
 }
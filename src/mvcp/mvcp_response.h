@@ -28,15 +28,21 @@ extern "C"
 {
 #endif
 
-/** Structure for the response
+/** Structure for the response - the text of the lines is kept in a chunked
+	arena, the array holds the start and the lengths table the length of each.
 */
 
+typedef struct mvcp_response_chunk_s *mvcp_response_chunk;
+
 typedef struct
 {
 	char **array;
 	int size;
 	int count;
 	int append;
+	int *lengths;
+	mvcp_response_chunk chunks;
+	mvcp_response_chunk current;
 }
 *mvcp_response, mvcp_response_t;
 
@@ -48,10 +54,13 @@ extern mvcp_response mvcp_response_clone( mvcp_response );
 extern int mvcp_response_get_error_code( mvcp_response );
 extern const char *mvcp_response_get_error_string( mvcp_response );
 extern char *mvcp_response_get_line( mvcp_response, int );
+extern int mvcp_response_get_length( mvcp_response, int );
 extern int mvcp_response_count( mvcp_response );
+extern void mvcp_response_reset( mvcp_response );
 extern void mvcp_response_set_error( mvcp_response, int, const char * );
 extern int mvcp_response_printf( mvcp_response, size_t, const char *, ... );
 extern int mvcp_response_write( mvcp_response, const char *, int );
+extern int mvcp_response_reserve( mvcp_response, int, int );
 extern void mvcp_response_close( mvcp_response );
 
 #ifdef __cplusplus
@@ -33,11 +33,17 @@
 #include <fcntl.h>
 #include <errno.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <sys/time.h>
 
 /* Application header files */
 #include "mvcp_socket.h"
 
+/** Default time in milliseconds a read waits for data.
+*/
+
+#define MVCP_SOCKET_TIMEOUT 1000
+
 /** Initialise the socket.
 */
 
@@ -48,6 +54,7 @@ mvcp_socket mvcp_socket_init( char *server, int port )
 	{
 		memset( socket, 0, sizeof( mvcp_socket_t ) );
 		socket->fd = -1;
+		socket->timeout = MVCP_SOCKET_TIMEOUT;
 		socket->server = strdup( server );
 		socket->port = port;
 	}
@@ -76,6 +83,14 @@ int mvcp_socket_connect( mvcp_socket connection )
 			ret = connect( connection->fd, (const struct sockaddr *)&sock, sizeof( struct sockaddr_in ) );
 		else
 			ret = -1;
+
+		/* Commands are small and each waits for its response, so don't let
+		   Nagle's algorithm hold them back for the delayed acknowledgement */
+		if ( ret == 0 )
+		{
+			int flag = 1;
+			setsockopt( connection->fd, IPPROTO_TCP, TCP_NODELAY, (char *)&flag, sizeof( int ) );
+		}
 	}
 	
 	return ret;	
@@ -92,6 +107,7 @@ mvcp_socket mvcp_socket_init_fd( int fd )
 		memset( socket, 0, sizeof( mvcp_socket_t ) );
 		socket->fd = fd;
 		socket->no_close = 1;
+		socket->timeout = MVCP_SOCKET_TIMEOUT;
 	}
 	return socket;
 }
@@ -101,7 +117,7 @@ mvcp_socket mvcp_socket_init_fd( int fd )
 
 int mvcp_socket_read_data( mvcp_socket socket, char *data, int length )
 {
-    struct timeval tv = { 1, 0 };
+    struct timeval tv = { socket->timeout / 1000, ( socket->timeout % 1000 ) * 1000 };
     fd_set rfds;
 	int used = 0;
 
@@ -110,7 +126,8 @@ int mvcp_socket_read_data( mvcp_socket socket, char *data, int length )
     FD_ZERO( &rfds );
     FD_SET( socket->fd, &rfds );
 
-	if ( select( socket->fd + 1, &rfds, NULL, NULL, &tv ) )
+	/* A negative timeout blocks until data arrives */
+	if ( socket->timeout < 0 || select( socket->fd + 1, &rfds, NULL, NULL, &tv ) )
 	{
 		used = read( socket->fd, data, length - 1 );
 		if ( used > 0 )
@@ -132,12 +149,9 @@ int mvcp_socket_write_data( mvcp_socket socket, const char *data, int length )
 	while ( used >=0 && used < length )
 	{
 		struct timeval tv = { 1, 0 };
-		fd_set rfds;
 		fd_set wfds;
 		fd_set efds;
 	
-		FD_ZERO( &rfds );
-		FD_SET( socket->fd, &rfds );
 		FD_ZERO( &wfds );
 		FD_SET( socket->fd, &wfds );
 		FD_ZERO( &efds );
@@ -145,9 +159,11 @@ int mvcp_socket_write_data( mvcp_socket socket, const char *data, int length )
 	
 		errno = 0;
 
-		if ( select( socket->fd + 1, &rfds, &wfds, &efds, &tv ) )
+		/* Responses to commands in flight may be waiting to be read, so a
+		   readable socket is no reason to fail */
+		if ( select( socket->fd + 1, NULL, &wfds, &efds, &tv ) )
 		{
-			if ( errno != 0 || FD_ISSET( socket->fd, &efds ) || FD_ISSET( socket->fd, &rfds ) )
+			if ( errno != 0 || FD_ISSET( socket->fd, &efds ) )
 			{
 				used = -1;
 			}
@@ -165,6 +181,24 @@ int mvcp_socket_write_data( mvcp_socket socket, const char *data, int length )
 	return used;
 }
 
+/** Set the time in milliseconds a read waits for data before returning 0.
+	A negative value waits indefinitely.
+*/
+
+void mvcp_socket_set_timeout( mvcp_socket socket, int timeout )
+{
+	socket->timeout = timeout;
+}
+
+/** Shut the connection down, which wakes any thread blocked on it.
+*/
+
+void mvcp_socket_shutdown( mvcp_socket socket )
+{
+	if ( socket != NULL && socket->fd != -1 )
+		shutdown( socket->fd, SHUT_RDWR );
+}
+
 /** Close the socket.
 */
 
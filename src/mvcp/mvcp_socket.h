@@ -36,6 +36,7 @@ typedef struct
 	int port;
 	int fd;
 	int no_close;
+	int timeout;
 }
 *mvcp_socket, mvcp_socket_t;
 
@@ -47,6 +48,8 @@ extern int mvcp_socket_connect( mvcp_socket );
 extern mvcp_socket mvcp_socket_init_fd( int );
 extern int mvcp_socket_read_data( mvcp_socket, char *, int );
 extern int mvcp_socket_write_data( mvcp_socket, const char *, int );
+extern void mvcp_socket_set_timeout( mvcp_socket, int );
+extern void mvcp_socket_shutdown( mvcp_socket );
 extern void mvcp_socket_close( mvcp_socket );
 
 #ifdef __cplusplus
@@ -25,58 +25,140 @@
 
 /* Application header files */
 #include "mvcp_status.h"
-#include "mvcp_tokeniser.h"
-#include "mvcp_util.h"
 
-/** Parse a unit status string.
+/** Maximum number of fields in a status line.
+*/
+
+#define MVCP_STATUS_FIELDS 17
+
+/** Locate the space separated fields of a status line in place. A field which
+	starts with a quote extends to the first space following a quote, as with
+	the tokeniser. Returns the number of fields found, which may exceed size.
+*/
+
+static int mvcp_status_fields( const char *text, const char **fields, int *lengths, int size )
+{
+	int count = 0;
+
+	while ( *text != '\0' )
+	{
+		const char *end = text;
+
+		if ( *text == ' ' )
+		{
+			text ++;
+			continue;
+		}
+
+		if ( *text == '\"' )
+		{
+			end = text + 1;
+			while ( *end != '\0' && !( *end == ' ' && end[ -1 ] == '\"' ) )
+				end ++;
+		}
+		else
+		{
+			while ( *end != '\0' && *end != ' ' )
+				end ++;
+		}
+
+		if ( count < size )
+		{
+			fields[ count ] = text;
+			lengths[ count ] = end - text;
+		}
+		count ++;
+		text = end;
+	}
+
+	return count;
+}
+
+/** Copy a field into a string, removing the quotes around it.
+*/
+
+static void mvcp_status_copy_field( char *dest, int size, const char *field, int length )
+{
+	if ( length > 0 && field[ 0 ] == '\"' )
+	{
+		field ++;
+		length --;
+	}
+	if ( length > 0 && field[ length - 1 ] == '\"' )
+		length --;
+	if ( length >= size )
+		length = size - 1;
+	memcpy( dest, field, length );
+	dest[ length ] = '\0';
+}
+
+/** Names used for each status code.
+*/
+
+static const char *mvcp_status_names[] =
+{
+	"unknown", "undefined", "offline", "not_loaded", "stopped", "playing", "paused", "disconnected"
+};
+
+/** Convert a status name field to its code, leaving the code unchanged if the
+	name is not known.
+*/
+
+static void mvcp_status_parse_name( mvcp_status status, const char *field, int length )
+{
+	int index = 0;
+	for ( index = unit_unknown; index <= unit_disconnected; index ++ )
+		if ( !strncmp( field, mvcp_status_names[ index ], length ) && mvcp_status_names[ index ][ length ] == '\0' )
+			status->status = index;
+}
+
+/** Parse the field following the unit at the given position into the status.
+*/
+
+static void mvcp_status_parse_field( mvcp_status status, int position, const char *field, int length )
+{
+	switch( position )
+	{
+		case 0: mvcp_status_parse_name( status, field, length ); break;
+		case 1: mvcp_status_copy_field( status->clip, sizeof( status->clip ), field, length ); break;
+		case 2: status->position = strtol( field, NULL, 10 ); break;
+		case 3: status->speed = strtol( field, NULL, 10 ); break;
+		case 4: status->fps = strtod( field, NULL ); break;
+		case 5: status->in = strtol( field, NULL, 10 ); break;
+		case 6: status->out = strtol( field, NULL, 10 ); break;
+		case 7: status->length = strtol( field, NULL, 10 ); break;
+		case 8: mvcp_status_copy_field( status->tail_clip, sizeof( status->tail_clip ), field, length ); break;
+		case 9: status->tail_position = strtol( field, NULL, 10 ); break;
+		case 10: status->tail_in = strtol( field, NULL, 10 ); break;
+		case 11: status->tail_out = strtol( field, NULL, 10 ); break;
+		case 12: status->tail_length = strtol( field, NULL, 10 ); break;
+		case 13: status->seek_flag = strtol( field, NULL, 10 ); break;
+		case 14: status->generation = strtol( field, NULL, 10 ); break;
+		case 15: status->clip_index = strtol( field, NULL, 10 ); break;
+	}
+}
+
+/** Parse a unit status string. The fields are read directly from the text,
+	which is left unmodified.
 */
 
 void mvcp_status_parse( mvcp_status status, char *text )
 {
-	mvcp_tokeniser tokeniser = mvcp_tokeniser_init( );
-	if ( mvcp_tokeniser_parse_new( tokeniser, text, " " ) == 17 )
+	const char *fields[ MVCP_STATUS_FIELDS ];
+	int lengths[ MVCP_STATUS_FIELDS ];
+
+	if ( mvcp_status_fields( text, fields, lengths, MVCP_STATUS_FIELDS ) == MVCP_STATUS_FIELDS )
 	{
-		status->unit = atoi( mvcp_tokeniser_get_string( tokeniser, 0 ) );
-		strncpy( status->clip, mvcp_util_strip( mvcp_tokeniser_get_string( tokeniser, 2 ), '\"' ), sizeof( status->clip ) );
-		status->position = atol( mvcp_tokeniser_get_string( tokeniser, 3 ) );
-		status->speed = atoi( mvcp_tokeniser_get_string( tokeniser, 4 ) );
-		status->fps = atof( mvcp_tokeniser_get_string( tokeniser, 5 ) );
-		status->in = atol( mvcp_tokeniser_get_string( tokeniser, 6 ) );
-		status->out = atol( mvcp_tokeniser_get_string( tokeniser, 7 ) );
-		status->length = atol( mvcp_tokeniser_get_string( tokeniser, 8 ) );
-
-		strncpy( status->tail_clip, mvcp_util_strip( mvcp_tokeniser_get_string( tokeniser, 9 ), '\"' ), sizeof( status->tail_clip ) );
-		status->tail_position = atol( mvcp_tokeniser_get_string( tokeniser, 10 ) );
-		status->tail_in = atol( mvcp_tokeniser_get_string( tokeniser, 11 ) );
-		status->tail_out = atol( mvcp_tokeniser_get_string( tokeniser, 12 ) );
-		status->tail_length = atol( mvcp_tokeniser_get_string( tokeniser, 13 ) );
-		status->seek_flag = atoi( mvcp_tokeniser_get_string( tokeniser, 14 ) );
-		status->generation = atoi( mvcp_tokeniser_get_string( tokeniser, 15 ) );
-		status->clip_index = atoi( mvcp_tokeniser_get_string( tokeniser, 16 ) );
-
-		if ( !strcmp( mvcp_tokeniser_get_string( tokeniser, 1 ), "unknown" ) )
-			status->status = unit_unknown;
-		else if ( !strcmp( mvcp_tokeniser_get_string( tokeniser, 1 ), "undefined" ) )
-			status->status = unit_undefined;
-		else if ( !strcmp( mvcp_tokeniser_get_string( tokeniser, 1 ), "offline" ) )
-			status->status = unit_offline;
-		else if ( !strcmp( mvcp_tokeniser_get_string( tokeniser, 1 ), "not_loaded" ) )
-			status->status = unit_not_loaded;
-		else if ( !strcmp( mvcp_tokeniser_get_string( tokeniser, 1 ), "stopped" ) )
-			status->status = unit_stopped;
-		else if ( !strcmp( mvcp_tokeniser_get_string( tokeniser, 1 ), "paused" ) )
-			status->status = unit_paused;
-		else if ( !strcmp( mvcp_tokeniser_get_string( tokeniser, 1 ), "playing" ) )
-			status->status = unit_playing;
-		else if ( !strcmp( mvcp_tokeniser_get_string( tokeniser, 1 ), "disconnected" ) )
-			status->status = unit_disconnected;
+		int index = 0;
+		status->unit = strtol( fields[ 0 ], NULL, 10 );
+		for ( index = 1; index < MVCP_STATUS_FIELDS; index ++ )
+			mvcp_status_parse_field( status, index - 1, fields[ index ], lengths[ index ] );
 	}
 	else
 	{
 		memset( status, 0, sizeof( mvcp_status_t ) );
 		fprintf( stderr, "Status thread changed?\n" );
 	}
-	mvcp_tokeniser_close( tokeniser );
 }
 
 /** Serialise a status into a string.
@@ -143,6 +225,106 @@ char *mvcp_status_serialise( mvcp_status status, char *text, int length )
 	return text;
 }
 
+/** Serialise only the fields which differ from the previous status of the
+	unit. The line is "{unit} ~{mask}" followed by the changed fields in the
+	order of the full status line, where bit N of the hexadecimal mask is
+	set when the field following the unit at position N is present.
+*/
+
+char *mvcp_status_serialise_delta( mvcp_status previous, mvcp_status status, char *text, int length )
+{
+	int mask = 0;
+	int used = 0;
+
+	if ( previous->status != status->status ) mask |= 1 << 0;
+	if ( strcmp( previous->clip, status->clip ) ) mask |= 1 << 1;
+	if ( previous->position != status->position ) mask |= 1 << 2;
+	if ( previous->speed != status->speed ) mask |= 1 << 3;
+	if ( previous->fps != status->fps ) mask |= 1 << 4;
+	if ( previous->in != status->in ) mask |= 1 << 5;
+	if ( previous->out != status->out ) mask |= 1 << 6;
+	if ( previous->length != status->length ) mask |= 1 << 7;
+	if ( strcmp( previous->tail_clip, status->tail_clip ) ) mask |= 1 << 8;
+	if ( previous->tail_position != status->tail_position ) mask |= 1 << 9;
+	if ( previous->tail_in != status->tail_in ) mask |= 1 << 10;
+	if ( previous->tail_out != status->tail_out ) mask |= 1 << 11;
+	if ( previous->tail_length != status->tail_length ) mask |= 1 << 12;
+	if ( previous->seek_flag != status->seek_flag ) mask |= 1 << 13;
+	if ( previous->generation != status->generation ) mask |= 1 << 14;
+	if ( previous->clip_index != status->clip_index ) mask |= 1 << 15;
+
+	used = snprintf( text, length, "%d ~%x", status->unit, mask );
+
+#define DELTA( bit, format, value ) \
+	if ( ( mask & ( 1 << bit ) ) && used < length ) \
+		used += snprintf( text + used, length - used, format, value );
+
+	DELTA( 0, " %s", status->status >= unit_unknown && status->status <= unit_disconnected ? mvcp_status_names[ status->status ] : "unknown" )
+	DELTA( 1, " \"%s\"", status->clip )
+	DELTA( 2, " %d", status->position )
+	DELTA( 3, " %d", status->speed )
+	DELTA( 4, " %.2f", status->fps )
+	DELTA( 5, " %d", status->in )
+	DELTA( 6, " %d", status->out )
+	DELTA( 7, " %d", status->length )
+	DELTA( 8, " \"%s\"", status->tail_clip )
+	DELTA( 9, " %d", status->tail_position )
+	DELTA( 10, " %d", status->tail_in )
+	DELTA( 11, " %d", status->tail_out )
+	DELTA( 12, " %d", status->tail_length )
+	DELTA( 13, " %d", status->seek_flag )
+	DELTA( 14, " %d", status->generation )
+	DELTA( 15, " %d", status->clip_index )
+
+#undef DELTA
+
+	if ( used < length )
+		snprintf( text + used, length - used, "\r\n" );
+
+	return text;
+}
+
+/** Determine if a status line is a delta.
+*/
+
+int mvcp_status_is_delta( char *text )
+{
+	char *space = strchr( text, ' ' );
+	return space != NULL && space[ 1 ] == '~';
+}
+
+/** Apply a delta line produced by mvcp_status_serialise_delta to the last
+	known status of the unit.
+*/
+
+void mvcp_status_parse_delta( mvcp_status status, char *text )
+{
+	const char *fields[ MVCP_STATUS_FIELDS + 1 ];
+	int lengths[ MVCP_STATUS_FIELDS + 1 ];
+	int count = mvcp_status_fields( text, fields, lengths, MVCP_STATUS_FIELDS + 1 );
+
+	if ( count >= 2 && fields[ 1 ][ 0 ] == '~' )
+	{
+		int mask = strtol( fields[ 1 ] + 1, NULL, 16 );
+		int position = 2;
+		int bit = 0;
+
+		if ( count > MVCP_STATUS_FIELDS + 1 )
+			count = MVCP_STATUS_FIELDS + 1;
+
+		status->unit = strtol( fields[ 0 ], NULL, 10 );
+
+		for ( bit = 0; bit < 16 && position < count; bit ++ )
+		{
+			if ( mask & ( 1 << bit ) )
+			{
+				mvcp_status_parse_field( status, bit, fields[ position ], lengths[ position ] );
+				position ++;
+			}
+		}
+	}
+}
+
 /** Compare two status codes for changes.
 */
 
@@ -151,6 +333,29 @@ int mvcp_status_compare( mvcp_status status1, mvcp_status status2 )
 	return memcmp( status1, status2, sizeof( mvcp_status_t ) );
 }
 
+/** Determine which groups of fields differ between two statuses of a unit -
+	returns a mask of mvcp_change values. The clip group covers the clip, its
+	index and its points, and the state covers the unit state and speed.
+*/
+
+int mvcp_status_changes( mvcp_status status1, mvcp_status status2 )
+{
+	int changed = 0;
+	if ( status1->position != status2->position )
+		changed |= mvcp_change_position;
+	if ( status1->clip_index != status2->clip_index ||
+		 status1->in != status2->in ||
+		 status1->out != status2->out ||
+		 status1->length != status2->length ||
+		 strcmp( status1->clip, status2->clip ) )
+		changed |= mvcp_change_clip;
+	if ( status1->generation != status2->generation )
+		changed |= mvcp_change_generation;
+	if ( status1->status != status2->status || status1->speed != status2->speed )
+		changed |= mvcp_change_state;
+	return changed;
+}
+
 /** Copy status code info from dest to src.
 */
 
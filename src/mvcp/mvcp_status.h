@@ -44,6 +44,19 @@ typedef enum
 }
 unit_status;
 
+/** Groups of status fields for which a change can be reported.
+*/
+
+typedef enum
+{
+	mvcp_change_position = 1,
+	mvcp_change_clip = 2,
+	mvcp_change_generation = 4,
+	mvcp_change_state = 8,
+	mvcp_change_all = 15
+}
+mvcp_change;
+
 /** Status structure.
 */
 
@@ -75,7 +88,11 @@ typedef struct
 
 extern void mvcp_status_parse( mvcp_status, char * );
 extern char *mvcp_status_serialise( mvcp_status, char *, int );
+extern char *mvcp_status_serialise_delta( mvcp_status, mvcp_status, char *, int );
+extern int mvcp_status_is_delta( char * );
+extern void mvcp_status_parse_delta( mvcp_status, char * );
 extern int mvcp_status_compare( mvcp_status, mvcp_status );
+extern int mvcp_status_changes( mvcp_status, mvcp_status );
 extern mvcp_status mvcp_status_copy( mvcp_status, mvcp_status );
 
 #ifdef __cplusplus
@@ -25,6 +25,21 @@
 /* Application header files */
 #include "mvcp_tokeniser.h"
 
+/** Point the tokeniser at its embedded storage.
+*/
+
+static mvcp_tokeniser mvcp_tokeniser_setup( mvcp_tokeniser tokeniser, int is_inline )
+{
+	memset( tokeniser, 0, sizeof( mvcp_tokeniser_t ) );
+	tokeniser->tokens = tokeniser->inline_tokens;
+	tokeniser->views = tokeniser->inline_views;
+	tokeniser->size = MVCP_TOKENISER_INLINE_TOKENS;
+	tokeniser->buffer = tokeniser->inline_buffer;
+	tokeniser->buffer_size = sizeof( tokeniser->inline_buffer );
+	tokeniser->is_inline = is_inline;
+	return tokeniser;
+}
+
 /** Initialise a tokeniser.
 */
 
@@ -32,108 +47,187 @@ mvcp_tokeniser mvcp_tokeniser_init( )
 {
 	mvcp_tokeniser tokeniser = malloc( sizeof( mvcp_tokeniser_t ) );
 	if ( tokeniser != NULL )
-		memset( tokeniser, 0, sizeof( mvcp_tokeniser_t ) );
+		mvcp_tokeniser_setup( tokeniser, 0 );
 	return tokeniser;
 }
 
-/** Clear the tokeniser.
+/** Initialise a tokeniser in caller owned storage (typically on the stack).
+	It must still be closed, which releases anything it had to allocate.
+*/
+
+mvcp_tokeniser mvcp_tokeniser_init_inline( mvcp_tokeniser_t *tokeniser )
+{
+	return mvcp_tokeniser_setup( tokeniser, 1 );
+}
+
+/** Clear the tokeniser - the storage is kept for the next parse.
 */
 
 static void mvcp_tokeniser_clear( mvcp_tokeniser tokeniser )
 {
-	int index = 0;
-	for ( index = 0; index < tokeniser->count; index ++ )
-		free( tokeniser->tokens[ index ] );
 	tokeniser->count = 0;
-	free( tokeniser->input );
 	tokeniser->input = NULL;
 }
 
-/** Append a string to the tokeniser.
+/** Make room for a number of tokens and bytes of input. Grown storage is
+	kept, so a tokeniser that is reused settles down to no allocations.
 */
 
-static int mvcp_tokeniser_append( mvcp_tokeniser tokeniser, char *token )
+static int mvcp_tokeniser_reserve( mvcp_tokeniser tokeniser, int tokens, int bytes )
 {
-	int error = 0;
-
-	if ( tokeniser->count == tokeniser->size )
+	if ( bytes > tokeniser->buffer_size )
 	{
-		tokeniser->size += 20;
-		tokeniser->tokens = realloc( tokeniser->tokens, tokeniser->size * sizeof( char * ) );
+		int size = tokeniser->buffer_size * 2 > bytes ? tokeniser->buffer_size * 2 : bytes;
+		char *buffer = malloc( size );
+		if ( buffer == NULL )
+			return -1;
+		if ( tokeniser->buffer != tokeniser->inline_buffer )
+			free( tokeniser->buffer );
+		tokeniser->buffer = buffer;
+		tokeniser->buffer_size = size;
 	}
 
-	if ( tokeniser->tokens != NULL )
+	if ( tokens > tokeniser->size )
 	{
-		tokeniser->tokens[ tokeniser->count ++ ] = strdup( token );
-	}
-	else
-	{
-		tokeniser->count = 0;
-		error = -1;
+		int size = tokeniser->size * 2 > tokens ? tokeniser->size * 2 : tokens;
+		char **strings = malloc( size * sizeof( char * ) );
+		mvcp_token_t *views = malloc( size * sizeof( mvcp_token_t ) );
+		if ( strings == NULL || views == NULL )
+		{
+			free( strings );
+			free( views );
+			return -1;
+		}
+		if ( tokeniser->tokens != tokeniser->inline_tokens )
+		{
+			free( tokeniser->tokens );
+			free( tokeniser->views );
+		}
+		tokeniser->tokens = strings;
+		tokeniser->views = views;
+		tokeniser->size = size;
 	}
-	return error;
+
+	return 0;
 }
 
-/** Parse a string by splitting on the delimiter provided.
+/** Split a string on the delimiter provided without copying or modifying it.
+	A token starting with a double quote extends up to the next token which
+	ends with one. Up to size views are stored in tokens and the number of
+	views is returned. A string which is empty or ends with the delimiter
+	yields a final empty view.
 */
 
-int mvcp_tokeniser_parse_new( mvcp_tokeniser tokeniser, char *string, const char *delimiter )
+int mvcp_tokeniser_split( const char *string, const char *delimiter, mvcp_token_t *tokens, int size )
 {
 	int count = 0;
 	int length = strlen( string );
 	int delimiter_size = strlen( delimiter );
 	int index = 0;
-	char *token = strdup( string );
-
-	mvcp_tokeniser_clear( tokeniser );
-	tokeniser->input = strdup( string );
-	strcpy( token, "" );
+	int pending = -1;
+	int empty = 1;
 
 	for ( index = 0; index < length; )
 	{
-		char *start = string + index;
-		char *end = strstr( start, delimiter );
+		const char *end = strstr( string + index, delimiter );
+		int from = pending >= 0 ? pending : index;
 
 		if ( end == NULL )
 		{
-			strcat( token, start );
-			mvcp_tokeniser_append( tokeniser, token );
-			index = length;
+			if ( count < size )
+			{
+				tokens[ count ].offset = from;
+				tokens[ count ].length = length - from;
+			}
 			count ++;
+			index = length;
+			empty = 0;
 		}
-		else if ( start != end )
+		else if ( end != string + index )
 		{
-			strncat( token, start, end - start );
-			index += end - start;
-			if ( token[ 0 ] != '\"' || ( token[ 0 ] == '\"' && token[ strlen( token ) - 1 ] == '\"' ) )
+			index = end - string;
+			if ( string[ from ] != '\"' || string[ index - 1 ] == '\"' )
 			{
-				mvcp_tokeniser_append( tokeniser, token );
-				strcpy( token, "" );
+				if ( count < size )
+				{
+					tokens[ count ].offset = from;
+					tokens[ count ].length = index - from;
+				}
 				count ++;
+				pending = -1;
+				empty = 1;
 			}
-			else while ( strncmp( string + index, delimiter, delimiter_size ) == 0 )
+			else
 			{
-				strncat( token, delimiter, delimiter_size );
-				index += delimiter_size;
+				pending = from;
+				empty = 0;
+				while ( strncmp( string + index, delimiter, delimiter_size ) == 0 )
+					index += delimiter_size;
 			}
 		}
 		else
 		{
-			index += strlen( delimiter );
+			index += delimiter_size;
 		}
 	}
 
-	/* Special case - malformed string condition */
-	if ( !strcmp( token, "" ) )
+	if ( empty )
 	{
-		count = 0 - ( count - 1 );
-		mvcp_tokeniser_append( tokeniser, token );
+		if ( count < size )
+		{
+			tokens[ count ].offset = length;
+			tokens[ count ].length = 0;
+		}
+		count ++;
 	}
-		
-	free( token );
+
 	return count;
 }
 
+/** Parse a string by splitting on the delimiter provided.
+*/
+
+int mvcp_tokeniser_parse_new( mvcp_tokeniser tokeniser, char *string, const char *delimiter )
+{
+	int length = strlen( string );
+	int views = 0;
+	int index = 0;
+	char *work = NULL;
+
+	mvcp_tokeniser_clear( tokeniser );
+
+	if ( mvcp_tokeniser_reserve( tokeniser, 0, 2 * ( length + 1 ) ) != 0 )
+		return 0;
+
+	/* The input is kept intact, the tokens are terminated in place in a copy */
+	tokeniser->input = tokeniser->buffer;
+	work = tokeniser->buffer + length + 1;
+	memcpy( tokeniser->input, string, length + 1 );
+	memcpy( work, string, length + 1 );
+
+	views = mvcp_tokeniser_split( tokeniser->input, delimiter, tokeniser->views, tokeniser->size );
+	if ( views > tokeniser->size )
+	{
+		if ( mvcp_tokeniser_reserve( tokeniser, views, 0 ) != 0 )
+			return 0;
+		mvcp_tokeniser_split( tokeniser->input, delimiter, tokeniser->views, tokeniser->size );
+	}
+
+	for ( index = 0; index < views; index ++ )
+	{
+		mvcp_token_t *view = &tokeniser->views[ index ];
+		work[ view->offset + view->length ] = '\0';
+		tokeniser->tokens[ index ] = work + view->offset;
+	}
+	tokeniser->count = views;
+
+	/* Special case - malformed string condition */
+	if ( views > 0 && tokeniser->views[ views - 1 ].length == 0 )
+		return 0 - ( views - 2 );
+
+	return views;
+}
+
 /** Get the original input.
 */
 
@@ -167,6 +261,13 @@ char *mvcp_tokeniser_get_string( mvcp_tokeniser tokeniser, int index )
 void mvcp_tokeniser_close( mvcp_tokeniser tokeniser )
 {
 	mvcp_tokeniser_clear( tokeniser );
-	free( tokeniser->tokens );
-	free( tokeniser );
+	if ( tokeniser->buffer != tokeniser->inline_buffer )
+		free( tokeniser->buffer );
+	if ( tokeniser->tokens != tokeniser->inline_tokens )
+	{
+		free( tokeniser->tokens );
+		free( tokeniser->views );
+	}
+	if ( !tokeniser->is_inline )
+		free( tokeniser );
 }
@@ -26,6 +26,23 @@ extern "C"
 {
 #endif
 
+/** A token as a view on the string split - no copy is made.
+*/
+
+typedef struct
+{
+	int offset;
+	int length;
+}
+mvcp_token_t;
+
+/** Sizes of the storage embedded in a tokeniser, which is enough for a
+	typical command line without touching the heap.
+*/
+
+#define MVCP_TOKENISER_INLINE_TOKENS 32
+#define MVCP_TOKENISER_INLINE_BYTES 512
+
 /** Structure for tokeniser.
 */
 
@@ -35,13 +52,22 @@ typedef struct
 	char **tokens;
 	int count;
 	int size;
+	char *buffer;
+	int buffer_size;
+	mvcp_token_t *views;
+	int is_inline;
+	char *inline_tokens[ MVCP_TOKENISER_INLINE_TOKENS ];
+	mvcp_token_t inline_views[ MVCP_TOKENISER_INLINE_TOKENS ];
+	char inline_buffer[ 2 * MVCP_TOKENISER_INLINE_BYTES ];
 }
 *mvcp_tokeniser, mvcp_tokeniser_t;
 
 /** Remote parser API.
 */
 
+extern int mvcp_tokeniser_split( const char *, const char *, mvcp_token_t *, int );
 extern mvcp_tokeniser mvcp_tokeniser_init( );
+extern mvcp_tokeniser mvcp_tokeniser_init_inline( mvcp_tokeniser_t * );
 extern int mvcp_tokeniser_parse_new( mvcp_tokeniser, char *, const char * );
 extern char *mvcp_tokeniser_get_input( mvcp_tokeniser );
 extern int mvcp_tokeniser_count( mvcp_tokeniser );
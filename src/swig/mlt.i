@@ -86,6 +86,8 @@ namespace Mlt {
 %include <MltTractor.h>
 %include <MltParser.h>
 %include <MltFilteredConsumer.h>
+%include <mvcp/mvcp_status.h>
+%array_class(mvcp_status_t, mvcpStatusArray);
 %include <MltMelted.h>
 %include <MltResponse.h>
 